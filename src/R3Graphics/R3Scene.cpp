@@ -366,6 +366,65 @@ RemoveHierarchy(void)
 
 
 
+#include <set>
+#include <unordered_map>
+
+static R3TriangleArray *
+R3SceneCopyMesh(const R3TriangleArray *mesh)
+{
+  // Copy vertices (indexing originals without marking the shared mesh)
+  RNArray<R3TriangleVertex *> vertices;
+  std::unordered_map<const R3TriangleVertex *, int> vertex_indices;
+  for (int i = 0; i < mesh->NVertices(); i++) {
+    R3TriangleVertex *vertex = mesh->Vertex(i);
+    vertex_indices[vertex] = i;
+    vertices.Insert(new R3TriangleVertex(*vertex));
+  }
+
+  // Copy triangles
+  RNArray<R3Triangle *> triangles;
+  for (int i = 0; i < mesh->NTriangles(); i++) {
+    R3Triangle *triangle = mesh->Triangle(i);
+    R3TriangleVertex *v0 = vertices.Kth(vertex_indices[triangle->Vertex(0)]);
+    R3TriangleVertex *v1 = vertices.Kth(vertex_indices[triangle->Vertex(1)]);
+    R3TriangleVertex *v2 = vertices.Kth(vertex_indices[triangle->Vertex(2)]);
+    triangles.Insert(new R3Triangle(v0, v1, v2));
+  }
+
+  // Return copy (triangles are in the same order, so the hierarchy carries over)
+  const R3TriangleArrayNode *nodes = (mesh->NNodes() > 0) ? &mesh->Node(0) : NULL;
+  return new R3TriangleArray(vertices, triangles, nodes, mesh->NNodes());
+}
+
+
+
+static void
+R3SceneUnshareMeshes(R3Scene *scene, R3SceneNode *node, std::set<R3Shape *>& meshes)
+{
+  // Give every element after the first its own copy of an instanced mesh,
+  // so that geometry can be modified in place
+  for (int i = 0; i < node->NElements(); i++) {
+    R3SceneElement *element = node->Element(i);
+    for (int j = 0; j < element->NShapes(); j++) {
+      R3Shape *shape = element->Shape(j);
+      if (shape->ClassID() != R3TriangleArray::CLASS_ID()) continue;
+      if (meshes.insert(shape).second) continue;
+      R3TriangleArray *copy = R3SceneCopyMesh((R3TriangleArray *) shape);
+      element->RemoveShape(shape);
+      element->InsertShape(copy);
+      j--;
+    }
+  }
+
+  // Recurse to children
+  for (int i = 0; i < node->NChildren(); i++) {
+    R3SceneNode *child = node->Child(i);
+    R3SceneUnshareMeshes(scene, child, meshes);
+  }
+}
+
+
+
 static void
 R3SceneRemoveTransformations(R3Scene *scene, R3SceneNode *node, const R3Affine& parent_transformation)
 {
@@ -400,6 +459,10 @@ R3SceneRemoveTransformations(R3Scene *scene, R3SceneNode *node, const R3Affine&
 void R3Scene::
 RemoveTransformations(void)
 {
+  // Instanced meshes cannot be transformed in place
+  std::set<R3Shape *> meshes;
+  R3SceneUnshareMeshes(this, root, meshes);
+
   // Maintain topology of scene, but set all node transformations to identity
   R3SceneRemoveTransformations(this, root, R3identity_affine);
 }
@@ -440,6 +503,10 @@ R3SceneSubdivideTriangles(R3Scene *scene, R3SceneNode *node, RNLength max_edge_l
 void R3Scene::
 SubdivideTriangles(RNLength max_edge_length)
 {
+  // Instanced meshes cannot be subdivided in place
+  std::set<R3Shape *> meshes;
+  R3SceneUnshareMeshes(this, root, meshes);
+
   // Subdivide triangles until none is longer than max edge length
   R3SceneSubdivideTriangles(this, root, max_edge_length);
 }
@@ -480,6 +547,16 @@ Intersects(const R3Ray& ray,
 
 
 
+void R3Scene::
+ComputeHitAttributes(const R3Ray& ray, R3SceneNode *hit_node, R3Shape *hit_shape,
+  R3Point *hit_point, R3Vector *hit_normal) const
+{
+  // Compute point and normal of a hit found by Intersects
+  root->ComputeHitAttributes(ray, hit_node, hit_shape, hit_point, hit_normal);
+}
+
+
+
 void R3Scene::
 Draw(const R3DrawFlags draw_flags, RNBoolean set_camera, RNBoolean set_lights) const
 {
@@ -1352,12 +1429,293 @@ WriteObjFile(const char *filename) const
 
 
 
+////////////////////////////////////////////////////////////////////////
+// MESH CACHE FUNCTIONS
+////////////////////////////////////////////////////////////////////////
+
+#if (RN_OS != RN_WINDOWS)
+#   include <sys/mman.h>
+#   include <sys/stat.h>
+#   include <fcntl.h>
+#   include <unistd.h>
+#endif
+#include <unordered_map>
+#include <vector>
+
+// Directory of cached meshes (NULL disables caching)
+static char *mesh_cache_directory = NULL;
+
+// Bump whenever the cache layout or the hierarchy construction changes
+static const int mesh_cache_version = 1;
+
+// Deepest hierarchy node a cache may hold (so that traversal stacks hold it)
+static const int mesh_cache_max_depth = 100;
+
+// On-disk records (plain data so they can be read straight from a mapping)
+struct R3MeshCacheHeader {
+  char magic[4];
+  int version;
+  unsigned long long key;
+  int nvertices;
+  int ntriangles;
+  int nnodes;
+  int reserved;
+};
+
+struct R3MeshCacheVertex {
+  double position[3];
+  double normal[3];
+};
+
+struct R3MeshCacheTriangle {
+  int vertices[3];
+};
+
+struct R3MeshCacheNode {
+  double box[6];
+  int index;
+  int ntriangles;
+};
+
+
+
+void 
+R3SetMeshCacheDirectory(const char *dirname)
+{
+  // Remember directory where flattened meshes are cached
+  if (mesh_cache_directory) free(mesh_cache_directory);
+  mesh_cache_directory = (dirname) ? strdup(dirname) : NULL;
+}
+
+
+
+static const void *
+MapMeshCacheFile(const char *filename, size_t *size)
+{
+#if (RN_OS != RN_WINDOWS)
+  // Open file
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0) return NULL;
+
+  // Get file size
+  struct stat st;
+  if ((fstat(fd, &st) < 0) || (st.st_size <= 0)) { close(fd); return NULL; }
+
+  // Map file into memory (read-only)
+  void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) return NULL;
+  *size = st.st_size;
+  return data;
+#else
+  return NULL;
+#endif
+}
+
+
+
+static void
+UnmapMeshCacheFile(const void *data, size_t size)
+{
+#if (RN_OS != RN_WINDOWS)
+  // Release mapping
+  if (data) munmap((void *) data, size);
+#endif
+}
+
+
+
+static unsigned long long
+MeshCacheKey(const char *filename)
+{
+  // Map mesh file
+  size_t size = 0;
+  const unsigned char *data = (const unsigned char *) MapMeshCacheFile(filename, &size);
+  if (!data) return 0;
+
+  // Hash contents (64-bit FNV-1a), folding in the cache version
+  unsigned long long key = 14695981039346656037ULL;
+  key = (key ^ (unsigned long long) mesh_cache_version) * 1099511628211ULL;
+  for (size_t i = 0; i < size; i++) {
+    key = (key ^ data[i]) * 1099511628211ULL;
+  }
+
+  // Unmap mesh file
+  UnmapMeshCacheFile(data, size);
+
+  // Return key
+  return key;
+}
+
+
+
+static R3TriangleArray *
+ReadMeshCache(const char *cachename, unsigned long long key)
+{
+  // Map cache file
+  size_t size = 0;
+  const char *data = (const char *) MapMeshCacheFile(cachename, &size);
+  if (!data) return NULL;
+
+  // Check header (sizes are computed in size_t so that corrupt counts cannot overflow)
+  const R3MeshCacheHeader *header = (const R3MeshCacheHeader *) data;
+  if ((size < sizeof(R3MeshCacheHeader)) || strncmp(header->magic, "R3MC", 4) ||
+      (header->version != mesh_cache_version) || (header->key != key) ||
+      (header->nvertices < 0) || (header->ntriangles < 0) || (header->nnodes < 0) ||
+      (size != sizeof(R3MeshCacheHeader) +
+        (size_t) header->nvertices * sizeof(R3MeshCacheVertex) +
+        (size_t) header->ntriangles * sizeof(R3MeshCacheTriangle) +
+        (size_t) header->nnodes * sizeof(R3MeshCacheNode))) {
+    UnmapMeshCacheFile(data, size);
+    return NULL;
+  }
+
+  // Get record arrays
+  const R3MeshCacheVertex *cache_vertices = (const R3MeshCacheVertex *) (header + 1);
+  const R3MeshCacheTriangle *cache_triangles = (const R3MeshCacheTriangle *) (cache_vertices + header->nvertices);
+  const R3MeshCacheNode *cache_nodes = (const R3MeshCacheNode *) (cache_triangles + header->ntriangles);
+
+  // Check that triangles index vertices, and that the hierarchy covers
+  // triangles with children that follow their parents within traversal depth
+  int valid = (header->nnodes > 0) || (header->ntriangles == 0);
+  for (int i = 0; valid && (i < header->ntriangles); i++) {
+    for (int j = 0; j < 3; j++) {
+      int k = cache_triangles[i].vertices[j];
+      if ((k < 0) || (k >= header->nvertices)) valid = 0;
+    }
+  }
+  std::vector<int> depths(header->nnodes, 0);
+  for (int i = 0; valid && (i < header->nnodes); i++) {
+    const R3MeshCacheNode& n = cache_nodes[i];
+    if (depths[i] > mesh_cache_max_depth) valid = 0;
+    else if (n.ntriangles > 0) {
+      if ((n.index < 0) || ((long long) n.index + n.ntriangles > header->ntriangles)) valid = 0;
+    }
+    else if ((n.ntriangles < 0) || (n.index <= i + 1) || (n.index >= header->nnodes)) valid = 0;
+    else {
+      depths[i + 1] = std::max(depths[i + 1], depths[i] + 1);
+      depths[n.index] = std::max(depths[n.index], depths[i] + 1);
+    }
+  }
+  if (!valid) {
+    UnmapMeshCacheFile(data, size);
+    return NULL;
+  }
+
+  // Create array of vertices (the shapes are polymorphic objects, so the
+  // records are decoded once rather than used in place)
+  RNArray<R3TriangleVertex *> vertices;
+  vertices.Resize(header->nvertices);
+  for (int i = 0; i < header->nvertices; i++) {
+    const R3MeshCacheVertex& v = cache_vertices[i];
+    R3Point position(v.position[0], v.position[1], v.position[2]);
+    R3Vector normal(v.normal[0], v.normal[1], v.normal[2]);
+    vertices.Insert(new R3TriangleVertex(position, normal));
+  }
+
+  // Create array of triangles (already in hierarchy leaf order)
+  RNArray<R3Triangle *> triangles;
+  triangles.Resize(header->ntriangles);
+  for (int i = 0; i < header->ntriangles; i++) {
+    const R3MeshCacheTriangle& t = cache_triangles[i];
+    R3TriangleVertex *v0 = vertices.Kth(t.vertices[0]);
+    R3TriangleVertex *v1 = vertices.Kth(t.vertices[1]);
+    R3TriangleVertex *v2 = vertices.Kth(t.vertices[2]);
+    triangles.Insert(new R3Triangle(v0, v1, v2));
+  }
+
+  // Create hierarchy
+  std::vector<R3TriangleArrayNode> nodes(header->nnodes);
+  for (int i = 0; i < header->nnodes; i++) {
+    const R3MeshCacheNode& n = cache_nodes[i];
+    nodes[i].box = R3Box(n.box[0], n.box[1], n.box[2], n.box[3], n.box[4], n.box[5]);
+    nodes[i].index = n.index;
+    nodes[i].ntriangles = n.ntriangles;
+  }
+
+  // Create triangle array
+  R3TriangleArray *array = new R3TriangleArray(vertices, triangles,
+    (header->nnodes > 0) ? &nodes[0] : NULL, header->nnodes);
+
+  // Clean up
+  UnmapMeshCacheFile(data, size);
+
+  // Return triangle array
+  return array;
+}
+
+
+
+static int
+WriteMeshCache(const char *cachename, unsigned long long key, R3TriangleArray *array)
+{
+  // Write to temporary file first so that concurrent readers never see partial data
+  char tmpname[2048];
+  int length = snprintf(tmpname, sizeof(tmpname), "%s.%d.tmp", cachename, (int) getpid());
+  if ((length < 0) || (length >= (int) sizeof(tmpname))) return 0;
+  FILE *fp = fopen(tmpname, "wb");
+  if (!fp) return 0;
+
+  // Write header
+  R3MeshCacheHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, "R3MC", 4);
+  header.version = mesh_cache_version;
+  header.key = key;
+  header.nvertices = array->NVertices();
+  header.ntriangles = array->NTriangles();
+  header.nnodes = array->NNodes();
+  int status = (fwrite(&header, sizeof(header), 1, fp) == 1);
+
+  // Write vertices (remembering their index, without touching their marks)
+  std::unordered_map<const R3TriangleVertex *, int> vertex_indices;
+  for (int i = 0; status && (i < array->NVertices()); i++) {
+    R3TriangleVertex *vertex = array->Vertex(i);
+    vertex_indices[vertex] = i;
+    R3MeshCacheVertex v;
+    for (int j = 0; j < 3; j++) v.position[j] = vertex->Position()[j];
+    for (int j = 0; j < 3; j++) v.normal[j] = vertex->Normal()[j];
+    status = (fwrite(&v, sizeof(v), 1, fp) == 1);
+  }
+
+  // Write triangles
+  for (int i = 0; status && (i < array->NTriangles()); i++) {
+    R3Triangle *triangle = array->Triangle(i);
+    R3MeshCacheTriangle t;
+    for (int j = 0; j < 3; j++) t.vertices[j] = vertex_indices[triangle->Vertex(j)];
+    status = (fwrite(&t, sizeof(t), 1, fp) == 1);
+  }
+
+  // Write hierarchy
+  for (int i = 0; status && (i < array->NNodes()); i++) {
+    const R3TriangleArrayNode& node = array->Node(i);
+    R3MeshCacheNode n;
+    for (int j = 0; j < 3; j++) n.box[j] = node.box.Min()[j];
+    for (int j = 0; j < 3; j++) n.box[3+j] = node.box.Max()[j];
+    n.index = node.index;
+    n.ntriangles = node.ntriangles;
+    status = (fwrite(&n, sizeof(n), 1, fp) == 1);
+  }
+
+  // Close file and move into place
+  if (fclose(fp) != 0) status = 0;
+  if (!status || (rename(tmpname, cachename) != 0)) {
+    remove(tmpname);
+    return 0;
+  }
+
+  // Return success
+  return 1;
+}
+
+
+
 ////////////////////////////////////////////////////////////////////////
 // MESH FILE I/O FUNCTIONS
 ////////////////////////////////////////////////////////////////////////
 
 static R3TriangleArray *
-ReadMesh(const char *filename)
+ParseMesh(const char *filename)
 {
   R3Mesh mesh;
   if (!mesh.ReadFile(filename)) {
@@ -1395,6 +1753,35 @@ ReadMesh(const char *filename)
 
 
 
+static R3TriangleArray *
+ReadMesh(const char *filename)
+{
+  // Parse mesh directly if there is no cache
+  if (!mesh_cache_directory) return ParseMesh(filename);
+
+  // Find cache file keyed by mesh contents
+  unsigned long long key = MeshCacheKey(filename);
+  if (key == 0) return ParseMesh(filename);
+  char cachename[2048];
+  int length = snprintf(cachename, sizeof(cachename), "%s/%016llx.r3mc", mesh_cache_directory, key);
+  if ((length < 0) || (length >= (int) sizeof(cachename))) return ParseMesh(filename);
+
+  // Read flattened triangles and hierarchy from cache if possible
+  R3TriangleArray *array = ReadMeshCache(cachename, key);
+  if (array) return array;
+
+  // Otherwise parse mesh and populate cache for next time
+  array = ParseMesh(filename);
+  if (array && !WriteMeshCache(cachename, key, array)) {
+    fprintf(stderr, "Unable to write mesh cache %s\n", cachename);
+  }
+
+  // Return triangle array
+  return array;
+}
+
+
+
 int R3Scene::
 ReadMeshFile(const char *filename)
 {
@@ -1459,6 +1846,11 @@ FindPrincetonMaterialAndElement(R3Scene *scene, R3SceneNode *node,
 
 
 
+// Meshes read so far, keyed by filename (shared across included files)
+static std::map<std::string, R3TriangleArray *> princeton_meshes;
+
+
+
 static int
 ReadPrinceton(R3Scene *scene, R3SceneNode *node, const char *filename, const bool REAL_MATERIAL)
 {
@@ -1651,9 +2043,15 @@ ReadPrinceton(R3Scene *scene, R3SceneNode *node, const char *filename, const boo
       else buffer[0] = '\0';
       strcat(buffer, meshname);
 
-      // Read mesh
-      R3TriangleArray *mesh = ReadMesh(buffer);
-      if (!mesh) return 0;
+      // Read mesh (shared by all references to the same file)
+      R3TriangleArray *mesh = NULL;
+      std::map<std::string, R3TriangleArray *>::iterator it = princeton_meshes.find(buffer);
+      if (it != princeton_meshes.end()) mesh = it->second;
+      else {
+        mesh = ReadMesh(buffer);
+        if (!mesh) return 0;
+        princeton_meshes[buffer] = mesh;
+      }
 
       // Get material and element from m
       if (!FindPrincetonMaterialAndElement(scene, group_nodes[depth], parsed_materials, m, group_materials[depth], material, element)) {
@@ -1958,7 +2356,10 @@ int R3Scene::
 ReadPrincetonFile(const char *filename, const bool REAL_MATERIAL)
 {
   // Read princeton file and insert contents into root node
-  return ReadPrinceton(this, root, filename, REAL_MATERIAL);
+  princeton_meshes.clear();
+  int status = ReadPrinceton(this, root, filename, REAL_MATERIAL);
+  princeton_meshes.clear();
+  return status;
 }
 
 
@@ -74,6 +74,8 @@ public:
     R3SceneNode **hit_node = NULL, R3SceneElement **hit_element = NULL, R3Shape **hit_shape = NULL,
     R3Point *hit_point = NULL, R3Vector *hit_normal = NULL, RNScalar *hit_t = NULL,
     RNScalar min_t = 0.0, RNScalar max_t = RN_INFINITY) const;
+  void ComputeHitAttributes(const R3Ray& ray, R3SceneNode *hit_node, R3Shape *hit_shape,
+    R3Point *hit_point = NULL, R3Vector *hit_normal = NULL) const;
 
   // I/O functions
   int ReadFile(const char *filename, const bool REAL_MATERIAL = true);
@@ -116,6 +118,12 @@ extern int ReadObj(R3Scene *scene, R3SceneNode *node, const char *filename, RNAr
 
 
 
+/* Mesh cache functions (meshes are cached by content in dirname; NULL disables) */
+
+extern void R3SetMeshCacheDirectory(const char *dirname);
+
+
+
 /* Inline functions */
 
 inline const R3Box& R3Scene::
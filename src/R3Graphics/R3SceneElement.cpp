@@ -127,8 +127,10 @@ SetMaterial(R3Material *material)
 void R3SceneElement::
 InsertShape(R3Shape *shape) 
 {
-  // Insert shape
+  // Insert shape (analytic primitives are intersected by the node)
   shapes.Insert(shape);
+  if (!IsPrimitive(shape)) other_shapes.Insert(shape);
+  else if (node) node->InsertPrimitive(this, shape);
 
   // Invalidate bounding box
   InvalidateBBox();
@@ -141,6 +143,8 @@ RemoveShape(R3Shape *shape)
 {
   // Remove shape
   shapes.Remove(shape);
+  if (!IsPrimitive(shape)) other_shapes.Remove(shape);
+  else if (node) node->UpdatePrimitives();
 
   // Invalidate bounding box
   InvalidateBBox();
@@ -157,6 +161,8 @@ Transform(const R3Transformation& transformation)
     shape->Transform(transformation);
   }
 
+  // Update primitives flattened by node
+  if (node) node->UpdatePrimitives();
 
   // Invalidate bounding box
   InvalidateBBox();
@@ -164,6 +170,16 @@ Transform(const R3Transformation& transformation)
 
 
 
+RNBoolean R3SceneElement::
+IsPrimitive(const R3Shape *shape)
+{
+  // Return whether shape is flattened into the analytic primitives of the node
+  RNClassID id = shape->ClassID();
+  return (id == R3Sphere::CLASS_ID()) || (id == R3Box::CLASS_ID()) || (id == R3Cylinder::CLASS_ID());
+}
+
+
+
 RNLength R3SceneElement::
 Distance(const R3Point& point) const
 {
@@ -209,13 +225,47 @@ FindClosest(const R3Point& point, R3Shape **hit_shape,
 RNBoolean R3SceneElement::
 Intersects(const R3Ray& ray, R3Shape **hit_shape,
   R3Point *hit_point, R3Vector *hit_normal, RNScalar *hit_t,
+  RNScalar min_t, RNScalar max_t, int *hit_primitive) const
+{
+  // Find closest shape
+  R3Shape *shape;
+  RNScalar t;
+  int primitive;
+  if (!FindIntersection(ray, shapes, &shape, &t, &primitive, min_t, max_t)) return FALSE;
+
+  // Fill in results
+  if (hit_shape) *hit_shape = shape;
+  if (hit_t) *hit_t = t;
+  if (hit_primitive) *hit_primitive = primitive;
+
+  // Compute point and normal for closest shape (or closest triangle) only
+  if (hit_point || hit_normal) {
+    if (primitive >= 0) {
+      const R3Triangle *triangle = ((R3TriangleArray *) shape)->Triangle(primitive);
+      if (hit_point) *hit_point = ray.Point(t);
+      if (hit_normal) *hit_normal = triangle->Normal();
+    }
+    else {
+      shape->Intersects(ray, hit_point, hit_normal, NULL);
+    }
+  }
+
+  // Return success
+  return TRUE;
+}
+
+
+
+RNBoolean R3SceneElement::
+FindIntersection(const R3Ray& ray, const RNArray<R3Shape *>& shapes,
+  R3Shape **hit_shape, RNScalar *hit_t, int *hit_primitive,
   RNScalar min_t, RNScalar max_t) const
 {
   // Variables
   RNScalar bbox_t;
   RNScalar closest_t = max_t;
-  R3Point point;
-  R3Vector normal;
+  R3Shape *closest_shape = NULL;
+  int closest_primitive = -1;
   RNScalar t;
 
   // Check if ray intersects bounding box
@@ -224,22 +274,32 @@ Intersects(const R3Ray& ray, R3Shape **hit_shape,
     if (RNIsGreater(bbox_t, max_t)) return FALSE;
   }
 
-  // Intersect with shapes
-  for (int i = 0; i < NShapes(); i++) {
-    R3Shape *shape = Shape(i);
-    if (shape->Intersects(ray, &point, &normal, &t)) {
+  // Intersect with shapes (remembering which triangle of a triangle array was hit)
+  for (int i = 0; i < shapes.NEntries(); i++) {
+    R3Shape *shape = shapes.Kth(i);
+    int primitive = -1;
+    RNBoolean hit = (shape->ClassID() == R3TriangleArray::CLASS_ID()) ?
+      (R3Intersects(ray, *((R3TriangleArray *) shape), &t, &primitive) != RN_NULL_CLASS_ID) :
+      shape->Intersects(ray, NULL, NULL, &t);
+    if (hit) {
       if ((t >= min_t) && (t <= closest_t)) {
-        if (hit_shape) *hit_shape = shape;
-        if (hit_point) *hit_point = point;
-        if (hit_normal) *hit_normal = normal;
-        if (hit_t) *hit_t = t;
+        closest_shape = shape;
+        closest_primitive = primitive;
         closest_t = t;
       }
     }
   }
 
-  // Return whether hit any shape
-  return (closest_t == max_t) ? FALSE : TRUE;
+  // Check if hit any shape
+  if (closest_t == max_t) return FALSE;
+
+  // Fill in results
+  *hit_shape = closest_shape;
+  *hit_t = closest_t;
+  *hit_primitive = closest_primitive;
+
+  // Return success
+  return TRUE;
 }
 
 
@@ -37,7 +37,7 @@ public:
     RNLength min_distance = 0, RNLength max_distance = RN_INFINITY) const;
   RNBoolean Intersects(const R3Ray& ray, R3Shape **hit_shape = NULL,
     R3Point *hit_point = NULL, R3Vector *hit_normal = NULL, RNScalar *hit_t = NULL,
-    RNScalar min_t = 0.0, RNScalar max_t = RN_INFINITY) const;
+    RNScalar min_t = 0.0, RNScalar max_t = RN_INFINITY, int *hit_primitive = NULL) const;
 
   // Draw functions
   void Draw(const R3DrawFlags draw_flags = R3_DEFAULT_DRAW_FLAGS) const;
@@ -47,11 +47,19 @@ public:
   void InvalidateBBox(void);
   void UpdateBBox(void);
 
+private:
+  // Internal query functions (closest of shapes, no point or normal)
+  static RNBoolean IsPrimitive(const R3Shape *shape);
+  RNBoolean FindIntersection(const R3Ray& ray, const RNArray<R3Shape *>& shapes,
+    R3Shape **hit_shape, RNScalar *hit_t, int *hit_primitive,
+    RNScalar min_t, RNScalar max_t) const;
+
 private:
   friend class R3SceneNode;
   R3SceneNode *node;
   R3Material *material;
   RNArray<R3Shape *> shapes;
+  RNArray<R3Shape *> other_shapes;
   unsigned int opengl_id;
   R3Box bbox;
 };
@@ -276,6 +276,12 @@ InsertElement(R3SceneElement *element)
   // Insert element
   elements.Insert(element);
 
+  // Insert its analytic primitives
+  for (int i = 0; i < element->NShapes(); i++) {
+    R3Shape *shape = element->Shape(i);
+    if (R3SceneElement::IsPrimitive(shape)) InsertPrimitive(element, shape);
+  }
+
   // Invalidate bounding box
   InvalidateBBox();
 }
@@ -292,12 +298,85 @@ RemoveElement(R3SceneElement *element)
   // Remove element
   elements.Remove(element);
 
+  // Remove its analytic primitives
+  UpdatePrimitives();
+
   // Invalidate bounding box
   InvalidateBBox();
 }
 
 
 
+void R3SceneNode::
+InsertPrimitive(R3SceneElement *element, R3Shape *shape)
+{
+  // Append analytic primitives of all elements to per-type arrays, so that
+  // they can be intersected in tight loops without virtual dispatch
+  if (shape->ClassID() == R3Sphere::CLASS_ID()) {
+    R3Sphere *sphere = (R3Sphere *) shape;
+    spheres.x.push_back(sphere->Center().X());
+    spheres.y.push_back(sphere->Center().Y());
+    spheres.z.push_back(sphere->Center().Z());
+    spheres.radius.push_back(sphere->Radius());
+    spheres.shapes.Insert(shape);
+    spheres.elements.Insert(element);
+  }
+  else if (shape->ClassID() == R3Box::CLASS_ID()) {
+    R3Box *box = (R3Box *) shape;
+    if (box->IsEmpty()) return;
+    boxes.xmin.push_back(box->XMin());
+    boxes.ymin.push_back(box->YMin());
+    boxes.zmin.push_back(box->ZMin());
+    boxes.xmax.push_back(box->XMax());
+    boxes.ymax.push_back(box->YMax());
+    boxes.zmax.push_back(box->ZMax());
+    boxes.shapes.Insert(shape);
+    boxes.elements.Insert(element);
+  }
+  else if (shape->ClassID() == R3Cylinder::CLASS_ID()) {
+    R3Cylinder *cylinder = (R3Cylinder *) shape;
+    const R3Span& axis = cylinder->Axis();
+    R3Vector direction = axis.Vector();
+    direction.Normalize();
+    cylinders.x.push_back(axis.Start().X());
+    cylinders.y.push_back(axis.Start().Y());
+    cylinders.z.push_back(axis.Start().Z());
+    cylinders.dx.push_back(direction.X());
+    cylinders.dy.push_back(direction.Y());
+    cylinders.dz.push_back(direction.Z());
+    cylinders.radius.push_back(cylinder->Radius());
+    cylinders.shapes.Insert(shape);
+    cylinders.elements.Insert(element);
+  }
+}
+
+
+
+void R3SceneNode::
+UpdatePrimitives(void)
+{
+  // Empty per-type arrays
+  spheres.x.clear(); spheres.y.clear(); spheres.z.clear(); spheres.radius.clear();
+  spheres.shapes.Empty(); spheres.elements.Empty();
+  boxes.xmin.clear(); boxes.ymin.clear(); boxes.zmin.clear();
+  boxes.xmax.clear(); boxes.ymax.clear(); boxes.zmax.clear();
+  boxes.shapes.Empty(); boxes.elements.Empty();
+  cylinders.x.clear(); cylinders.y.clear(); cylinders.z.clear();
+  cylinders.dx.clear(); cylinders.dy.clear(); cylinders.dz.clear(); cylinders.radius.clear();
+  cylinders.shapes.Empty(); cylinders.elements.Empty();
+
+  // Refill from shapes of elements
+  for (int i = 0; i < elements.NEntries(); i++) {
+    R3SceneElement *element = elements.Kth(i);
+    for (int j = 0; j < element->NShapes(); j++) {
+      R3Shape *shape = element->Shape(j);
+      if (R3SceneElement::IsPrimitive(shape)) InsertPrimitive(element, shape);
+    }
+  }
+}
+
+
+
 void R3SceneNode::
 SetTransformation(const R3Affine& transformation)
 {
@@ -422,18 +501,90 @@ Intersects(const R3Ray& ray,
   R3SceneNode **hit_node, R3SceneElement **hit_element, R3Shape **hit_shape,
   R3Point *hit_point, R3Vector *hit_normal, RNScalar *hit_t,
   RNScalar min_t, RNScalar max_t) const
+{
+  // Find closest hit without computing its point or normal
+  R3SceneNode *node = NULL;
+  R3SceneElement *element = NULL;
+  R3Shape *shape = NULL;
+  RNScalar t = max_t;
+  int primitive = -1;
+  if (!FindIntersection(ray, &node, &element, &shape, &t, min_t, max_t, &primitive)) return FALSE;
+
+  // Fill in results
+  if (hit_node) *hit_node = node;
+  if (hit_element) *hit_element = element;
+  if (hit_shape) *hit_shape = shape;
+  if (hit_t) *hit_t = t;
+
+  // Compute point and normal only for the closest hit
+  if (hit_point || hit_normal) {
+    ComputeHitAttributes(ray, node, shape, hit_point, hit_normal, primitive);
+  }
+
+  // Return success
+  return TRUE;
+}
+
+
+
+void R3SceneNode::
+ComputeHitAttributes(const R3Ray& ray, R3SceneNode *hit_node, R3Shape *hit_shape,
+  R3Point *hit_point, R3Vector *hit_normal, int hit_primitive) const
+{
+  // Gather path from hit node up to this node
+  const int max_depth = 1024;
+  const R3SceneNode *path[max_depth];
+  int depth = 0;
+  for (const R3SceneNode *node = hit_node; node && (depth < max_depth); node = node->parent) {
+    path[depth++] = node;
+    if (node == this) break;
+  }
+
+  // Transform ray into hit node's coordinate system (same steps as traversal)
+  R3Ray node_ray = ray;
+  for (int i = depth-1; i >= 0; i--) {
+    node_ray.InverseTransform(path[i]->transformation);
+  }
+
+  // Intersect hit triangle if traversal recorded one, otherwise the whole hit shape
+  R3Point point = R3zero_point;
+  R3Vector normal = R3zero_vector;
+  RNBoolean found = FALSE;
+  if ((hit_primitive >= 0) && (hit_shape->ClassID() == R3TriangleArray::CLASS_ID())) {
+    const R3Triangle *triangle = ((R3TriangleArray *) hit_shape)->Triangle(hit_primitive);
+    found = (R3Intersects(node_ray, *triangle, &point, &normal, NULL) != RN_NULL_CLASS_ID);
+  }
+  if (!found) hit_shape->Intersects(node_ray, &point, &normal, NULL);
+
+  // Transform point and normal back into this node's parent coordinate system
+  for (int i = 0; i < depth; i++) {
+    const R3Affine& transformation = path[i]->transformation;
+    point.Transform(transformation);
+    normal.Transform(transformation);
+    normal.Normalize();
+  }
+
+  // Return point and normal
+  if (hit_point) *hit_point = point;
+  if (hit_normal) *hit_normal = normal;
+}
+
+
+
+RNBoolean R3SceneNode::
+FindIntersection(const R3Ray& ray,
+  R3SceneNode **hit_node, R3SceneElement **hit_element, R3Shape **hit_shape, RNScalar *hit_t,
+  RNScalar min_t, RNScalar max_t, int *hit_primitive) const
 {
   // Temporary variables
   R3SceneNode *closest_node = NULL;
-  R3Point closest_point = R3zero_point;
   RNScalar closest_t = max_t;
   RNScalar bbox_t;
   R3SceneNode *node;
   R3SceneElement *element;
   R3Shape *shape;
-  R3Point point;
-  R3Vector normal;
   RNScalar t;
+  int primitive;
 
   // Check if ray intersects bounding box
   if (!R3Contains(BBox(), ray.Start())) {
@@ -457,17 +608,29 @@ Intersects(const R3Ray& ray,
     closest_t /= scale;
   }
 
-  // Find closest element intersection
+  // Find closest analytic primitive intersection (of all elements at once)
+  if (FindPrimitiveIntersection(node_ray, &element, &shape, &t, min_t, closest_t)) {
+    if ((t >= min_t) && (t <= closest_t)) {
+      *hit_node = (R3SceneNode *) this;
+      *hit_element = element;
+      *hit_shape = shape; 
+      *hit_primitive = -1;
+      closest_node = (R3SceneNode *) this;
+      closest_t = t;
+    }
+  }
+
+  // Find closest intersection with other shapes of elements
   for (int i = 0; i < elements.NEntries(); i++) {
     R3SceneElement *element = elements.Kth(i);
-    if (element->Intersects(node_ray, &shape, &point, &normal, &t, min_t, closest_t)) {
+    if (element->other_shapes.IsEmpty()) continue;
+    if (element->FindIntersection(node_ray, element->other_shapes, &shape, &t, &primitive, min_t, closest_t)) {
       if ((t >= min_t) && (t <= closest_t)) {
-        if (hit_node) *hit_node = (R3SceneNode *) this;
-        if (hit_element) *hit_element = element;
-        if (hit_shape) *hit_shape = shape; 
-        if (hit_normal) *hit_normal = normal; 
+        *hit_node = (R3SceneNode *) this;
+        *hit_element = element;
+        *hit_shape = shape; 
+        *hit_primitive = primitive;
         closest_node = (R3SceneNode *) this;
-        closest_point = point;
         closest_t = t;
       }
     }
@@ -476,14 +639,13 @@ Intersects(const R3Ray& ray,
   // Find closest node intersection
   for (int i = 0; i < children.NEntries(); i++) {
     R3SceneNode *child = children.Kth(i);
-    if (child->Intersects(node_ray, &node, &element, &shape, &point, &normal, &t, min_t, closest_t)) {
+    if (child->FindIntersection(node_ray, &node, &element, &shape, &t, min_t, closest_t, &primitive)) {
       if ((t >= min_t) && (t <= closest_t)) {
-        if (hit_node) *hit_node = node;
-        if (hit_element) *hit_element = element;
-        if (hit_shape) *hit_shape = shape; 
-        if (hit_normal) *hit_normal = normal; 
+        *hit_node = node;
+        *hit_element = element;
+        *hit_shape = shape; 
+        *hit_primitive = primitive;
         closest_node = node;
-        closest_point = point;
         closest_t = t;
       }
     }
@@ -492,25 +654,119 @@ Intersects(const R3Ray& ray,
   // Check if found hit
   if (!closest_node) return FALSE;
 
-  // Transform hit point into parent's coordinate system
-  if (hit_t || hit_point) {
-    closest_point.Transform(transformation); 
-    if (hit_point) *hit_point = closest_point;
-    if (hit_t) *hit_t = scale * closest_t; 
+  // Transform hit parameter into parent's coordinate system
+  *hit_t = scale * closest_t; 
+
+  // Return success
+  return TRUE;
+}
+
+
+
+RNBoolean R3SceneNode::
+FindPrimitiveIntersection(const R3Ray& ray,
+  R3SceneElement **hit_element, R3Shape **hit_shape, RNScalar *hit_t,
+  RNScalar min_t, RNScalar max_t) const
+{
+  // Variables
+  RNScalar closest_t = max_t;
+  R3SceneElement *closest_element = NULL;
+  R3Shape *closest_shape = NULL;
+  RNScalar t;
+
+  // Ray in scalar form
+  const RNScalar sx = ray.Start().X(), sy = ray.Start().Y(), sz = ray.Start().Z();
+  const RNScalar vx = ray.Vector().X(), vy = ray.Vector().Y(), vz = ray.Vector().Z();
+
+  // Intersect with spheres (same tests as R3Intersects)
+  for (int i = 0; i < (int) spheres.radius.size(); i++) {
+    RNScalar ex = spheres.x[i] - sx, ey = spheres.y[i] - sy, ez = spheres.z[i] - sz;
+    RNScalar r2 = spheres.radius[i] * spheres.radius[i];
+    RNScalar e2 = ex*ex + ey*ey + ez*ez;
+    RNScalar v = ex*vx + ey*vy + ez*vz;
+    RNBoolean start_inside = RNIsLessOrEqual(e2, r2);
+    if (!start_inside && RNIsNegativeOrZero(v)) continue;
+    RNScalar disc = r2 - (e2 - v*v);
+    if (RNIsNegative(disc)) continue;
+    t = (start_inside) ? v + sqrt(disc) : v - sqrt(disc);
+    if ((t >= min_t) && (t <= closest_t)) {
+      closest_shape = spheres.shapes.Kth(i);
+      closest_element = spheres.elements.Kth(i);
+      closest_t = t;
+    }
+  }
+
+  // Intersect with boxes (same tests as R3Intersects)
+  for (int i = 0; i < (int) boxes.xmin.size(); i++) {
+    RNScalar bmin[3] = { boxes.xmin[i], boxes.ymin[i], boxes.zmin[i] };
+    RNScalar bmax[3] = { boxes.xmax[i], boxes.ymax[i], boxes.zmax[i] };
+    RNScalar start[3] = { sx, sy, sz };
+    RNScalar vector[3] = { vx, vy, vz };
+    RNBoolean start_inside =
+      !RNIsLess(sx, bmin[0]) && !RNIsLess(sy, bmin[1]) && !RNIsLess(sz, bmin[2]) &&
+      !RNIsGreater(sx, bmax[0]) && !RNIsGreater(sy, bmax[1]) && !RNIsGreater(sz, bmax[2]);
+    for (int dim = 0; dim < 3; dim++) {
+      RNScalar delta;
+      if (RNIsPositive(vector[dim])) {
+        delta = ((start_inside) ? bmax[dim] : bmin[dim]) - start[dim];
+        if (delta < 0.0) continue;
+      }
+      else if (RNIsNegative(vector[dim])) {
+        delta = ((start_inside) ? bmin[dim] : bmax[dim]) - start[dim];
+        if (delta > 0.0) continue;
+      }
+      else continue;
+      RNScalar tval = delta / vector[dim];
+      int dim1 = (dim + 1) % 3;
+      int dim2 = (dim + 2) % 3;
+      RNScalar p1 = start[dim1] + vector[dim1] * tval;
+      RNScalar p2 = start[dim2] + vector[dim2] * tval;
+      if (RNIsLessOrEqual(p1, bmax[dim1]) && RNIsGreaterOrEqual(p1, bmin[dim1]) &&
+          RNIsLessOrEqual(p2, bmax[dim2]) && RNIsGreaterOrEqual(p2, bmin[dim2])) {
+        if ((tval >= min_t) && (tval <= closest_t)) {
+          closest_shape = boxes.shapes.Kth(i);
+          closest_element = boxes.elements.Kth(i);
+              closest_t = tval;
+        }
+        break;
+      }
+    }
   }
 
-  // Transform hit normal into parent's coordinate system
-  if (hit_normal) {
-    hit_normal->Transform(transformation); 
-    hit_normal->Normalize();
+  // Intersect with cylinders (reject by distance to infinite cylinder, then exact test)
+  for (int i = 0; i < (int) cylinders.radius.size(); i++) {
+    RNScalar ax = cylinders.dx[i], ay = cylinders.dy[i], az = cylinders.dz[i];
+    RNScalar cx = vy*az - vz*ay, cy = vz*ax - vx*az, cz = vx*ay - vy*ax;
+    RNScalar a = sqrt(cx*cx + cy*cy + cz*cz);
+    if (a > 0.0) {
+      RNScalar d = ((sx - cylinders.x[i])*cx + (sy - cylinders.y[i])*cy + (sz - cylinders.z[i])*cz) / a;
+      if (fabs(d) > cylinders.radius[i] + 2.0 * RN_EPSILON) continue;
+    }
+    R3Cylinder *cylinder = (R3Cylinder *) cylinders.shapes.Kth(i);
+    if (R3Intersects(ray, *cylinder, NULL, NULL, &t)) {
+      if ((t >= min_t) && (t <= closest_t)) {
+        closest_shape = cylinder;
+        closest_element = cylinders.elements.Kth(i);
+          closest_t = t;
+      }
+    }
   }
 
+  // Check if hit any primitive
+  if (closest_t == max_t) return FALSE;
+
+  // Fill in results
+  *hit_element = closest_element;
+  *hit_shape = closest_shape;
+  *hit_t = closest_t;
+
   // Return success
   return TRUE;
 }
 
 
 
+
 void R3SceneNode::
 Draw(const R3DrawFlags draw_flags) const
 {
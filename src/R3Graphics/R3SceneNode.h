@@ -60,6 +60,8 @@ public:
     R3SceneNode **hit_node = NULL, R3SceneElement **hit_element = NULL, R3Shape **hit_shape = NULL,
     R3Point *hit_point = NULL, R3Vector *hit_normal = NULL, RNScalar *hit_t = NULL,
     RNScalar min_t = 0.0, RNScalar max_t = RN_INFINITY) const;
+  void ComputeHitAttributes(const R3Ray& ray, R3SceneNode *hit_node, R3Shape *hit_shape,
+    R3Point *hit_point = NULL, R3Vector *hit_normal = NULL, int hit_primitive = -1) const;
 
   // Draw functions
   void Draw(const R3DrawFlags draw_flags = R3_DEFAULT_DRAW_FLAGS) const;
@@ -69,8 +71,22 @@ public:
   void InvalidateBBox(void);
   void UpdateBBox(void);
 
+private:
+  // Internal query functions (closest hit only, no point or normal)
+  RNBoolean FindIntersection(const R3Ray& ray,
+    R3SceneNode **hit_node, R3SceneElement **hit_element, R3Shape **hit_shape, RNScalar *hit_t,
+    RNScalar min_t, RNScalar max_t, int *hit_primitive) const;
+  RNBoolean FindPrimitiveIntersection(const R3Ray& ray,
+    R3SceneElement **hit_element, R3Shape **hit_shape, RNScalar *hit_t,
+    RNScalar min_t, RNScalar max_t) const;
+
+  // Internal primitive functions
+  void InsertPrimitive(R3SceneElement *element, R3Shape *shape);
+  void UpdatePrimitives(void);
+
 private:
   friend class R3Scene;
+  friend class R3SceneElement;
   R3Scene *scene;
   int scene_index;
   R3SceneNode *parent;
@@ -81,6 +97,23 @@ private:
   R3Box bbox;
   char *name;
   void *data;
+
+  // Analytic primitives of all elements flattened by type (struct of arrays)
+  struct {
+    std::vector<RNScalar> x, y, z, radius;
+    RNArray<R3Shape *> shapes;
+    RNArray<R3SceneElement *> elements;
+  } spheres;
+  struct {
+    std::vector<RNScalar> xmin, ymin, zmin, xmax, ymax, zmax;
+    RNArray<R3Shape *> shapes;
+    RNArray<R3SceneElement *> elements;
+  } boxes;
+  struct {
+    std::vector<RNScalar> x, y, z, dx, dy, dz, radius;
+    RNArray<R3Shape *> shapes;
+    RNArray<R3SceneElement *> elements;
+  } cylinders;
 };
 
 
@@ -797,36 +797,96 @@ RNClassID R3Intersects(const R3Ray& ray, const R3Triangle& triangle,
 
 
 
-RNClassID R3Intersects(const R3Ray& ray, const R3TriangleArray& array,
-    R3Point *hit_point, R3Vector *hit_normal, RNScalar *hit_t)
+static RNBoolean
+R3IntersectsSlabs(const R3Point& start, const RNScalar inverse[3], const R3Box& box,
+    RNScalar max_t)
 {
-    // This could be more efficient ???
-    // Sort intersections with front-facing planes 
-    //   before do any point-in-triangle operations
+    // Clip parametric interval against the three slabs of the box
+    RNScalar t0 = 0.0;
+    RNScalar t1 = max_t;
+    for (int dim = RN_X; dim <= RN_Z; dim++) {
+        RNScalar ta = (box.Min()[dim] - start[dim]) * inverse[dim];
+        RNScalar tb = (box.Max()[dim] - start[dim]) * inverse[dim];
+        if (ta > tb) { RNScalar swap = ta; ta = tb; tb = swap; }
+        if (ta > t0) t0 = ta;
+        if (tb < t1) t1 = tb;
+        if (t0 > t1 + RN_EPSILON) return FALSE;
+    }
+    return TRUE;
+}
+
+
 
-    // Check bounding volume for intersection 
-    if (!R3Intersects(ray, array.Box())) 
+RNClassID R3Intersects(const R3Ray& ray, const R3TriangleArray& array,
+    RNScalar *hit_t, int *hit_triangle)
+{
+    // Check hierarchy
+    if (array.NNodes() == 0) 
 	return RN_NULL_CLASS_ID;
 
-    // Check each triangle for intersection
+    // Precompute reciprocal ray direction for slab tests
+    const R3Point& start = ray.Start();
+    RNScalar inverse[3];
+    for (int dim = RN_X; dim <= RN_Z; dim++) {
+        RNScalar v = ray.Vector()[dim];
+        inverse[dim] = (v != 0) ? 1.0 / v : RN_INFINITY;
+    }
+
+    // Traverse hierarchy, visiting only nodes closer than the closest hit
     RNClassID status = RN_NULL_CLASS_ID;
     RNScalar min_t = FLT_MAX;
-    for (int i = 0; i < array.NTriangles(); i++) {
-        R3Point point;
-        R3Vector normal;
-	RNScalar t;
-        if (R3Intersects(ray, *(array.Triangle(i)), &point, &normal, &t) == R3_POINT_CLASS_ID) {
-	    if (t < min_t) {
-	        status = R3_POINT_CLASS_ID;
-	        if (hit_point) *hit_point = point;
-	        if (hit_normal) *hit_normal = normal;
-	        min_t = t;
+    int hit_index = -1;
+    int stack[128];
+    int stack_size = 0;
+    stack[stack_size++] = 0;
+    while (stack_size > 0) {
+	int node_index = stack[--stack_size];
+	const R3TriangleArrayNode& node = array.Node(node_index);
+	if (!R3IntersectsSlabs(start, inverse, node.box, min_t)) continue;
+	if (node.ntriangles > 0) {
+	    // Check each triangle in leaf for intersection
+	    for (int i = node.index; i < node.index + node.ntriangles; i++) {
+		const R3Triangle *triangle = array.Triangle(i);
+		RNScalar t;
+		if (R3Intersects(ray, *triangle, NULL, NULL, &t) == R3_POINT_CLASS_ID) {
+		    if (t < min_t) {
+			status = R3_POINT_CLASS_ID;
+			hit_index = i;
+			min_t = t;
+		    }
+		}
 	    }
 	}
+	else {
+	    // Push both children (first child follows parent)
+	    stack[stack_size++] = node.index;
+	    stack[stack_size++] = node_index + 1;
+	}
     }
 
-    // Update hit t
+    // Update hit t and index of closest triangle
     if (hit_t) *hit_t = min_t;
+    if (hit_triangle) *hit_triangle = hit_index;
+
+    // Return whether hit any triangle
+    return status;
+}
+
+
+
+RNClassID R3Intersects(const R3Ray& ray, const R3TriangleArray& array,
+    R3Point *hit_point, R3Vector *hit_normal, RNScalar *hit_t)
+{
+    // Find closest triangle
+    RNScalar t;
+    int index;
+    RNClassID status = R3Intersects(ray, array, &t, &index);
+    if (status == RN_NULL_CLASS_ID) return status;
+
+    // Fill in hit information for closest triangle only
+    if (hit_point) *hit_point = ray.Point(t);
+    if (hit_normal) *hit_normal = array.Triangle(index)->Normal();
+    if (hit_t) *hit_t = t;
 
     // Return whether hit any triangle
     return status;
@@ -57,6 +57,8 @@ RNClassID R3Intersects(const R3Ray& ray, const R3Triangle& triangle,
     R3Point *hit_point1 = NULL, R3Vector *hit_normal1 = NULL, RNScalar *hit_t1 = NULL);
 RNClassID R3Intersects(const R3Ray& ray, const R3TriangleArray& array, 
     R3Point *hit_point1 = NULL, R3Vector *hit_normal1 = NULL, RNScalar *hit_t1 = NULL);
+RNClassID R3Intersects(const R3Ray& ray, const R3TriangleArray& array, 
+    RNScalar *hit_t1, int *hit_triangle1);
 RNClassID R3Intersects(const R3Ray& ray, const R3Circle& circle, 
     R3Point *hit_point1 = NULL, R3Vector *hit_normal1 = NULL, RNScalar *hit_t1 = NULL);
 RNClassID R3Intersects(const R3Ray& ray, const R3Box& box, 
@@ -34,7 +34,9 @@ R3StopTriangleArray()
 
 R3TriangleArray::
 R3TriangleArray(void)
-    : bbox(R3null_box)
+    : nodes(NULL),
+      nnodes(0),
+      bbox(R3null_box)
 {
 }
 
@@ -44,8 +46,15 @@ R3TriangleArray::
 R3TriangleArray(const R3TriangleArray& array)
   : vertices(array.vertices),
     triangles(array.triangles),
+    nodes(NULL),
+    nnodes(array.nnodes),
     bbox(array.bbox)
 {
+    // Copy hierarchy
+    if (nnodes > 0) {
+      nodes = new R3TriangleArrayNode [ nnodes ];
+      for (int i = 0; i < nnodes; i++) nodes[i] = array.nodes[i];
+    }
 }
 
 
@@ -54,6 +63,8 @@ R3TriangleArray::
 R3TriangleArray(const RNArray<R3TriangleVertex *>& vertices, const RNArray<R3Triangle *>& triangles)
   : vertices(vertices),
     triangles(triangles),
+    nodes(NULL),
+    nnodes(0),
     bbox(R3null_box)
 {
     // Update bounding box
@@ -62,6 +73,68 @@ R3TriangleArray(const RNArray<R3TriangleVertex *>& vertices, const RNArray<R3Tri
 
 
 
+R3TriangleArray::
+R3TriangleArray(const RNArray<R3TriangleVertex *>& vertices, const RNArray<R3Triangle *>& triangles,
+  const R3TriangleArrayNode *hierarchy, int nhierarchy)
+  : vertices(vertices),
+    triangles(triangles),
+    nodes(NULL),
+    nnodes(0),
+    bbox(R3null_box)
+{
+    // Adopt prebuilt hierarchy (triangles must already be in leaf order)
+    if (nhierarchy > 0) {
+      nnodes = nhierarchy;
+      nodes = new R3TriangleArrayNode [ nnodes ];
+      for (int i = 0; i < nnodes; i++) nodes[i] = hierarchy[i];
+    }
+
+    // Update bounding box (and hierarchy if none given)
+    bbox = R3null_box;
+    for (int i = 0; i < vertices.NEntries(); i++) {
+      R3TriangleVertex *v = vertices.Kth(i);
+      bbox.Union(v->Position());
+    }
+    if (nnodes == 0) UpdateHierarchy();
+}
+
+
+
+R3TriangleArray::
+~R3TriangleArray(void)
+{
+    // Delete hierarchy
+    if (nodes) delete [] nodes;
+}
+
+
+
+R3TriangleArray& R3TriangleArray::
+operator=(const R3TriangleArray& array)
+{
+    // Check for self assignment
+    if (this == &array) return *this;
+
+    // Copy vertices and triangles
+    vertices = array.vertices;
+    triangles = array.triangles;
+    bbox = array.bbox;
+
+    // Copy hierarchy
+    if (nodes) delete [] nodes;
+    nodes = NULL;
+    nnodes = array.nnodes;
+    if (nnodes > 0) {
+      nodes = new R3TriangleArrayNode [ nnodes ];
+      for (int i = 0; i < nnodes; i++) nodes[i] = array.nodes[i];
+    }
+
+    // Return this
+    return *this;
+}
+
+
+
 const RNBoolean R3TriangleArray::
 IsPoint (void) const
 {
@@ -352,6 +425,9 @@ Subdivide(RNLength max_edge_length)
       stack.Insert(t);
     }
   }
+
+  // Update bounding box and hierarchy
+  Update();
 }
 
 
@@ -366,15 +442,20 @@ MoveVertex(R3TriangleVertex *vertex, const R3Point& position)
     for (int i = 0; i < triangles.NEntries(); i++) {
       R3Triangle *triangle = triangles.Kth(i);
       for (int j = 0; j < 3; j++) {
-        if (triangle->Vertex(i) == vertex) {
+        if (triangle->Vertex(j) == vertex) {
           triangle->Update();
           break;
         }
       }
     }
 
-    // Update
-    Update();
+    // Update bounding box and refit hierarchy (its topology still holds)
+    bbox = R3null_box;
+    for (int i = 0; i < vertices.NEntries(); i++) {
+      R3TriangleVertex *v = vertices.Kth(i);
+      bbox.Union(v->Position());
+    }
+    RefitHierarchy();
 }
 
 
@@ -388,6 +469,98 @@ Update(void)
       R3TriangleVertex *v = vertices.Kth(i);
       bbox.Union(v->Position());
     }
+
+    // Rebuild hierarchy
+    UpdateHierarchy();
+}
+
+
+
+void R3TriangleArray::
+UpdateHierarchy(void)
+{
+    // Delete previous hierarchy
+    if (nodes) delete [] nodes;
+    nodes = NULL;
+    nnodes = 0;
+
+    // Check triangles
+    if (triangles.IsEmpty()) return;
+
+    // Allocate nodes (a binary tree with N leaves has at most 2N-1 nodes)
+    nodes = new R3TriangleArrayNode [ 2 * triangles.NEntries() ];
+
+    // Build hierarchy (reorders triangles so that leaves are contiguous)
+    BuildHierarchy(0, triangles.NEntries(), 0);
+}
+
+
+
+void R3TriangleArray::
+RefitHierarchy(void)
+{
+    // Recompute node boxes bottom up (children follow their parents)
+    for (int i = nnodes - 1; i >= 0; i--) {
+      R3TriangleArrayNode& node = nodes[i];
+      node.box = R3null_box;
+      if (node.ntriangles > 0) {
+        for (int j = node.index; j < node.index + node.ntriangles; j++) {
+          node.box.Union(triangles[j]->Box());
+        }
+      }
+      else {
+        node.box.Union(nodes[i+1].box);
+        node.box.Union(nodes[node.index].box);
+      }
+    }
+}
+
+
+
+int R3TriangleArray::
+BuildHierarchy(int start, int end, int depth)
+{
+    // Maximum number of triangles in a leaf
+    const int max_leaf_triangles = 4;
+
+    // Create node
+    int node_index = nnodes++;
+    R3TriangleArrayNode& node = nodes[node_index];
+    node.box = R3null_box;
+    R3Box centroid_box = R3null_box;
+    for (int i = start; i < end; i++) {
+      const R3Box& box = triangles[i]->Box();
+      node.box.Union(box);
+      centroid_box.Union(box.Centroid());
+    }
+
+    // Check if leaf
+    int dim = centroid_box.LongestAxis();
+    RNCoord split = centroid_box.AxisCenter(dim);
+    if ((end - start <= max_leaf_triangles) || RNIsZero(centroid_box.AxisLength(dim))) {
+      node.index = start;
+      node.ntriangles = end - start;
+      return node_index;
+    }
+
+    // Partition triangles around middle of centroid bounds
+    int mid = start;
+    for (int i = start; i < end; i++) {
+      if (triangles[i]->Box().Centroid()[dim] < split) {
+        triangles.Swap(i, mid);
+        mid++;
+      }
+    }
+
+    // Fall back to even split if partition is degenerate or tree is deep
+    // (bounds depth so that traversal stacks stay small)
+    if ((mid == start) || (mid == end) || (depth > 32)) mid = (start + end) / 2;
+
+    // Build children (first child immediately follows its parent)
+    nodes[node_index].ntriangles = 0;
+    BuildHierarchy(start, mid, depth + 1);
+    nodes[node_index].index = BuildHierarchy(mid, end, depth + 1);
+    return node_index;
 }
 
 
@@ -9,6 +9,16 @@ void R3StopTriangleArray();
 
 
 
+/* Hierarchy node definition */
+
+struct R3TriangleArrayNode {
+    R3Box box;
+    int index; // First triangle (leaf) or second child (interior)
+    int ntriangles; // Zero for interior nodes
+};
+
+
+
 /* Triangle class definition */
 
 class R3TriangleArray : public R3Surface {
@@ -17,6 +27,12 @@ class R3TriangleArray : public R3Surface {
         R3TriangleArray(void);
         R3TriangleArray(const R3TriangleArray& array);
         R3TriangleArray(const RNArray<R3TriangleVertex *>& vertices, const RNArray<R3Triangle *>& triangles);
+        R3TriangleArray(const RNArray<R3TriangleVertex *>& vertices, const RNArray<R3Triangle *>& triangles,
+            const R3TriangleArrayNode *nodes, int nnodes);
+        virtual ~R3TriangleArray(void);
+
+        // Assignment functions/operators
+        R3TriangleArray& operator=(const R3TriangleArray& array);
 
         // Triangle array properties
         const R3Box& Box(void) const;
@@ -29,6 +45,10 @@ class R3TriangleArray : public R3Surface {
         int NTriangles(void) const;
 	R3Triangle *Triangle(int index) const;
 
+	// Hierarchy access functions/operators (depth-first, leaves index triangles)
+        int NNodes(void) const;
+	const R3TriangleArrayNode& Node(int index) const;
+
         // Shape property functions/operators
 	virtual const RNBoolean IsPoint(void) const;
 	virtual const RNBoolean IsLinear(void) const;
@@ -59,9 +79,16 @@ class R3TriangleArray : public R3Surface {
 	RN_CLASS_TYPE_DECLARATIONS(R3TriangleArray);
         R3_SHAPE_RELATIONSHIP_DECLARATIONS(R3TriangleArray);
 
+    private:
+        void UpdateHierarchy(void);
+        void RefitHierarchy(void);
+        int BuildHierarchy(int start, int end, int depth);
+
     private:
 	RNArray<R3TriangleVertex *> vertices;
 	RNArray<R3Triangle *> triangles;
+        R3TriangleArrayNode *nodes;
+        int nnodes;
         R3Box bbox;
 };
 
@@ -114,6 +141,24 @@ Triangle(int k) const
 
 
 
+inline int R3TriangleArray::
+NNodes(void) const
+{
+    // Return number of hierarchy nodes
+    return nnodes;
+}
+
+
+
+inline const R3TriangleArrayNode& R3TriangleArray::
+Node(int k) const
+{
+    // Return kth hierarchy node
+    return nodes[k];
+}
+
+
+
 
 
 
@@ -114,6 +114,17 @@ void RNSeedThreadRandomness(RNScalar seed) {
   generator->discard(700000);
 }
 
+/* Threadable Random Number Functions (deterministic seed, cheap enough to
+   call once per batch of work since the state is mixed instead of warmed up) */
+void RNReseedThreadRandomness(unsigned int seed) {
+  std::seed_seq sequence{seed, 0x9E3779B9u};
+  if (!generator) {
+    generator = new std::mt19937(sequence);
+  } else {
+    generator->seed(sequence);
+  }
+}
+
 /* Threadable Random Number Functions */
 void RNClearThreadRandomness(void) {
   if (generator) {
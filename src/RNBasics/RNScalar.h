@@ -173,6 +173,7 @@ extern void RNSetEpsilon(RNScalar epsilon);
 /* Thread safe RNG */
 extern void RNInitThreadRandomness(void);
 extern void RNSeedThreadRandomness(RNScalar seed = 0.0);
+extern void RNReseedThreadRandomness(unsigned int seed);
 extern void RNClearThreadRandomness(void);
 extern RNScalar RNThreadableRandomScalar(void);
 
@@ -0,0 +1,640 @@
+// Source file for the benchmark driver, which renders a fixed set of scenes at
+// several quality tiers with photonmap and records how fast each phase ran
+
+// Include files
+#include <vector>
+#include <string>
+#include <map>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+
+using namespace std;
+
+////////////////////////////////////////////////////////////////////////
+// Benchmark Definition
+////////////////////////////////////////////////////////////////////////
+
+// Scenes rendered (from the input directory)
+static const char *bench_scenes[] = {
+  "cornell",          // Diffuse box with glossy and glass spheres
+  "glass_spheres",    // Caustics through glass
+  "softshadow",       // Area light soft shadows
+  "specular",         // Glossy reflection
+};
+static const int num_bench_scenes = sizeof(bench_scenes) / sizeof(bench_scenes[0]);
+
+// Quality tiers (flags passed to photonmap)
+struct BenchTier {
+  const char *name;
+  const char *flags;
+};
+static const BenchTier bench_tiers[] = {
+  { "smoke", "-resolution 64 64 -aa 0 -global 20000 -caustic 20000 -it 16 -lt 8 -ss 8 "
+    "-tt 8 -st 8 -md 16" },
+  { "small", "-resolution 256 256 -aa 1 -global 200000 -caustic 200000 -it 64 -lt 32 "
+    "-ss 32 -tt 64 -st 64 -md 64" },
+  { "full", "-resolution 512 512 -aa 1 -global 1000000 -caustic 1000000 -it 256 -lt 128 "
+    "-ss 96 -tt 256 -st 256 -md 128" },
+};
+static const int num_bench_tiers = sizeof(bench_tiers) / sizeof(bench_tiers[0]);
+
+// Phases timed (trace event names of photonmap)
+static const char *bench_phases[] = {
+  "read scene", "importance map", "map photons", "build kdtrees", "irradiance cache",
+  "map shadow photons", "render", "denoise", "write image"
+};
+static const int num_bench_phases = sizeof(bench_phases) / sizeof(bench_phases[0]);
+
+// Rays counted (args of the render strips traced by photonmap)
+static const char *bench_rays[] = {
+  "screen_rays", "shadow_rays", "monte_carlo_rays", "transmissive_samples",
+  "specular_samples", "indirect_samples", "caustic_samples"
+};
+static const int num_bench_rays = sizeof(bench_rays) / sizeof(bench_rays[0]);
+
+// Absolute slack of time comparisons, so that phases too short to time
+// reliably do not fail the comparison
+static const double time_slack = 0.05;
+
+////////////////////////////////////////////////////////////////////////
+// Program Parameters
+////////////////////////////////////////////////////////////////////////
+
+static const char *photonmap_exe = "src/photonmap";
+static const char *input_dir = "input";
+static const char *output_dir = "bench";
+static const char *baseline_name = NULL;
+static double tolerance = 0.1;
+static vector<string> tier_names;
+static vector<string> scene_names;
+static int threads = 1;
+static int seed = 1;
+static int runs = 1;
+
+////////////////////////////////////////////////////////////////////////
+// Results
+////////////////////////////////////////////////////////////////////////
+
+// Measurements of a render of a scene at a tier (columns of the CSV, in order)
+struct BenchResult {
+  string scene;
+  string tier;
+  vector<pair<string, double> > values;
+  string image_hash;
+};
+
+// Value of result named name (NULL if missing)
+static const double *ResultValue(const BenchResult& result, const string& name)
+{
+  for (unsigned int i = 0; i < result.values.size(); i++) {
+    if (result.values[i].first == name) return &result.values[i].second;
+  }
+  return NULL;
+}
+
+// Column name of an event or ray name (spaces become underscores)
+static string ColumnName(const char *name, const char *suffix)
+{
+  string column(name);
+  replace(column.begin(), column.end(), ' ', '_');
+  return column + suffix;
+}
+
+////////////////////////////////////////////////////////////////////////
+// Trace Summary Parsing
+////////////////////////////////////////////////////////////////////////
+
+// A value of a JSON document (only what the trace summary holds)
+struct JSONValue {
+  enum { NUMBER, STRING, OBJECT, OTHER } type;
+  double number;
+  string text;
+  map<string, JSONValue> members;
+};
+
+static void SkipJSONSpace(const char *&s)
+{
+  while (*s == ' ' || *s == '\t' || *s == '\n' || *s == '\r') s++;
+}
+
+static int ParseJSONString(const char *&s, string& text)
+{
+  if (*s != '"') return 0;
+  s++;
+  text.clear();
+  while (*s && *s != '"') {
+    if (*s == '\\' && s[1]) {
+      s++;
+      if (*s == 'u' && strlen(s) >= 5) {
+        text += (char) strtol(string(s + 1, 4).c_str(), NULL, 16);
+        s += 4;
+      } else if (*s == 'n') text += '\n';
+      else if (*s == 't') text += '\t';
+      else text += *s;
+    } else {
+      text += *s;
+    }
+    s++;
+  }
+  if (*s != '"') return 0;
+  s++;
+  return 1;
+}
+
+static int ParseJSONValue(const char *&s, JSONValue& value)
+{
+  SkipJSONSpace(s);
+  if (*s == '{') {
+    value.type = JSONValue::OBJECT;
+    s++;
+    SkipJSONSpace(s);
+    if (*s == '}') { s++; return 1; }
+    while (true) {
+      string key;
+      SkipJSONSpace(s);
+      if (!ParseJSONString(s, key)) return 0;
+      SkipJSONSpace(s);
+      if (*s++ != ':') return 0;
+      if (!ParseJSONValue(s, value.members[key])) return 0;
+      SkipJSONSpace(s);
+      if (*s == ',') { s++; continue; }
+      if (*s++ != '}') return 0;
+      return 1;
+    }
+  } else if (*s == '"') {
+    value.type = JSONValue::STRING;
+    return ParseJSONString(s, value.text);
+  } else if (!strncmp(s, "null", 4)) {
+    // Args that were not finite
+    value.type = JSONValue::OTHER;
+    s += 4;
+    return 1;
+  } else {
+    char *end;
+    value.number = strtod(s, &end);
+    if (end == s) {
+      // Other literals and arrays are not in summaries
+      value.type = JSONValue::OTHER;
+      return 0;
+    }
+    value.type = JSONValue::NUMBER;
+    s = end;
+    return 1;
+  }
+}
+
+// Read the JSON document in filename into value
+static int ReadJSONFile(const char *filename, JSONValue& value)
+{
+  FILE *fp = fopen(filename, "r");
+  if (!fp) {
+    fprintf(stderr, "Unable to open %s\n", filename);
+    return 0;
+  }
+  string text;
+  char buffer[4096];
+  size_t count;
+  while ((count = fread(buffer, 1, sizeof(buffer), fp)) > 0) text.append(buffer, count);
+  fclose(fp);
+  const char *s = text.c_str();
+  if (!ParseJSONValue(s, value)) {
+    fprintf(stderr, "Unable to parse %s\n", filename);
+    return 0;
+  }
+  return 1;
+}
+
+// Number member name of object (0 if missing)
+static double JSONNumber(const JSONValue& object, const char *name)
+{
+  map<string, JSONValue>::const_iterator it = object.members.find(name);
+  if (it == object.members.end() || it->second.type != JSONValue::NUMBER) return 0;
+  return it->second.number;
+}
+
+// Summary of event name in the trace summary (NULL if not recorded)
+static const JSONValue *SummaryEvent(const JSONValue& summary, const char *name)
+{
+  map<string, JSONValue>::const_iterator events = summary.members.find("events");
+  if (events == summary.members.end()) return NULL;
+  map<string, JSONValue>::const_iterator it = events->second.members.find(name);
+  if (it == events->second.members.end()) return NULL;
+  return &it->second;
+}
+
+// Summed arg name of event name in the trace summary (0 if missing)
+static double SummaryArg(const JSONValue& summary, const char *event_name, const char *name)
+{
+  const JSONValue *event = SummaryEvent(summary, event_name);
+  if (!event) return 0;
+  map<string, JSONValue>::const_iterator args = event->members.find("args");
+  if (args == event->members.end()) return 0;
+  return JSONNumber(args->second, name);
+}
+
+////////////////////////////////////////////////////////////////////////
+// Running
+////////////////////////////////////////////////////////////////////////
+
+// Split flags at whitespace
+static vector<string> SplitFlags(const char *flags)
+{
+  vector<string> words;
+  string word;
+  for (const char *s = flags; ; s++) {
+    if (*s && *s != ' ') word += *s;
+    else if (!word.empty()) { words.push_back(word); word.clear(); }
+    if (!*s) break;
+  }
+  return words;
+}
+
+// FNV-1a hash of the contents of filename, in hex (empty if unreadable)
+static string HashFile(const char *filename)
+{
+  FILE *fp = fopen(filename, "rb");
+  if (!fp) return string();
+  unsigned long long h = 0xCBF29CE484222325ull;
+  int c;
+  while ((c = getc(fp)) != EOF) {
+    h ^= (unsigned char) c;
+    h *= 0x100000001B3ull;
+  }
+  fclose(fp);
+  char hex[17];
+  sprintf(hex, "%016llx", h);
+  return string(hex);
+}
+
+// Render scene at tier once with photonmap (its output going to a log),
+// filling result with the wall time, peak RSS, and the phase times, ray rates
+// and photon rate of its trace summary
+static int RunBenchmark(const string& scene, const BenchTier& tier, BenchResult& result)
+{
+  // Build arguments
+  string name = output_dir + string("/") + scene + "_" + tier.name;
+  string scene_name = input_dir + string("/") + scene + ".scn";
+  string image_name = name + ".png";
+  string trace_name = name + ".json";
+  string summary_name = name + "_summary.json";
+  string log_name = name + ".log";
+  vector<string> words;
+  words.push_back(photonmap_exe);
+  words.push_back(scene_name);
+  words.push_back(image_name);
+  vector<string> flags = SplitFlags(tier.flags);
+  words.insert(words.end(), flags.begin(), flags.end());
+  words.push_back("-threads");
+  words.push_back(to_string(threads));
+  words.push_back("-seed");
+  words.push_back(to_string(seed));
+  words.push_back("-trace");
+  words.push_back(trace_name);
+  words.push_back("-v");
+  vector<char *> args;
+  for (unsigned int i = 0; i < words.size(); i++) args.push_back((char *) words[i].c_str());
+  args.push_back(NULL);
+  remove(summary_name.c_str());
+
+  // Run photonmap
+  chrono::steady_clock::time_point start = chrono::steady_clock::now();
+  pid_t pid = fork();
+  if (pid < 0) {
+    fprintf(stderr, "Unable to run %s\n", photonmap_exe);
+    return 0;
+  } else if (pid == 0) {
+    int fd = open(log_name.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd >= 0) {
+      dup2(fd, STDOUT_FILENO);
+      dup2(fd, STDERR_FILENO);
+      close(fd);
+    }
+    execv(photonmap_exe, &args[0]);
+    fprintf(stderr, "Unable to start %s\n", photonmap_exe);
+    _exit(-1);
+  }
+  int status;
+  struct rusage usage;
+  if (wait4(pid, &status, 0, &usage) < 0) {
+    fprintf(stderr, "Unable to wait for %s\n", photonmap_exe);
+    return 0;
+  }
+  double wall = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+  if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+    fprintf(stderr, "Render of %s at %s failed (see %s)\n", scene.c_str(), tier.name,
+      log_name.c_str());
+    return 0;
+  }
+
+  // Read trace summary
+  JSONValue summary;
+  if (!ReadJSONFile(summary_name.c_str(), summary)) return 0;
+
+  // Fill result
+  result.scene = scene;
+  result.tier = tier.name;
+  result.values.clear();
+  result.values.push_back(make_pair(string("wall_seconds"), wall));
+  result.values.push_back(make_pair(string("peak_rss_mb"), usage.ru_maxrss / 1024.0));
+  for (int i = 0; i < num_bench_phases; i++) {
+    const JSONValue *event = SummaryEvent(summary, bench_phases[i]);
+    double seconds = (event) ? JSONNumber(*event, "total_seconds") : 0;
+    result.values.push_back(make_pair(ColumnName(bench_phases[i], "_seconds"), seconds));
+  }
+  const JSONValue *render = SummaryEvent(summary, "render");
+  double render_seconds = (render) ? JSONNumber(*render, "total_seconds") : 0;
+  for (int i = 0; i < num_bench_rays; i++) {
+    double rays = SummaryArg(summary, "render strip", bench_rays[i]);
+    double rate = (render_seconds > 0) ? rays / render_seconds : 0;
+    result.values.push_back(make_pair(ColumnName(bench_rays[i], "_per_second"), rate));
+  }
+  const JSONValue *photons = SummaryEvent(summary, "map photons");
+  double photon_seconds = (photons) ? JSONNumber(*photons, "total_seconds") : 0;
+  double photon_rate = (photon_seconds > 0) ?
+    SummaryArg(summary, "map photons", "photons") / photon_seconds : 0;
+  result.values.push_back(make_pair(string("photons_per_second"), photon_rate));
+  result.image_hash = HashFile(image_name.c_str());
+  return 1;
+}
+
+////////////////////////////////////////////////////////////////////////
+// Output
+////////////////////////////////////////////////////////////////////////
+
+// Write results as CSV (one row per scene and tier)
+static int WriteCSV(const vector<BenchResult>& results, const char *filename)
+{
+  FILE *fp = fopen(filename, "w");
+  if (!fp) {
+    fprintf(stderr, "Unable to open %s\n", filename);
+    return 0;
+  }
+  fprintf(fp, "scene,tier");
+  if (!results.empty()) {
+    for (unsigned int i = 0; i < results[0].values.size(); i++) {
+      fprintf(fp, ",%s", results[0].values[i].first.c_str());
+    }
+  }
+  fprintf(fp, ",image_hash\n");
+  for (unsigned int r = 0; r < results.size(); r++) {
+    fprintf(fp, "%s,%s", results[r].scene.c_str(), results[r].tier.c_str());
+    for (unsigned int i = 0; i < results[r].values.size(); i++) {
+      fprintf(fp, ",%.6g", results[r].values[i].second);
+    }
+    fprintf(fp, ",%s\n", results[r].image_hash.c_str());
+  }
+  fclose(fp);
+  return 1;
+}
+
+// Write results as JSON, with the settings they were measured with
+static int WriteJSON(const vector<BenchResult>& results, const char *filename)
+{
+  FILE *fp = fopen(filename, "w");
+  if (!fp) {
+    fprintf(stderr, "Unable to open %s\n", filename);
+    return 0;
+  }
+  fprintf(fp, "{\n  \"threads\": %d,\n  \"seed\": %d,\n  \"runs\": %d,\n  \"tiers\": {",
+    threads, seed, runs);
+  bool first = true;
+  for (int t = 0; t < num_bench_tiers; t++) {
+    if (find(tier_names.begin(), tier_names.end(), bench_tiers[t].name) == tier_names.end()) continue;
+    fprintf(fp, "%s\n    \"%s\": \"%s\"", (first) ? "" : ",", bench_tiers[t].name,
+      bench_tiers[t].flags);
+    first = false;
+  }
+  fprintf(fp, "\n  },\n  \"results\": [");
+  for (unsigned int r = 0; r < results.size(); r++) {
+    fprintf(fp, "%s\n    {\"scene\": \"%s\", \"tier\": \"%s\"", (r > 0) ? "," : "",
+      results[r].scene.c_str(), results[r].tier.c_str());
+    for (unsigned int i = 0; i < results[r].values.size(); i++) {
+      fprintf(fp, ", \"%s\": %.6g", results[r].values[i].first.c_str(),
+        results[r].values[i].second);
+    }
+    fprintf(fp, ", \"image_hash\": \"%s\"}", results[r].image_hash.c_str());
+  }
+  fprintf(fp, "\n  ]\n}\n");
+  fclose(fp);
+  return 1;
+}
+
+////////////////////////////////////////////////////////////////////////
+// Baseline Comparison
+////////////////////////////////////////////////////////////////////////
+
+// Read results from a CSV written by WriteCSV
+static int ReadCSV(const char *filename, vector<BenchResult>& results)
+{
+  FILE *fp = fopen(filename, "r");
+  if (!fp) {
+    fprintf(stderr, "Unable to open baseline %s\n", filename);
+    return 0;
+  }
+  char line[4096];
+  vector<string> header;
+  while (fgets(line, sizeof(line), fp)) {
+    // Split line at commas
+    vector<string> fields;
+    string field;
+    for (char *s = line; ; s++) {
+      if (*s == ',' || *s == '\n' || *s == '\r' || !*s) {
+        fields.push_back(field);
+        field.clear();
+        if (*s != ',') break;
+      } else {
+        field += *s;
+      }
+    }
+    if (header.empty()) { header = fields; continue; }
+    if (fields.size() != header.size() || fields.size() < 3) continue;
+
+    // Fill result
+    BenchResult result;
+    result.scene = fields[0];
+    result.tier = fields[1];
+    for (unsigned int i = 2; i < fields.size(); i++) {
+      if (header[i] == "image_hash") result.image_hash = fields[i];
+      else result.values.push_back(make_pair(header[i], atof(fields[i].c_str())));
+    }
+    results.push_back(result);
+  }
+  fclose(fp);
+  return 1;
+}
+
+// Compare results to the baseline, printing each measurement that regressed
+// by more than the tolerance (times and memory that grew, rates that fell).
+// Returns the number of regressions
+static int CompareBaseline(const vector<BenchResult>& results, const vector<BenchResult>& baseline)
+{
+  int regressions = 0;
+  printf("Comparing to baseline %s (tolerance %.0f%%)\n", baseline_name, 100 * tolerance);
+  for (unsigned int r = 0; r < results.size(); r++) {
+    const BenchResult& result = results[r];
+
+    // Find baseline of this scene and tier
+    const BenchResult *base = NULL;
+    for (unsigned int b = 0; b < baseline.size(); b++) {
+      if (baseline[b].scene == result.scene && baseline[b].tier == result.tier) base = &baseline[b];
+    }
+    if (!base) {
+      printf("  %s %s: not in baseline\n", result.scene.c_str(), result.tier.c_str());
+      continue;
+    }
+
+    // Compare each measurement
+    for (unsigned int i = 0; i < result.values.size(); i++) {
+      const string& name = result.values[i].first;
+      const double *base_value = ResultValue(*base, name);
+      if (!base_value) continue;
+      double value = result.values[i].second;
+      bool rate = name.find("_per_second") != string::npos;
+      bool seconds = name.find("_seconds") != string::npos;
+      bool regressed;
+      if (rate) regressed = value < *base_value / (1 + tolerance);
+      else if (seconds) regressed = value > *base_value * (1 + tolerance) + time_slack;
+      else regressed = value > *base_value * (1 + tolerance);
+      if (regressed) {
+        printf("  %s %s: %s regressed from %.6g to %.6g\n", result.scene.c_str(),
+          result.tier.c_str(), name.c_str(), *base_value, value);
+        regressions++;
+      }
+    }
+
+    // Note images that changed (expected after changes to the renderer)
+    if (!base->image_hash.empty() && base->image_hash != result.image_hash) {
+      printf("  %s %s: image differs from baseline\n", result.scene.c_str(), result.tier.c_str());
+    }
+  }
+  printf("%d regression%s\n", regressions, (regressions == 1) ? "" : "s");
+  return regressions;
+}
+
+////////////////////////////////////////////////////////////////////////
+// Program
+////////////////////////////////////////////////////////////////////////
+
+// Split a comma separated list
+static vector<string> SplitList(const char *list)
+{
+  vector<string> items;
+  string item;
+  for (const char *s = list; ; s++) {
+    if (*s && *s != ',') item += *s;
+    else if (!item.empty()) { items.push_back(item); item.clear(); }
+    if (!*s) break;
+  }
+  return items;
+}
+
+static int ParseArgs(int argc, char **argv)
+{
+  argc--; argv++;
+  while (argc > 0) {
+    if (!strcmp(*argv, "-photonmap") && argc > 1) {
+      argc--; argv++; photonmap_exe = *argv;
+    } else if (!strcmp(*argv, "-input") && argc > 1) {
+      argc--; argv++; input_dir = *argv;
+    } else if (!strcmp(*argv, "-output") && argc > 1) {
+      argc--; argv++; output_dir = *argv;
+    } else if (!strcmp(*argv, "-tiers") && argc > 1) {
+      argc--; argv++; tier_names = SplitList(*argv);
+    } else if (!strcmp(*argv, "-scenes") && argc > 1) {
+      argc--; argv++; scene_names = SplitList(*argv);
+    } else if (!strcmp(*argv, "-threads") && argc > 1) {
+      argc--; argv++; threads = max(1, atoi(*argv));
+    } else if (!strcmp(*argv, "-seed") && argc > 1) {
+      argc--; argv++; seed = max(1, atoi(*argv));
+    } else if (!strcmp(*argv, "-runs") && argc > 1) {
+      argc--; argv++; runs = max(1, atoi(*argv));
+    } else if (!strcmp(*argv, "-baseline") && argc > 1) {
+      argc--; argv++; baseline_name = *argv;
+    } else if (!strcmp(*argv, "-tolerance") && argc > 1) {
+      argc--; argv++; tolerance = max(0.0, atof(*argv));
+    } else {
+      fprintf(stderr, "Usage: bench [-photonmap EXE] [-input DIR] [-output DIR] "
+        "[-tiers T1,T2] [-scenes S1,S2] [-threads N] [-seed S] [-runs N] "
+        "[-baseline CSV] [-tolerance F]\n");
+      return 0;
+    }
+    argc--; argv++;
+  }
+
+  // Default to the quicker tiers and every scene
+  if (tier_names.empty()) {
+    tier_names.push_back("smoke");
+    tier_names.push_back("small");
+  }
+  if (scene_names.empty()) {
+    for (int i = 0; i < num_bench_scenes; i++) scene_names.push_back(bench_scenes[i]);
+  }
+
+  // Check tiers
+  for (unsigned int i = 0; i < tier_names.size(); i++) {
+    bool found = false;
+    for (int t = 0; t < num_bench_tiers; t++) {
+      if (tier_names[i] == bench_tiers[t].name) found = true;
+    }
+    if (!found) {
+      fprintf(stderr, "Unknown tier %s\n", tier_names[i].c_str());
+      return 0;
+    }
+  }
+
+  return 1;
+}
+
+int main(int argc, char **argv)
+{
+  // Parse program arguments
+  if (!ParseArgs(argc, argv)) exit(-1);
+  mkdir(output_dir, 0755);
+
+  // Render each scene at each tier, keeping the fastest of the runs
+  vector<BenchResult> results;
+  for (int t = 0; t < num_bench_tiers; t++) {
+    const BenchTier& tier = bench_tiers[t];
+    if (find(tier_names.begin(), tier_names.end(), tier.name) == tier_names.end()) continue;
+    for (unsigned int s = 0; s < scene_names.size(); s++) {
+      BenchResult best;
+      for (int run = 0; run < runs; run++) {
+        BenchResult result;
+        if (!RunBenchmark(scene_names[s], tier, result)) exit(-1);
+        if (run == 0 || *ResultValue(result, "wall_seconds") < *ResultValue(best, "wall_seconds")) {
+          best = result;
+        }
+      }
+      printf("%-16s %-6s %8.2f s %8.1f MB\n", best.scene.c_str(), best.tier.c_str(),
+        *ResultValue(best, "wall_seconds"), *ResultValue(best, "peak_rss_mb"));
+      fflush(stdout);
+      results.push_back(best);
+    }
+  }
+
+  // Write results
+  string csv_name = output_dir + string("/bench.csv");
+  string json_name = output_dir + string("/bench.json");
+  if (!WriteCSV(results, csv_name.c_str())) exit(-1);
+  if (!WriteJSON(results, json_name.c_str())) exit(-1);
+  printf("Wrote %s and %s\n", csv_name.c_str(), json_name.c_str());
+
+  // Compare to baseline
+  if (baseline_name) {
+    vector<BenchResult> baseline;
+    if (!ReadCSV(baseline_name, baseline)) exit(-1);
+    if (CompareBaseline(results, baseline) > 0) exit(1);
+  }
+
+  // Return success
+  return 0;
+}
@@ -9,11 +9,30 @@
 #include "utils/photon_utils.h"
 #include "R3Graphics/R3Graphics.h"
 
+////////////////////////////////////////////////////////////////////////
+// Path Termination
+////////////////////////////////////////////////////////////////////////
+
+// Throughput-based Russian roulette: once a path is deeper than the minimum
+// depth, it survives with probability equal to the energy it still carries to
+// the pixel (weight scaled by throughput), and survivors are scaled back up.
+// Returns false if the path should be terminated
+static bool RussianRoulette(int depth, RNRgb& total_weight, const RNRgb& throughput)
+{
+  if (!RUSSIAN_ROULETTE || depth < RR_MIN_DEPTH) return true;
+
+  RNScalar prob_survive = MaxChannelVal(total_weight * throughput);
+  if (prob_survive >= 1.0) return true;
+  if (RNThreadableRandomScalar() >= prob_survive) return false;
+  total_weight /= prob_survive;
+  return true;
+}
+
 ////////////////////////////////////////////////////////////////////////
 // Monte Carlo Path-Tracing Method
 ////////////////////////////////////////////////////////////////////////
 
-void MonteCarlo_PathTrace(R3Ray& ray, RNRgb& color)
+void MonteCarlo_PathTrace(R3Ray& ray, RNRgb& color, const RNRgb& throughput)
 {
   // Corner case
   if (!MONTE_CARLO) {
@@ -158,6 +177,11 @@ void MonteCarlo_PathTrace(R3Ray& ray, RNRgb& color)
           break;
         }
 
+        // Stop paths that no longer carry much energy
+        if (!RussianRoulette(iter + 1, total_weight, throughput)) {
+          break;
+        }
+
         // Recur
         ray_start = point + sampled_bounce * RN_EPSILON;
         ray = R3Ray(ray_start, sampled_bounce, TRUE);
@@ -174,7 +198,7 @@ void MonteCarlo_PathTrace(R3Ray& ray, RNRgb& color)
 // Indirect Illumination Path-Tracing Method
 ////////////////////////////////////////////////////////////////////////
 
-void MonteCarlo_IndirectSample(R3Ray& ray, RNRgb& color)
+void MonteCarlo_IndirectSample(R3Ray& ray, RNRgb& color, const RNRgb& throughput)
 {
 
   // Intersection variables and forward declarations
@@ -292,6 +316,11 @@ void MonteCarlo_IndirectSample(R3Ray& ray, RNRgb& color)
           break;
         }
 
+        // Stop paths that no longer carry much energy
+        if (!RussianRoulette(iter + 1, total_weight, throughput)) {
+          break;
+        }
+
         // Recur
         ray_start = point + sampled_bounce * RN_EPSILON;
         ray = R3Ray(ray_start, sampled_bounce, TRUE);
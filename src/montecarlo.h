@@ -10,12 +10,18 @@
 // Monte Carlo Path-Tracing Method
 ////////////////////////////////////////////////////////////////////////
 
-void MonteCarlo_PathTrace(R3Ray& ray, RNRgb& color);
+// Throughput is the weight the path's color will receive in the pixel (used
+// only to decide when to terminate it)
+void MonteCarlo_PathTrace(R3Ray& ray, RNRgb& color,
+  const RNRgb& throughput = RNwhite_rgb);
 
 ////////////////////////////////////////////////////////////////////////
 // Indirect Illumination Path-Tracing Method
 ////////////////////////////////////////////////////////////////////////
 
-void MonteCarlo_IndirectSample(R3Ray& ray, RNRgb& color);
+// Throughput is the weight the path's color will receive in the pixel (used
+// only to decide when to terminate it)
+void MonteCarlo_IndirectSample(R3Ray& ray, RNRgb& color,
+  const RNRgb& throughput = RNwhite_rgb);
 
 #endif
@@ -7,11 +7,24 @@
 #include "utils/io_utils.h"
 #include "utils/graphics_utils.h"
 #include "utils/photon_utils.h"
+#include "utils/light_utils.h"
+#include "utils/importance_utils.h"
+#include "utils/visibility_utils.h"
+#include "utils/distribute_utils.h"
+#include "utils/server_utils.h"
+#include "utils/trace_utils.h"
+#include "utils/microbench_utils.h"
+#include "utils/perf_utils.h"
+#include "utils/memory_utils.h"
 #include <vector>
 #include <thread>
 #include <functional>
 #include <mutex>
-#include <atomic>
+#include <climits>
+#include <csignal>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
 
 using namespace std;
 
@@ -33,6 +46,9 @@ static int aa = 2;
 // Normalize material components to 1 when loading brdfs
 static bool real_material = false;
 
+// Directory for cached mesh hierarchies (disabled if NULL)
+static char *scene_cache_dir = NULL;
+
 ////////////////////////////////////////////////////////////////////////
 // Global Parameter Defaults (Declared in render.h)
 ////////////////////////////////////////////////////////////////////////
@@ -70,11 +86,25 @@ int LIGHT_TEST = 128; // Number of direct illumination tests per 2Dlight;
                      // NB: Each illumination test is also a shadow test
 int SHADOW_TEST = 128; // Total number of *additional* shadow tests per light
                       // (on top of implicit the shadow tests set via LIGHT_TEST);
+bool SOLID_ANGLE_SAMPLING = false; // Sample rect lights by solid angle
+bool CONCENTRIC_DISK_SAMPLING = false; // Sample area light disks concentrically
+bool MIS = false; // Multiple importance sample specular reflection of 2D lights
+int LIGHT_TREE_SAMPLES = 0; // Lights sampled per point from the light tree
+                            // (0 visits every light instead);
+bool OCCLUDER_CACHE = true; // Test each thread's last occluder of a light first
+int VISIBILITY_GRID = 0; // Cells per axis of the per light grids that answer
+                         // shadow rays of point-like lights (0 disables)
 
 // Monte Carlo Raytracing Parameters
 bool MONTE_CARLO = true; // Toggles monte carlo path tracing
 int MAX_MONTE_DEPTH = 128; // Toggles monte carlo path tracing
 RNScalar PROB_ABSORB = 0.005; // Minimal brdf absorption probability (out of one)
+bool RUSSIAN_ROULETTE = false; // Terminate paths by the energy they carry
+int RR_MIN_DEPTH = 2; // Bounces before russian roulette may terminate a path
+int RAY_BUDGET = 0; // Bounce rays per pixel split among specular, transmissive,
+                    // and indirect sampling (0 sizes each bounce separately)
+int PIXEL_SAMPLES = 1; // Eye rays per pixel from anti-aliasing (4^aa), which
+                       // share RAY_BUDGET
 bool RECURSIVE_SHADOWS = true; // Test shadows while path tracing
 bool DISTRIB_TRANSMISSIVE = true; // Use importance sampling
 int TRANSMISSIVE_TEST = 128;
@@ -87,13 +117,23 @@ int DOF_TEST = 1;
 RNScalar FOCUS_DEPTH = 100.0;
 RNScalar APERTURE_RADIUS = 0.025;
 
+// Denoising Parameters
+int DENOISE = 0; // A-trous passes of the denoiser run after rendering (0 disables)
+bool WRITE_AOVS = false; // Also write albedo, normal, depth, direct and indirect images
+
 // Photon Map Tracing Parameters
 int GLOBAL_PHOTON_COUNT = 2176; // Number of photons emmitted for global map
 int CAUSTIC_PHOTON_COUNT = 10000000; // Number of photons emmited for caustic map
 int MAX_PHOTON_DEPTH = 128;
+bool QMC_PHOTONS = false; // Emit photons from reproducible Halton sequences
+int IMPORTON_COUNT = 0; // Importons traced from the camera to decide where global
+                        // photons are worth storing (0 stores them all)
 
 // Photon Map Sampling Parameters
 int INDIRECT_TEST = 256;
+bool GUIDED_GATHER = false; // Guide final gather rays by nearby photon directions
+RNScalar GUIDE_COSINE_PROB = 0.5; // Fraction of guided rays still drawn from cosine lobe
+int GUIDE_ESTIMATE_SIZE = 200; // Number of photons in each guiding histogram
 int GLOBAL_ESTIMATE_SIZE = 50;
 RNScalar GLOBAL_ESTIMATE_DIST = 2.5;
 Filter_Type GLOBAL_FILTER = DISK;
@@ -101,6 +141,41 @@ int CAUSTIC_ESTIMATE_SIZE = 225;
 RNScalar CAUSTIC_ESTIMATE_DIST = 0.225;
 Filter_Type CAUSTIC_FILTER = DISK;
 
+// Shadow Photon Map Parameters (number emitted per area or rect light; 0 disables)
+int SHADOW_PHOTON_COUNT = 0;
+int SHADOW_ESTIMATE_SIZE = 32;
+RNScalar SHADOW_ESTIMATE_DIST = 0.3;
+
+// Distributed Rendering Parameters
+char *JOB_DIR = NULL; // Shared directory of a tiled render (disabled if NULL)
+int JOB_WORKERS = 0; // Worker processes spawned by the coordinator
+bool JOB_WORKER = false; // Render tiles of the job instead of coordinating it
+
+// Batch Rendering Parameters
+char *CAMERA_PATH = NULL; // Frames to render with the same photon maps (disabled if NULL)
+
+// Pipelined Rendering Parameters
+bool PIPELINE = false; // Render direct light while the photon maps are traced
+
+// Tracing Parameters
+char *TRACE_FILE = NULL; // Chrome trace of the phases of the render (disabled if NULL)
+
+// Reproducibility Parameters
+unsigned int RANDOM_SEED = 0; // Seed of every random sequence (seeded by the system if 0)
+
+// Microbenchmark Parameters
+bool MICROBENCH = false; // Time the hot kernels with the scene instead of rendering it
+
+// Hardware Counter Parameters
+bool PERF_COUNTERS = false; // Count hardware events per phase and worker (Linux only)
+
+// Memory Budget Parameters
+int MEM_BUDGET = 0; // Megabytes the render may take, downscaling it to fit (0 disables)
+
+// Render Server Parameters
+char *SERVER_SOCKET = NULL; // Unix socket the render server listens on (disabled if NULL)
+int SERVER_CACHE_SIZE = 4; // Scenes the server keeps resident with their photon maps
+
 RNScalar FILTER_CONST_A = 0.918;
 RNScalar FILTER_CONST_B = 1.953;
 RNScalar FILTER_CONST_K = 1.0;
@@ -117,6 +192,10 @@ R3Kdtree<Photon *> *CAUSTIC_PMAP = NULL;
 RNArray <Photon *> GLOBAL_PHOTONS;
 RNArray <Photon *> CAUSTIC_PHOTONS;
 
+// Shadow photon maps (indexed by light; NULL for lights without one) and memory
+vector<R3Kdtree<ShadowPhoton *> *> SHADOW_PMAPS;
+RNArray <ShadowPhoton *> SHADOW_PHOTONS;
+
 // Lookup tables for incident direction
 RNScalar PHOTON_X_LOOKUP[65536];
 RNScalar PHOTON_Y_LOOKUP[65536];
@@ -134,126 +213,357 @@ const int PROGRESS_BAR_WIDTH = 50;
 // Shared synchronization primative
 mutex LOCK;
 
-static atomic_int global_emitted_count (0);
-static atomic_int caustic_emitted_count (0);
-
 ////////////////////////////////////////////////////////////////////////
 // Photon Mapping Methods
 ////////////////////////////////////////////////////////////////////////
 
-// Threadable (parallelizable) photon tracing method
-static void Threadable_PhotonTracer(const int num_global_photons,
-  const int num_caustic_photons, vector<RNScalar> &light_powers, RNScalar total_power,
-  int thread_id)
+// Most photons a map may emit per photon of its target (so that lights that
+// rarely store a photon, e.g. into small caustics, cannot emit without bound)
+static const int MAX_EMITTED_PER_PHOTON = 100;
+
+// Range of a light's photons, emitted as one unit of work
+struct PhotonBatch {
+  int light_index;
+  int first_index;
+  int num_photons;
+  int num_stored;                   // Photons the batch stored once done
+  bool done;
+  vector<Photon> photons;           // Photons until appended to the map
+};
+
+// Photons of the map appended from a light's batch (scaled by the light's
+// power once its emission is known)
+struct PhotonRange {
+  int light_index;
+  int start;
+  int count;
+};
+
+// Central photon budget: hands out emission batches to threads, splitting
+// emission among lights by power, until the photons stored reach the target.
+// Finished batches are appended to the map in the order they were handed out
+struct PhotonController {
+  Photon_Type map_type;
+  int target;                       // Photons to store
+  int batch_size;                   // Photons emitted per batch
+  int stored_count;                 // Photons stored by finished batches
+  long long int emitted_count;      // Photons handed out
+  long long int max_emitted;        // Photons that may be handed out
+  vector<PhotonBatch *> batches;    // Batches in the order they were handed out
+  vector<RNScalar> light_powers;    // Emission share of each light
+  vector<int> emitted;              // Photons handed out per light
+  vector<bool> stopped;             // Lights no longer emitting
+  int next_probe;                   // Next probe batch (one per light) to trace
+  int last_progress;                // Last percentage printed
+  RNArray<Photon *> *photons;       // Map appended to
+  unsigned int next_append;         // Next batch to append
+  int kept;                         // Photons appended
+  vector<RNScalar> kept_emitted;    // Emission of the photons appended per light
+  vector<int> kept_stored;          // Photons appended per light
+  vector<PhotonRange> ranges;       // Photons appended from each batch
+  mutex lock;
+};
+
+// Seed of the random numbers of a unit of photon work of map (global,
+// caustic, or shadow after them) with -seed (mixes the bits so neighboring
+// units get unrelated random sequences)
+static unsigned int PhotonSeed(int map, int light_index, int index)
 {
-  RNInitThreadRandomness();
-  // Global (Indirect) Illumination Photon mapping
-  int local_global_emitted_count = 0;
-  if (INDIRECT_ILLUM || DIRECT_PHOTON_ILLUM) {
-    // Print Info
-    if (VERBOSE && (thread_id == 0)) {
-      printf("Building global photon map ...\n");
-    }
-
-    // Emit photons from each light in rounds (slowly reaching GLOBAL_PHOTON_COUNT)
-    PHOTONS_STORED_COUNT = 0;
-    RNScalar average_bounce_rate = 4.0; // Init with an overestimate (depends on scene)
-    RNScalar slowdown_factor = 1.0;
-    int attempts_left = 10;
-    while (PHOTONS_STORED_COUNT < num_global_photons && attempts_left > 0) {
-      // Approach goal based on how we've done thus far
-      int emit_goal = (int) (num_global_photons - PHOTONS_STORED_COUNT)
-                      / average_bounce_rate / slowdown_factor + 1;
-      int photons_assigned = 0;
-
-      // Emit photons
-      for (int i = 0; i < SCENE_NLIGHTS; i++) {
-        // Emit photons proportional to light contribution over total power, as well as the
-        // assigned total number of photons to emit
-        int num_photons = ceil(emit_goal * (light_powers[i] / total_power));
-        EmitPhotons(num_photons, SCENE->Light(i), GLOBAL, thread_id);
-        photons_assigned += num_photons;
+  unsigned int h = RANDOM_SEED * 0x9E3779B9u ^ (unsigned int) map * 0x85EBCA6Bu ^
+    (unsigned int) light_index * 0xC2B2AE35u ^ (unsigned int) index * 0x27D4EB2Fu;
+  h ^= h >> 16;
+  h *= 0x7FEB352Du;
+  h ^= h >> 15;
+  return h;
+}
+
+// Append the finished batches to the map in the order they were handed out (a
+// batch that finishes early waits for those before it) until the map holds
+// the target; the emission of the batch that crosses it is prorated by the
+// share of its photons kept. Called with the controller locked
+static void AppendPhotonBatches(PhotonController& controller)
+{
+  while (controller.next_append < controller.batches.size() &&
+         controller.batches[controller.next_append]->done) {
+    PhotonBatch *batch = controller.batches[controller.next_append++];
+    if (controller.kept < controller.target) {
+      int count = min((int) batch->photons.size(), controller.target - controller.kept);
+      RNScalar fraction = (count < (int) batch->photons.size()) ?
+        (RNScalar) count / batch->photons.size() : 1.0;
+      controller.kept_emitted[batch->light_index] += fraction * batch->num_photons;
+      controller.kept_stored[batch->light_index] += count;
+      PhotonRange range = {batch->light_index, controller.photons->NEntries(), count};
+      controller.ranges.push_back(range);
+      for (int p = 0; p < count; p++) {
+        controller.photons->Insert(new Photon(batch->photons[p]));
       }
-      local_global_emitted_count += photons_assigned;
+      controller.kept += count;
+    }
+    vector<Photon>().swap(batch->photons);
+  }
+}
+
+// Trace a batch of photons into local storage, then copy them into the batch
+// and append the batches finished so far to the map.
+// With -seed, each batch is seeded from its light and first index, so the
+// batches kept do not depend on which thread traced them
+static void TracePhotonBatch(PhotonController& controller, PhotonBatch *batch,
+  vector<Photon>& local_photon_storage)
+{
+  int count;
+  if (QMC_PHOTONS) {
+    count = EmitQuasiRandomPhotons(batch->first_index, batch->num_photons,
+      batch->light_index, controller.map_type, local_photon_storage);
+  } else {
+    if (RANDOM_SEED) {
+      RNReseedThreadRandomness(PhotonSeed(controller.map_type, batch->light_index,
+        batch->first_index));
+    }
+    count = EmitPhotons(batch->num_photons, SCENE->Light(batch->light_index),
+      controller.map_type, local_photon_storage);
+  }
+
+  lock_guard<mutex> lk(controller.lock);
+  batch->photons.assign(local_photon_storage.begin(),
+    local_photon_storage.begin() + count);
+  batch->num_stored = count;
+  batch->done = true;
+  controller.stored_count += count;
+  AppendPhotonBatches(controller);
+}
 
-      // Update average
-      if (PHOTONS_STORED_COUNT > 0 && local_global_emitted_count > 0) {
-        average_bounce_rate = ((RNScalar) (PHOTONS_STORED_COUNT)) / local_global_emitted_count;
+// Hand out the next batch (NULL once the target is reached, the emission cap
+// is hit, or all lights have stopped); the light chosen is the one furthest
+// behind its share of emission, so the sequence of batches only depends on
+// the lights' powers
+static PhotonBatch *NextPhotonBatch(PhotonController& controller)
+{
+  lock_guard<mutex> lk(controller.lock);
+  if (controller.stored_count >= controller.target) return NULL;
+  if (controller.emitted_count >= controller.max_emitted) return NULL;
+
+  // Choose light
+  int light_index = -1;
+  RNScalar lowest_share = 0;
+  for (unsigned int i = 0; i < controller.emitted.size(); i++) {
+    if (controller.stopped[i]) continue;
+    RNScalar share = controller.emitted[i] / controller.light_powers[i];
+    if (light_index < 0 || share < lowest_share) {
+      lowest_share = share;
+      light_index = i;
+    }
+  }
+  if (light_index < 0) return NULL;
+
+  // Create batch (stop lights whose sequence index would overflow)
+  PhotonBatch *batch = new PhotonBatch();
+  batch->light_index = light_index;
+  batch->first_index = controller.emitted[light_index];
+  batch->num_photons = controller.batch_size;
+  batch->num_stored = 0;
+  batch->done = false;
+  controller.emitted[light_index] += controller.batch_size;
+  controller.emitted_count += controller.batch_size;
+  if (controller.emitted[light_index] > INT_MAX - controller.batch_size) {
+    controller.stopped[light_index] = true;
+  }
+  controller.batches.push_back(batch);
+  return batch;
+}
 
-        // Approach slower for first 75% to avoid shooting over
-        if ((RNScalar) PHOTONS_STORED_COUNT / local_global_emitted_count < 0.75) {
-          slowdown_factor = 2.0;
-        } else {
-          slowdown_factor = 1.0;
+// Threadable (parallelizable) photon tracing method; first traces the probe
+// batches, then (if not probing) takes batches until the controller runs out
+static void Threadable_PhotonTracer(PhotonController& controller, bool probe, int id)
+{
+  static const char *names[2][2] = {
+    {"emit global photons", "probe global photons"},
+    {"emit caustic photons", "probe caustic photons"}
+  };
+  TraceScope trace(names[controller.map_type][probe], "photons");
+  PerfScope perf(names[controller.map_type][probe], id);
+  int batches = 0;
+  RNInitThreadRandomness();
+  vector<Photon> local_photon_storage(SIZE_LOCAL_PHOTON_STORAGE);
+
+  if (probe) {
+    while (true) {
+      PhotonBatch *batch = NULL;
+      {
+        lock_guard<mutex> lk(controller.lock);
+        if (controller.next_probe < (int) controller.batches.size()) {
+          batch = controller.batches[controller.next_probe++];
         }
-      } else {
-        average_bounce_rate /= 2.0;
-        attempts_left--;
       }
+      if (!batch) break;
+      TracePhotonBatch(controller, batch, local_photon_storage);
+      batches++;
     }
-    if (VERBOSE && (thread_id == 0)) {
-      PrintProgress(double(PHOTONS_STORED_COUNT) / GLOBAL_PHOTON_COUNT * THREADS,
-        PROGRESS_BAR_WIDTH);
-      printf("\n");
+  } else {
+    PhotonBatch *batch;
+    while ((batch = NextPhotonBatch(controller))) {
+      TracePhotonBatch(controller, batch, local_photon_storage);
+      batches++;
+      if (VERBOSE) {
+        lock_guard<mutex> lk(controller.lock);
+        double progress = min(1.0, double(controller.stored_count) / controller.target);
+        int next_value = int(progress * 100.0);
+        if (next_value != controller.last_progress) {
+          PrintProgress(progress, PROGRESS_BAR_WIDTH);
+          controller.last_progress = next_value;
+        }
+      }
     }
   }
+  trace.args.push_back(make_pair(string("batches"), (double) batches));
 
-  // Caustic Illumination Photon mapping
-  int local_caustic_emitted_count = 0;
-  if (CAUSTIC_ILLUM) {
-    // Print Info
-    if (VERBOSE && (thread_id == 0)) {
-      printf("Building caustic photon map ...\n");
-    }
-
-    // Emit photons from each light
-    PHOTONS_STORED_COUNT = 0;
-    RNScalar average_bounce_rate = MAX_PHOTON_DEPTH; // Init with an overestimate (depends on scene)
-    RNScalar slowdown_factor = 1.0;
-    int attempts_left = 10;
-    while (PHOTONS_STORED_COUNT < num_caustic_photons && attempts_left > 0) {
-      // Approach goal based on how we've done thus far
-      int emit_goal = (int) (num_caustic_photons - PHOTONS_STORED_COUNT)
-                        / average_bounce_rate / slowdown_factor + 1;
-      int photons_assigned = 0;
-
-      // Emit photons
-      for (int i = 0; i < SCENE_NLIGHTS; i++) {
-        // Emit photons proportional to light contribution to total power and the
-        // assigned total number of photons to emit
-        int num_photons = ceil(emit_goal * (light_powers[i] / total_power));
-        EmitPhotons(num_photons, SCENE->Light(i), CAUSTIC, thread_id);
-        photons_assigned += num_photons;
-      }
-      local_caustic_emitted_count += photons_assigned;
+  RNClearThreadRandomness();
+}
 
-      // Update average
-      if (PHOTONS_STORED_COUNT > 0 && local_caustic_emitted_count > 0) {
-        average_bounce_rate = ((RNScalar) (PHOTONS_STORED_COUNT)) / local_caustic_emitted_count;
+// Run photon tracer on all threads
+static void RunPhotonTracers(PhotonController& controller, bool probe)
+{
+  thread *children = new thread[THREADS - 1];
+  for (int i = 0; i < THREADS - 1; ++i) {
+    children[i] = thread(Threadable_PhotonTracer, ref(controller), probe, i + 1);
+  }
+  Threadable_PhotonTracer(controller, probe, 0);
+  for (int i = 0; i < THREADS - 1; i++)
+    children[i].join();
+  delete [] children;
+}
 
-        // Approach slower for first 75% to avoid shooting over
-        if ((RNScalar) PHOTONS_STORED_COUNT / num_caustic_photons < 0.75) {
-          slowdown_factor = 2.0;
-        } else {
-          slowdown_factor = 1.0;
-        }
-      } else {
-        average_bounce_rate /= 2.0;
-        attempts_left--;
-      }
+// Populate a photon map with exactly num_photons photons (unless the lights
+// cannot deliver them within MAX_EMITTED_PER_PHOTON emitted per photon). A
+// probe batch is traced from every light first, and lights whose probe
+// stores nothing (e.g. photons never land on diffuse surfaces) stop emitting.
+// Batches are appended in the order they were handed out, and photons are
+// scaled by their light's power over the photons that light emitted. Returns
+// the number of photons stored
+static int MapPhotonBatches(Photon_Type map_type, int num_photons,
+  vector<RNScalar> &light_powers)
+{
+  TraceScope map_trace("map photons", "photons");
+  RNArray <Photon *>& photons = (map_type == GLOBAL) ? GLOBAL_PHOTONS : CAUSTIC_PHOTONS;
+
+  // Set up controller (batches are small enough to never overflow local storage)
+  PhotonController controller;
+  controller.map_type = map_type;
+  controller.target = num_photons;
+  controller.batch_size = max(1, SIZE_LOCAL_PHOTON_STORAGE / MAX_PHOTON_DEPTH);
+  controller.stored_count = 0;
+  controller.emitted_count = 0;
+  controller.max_emitted = (long long int) num_photons * MAX_EMITTED_PER_PHOTON;
+  controller.light_powers = light_powers;
+  controller.emitted.assign(SCENE_NLIGHTS, 0);
+  controller.stopped.assign(SCENE_NLIGHTS, false);
+  controller.next_probe = 0;
+  controller.last_progress = -1;
+  controller.photons = &photons;
+  controller.next_append = 0;
+  controller.kept = 0;
+  controller.kept_emitted.assign(SCENE_NLIGHTS, 0.0);
+  controller.kept_stored.assign(SCENE_NLIGHTS, 0);
+
+  // Probe each light with one batch
+  for (int i = 0; i < SCENE_NLIGHTS; i++) {
+    if (light_powers[i] <= 0) {
+      controller.stopped[i] = true;
+      continue;
+    }
+    PhotonBatch *batch = new PhotonBatch();
+    batch->light_index = i;
+    batch->first_index = 0;
+    batch->num_photons = controller.batch_size;
+    batch->num_stored = 0;
+    batch->done = false;
+    controller.emitted[i] = controller.batch_size;
+    controller.emitted_count += controller.batch_size;
+    controller.batches.push_back(batch);
+  }
+  RunPhotonTracers(controller, true);
+
+  // Stop lights that stored nothing
+  vector<int> stored(SCENE_NLIGHTS, 0);
+  for (unsigned int b = 0; b < controller.batches.size(); b++) {
+    stored[controller.batches[b]->light_index] += controller.batches[b]->num_stored;
+  }
+  for (int i = 0; i < SCENE_NLIGHTS; i++) {
+    if (stored[i] == 0) controller.stopped[i] = true;
+  }
+
+  // Emit until target is reached
+  RunPhotonTracers(controller, false);
+  if (VERBOSE) {
+    PrintProgress(min(1.0, double(controller.stored_count) / num_photons),
+      PROGRESS_BAR_WIDTH);
+    printf("\n");
+  }
+
+  // Scale photons by power of their light
+  TraceScope trace("store photons", "photons");
+  trace.args.push_back(make_pair(string("photons"), (double) controller.kept));
+  map_trace.args.push_back(make_pair(string("photons"), (double) controller.kept));
+  for (unsigned int r = 0; r < controller.ranges.size(); r++) {
+    const PhotonRange& range = controller.ranges[r];
+    RNScalar photon_power = light_powers[range.light_index] /
+      controller.kept_emitted[range.light_index];
+    for (int p = range.start; p < range.start + range.count; p++) {
+      Photon *photon = photons[p];
+      RNRgb color = RGBE_to_RNRgb(photon->rgbe);
+      color *= photon_power;
+      RNRgb_to_RGBE(color, photon->rgbe);
+    }
+  }
+
+  // Print per-light statistics
+  if (VERBOSE) {
+    for (int i = 0; i < SCENE_NLIGHTS; i++) {
+      RNScalar emitted = controller.kept_emitted[i];
+      printf("  Light %d: %d stored / %.0f emitted (%.3f per photon)%s\n", i,
+        controller.kept_stored[i], emitted,
+        (emitted > 0) ? controller.kept_stored[i] / emitted : 0.0,
+        (controller.stopped[i]) ? ", stopped" : "");
     }
-    if (VERBOSE && (thread_id == 0)) {
-      PrintProgress(double(PHOTONS_STORED_COUNT) / CAUSTIC_PHOTON_COUNT * THREADS,
-        PROGRESS_BAR_WIDTH);
-      printf("\n");
+    if (controller.kept < num_photons && controller.emitted_count >= controller.max_emitted) {
+      printf("  Stopped after %lld photons emitted (%d per photon asked for)\n",
+        controller.emitted_count, MAX_EMITTED_PER_PHOTON);
     }
   }
 
-  // Update counts
-  global_emitted_count += local_global_emitted_count;
-  caustic_emitted_count += local_caustic_emitted_count;
+  // Clean up
+  TrackMemory((map_type == GLOBAL) ? MEM_GLOBAL_PHOTONS : MEM_CAUSTIC_PHOTONS,
+    HeapObjectBytes(controller.kept, sizeof(Photon)));
+  for (unsigned int b = 0; b < controller.batches.size(); b++) {
+    delete controller.batches[b];
+  }
 
-  RNClearThreadRandomness();
+  return controller.kept;
+}
+
+// Build the kdtrees of the global and caustic photon maps (for the maps in
+// use that hold photons)
+static void BuildPhotonKdtrees(void)
+{
+  TraceScope trace("build kdtrees", "photons");
+  PerfScope perf("build kdtrees", 0);
+  if ((INDIRECT_ILLUM || DIRECT_PHOTON_ILLUM) && GLOBAL_PHOTONS.NEntries()) {
+    GLOBAL_PHOTON_COUNT = GLOBAL_PHOTONS.NEntries();
+    GLOBAL_PMAP = new R3Kdtree<Photon *>(GLOBAL_PHOTONS, (int) offsetof(struct Photon, position));
+    if (!GLOBAL_PMAP) {
+      fprintf(stderr, ("Unable to create global photon map\n"));
+      exit(-1);
+    }
+    TrackMemory(MEM_KDTREES, KdtreeBytes(GLOBAL_PMAP));
+  }
+  if (CAUSTIC_ILLUM && CAUSTIC_PHOTONS.NEntries()) {
+    CAUSTIC_PHOTON_COUNT = CAUSTIC_PHOTONS.NEntries();
+    CAUSTIC_PMAP = new R3Kdtree<Photon *>(CAUSTIC_PHOTONS, (int) offsetof(struct Photon, position));
+    if (!CAUSTIC_PMAP) {
+      fprintf(stderr, ("Unable to create caustic photon map\n"));
+      exit(-1);
+    }
+    TrackMemory(MEM_KDTREES, KdtreeBytes(CAUSTIC_PMAP));
+  }
 }
 
 // Multithreading method that populates the photon maps as arrays
@@ -264,12 +574,9 @@ static void MapPhotons(void)
     return;
   }
 
-  // Children threads
-  thread *children = new thread[THREADS - 1];
-
   // Start statistics
   RNTime total_start_time, photon_time, kd_time, irrad_time;
-  RNScalar photon_dur, kd_dur, irrad_dur;
+  RNScalar photon_dur = 0, kd_dur = 0, irrad_dur = 0;
   total_start_time.Read();
 
   // Compute power distribution of lights
@@ -291,43 +598,17 @@ static void MapPhotons(void)
   // Build compressed spherical coordinates mapping for fast lookup
   BuildDirectionLookupTable();
 
-  // Divide work among threads
-  int global_photons_remaining = 0;
-  int caustic_photons_remaining = 0;
-
-  // For global photons
+  // Trace photons until each map holds its target
+  photon_time.Read();
   if (INDIRECT_ILLUM || DIRECT_PHOTON_ILLUM) {
-    // Compute how many photons to distribute to each thread
-    global_photons_remaining = GLOBAL_PHOTON_COUNT;
+    if (VERBOSE) printf("Building global photon map ...\n");
+    MapPhotonBatches(GLOBAL, GLOBAL_PHOTON_COUNT, light_powers);
   }
-  int global_photons_per_thread = (int) global_photons_remaining / THREADS;
-
-  // For caustic photons
   if (CAUSTIC_ILLUM) {
-    // Compute how many photons to distribute to each thread
-    caustic_photons_remaining = CAUSTIC_PHOTON_COUNT;
-  }
-  int caustic_photons_per_thread = (int) caustic_photons_remaining / THREADS;
-
-  // Split off into threads
-  photon_time.Read();
-  for (int i = 0; i < THREADS - 1; ++i) {
-    // Launch thread and book-keep
-    children[i] = thread(Threadable_PhotonTracer, global_photons_per_thread,
-                      caustic_photons_per_thread, ref(light_powers), total_power, i+1);
-    global_photons_remaining -= global_photons_per_thread;
-    caustic_photons_remaining -= caustic_photons_per_thread;
+    if (VERBOSE) printf("Building caustic photon map ...\n");
+    MapPhotonBatches(CAUSTIC, CAUSTIC_PHOTON_COUNT, light_powers);
   }
 
-  // Use the main thread as well
-  Threadable_PhotonTracer(global_photons_remaining, caustic_photons_remaining,
-                          light_powers, total_power, 0);
-
-  // Join children threads
-  for (int i = 0; i < THREADS - 1; i++)
-    children[i].join();
-  delete [] children;
-
   photon_dur = photon_time.Elapsed();
 
   // Build kd trees
@@ -335,50 +616,24 @@ static void MapPhotons(void)
     printf("Building kdtrees ...\n");
   kd_time.Read();
 
-  // First update globals and scale by power
-  if ((INDIRECT_ILLUM || DIRECT_PHOTON_ILLUM) && GLOBAL_PHOTONS.NEntries()) {
-    GLOBAL_PHOTON_COUNT = GLOBAL_PHOTONS.NEntries();
-    RNScalar photon_power = (RNScalar) total_power / global_emitted_count.load();
-    for (int i = 0; i < GLOBAL_PHOTON_COUNT; i++) {
-      RNRgb color = RGBE_to_RNRgb(GLOBAL_PHOTONS[i]->rgbe);
-      color *= photon_power;
-      RNRgb_to_RGBE(color, GLOBAL_PHOTONS[i]->rgbe);
-    }
-  } else if ((INDIRECT_ILLUM || DIRECT_PHOTON_ILLUM) && GLOBAL_PHOTONS.NEntries() == 0) {
+  // First turn off maps without photons (photons are already scaled by power)
+  if ((INDIRECT_ILLUM || DIRECT_PHOTON_ILLUM) && GLOBAL_PHOTONS.NEntries() == 0) {
     INDIRECT_ILLUM = false;
     DIRECT_PHOTON_ILLUM = false;
   }
-  if (CAUSTIC_ILLUM && CAUSTIC_PHOTONS.NEntries()) {
-    CAUSTIC_PHOTON_COUNT = CAUSTIC_PHOTONS.NEntries();
-    RNScalar photon_power = total_power / caustic_emitted_count.load();
-    for (int i = 0; i < CAUSTIC_PHOTON_COUNT; i++) {
-      RNRgb color = RGBE_to_RNRgb(CAUSTIC_PHOTONS[i]->rgbe);
-      color *= photon_power;
-      RNRgb_to_RGBE(color, CAUSTIC_PHOTONS[i]->rgbe);
-    }
-  } else if (CAUSTIC_ILLUM && CAUSTIC_PHOTONS.NEntries() == 0) {
+  if (CAUSTIC_ILLUM && CAUSTIC_PHOTONS.NEntries() == 0) {
     CAUSTIC_ILLUM = false;
   }
 
   // Now build...
-  if (INDIRECT_ILLUM || DIRECT_PHOTON_ILLUM) {
-    GLOBAL_PMAP = new R3Kdtree<Photon *>(GLOBAL_PHOTONS, offsetof(struct Photon, position));
-    if (!GLOBAL_PMAP) {
-      fprintf(stderr, ("Unable to create global photon map\n"));
-      exit(-1);
-    }
-  }
-  if (CAUSTIC_ILLUM) {
-    CAUSTIC_PMAP = new R3Kdtree<Photon *>(CAUSTIC_PHOTONS, offsetof(struct Photon, position));
-    if (!CAUSTIC_PMAP) {
-      fprintf(stderr, ("Unable to create caustic photon map\n"));
-      exit(-1);
-    }
-  }
+  BuildPhotonKdtrees();
   kd_dur = kd_time.Elapsed();
 
   // Build irradiance cache if necessary
   if (IRRADIANCE_CACHE && (INDIRECT_ILLUM || DIRECT_PHOTON_ILLUM)) {
+    TraceScope trace("irradiance cache", "photons");
+    PerfScope perf("irradiance cache", 0);
+    unsigned long long int perf_gathers = LOCAL_GATHER_COUNT;
     irrad_time.Read();
     if (VERBOSE)
       printf("Building irradiance cache ...\n");
@@ -394,6 +649,7 @@ static void MapPhotons(void)
       // Insert into cache
       irradiances.Insert(new_photon);
     }
+    TrackMemory(MEM_IRRADIANCE_CACHE, HeapObjectBytes(irradiances.NEntries(), sizeof(Photon)));
 
     // Overwrite the color values in the Global map
     for (int i = 0; i < GLOBAL_PHOTON_COUNT; i++) {
@@ -408,6 +664,8 @@ static void MapPhotons(void)
     for (int i = 0; i < irradiances.NEntries(); i++) {
       delete irradiances[i];
     }
+    TrackMemory(MEM_IRRADIANCE_CACHE, -(long long int) HeapObjectBytes(irradiances.NEntries(), sizeof(Photon)));
+    perf.gathers = LOCAL_GATHER_COUNT - perf_gathers;
 
     irrad_dur = irrad_time.Elapsed();
   }
@@ -435,6 +693,386 @@ static void MapPhotons(void)
   }
 }
 
+////////////////////////////////////////////////////////////////////////
+// Shadow Photon Mapping Methods
+////////////////////////////////////////////////////////////////////////
+
+// Threadable (parallelizable) shadow photon tracing method (seeded from the
+// light and thread with -seed)
+static void Threadable_ShadowPhotonTracer(const int num_photons, R3Light *light,
+  int light_index, int id, vector<ShadowPhoton>& local_storage)
+{
+  TraceScope trace("emit shadow photons", "photons");
+  PerfScope perf("emit shadow photons", id);
+  RNInitThreadRandomness();
+  if (RANDOM_SEED) RNReseedThreadRandomness(PhotonSeed(CAUSTIC + 1, light_index, id));
+  EmitShadowPhotons(num_photons, light, local_storage);
+  RNClearThreadRandomness();
+}
+
+// Build the shadow photon map of each light from its photons (indexed by
+// light, and tracked with them since the caller keeps them)
+static void BuildShadowPhotonMaps(const vector<vector<ShadowPhoton> >& shadow_photons)
+{
+  TraceScope trace("build shadow kdtrees", "photons");
+  PerfScope perf("build shadow kdtrees", 0);
+  SHADOW_PMAPS.assign(SCENE_NLIGHTS, NULL);
+  for (unsigned int i = 0; i < shadow_photons.size(); i++) {
+    if (shadow_photons[i].empty()) continue;
+
+    // Copy photons of this light
+    RNArray <ShadowPhoton *> light_photons;
+    for (unsigned int j = 0; j < shadow_photons[i].size(); j++) {
+      ShadowPhoton *photon = new ShadowPhoton(shadow_photons[i][j]);
+      light_photons.Insert(photon);
+      SHADOW_PHOTONS.Insert(photon);
+    }
+
+    // Build kdtree
+    SHADOW_PMAPS[i] = new R3Kdtree<ShadowPhoton *>(light_photons, (int) offsetof(struct ShadowPhoton, position));
+    if (!SHADOW_PMAPS[i]) {
+      fprintf(stderr, ("Unable to create shadow photon map\n"));
+      exit(-1);
+    }
+    TrackMemory(MEM_SHADOW_PHOTONS, HeapObjectBytes(light_photons.NEntries(), sizeof(ShadowPhoton)) +
+      shadow_photons[i].capacity() * sizeof(ShadowPhoton));
+    TrackMemory(MEM_KDTREES, KdtreeBytes(SHADOW_PMAPS[i]));
+  }
+}
+
+// Build a shadow photon map for each area and rect light, so that soft shadow
+// sampling can skip occlusion tests in points that are fully lit or fully
+// shadowed. The photons of each light are also kept in shadow_photons
+static void MapShadowPhotons(vector<vector<ShadowPhoton> >& shadow_photons)
+{
+  TraceScope trace("map shadow photons", "photons");
+
+  // Start statistics
+  RNTime start_time;
+  start_time.Read();
+  if (VERBOSE)
+    printf("Building shadow photon maps ...\n");
+
+  // Children threads
+  thread *children = new thread[THREADS - 1];
+  vector<vector<ShadowPhoton> > thread_storage(THREADS);
+
+  shadow_photons.assign(SCENE_NLIGHTS, vector<ShadowPhoton>());
+  for (int i = 0; i < SCENE_NLIGHTS; i++) {
+    R3Light *light = SCENE->Light(i);
+    if (!(light->IsActive())) continue;
+    if (light->ClassID() != R3AreaLight::CLASS_ID() &&
+        light->ClassID() != R3RectLight::CLASS_ID()) continue;
+
+    // Split off into threads
+    int photons_per_thread = SHADOW_PHOTON_COUNT / THREADS;
+    for (int t = 0; t < THREADS - 1; t++) {
+      thread_storage[t + 1].clear();
+      children[t] = thread(Threadable_ShadowPhotonTracer, photons_per_thread, light,
+                        i, t + 1, ref(thread_storage[t + 1]));
+    }
+    thread_storage[0].clear();
+    Threadable_ShadowPhotonTracer(SHADOW_PHOTON_COUNT - photons_per_thread * (THREADS - 1),
+                                  light, i, 0, thread_storage[0]);
+    for (int t = 0; t < THREADS - 1; t++)
+      children[t].join();
+
+    // Gather photons of this light
+    for (int t = 0; t < THREADS; t++) {
+      shadow_photons[i].insert(shadow_photons[i].end(),
+        thread_storage[t].begin(), thread_storage[t].end());
+    }
+  }
+  delete [] children;
+
+  // Build kdtrees
+  BuildShadowPhotonMaps(shadow_photons);
+
+  // Print statistics
+  if (VERBOSE) {
+    printf("Built shadow photon maps ...\n");
+    printf("  Time = %.2f seconds\n", start_time.Elapsed());
+    printf("  # Shadow Photons Stored = %u\n", SHADOW_PHOTONS.NEntries());
+    fflush(stdout);
+  }
+}
+
+// Trace the global and caustic photon maps the render needs
+static void MapPhotonLighting(void)
+{
+  // Build importance map if storing global photons by visual importance
+  if (IMPORTON_COUNT > 0 && (INDIRECT_ILLUM || DIRECT_PHOTON_ILLUM)) {
+    TraceScope trace("importance map", "photons");
+    BuildImportanceMap();
+  }
+
+  // Generate Photon Map if necessary
+  if (INDIRECT_ILLUM || CAUSTIC_ILLUM || DIRECT_PHOTON_ILLUM) {
+    MapPhotons();
+  }
+  DeleteImportanceMap();
+}
+
+// Trace the shadow photon maps the render needs (keeping the shadow photons
+// of each light in shadow_photons)
+static void MapShadowLighting(vector<vector<ShadowPhoton> >& shadow_photons)
+{
+  // Generate Shadow Photon Maps if necessary
+  if (SHADOW_PHOTON_COUNT > 0 && SHADOWS && SOFT_SHADOWS) {
+    MapShadowPhotons(shadow_photons);
+  }
+}
+
+// Trace the photon maps and shadow photon maps the render needs (keeping the
+// shadow photons of each light in shadow_photons)
+static void MapSceneLighting(vector<vector<ShadowPhoton> >& shadow_photons)
+{
+  MapPhotonLighting();
+  MapShadowLighting(shadow_photons);
+}
+
+////////////////////////////////////////////////////////////////////////
+// Batch Rendering
+////////////////////////////////////////////////////////////////////////
+
+// Delete the image and auxiliary images of a frame
+static void DeleteFrame(R2Image *image, const RenderAOVs& aovs)
+{
+  delete image;
+  delete aovs.albedo;
+  delete aovs.normal;
+  delete aovs.depth;
+  delete aovs.direct;
+  delete aovs.indirect;
+}
+
+// Write the image (and auxiliary images) of a frame, then delete them
+static void WriteFrame(R2Image *image, RenderAOVs aovs, string filename, int *status)
+{
+  *status = WriteImage(image, filename.c_str());
+  if (*status && WRITE_AOVS) *status = WriteAOVs(aovs, filename.c_str());
+  DeleteFrame(image, aovs);
+}
+
+// Render every frame of CAMERA_PATH with the current photon maps and light
+// visibility, writing each frame while the next one renders
+static int RenderCameraPath(void)
+{
+  vector<R3Camera> cameras;
+  if (!ReadCameraPath(CAMERA_PATH, SCENE->Camera(), cameras)) return 0;
+
+  thread writer;
+  int write_status = 1;
+  for (unsigned int i = 0; i < cameras.size(); i++) {
+    if (VERBOSE) {
+      printf("Frame %u of %u ...\n", i + 1, (unsigned int) cameras.size());
+      fflush(stdout);
+    }
+
+    // Render frame
+    SCENE->SetCamera(cameras[i]);
+    RenderAOVs aovs = {NULL, NULL, NULL, NULL, NULL};
+    R2Image *image = RenderImage(aa, render_image_width, render_image_height,
+      (WRITE_AOVS) ? &aovs : NULL);
+
+    // Write the previous frame before handing this one to the writer
+    if (writer.joinable()) writer.join();
+    if (!image || !write_status) {
+      if (image) DeleteFrame(image, aovs);
+      return 0;
+    }
+    writer = thread(WriteFrame, image, aovs, FrameImageName(output_image_name, i), &write_status);
+  }
+  writer.join();
+
+  return write_status;
+}
+
+////////////////////////////////////////////////////////////////////////
+// Render Server
+////////////////////////////////////////////////////////////////////////
+
+// Read a scene and trace its photon maps with the server's settings, keeping
+// them resident (the server's illumination toggles are left as they were)
+static ResidentScene *LoadResidentScene(const string& filename)
+{
+  bool indirect_illum = INDIRECT_ILLUM;
+  bool direct_photon_illum = DIRECT_PHOTON_ILLUM;
+  bool caustic_illum = CAUSTIC_ILLUM;
+  int global_photon_count = GLOBAL_PHOTON_COUNT;
+  int caustic_photon_count = CAUSTIC_PHOTON_COUNT;
+
+  // Read scene and trace photons
+  SCENE = ReadScene((char *) filename.c_str(), real_material, scene_cache_dir);
+  if (!SCENE) return NULL;
+  SCENE_RADIUS = SCENE->BBox().DiagonalRadius();
+  SCENE_AMBIENT = SCENE->Ambient();
+  SCENE_NLIGHTS = SCENE->NLights();
+  vector<vector<ShadowPhoton> > shadow_photons;
+  MapSceneLighting(shadow_photons);
+
+  // Keep resident
+  ResidentScene *resident = new ResidentScene();
+  resident->filename = filename;
+  StoreResidentScene(*resident);
+
+  INDIRECT_ILLUM = indirect_illum;
+  DIRECT_PHOTON_ILLUM = direct_photon_illum;
+  CAUSTIC_ILLUM = caustic_illum;
+  GLOBAL_PHOTON_COUNT = global_photon_count;
+  CAUSTIC_PHOTON_COUNT = caustic_photon_count;
+  return resident;
+}
+
+// Render a job (as a child of the server, so that the flags of the job do
+// not outlive it) and send the image to client. args are the scene, the
+// output name (whose extension selects the format) and flags. Every return
+// has sent client a reply, either the image or an ERROR line
+static void RunServerJob(int client, const ResidentScene& resident, vector<string>& args)
+{
+  ActivateResidentScene(resident);
+
+  // Move camera
+  R3Camera camera = SCENE->Camera();
+  if (!ExtractCameraArgs(args, camera)) {
+    SendServerError(client, "Invalid camera");
+    return;
+  }
+  SCENE->SetCamera(camera);
+
+  // Parse flags of job (maps the server did not trace stay off)
+  vector<char *> argv;
+  char program_name[] = "photonmap";
+  argv.push_back(program_name);
+  for (unsigned int i = 0; i < args.size(); i++) {
+    argv.push_back((char *) args[i].c_str());
+  }
+  SERVER_SOCKET = NULL;
+  char *scene_name = NULL;
+  char *output_name = NULL;
+  if (!ParseArgs(argv.size(), &argv[0], scene_name, output_name, render_image_width,
+    render_image_height, aa, real_material, scene_cache_dir)) {
+    SendServerError(client, "Usage: inputscenefile outputimagefile [-FLAGS]");
+    return;
+  }
+  if (!GLOBAL_PMAP) {
+    INDIRECT_ILLUM = false;
+    DIRECT_PHOTON_ILLUM = false;
+  }
+  if (!CAUSTIC_PMAP) {
+    CAUSTIC_ILLUM = false;
+  }
+  JOB_DIR = NULL;
+
+  // Render image
+  if (LIGHT_TREE_SAMPLES > 0) {
+    BuildLightTree();
+  }
+  int aa_factor = pow(2.0, aa);
+  PIXEL_SAMPLES = aa_factor * aa_factor;
+  SCENE->SetViewport(R2Viewport(0, 0, render_image_width*aa_factor, render_image_height*aa_factor));
+  InitializeLightVisibility();
+  vector<vector<RNRgb> > radiance;
+  R2Image *image = RenderImage(aa, render_image_width, render_image_height, NULL, &radiance);
+  DeleteLightVisibility();
+  if (!image) {
+    SendServerError(client, "Unable to render image");
+    return;
+  }
+
+  // Send image
+  SendServerImage(client, image, radiance, output_name);
+  delete image;
+}
+
+// Serve render jobs on SERVER_SOCKET until killed, keeping the photon maps
+// of the SERVER_CACHE_SIZE most recently used scenes resident
+static int ServeRenders(void)
+{
+  int server = OpenServerSocket(SERVER_SOCKET);
+  if (server < 0) return 0;
+  signal(SIGPIPE, SIG_IGN);
+  BuildDirectionLookupTable();
+  if (VERBOSE) {
+    printf("Serving renders on %s ...\n", SERVER_SOCKET);
+    fflush(stdout);
+  }
+
+  // Scenes in order of use (most recent first)
+  vector<ResidentScene *> residents;
+  while (true) {
+    int client = accept(server, NULL, NULL);
+    if (client < 0) continue;
+    vector<string> args;
+    if (!ReadServerRequest(client, args)) {
+      SendServerError(client, "Invalid request");
+      close(client);
+      continue;
+    }
+
+    // Find scene, or load it in place of the least recently used one
+    ResidentScene *resident = NULL;
+    for (unsigned int i = 0; i < residents.size(); i++) {
+      if (residents[i]->filename != args[0]) continue;
+      resident = residents[i];
+      residents.erase(residents.begin() + i);
+      break;
+    }
+    if (!resident) {
+      if ((int) residents.size() >= SERVER_CACHE_SIZE) {
+        DeleteResidentScene(residents.back());
+        residents.pop_back();
+      }
+      resident = LoadResidentScene(args[0]);
+      if (!resident) {
+        SendServerError(client, "Unable to read scene");
+        close(client);
+        continue;
+      }
+    }
+    residents.insert(residents.begin(), resident);
+
+    // Render in a child process sharing the resident maps
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0) {
+      close(server);
+      RunServerJob(client, *resident, args);
+      fflush(stdout);
+      _exit(0);
+    }
+
+    // Reply for the child only if it died on a signal or exited from inside
+    // the renderer, before it could write anything to client
+    int status = 0;
+    if (pid < 0 || waitpid(pid, &status, 0) < 0 || WIFSIGNALED(status) ||
+        (WIFEXITED(status) && WEXITSTATUS(status) != 0)) {
+      SendServerError(client, "Render failed");
+    }
+    close(client);
+  }
+
+  return 1;
+}
+
+////////////////////////////////////////////////////////////////////////
+// Tracing
+////////////////////////////////////////////////////////////////////////
+
+// Write the trace of this process if tracing (workers of a distributed render
+// append their process id to the name, so they keep to their own files)
+static int WriteProcessTrace(void)
+{
+  if (!TRACE_FILE) return 1;
+  string filename = (JOB_WORKER) ? SuffixedName(TRACE_FILE, "_" + to_string(getpid())) : string(TRACE_FILE);
+  if (!WriteTrace(filename.c_str())) return 0;
+  if (VERBOSE) {
+    printf("Wrote trace to %s ...\n", filename.c_str());
+    fflush(stdout);
+  }
+  return 1;
+}
+
 ////////////////////////////////////////////////////////////////////////
 // Main program
 ////////////////////////////////////////////////////////////////////////
@@ -443,11 +1081,33 @@ int main(int argc, char **argv)
 {
   // Parse program arguments
   if (!ParseArgs(argc, argv, input_scene_name, output_image_name, render_image_width,
-    render_image_height, aa, real_material)) exit(-1);
+    render_image_height, aa, real_material, scene_cache_dir)) exit(-1);
 
-  // Read scene
-  SCENE = ReadScene(input_scene_name, real_material);
+  // Keep scenes resident and render requests instead
+  if (SERVER_SOCKET) return (ServeRenders()) ? 0 : -1;
+
+  // Record the phases of the render
+  if (TRACE_FILE) StartTracing();
+
+  // Count hardware events of the phases (rendering without them if unavailable)
+  if (PERF_COUNTERS && !StartPerfCounters()) PERF_COUNTERS = false;
+
+  // Start the workers of a distributed render, so that they read the scene
+  // while this process traces photons
+  if (JOB_DIR && !JOB_WORKER) {
+    if (!PrepareJob()) exit(-1);
+    if (!SpawnJobWorkers(argc, argv)) exit(-1);
+  }
+
+  // Read scene (tracking the memory it grew the process by)
+  {
+    TraceScope trace("read scene", "scene");
+    unsigned long long int rss = CurrentRSS();
+    SCENE = ReadScene(input_scene_name, real_material, scene_cache_dir);
+    TrackMemory(MEM_SCENE, max(0LL, (long long int) (CurrentRSS() - rss)));
+  }
   if (!SCENE) exit(-1);
+  SampleMemory("read scene");
 
   // Check output image file
   if (output_image_name) {
@@ -456,19 +1116,77 @@ int main(int argc, char **argv)
     SCENE_AMBIENT = SCENE->Ambient();
     SCENE_NLIGHTS = SCENE->NLights();
 
-    // Generate Photon Map if necessary
-    if (INDIRECT_ILLUM || CAUSTIC_ILLUM || DIRECT_PHOTON_ILLUM) {
-      MapPhotons();
+    // Time the kernels instead of rendering (writing their timings as CSV)
+    if (MICROBENCH) return (RunMicrobenchmarks(output_image_name)) ? 0 : -1;
+
+    // Build light tree if sampling lights stochastically
+    if (LIGHT_TREE_SAMPLES > 0) {
+      BuildLightTree();
+    }
+
+    // Lower anti-aliasing and photon counts to fit the memory budget
+    if (MEM_BUDGET > 0 && !JOB_WORKER && !FitMemoryBudget(aa, render_image_width, render_image_height)) exit(-1);
+
+    vector<vector<ShadowPhoton> > shadow_photons;
+    if (JOB_WORKER) {
+      // Build the photon maps traced by the coordinator
+      {
+        TraceScope trace("read job photons", "photons");
+        if (!ReadJobPhotons(shadow_photons)) exit(-1);
+      }
+      TrackMemory(MEM_GLOBAL_PHOTONS, HeapObjectBytes(GLOBAL_PHOTONS.NEntries(), sizeof(Photon)));
+      TrackMemory(MEM_CAUSTIC_PHOTONS, HeapObjectBytes(CAUSTIC_PHOTONS.NEntries(), sizeof(Photon)));
+      BuildDirectionLookupTable();
+      BuildPhotonKdtrees();
+      if (!shadow_photons.empty()) BuildShadowPhotonMaps(shadow_photons);
+    } else if (PIPELINE) {
+      // Shadow photons are needed by direct lighting, the photon maps only
+      // once it is rendered (they are traced while it renders)
+      MapShadowLighting(shadow_photons);
+    } else {
+      // Generate photon maps, then hand them over to the workers
+      MapSceneLighting(shadow_photons);
+      if (JOB_DIR && !WriteJobPhotons(shadow_photons)) exit(-1);
     }
+    SampleMemory((PIPELINE) ? "shadow photon maps" : "photon maps");
 
     // Scale for anti-aliasing
     int aa_factor = pow(2.0, aa);
+    PIXEL_SAMPLES = aa_factor * aa_factor;
 
     // Set scene viewport (scaled for anti aliasing)
     SCENE->SetViewport(R2Viewport(0, 0, render_image_width*aa_factor, render_image_height*aa_factor));
 
-    // Render image
-    R2Image *image = RenderImage(aa, render_image_width, render_image_height);
+    // Render image (or, as a worker, tiles of it, or frames of a camera path)
+    InitializeLightVisibility();
+    RenderAOVs aovs = {NULL, NULL, NULL, NULL, NULL};
+    R2Image *image = NULL;
+    int status = 1;
+
+    // Keep the unclamped radiance of float images
+    const char *extension = strrchr(output_image_name, '.');
+    vector<vector<RNRgb> > radiance;
+    vector<vector<RNRgb> > *float_radiance =
+      (extension && !strcmp(extension, ".pfm")) ? &radiance : NULL;
+    if (CAMERA_PATH) {
+      status = RenderCameraPath();
+    } else if (JOB_WORKER) {
+      status = WorkOnJob(render_image_width*aa_factor, render_image_height*aa_factor);
+    } else if (JOB_DIR) {
+      image = RenderDistributedImage(aa, render_image_width, render_image_height, float_radiance);
+      WaitJobWorkers();
+    } else if (PIPELINE) {
+      string preview_name = SuffixedName(output_image_name, "_preview");
+      image = RenderPipelinedImage(aa, render_image_width, render_image_height,
+        MapPhotonLighting, preview_name.c_str(), (WRITE_AOVS) ? &aovs : NULL, float_radiance);
+    } else {
+      image = RenderImage(aa, render_image_width, render_image_height,
+        (WRITE_AOVS) ? &aovs : NULL, float_radiance);
+    }
+    DeleteLightVisibility();
+    SampleMemory("render");
+    if (PERF_COUNTERS && VERBOSE) PrintPerfCounters();
+    if (VERBOSE) PrintMemoryUsage();
 
     // Cleanup Photon Map Memory
     for (int i = 0; i < GLOBAL_PHOTONS.NEntries(); i++) {
@@ -483,15 +1201,36 @@ int main(int argc, char **argv)
     if (CAUSTIC_PMAP) {
       delete CAUSTIC_PMAP;
     }
+    for (unsigned int i = 0; i < SHADOW_PMAPS.size(); i++) {
+      if (SHADOW_PMAPS[i]) delete SHADOW_PMAPS[i];
+    }
+    for (int i = 0; i < SHADOW_PHOTONS.NEntries(); i++) {
+      delete SHADOW_PHOTONS[i];
+    }
+
+    // Workers and camera paths are done once their tiles or frames are written
+    if (JOB_WORKER || CAMERA_PATH) {
+      if (!WriteProcessTrace()) status = 0;
+      return (status) ? 0 : -1;
+    }
 
     // Error Check
     if (!image) exit(-1);
 
     // Write image
-    if (!WriteImage(image, output_image_name)) exit(-1);
+    if (!WriteImage(image, output_image_name, (radiance.empty()) ? NULL : &radiance)) exit(-1);
+    if (WRITE_AOVS && !WriteAOVs(aovs, output_image_name)) exit(-1);
 
-    // Delete image
+    // Delete images
     delete image;
+    delete aovs.albedo;
+    delete aovs.normal;
+    delete aovs.depth;
+    delete aovs.direct;
+    delete aovs.indirect;
+
+    // Write trace
+    if (!WriteProcessTrace()) exit(-1);
   }
 
   // Return success
@@ -17,6 +17,9 @@ using namespace std;
 ////////////////////////////////////////////////////////////////////////
 
 const int SIZE_LOCAL_PHOTON_STORAGE = 100000;
+
+// Offset for continuing shadow photons through surfaces
+static const RNScalar SHADOW_PHOTON_EPSILON = 1.0E-4;
 __thread int PHOTONS_STORED_COUNT = 0;
 __thread int TEMPORARY_STORAGE_COUNT = 0;
 
@@ -26,7 +29,7 @@ __thread int TEMPORARY_STORAGE_COUNT = 0;
 
 // Monte carlo trace photon, storing at each diffuse intersection
 void PhotonTrace(R3Ray ray, RNRgb photon, vector<Photon>& local_photon_storage,
-  Photon_Type map_type, int thread_id)
+  Photon_Type map_type)
 {
   // Intersection variables and forward declarations
   R3SceneElement *element;
@@ -75,7 +78,7 @@ void PhotonTrace(R3Ray ray, RNRgb photon, vector<Photon>& local_photon_storage,
 
       // Diffuse interaction (store unless first bounce of caustic)
       if (brdf->IsDiffuse() && store) {
-        StorePhoton(photon, local_photon_storage, view, point, map_type);
+        StorePhoton(photon, local_photon_storage, view, point, iter, map_type);
       }
 
       // Compute Reflection Coefficient, carry reflection portion to Specular
@@ -157,43 +160,25 @@ void PhotonTrace(R3Ray ray, RNRgb photon, vector<Photon>& local_photon_storage,
       ray = R3Ray(ray_start, sampled_bounce, TRUE);
     }
   }
-
-  // Print progress if necessary
-  if (VERBOSE && thread_id == 0) {
-    static int last_value = -1;
-    double progress;
-    if (map_type == GLOBAL) {
-      progress = double(PHOTONS_STORED_COUNT) / GLOBAL_PHOTON_COUNT * THREADS;
-    } else {
-      progress = double(PHOTONS_STORED_COUNT) / CAUSTIC_PHOTON_COUNT * THREADS;
-    }
-    int next_value = int(progress * 100.0);
-    if (next_value != last_value) {
-      PrintProgress(progress, PROGRESS_BAR_WIDTH);
-      last_value = next_value;
-    }
-  }
 }
 
 ////////////////////////////////////////////////////////////////////////
 // Photon Emitting Method (invokes internal photon tracer)
 ////////////////////////////////////////////////////////////////////////
 
-void EmitPhotons(int num_photons, R3Light* light, Photon_Type map_type, int thread_id)
+int EmitPhotons(int num_photons, R3Light* light, Photon_Type map_type,
+  vector<Photon>& local_photon_storage)
 {
+  // Reset counts
+  TEMPORARY_STORAGE_COUNT = 0;
+
   // Corner cases
-  if (!(light->IsActive()) || !num_photons) return;
+  if (!(light->IsActive()) || !num_photons) return 0;
 
   // Compute photon power (normalized across lights in scene)
   RNRgb photon = light->Color();
   NormalizeColor(photon);
 
-  // Allocate stack space for fast thread local storage
-  vector<Photon> local_photon_storage(SIZE_LOCAL_PHOTON_STORAGE);
-
-  // Reset counts
-  TEMPORARY_STORAGE_COUNT = 0;
-
   // Emit photons based on geometry of light
   if (light->ClassID() == R3DirectionalLight::CLASS_ID()) {
     // Directional Light (emit from a large disk outside scene)
@@ -229,7 +214,7 @@ void EmitPhotons(int num_photons, R3Light* light, Photon_Type map_type, int thre
 
       sample_point = r1*u + r2*v + center + light_norm*RN_EPSILON;
       ray = R3Ray(sample_point, light_norm, TRUE);
-      PhotonTrace(ray, photon,local_photon_storage, map_type, thread_id);
+      PhotonTrace(ray, photon, local_photon_storage, map_type);
     }
   } else if (light->ClassID() == R3PointLight::CLASS_ID()) {
     // Point Light (use spherical point picking to pick emmission direction)
@@ -253,7 +238,7 @@ void EmitPhotons(int num_photons, R3Light* light, Photon_Type map_type, int thre
       sample_direction = R3Vector(x, y, z);
       sample_direction.Normalize();
       ray = R3Ray(center, sample_direction, TRUE);
-      PhotonTrace(ray, photon, local_photon_storage, map_type, thread_id);
+      PhotonTrace(ray, photon, local_photon_storage, map_type);
     }
   } else if (light->ClassID() == R3SpotLight::CLASS_ID()) {
     // Spot Light (use specular importance sampling)
@@ -282,7 +267,7 @@ void EmitPhotons(int num_photons, R3Light* light, Photon_Type map_type, int thre
       }
 
       ray = R3Ray(center, sample_direction, TRUE);
-      PhotonTrace(ray, photon, local_photon_storage, map_type, thread_id);
+      PhotonTrace(ray, photon, local_photon_storage, map_type);
     }
   } else if (light->ClassID() == R3AreaLight::CLASS_ID()) {
     // Area Light (pick from a circle and diffuse direction)
@@ -326,7 +311,7 @@ void EmitPhotons(int num_photons, R3Light* light, Photon_Type map_type, int thre
       sample_direction = Diffuse_ImportanceSample(light_norm, 1.0);
 
       ray = R3Ray(sample_point, sample_direction, TRUE);
-      PhotonTrace(ray, photon, local_photon_storage, map_type, thread_id);
+      PhotonTrace(ray, photon, local_photon_storage, map_type);
     }
   } else if (light->ClassID() == R3RectLight::CLASS_ID()) {
     // Rect Light (pick from rectangle and emit in diffuse direction)
@@ -356,18 +341,238 @@ void EmitPhotons(int num_photons, R3Light* light, Photon_Type map_type, int thre
       // Use diffuse importance sampling to pick a direction
       sample_direction = Diffuse_ImportanceSample(light_norm, 1.0);
       ray = R3Ray(sample_point, sample_direction, TRUE);
-      PhotonTrace(ray, photon, local_photon_storage, map_type, thread_id);
+      PhotonTrace(ray, photon, local_photon_storage, map_type);
     }
   } else {
     fprintf(stderr, "Unrecognized light type: %d\n", light->ClassID());
   }
 
-  // Flush storage
-  int success = FlushPhotonStorage(local_photon_storage, map_type);
-  if (!success) {
-    fprintf(stderr, "\nError allocating photon memory \n");
-    exit(-1);
+  return TEMPORARY_STORAGE_COUNT;
+}
+
+////////////////////////////////////////////////////////////////////////
+// Quasi-Random Photon Emitting Method
+////////////////////////////////////////////////////////////////////////
+
+// Mix the bits of an integer (used for per-light offsets and batch seeds)
+static unsigned int HashInt(unsigned int x)
+{
+  x ^= x >> 16;
+  x *= 0x7FEB352Du;
+  x ^= x >> 15;
+  x *= 0x846CA68Bu;
+  x ^= x >> 16;
+  return x;
+}
+
+// Find two perpendicular unit vectors spanning the plane with normal light_norm
+static void LightPlaneAxes(const R3Vector& light_norm, R3Vector& u, R3Vector& v)
+{
+  u = R3Vector(light_norm[1], -light_norm[0], 0);
+  if (1.0 - abs(light_norm[2]) < 0.1) {
+    u = R3Vector(light_norm[2], 0, -light_norm[0]);
   }
+  v = u % light_norm;
+  u.Normalize();
+  v.Normalize();
+}
 
-  return;
+// Map a point of the unit 4D cube to an emission ray of the light (origin from
+// the first two values and direction from the last two); returns false for
+// unrecognized lights
+static bool QuasiRandomEmissionRay(R3Light* light, const RNScalar sample[4], R3Ray& ray)
+{
+  R3Vector u, v;
+  RNScalar r1, r2;
+  if (light->ClassID() == R3DirectionalLight::CLASS_ID()) {
+    // Directional Light (emit from a large disk outside scene)
+    R3DirectionalLight *directional_light = (R3DirectionalLight *) light;
+    R3Vector light_norm = directional_light->Direction();
+    R3Point center = SCENE->Centroid() - light_norm * SCENE_RADIUS * 3.0;
+    LightPlaneAxes(light_norm, u, v);
+    ConcentricSampleDisk(sample[0], sample[1], r1, r2);
+    R3Point sample_point = (r1*u + r2*v) * SCENE_RADIUS + center + light_norm*RN_EPSILON;
+    ray = R3Ray(sample_point, light_norm, TRUE);
+  } else if (light->ClassID() == R3PointLight::CLASS_ID()) {
+    // Point Light (uniform direction on sphere)
+    R3PointLight *point_light = (R3PointLight *) light;
+    RNScalar z = 1.0 - 2.0*sample[2];
+    RNScalar r = sqrt(max(0.0, 1.0 - z*z));
+    RNAngle phi = RN_TWO_PI*sample[3];
+    ray = R3Ray(point_light->Position(), R3Vector(r*cos(phi), r*sin(phi), z), TRUE);
+  } else if (light->ClassID() == R3SpotLight::CLASS_ID()) {
+    // Spot Light (specular lobe, truncated at the cutoff by inversion rather
+    // than by rejection)
+    R3SpotLight *spot_light = (R3SpotLight *) light;
+    RNScalar n = spot_light->DropOffRate();
+    RNScalar cutoff = abs(cos(spot_light->CutOffAngle()));
+    RNScalar min_sample = pow(cutoff, n + 1.0);
+    R3Vector sample_direction = Specular_ImportanceSample(spot_light->Direction(), n,
+      1.0, min_sample + sample[2]*(1.0 - min_sample), sample[3]);
+    ray = R3Ray(spot_light->Position(), sample_direction, TRUE);
+  } else if (light->ClassID() == R3AreaLight::CLASS_ID()) {
+    // Area Light (pick from a circle and diffuse direction)
+    R3AreaLight *area_light = (R3AreaLight *) light;
+    R3Vector light_norm = area_light->Direction();
+    LightPlaneAxes(light_norm, u, v);
+    ConcentricSampleDisk(sample[0], sample[1], r1, r2);
+    R3Point sample_point = (r1*u + r2*v) * area_light->Radius()
+      + area_light->Position() + light_norm*RN_EPSILON;
+    R3Vector sample_direction = Diffuse_ImportanceSample(light_norm, 1.0, sample[2], sample[3]);
+    ray = R3Ray(sample_point, sample_direction, TRUE);
+  } else if (light->ClassID() == R3RectLight::CLASS_ID()) {
+    // Rect Light (pick from rectangle and emit in diffuse direction)
+    R3RectLight *rect_light = (R3RectLight *) light;
+    R3Vector light_norm = rect_light->Direction();
+    R3Vector a1 = rect_light->PrimaryAxis() * rect_light->PrimaryLength();
+    R3Vector a2 = rect_light->SecondaryAxis() * rect_light->SecondaryLength();
+    R3Point sample_point = (sample[0] - 0.5)*a1 + (sample[1] - 0.5)*a2
+      + rect_light->Position() + light_norm*RN_EPSILON;
+    R3Vector sample_direction = Diffuse_ImportanceSample(light_norm, 1.0, sample[2], sample[3]);
+    ray = R3Ray(sample_point, sample_direction, TRUE);
+  } else {
+    return false;
+  }
+  return true;
+}
+
+// Emit photons [first_index, first_index + num_photons) of the light's Halton
+// sequence, which stratifies origin and direction jointly; photons are left in
+// local_photon_storage and the number stored is returned. Each light's sequence
+// is offset (Cranley-Patterson rotation) and bounces are drawn from a generator
+// seeded by the batch, so the result does not depend on which thread traces it
+int EmitQuasiRandomPhotons(int first_index, int num_photons, int light_index,
+  Photon_Type map_type, vector<Photon>& local_photon_storage)
+{
+  // Reset counts
+  TEMPORARY_STORAGE_COUNT = 0;
+
+  // Corner cases
+  R3Light *light = SCENE->Light(light_index);
+  if (!(light->IsActive()) || !num_photons) return 0;
+
+  // Compute photon power (normalized across lights in scene)
+  RNRgb photon = light->Color();
+  NormalizeColor(photon);
+
+  // Per-light offsets of the sequence, and seed of this batch
+  static const int bases[4] = {2, 3, 5, 7};
+  unsigned int key = HashInt(2*light_index + (map_type == CAUSTIC));
+  RNScalar offset[4];
+  for (int d = 0; d < 4; d++) {
+    offset[d] = (HashInt(key + d + 1) & 0xFFFFFF) / (RNScalar) 0x1000000;
+  }
+  RNReseedThreadRandomness(HashInt(key ^ HashInt(first_index)));
+
+  // Emit photons
+  R3Ray ray;
+  RNScalar sample[4];
+  for (int i = 0; i < num_photons; i++) {
+    // Skip index 0 (the origin of every dimension)
+    unsigned int index = first_index + i + 1;
+    for (int d = 0; d < 4; d++) {
+      sample[d] = RadicalInverse(bases[d], index) + offset[d];
+      if (sample[d] >= 1.0) sample[d] -= 1.0;
+    }
+    if (!QuasiRandomEmissionRay(light, sample, ray)) {
+      fprintf(stderr, "Unrecognized light type: %d\n", light->ClassID());
+      return 0;
+    }
+    PhotonTrace(ray, photon, local_photon_storage, map_type);
+  }
+
+  return TEMPORARY_STORAGE_COUNT;
+}
+
+////////////////////////////////////////////////////////////////////////
+// Shadow Photon Methods
+////////////////////////////////////////////////////////////////////////
+
+// Trace shadow photon along ray, storing a lit photon at the first intersection
+// and a shadow photon at every intersection behind it
+void ShadowPhotonTrace(R3Ray ray, vector<ShadowPhoton>& local_storage)
+{
+  ShadowPhoton photon;
+  photon.shadow = false;
+  R3Point point;
+  RNScalar t;
+  for (int iter = 0; iter < MAX_PHOTON_DEPTH &&
+    SCENE->Intersects(ray, NULL, NULL, NULL, &point, NULL, &t); iter++)
+  {
+    // Store unless surface was hit again where the ray left it (only the
+    // first intersection is lit)
+    if (!photon.shadow || t > SHADOW_PHOTON_EPSILON) {
+      photon.position = point;
+      local_storage.push_back(photon);
+      photon.shadow = true;
+    }
+
+    // Continue straight through the surface
+    ray = R3Ray(point + ray.Vector() * SHADOW_PHOTON_EPSILON, ray.Vector(), TRUE);
+  }
+}
+
+// Emit shadow photons from area or rect light in random direction
+void EmitShadowPhotons(int num_photons, R3Light* light, vector<ShadowPhoton>& local_storage)
+{
+  // Corner cases
+  if (!(light->IsActive()) || !num_photons) return;
+
+  // Get light geometry (disk spanned by u and v, or rectangle spanned by a1 and a2)
+  R3Point center;
+  R3Vector light_norm;
+  R3Vector a1, a2;
+  bool disk;
+  if (light->ClassID() == R3AreaLight::CLASS_ID()) {
+    R3AreaLight *area_light = (R3AreaLight *) light;
+    center = area_light->Position();
+    light_norm = area_light->Direction();
+
+    // Find two perpendicular vectors spanning circle plane
+    a1 = R3Vector(light_norm[1], -light_norm[0], 0);
+    if (1.0 - abs(light_norm[2]) < 0.1) {
+      a1 = R3Vector(light_norm[2], 0, -light_norm[0]);
+    }
+    a2 = a1 % light_norm;
+    a1.Normalize();
+    a2.Normalize();
+    a1 *= area_light->Radius();
+    a2 *= area_light->Radius();
+    disk = true;
+  } else if (light->ClassID() == R3RectLight::CLASS_ID()) {
+    R3RectLight *rect_light = (R3RectLight *) light;
+    center = rect_light->Position();
+    light_norm = rect_light->Direction();
+    a1 = rect_light->PrimaryAxis() * rect_light->PrimaryLength();
+    a2 = rect_light->SecondaryAxis() * rect_light->SecondaryLength();
+    disk = false;
+  } else {
+    // Other lights cast hard shadows with a single ray
+    return;
+  }
+
+  // Genereal Forward Declarations
+  R3Point sample_point;
+  R3Vector sample_direction;
+  RNScalar r1, r2;
+
+  for (int i = 0; i < num_photons; i++) {
+    if (disk) {
+      do {
+        // Sample point in circle
+        r1 = RNThreadableRandomScalar()*2.0 - 1.0;
+        r2 = RNThreadableRandomScalar()*2.0 - 1.0;
+      } while (r1*r1 + r2*r2 > 1.0);
+    } else {
+      r1 = RNThreadableRandomScalar() - 0.5;
+      r2 = RNThreadableRandomScalar() - 0.5;
+    }
+
+    // Use values r1, r2 and vectors a1, a2 to find a random point on light
+    sample_point = r1*a1 + r2*a2 + center + light_norm*RN_EPSILON;
+
+    // Use diffuse importance sampling to pick a direction
+    sample_direction = Diffuse_ImportanceSample(light_norm, 1.0);
+    ShadowPhotonTrace(R3Ray(sample_point, sample_direction, TRUE), local_storage);
+  }
 }
@@ -17,13 +17,37 @@ using namespace std;
 
 // Monte carlo trace photon, storing at each diffuse intersection
 void PhotonTrace(R3Ray ray, RNRgb photon, vector<Photon>& local_photon_storage,
-  Photon_Type map_type, int thread_id);
+  Photon_Type map_type);
 
 ////////////////////////////////////////////////////////////////////////
 // Photon Emitting Method (invokes internal photon tracer)
 ////////////////////////////////////////////////////////////////////////
 
-// Emit photons from light source in random direction
-void EmitPhotons(int num_photons, R3Light* light, Photon_Type map_type, int thread_id);
+// Emit photons from light source in random direction; photons are left in
+// local_photon_storage and the number stored is returned (the batch must fit)
+int EmitPhotons(int num_photons, R3Light* light, Photon_Type map_type,
+  vector<Photon>& local_photon_storage);
+
+////////////////////////////////////////////////////////////////////////
+// Quasi-Random Photon Emitting Method
+////////////////////////////////////////////////////////////////////////
+
+// Emit photons [first_index, first_index + num_photons) of the light's Halton
+// sequence, which stratifies origin and direction jointly; photons are left in
+// local_photon_storage and the number stored is returned (the batch must fit,
+// and its result does not depend on the thread that traces it)
+int EmitQuasiRandomPhotons(int first_index, int num_photons, int light_index,
+  Photon_Type map_type, vector<Photon>& local_photon_storage);
+
+////////////////////////////////////////////////////////////////////////
+// Shadow Photon Methods
+////////////////////////////////////////////////////////////////////////
+
+// Trace shadow photon along ray, storing a lit photon at the first intersection
+// and a shadow photon at every intersection behind it
+void ShadowPhotonTrace(R3Ray ray, vector<ShadowPhoton>& local_storage);
+
+// Emit shadow photons from area or rect light in random direction
+void EmitShadowPhotons(int num_photons, R3Light* light, vector<ShadowPhoton>& local_storage);
 
 #endif
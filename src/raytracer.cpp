@@ -8,6 +8,7 @@
 #include "utils/graphics_utils.h"
 #include "utils/photon_utils.h"
 #include "utils/illumination_utils.h"
+#include "utils/light_utils.h"
 #include "R3Graphics/R3Graphics.h"
 
 ////////////////////////////////////////////////////////////////////////
@@ -21,6 +22,46 @@ void DirectIllumination(R3Point& point, R3Vector& normal, const R3Point& eye,
   // Check for single emmissive side of area lights
   bool should_emit = true;
 
+  // Sample a few lights from the light tree instead of visiting every light
+  if (LIGHT_TREE_SAMPLES > 0) {
+    // Lights without position are always sampled
+    for (int k = 0; k < NUnboundedLights(); k++) {
+      ComputeIllumination(color, UnboundedLight(k), brdf, eye, point, normal, cos_theta, inMonteCarlo);
+    }
+
+    // Positioned lights are chosen stochastically and weighted by their pdf
+    RNScalar pdf;
+    for (int i = 0; i < LIGHT_TREE_SAMPLES; i++) {
+      R3Light *light = SampleLightTree(point, pdf);
+      if (!light || (pdf <= 0)) break;
+      int light_intersection = TestLightIntersection(point, eye, light);
+      if (light_intersection != 0) {
+        if (light_intersection == -1) {
+          should_emit = false;
+        }
+        continue;
+      }
+      RNRgb light_color = RNblack_rgb;
+      ComputeIllumination(light_color, light, brdf, eye, point, normal, cos_theta, inMonteCarlo);
+      color += light_color / (pdf * LIGHT_TREE_SAMPLES);
+    }
+
+    // Account for emission (only emissive points, which may lie on the back
+    // of a light that was not sampled, test for lying on every light)
+    if (should_emit && !brdf->Emission().IsBlack()) {
+      for (int k = 0; k < SCENE_NLIGHTS; k++) {
+        if (TestLightIntersection(point, eye, SCENE->Light(k)) == -1) {
+          should_emit = false;
+          break;
+        }
+      }
+      if (should_emit) {
+        color += brdf->Emission();
+      }
+    }
+    return;
+  }
+
   // Compute illumination from lights
   for (int k = 0; k < SCENE_NLIGHTS; k++) {
     R3Light *light = SCENE->Light(k);
@@ -45,7 +86,8 @@ void DirectIllumination(R3Point& point, R3Vector& normal, const R3Point& eye,
 
 // Compute transmissive bounce on point
 void TransmissiveIllumination(R3Point& point, R3Vector& normal, RNRgb& color,
-  const R3Brdf *brdf, R3Vector& view, RNScalar cos_theta, RNScalar T_coeff)
+  const R3Brdf *brdf, R3Vector& view, RNScalar cos_theta, RNScalar T_coeff,
+  int num_samples)
 {
   // Get direction of bounced ray (might be a specular if total internal reflection)
   const R3Vector exact_bounce = TransmissiveBounce(normal, view, cos_theta,
@@ -54,7 +96,9 @@ void TransmissiveIllumination(R3Point& point, R3Vector& normal, RNRgb& color,
   // Scale number of samples with contribution to final color of pixel
   RNRgb total_weight = T_coeff * (brdf->Transmission());
   RNScalar highest_weight = MaxChannelVal(total_weight);
-  const int num_samples = ceil((TRANSMISSIVE_TEST*highest_weight + TRANSMISSIVE_TEST) / 2.0);
+  if (num_samples < 1) {
+    num_samples = ceil((TRANSMISSIVE_TEST*highest_weight + TRANSMISSIVE_TEST) / 2.0);
+  }
 
   // Recursively raytrace the bounce using montecarlo path tracing
   RNRgb color_buffer = RNblack_rgb;
@@ -69,7 +113,7 @@ void TransmissiveIllumination(R3Point& point, R3Vector& normal, RNRgb& color,
       sampled_bounce = exact_bounce;
     }
     ray = R3Ray(point + sampled_bounce * RN_EPSILON, sampled_bounce, TRUE);
-    MonteCarlo_PathTrace(ray, color_buffer);
+    MonteCarlo_PathTrace(ray, color_buffer, total_weight);
     LOCAL_TRANSMISSIVE_RAY_COUNT++;
   }
   // Normalize average and add contribution
@@ -78,7 +122,8 @@ void TransmissiveIllumination(R3Point& point, R3Vector& normal, RNRgb& color,
 
 // Compute specular bounce on point
 void SpecularIllumination(R3Point& point, R3Vector& normal, RNRgb& color,
-  const R3Brdf *brdf, R3Vector& view, RNScalar cos_theta, RNScalar R_coeff)
+  const R3Brdf *brdf, R3Vector& view, RNScalar cos_theta, RNScalar R_coeff,
+  int num_samples)
 {
   // Get direction of bounced ray
   const R3Vector exact_bounce = ReflectiveBounce(normal, view, cos_theta);
@@ -86,7 +131,9 @@ void SpecularIllumination(R3Point& point, R3Vector& normal, RNRgb& color,
   // Scale number of samples with contribution to final color of pixel
   RNRgb total_weight = brdf->Transmission()*R_coeff + brdf->Specular();
   RNScalar highest_weight = MaxChannelVal(total_weight);
-  const int num_samples = ceil((SPECULAR_TEST*highest_weight + SPECULAR_TEST) / 2.0);
+  if (num_samples < 1) {
+    num_samples = ceil((SPECULAR_TEST*highest_weight + SPECULAR_TEST) / 2.0);
+  }
 
   // Recursively raytrace the bounce using montecarlo path tracing
   RNRgb color_buffer = RNblack_rgb;
@@ -101,7 +148,7 @@ void SpecularIllumination(R3Point& point, R3Vector& normal, RNRgb& color,
       sampled_bounce = exact_bounce;
     }
     ray = R3Ray(point + sampled_bounce * RN_EPSILON, sampled_bounce, TRUE);
-    MonteCarlo_PathTrace(ray, color_buffer);
+    MonteCarlo_PathTrace(ray, color_buffer, total_weight);
     LOCAL_SPECULAR_RAY_COUNT++;
   }
   // Normalize average and add contribution
@@ -110,25 +157,46 @@ void SpecularIllumination(R3Point& point, R3Vector& normal, RNRgb& color,
 
 // Compute indirect illumination at point
 void IndirectIllumination(R3Point& point, R3Vector& normal, RNRgb& color,
-  const R3Brdf *brdf, const RNScalar cos_theta, const bool inMonteCarlo)
+  const R3Brdf *brdf, const RNScalar cos_theta, const bool inMonteCarlo,
+  int num_samples)
 {
   if (!brdf->IsDiffuse()) return;
   // Scale number of samples with contribution to final color of pixel
   RNRgb total_weight = brdf->Diffuse();
   RNScalar highest_weight = MaxChannelVal(total_weight);
-  int num_samples = ceil((INDIRECT_TEST*highest_weight + INDIRECT_TEST) / 2.0);
+  if (num_samples < 1) {
+    num_samples = ceil((INDIRECT_TEST*highest_weight + INDIRECT_TEST) / 2.0);
+  }
   if (inMonteCarlo) num_samples = 1;
 
   // Recursively raytrace the bounce using montecarlo path tracing
   RNRgb color_buffer = RNblack_rgb;
   R3Ray ray;
   R3Vector sampled_bounce;
-  for (int i = 0; i < num_samples; i++) {
-    // Diffuse importance sample
-    sampled_bounce = Diffuse_ImportanceSample(normal, cos_theta);
-    ray = R3Ray(point + sampled_bounce * RN_EPSILON, sampled_bounce, TRUE);
-    MonteCarlo_IndirectSample(ray, color_buffer);
-    LOCAL_INDIRECT_RAY_COUNT++;
+  if (GUIDED_GATHER && GLOBAL_PMAP && !inMonteCarlo) {
+    // Importance sample directions photons arrive from (mixed with cosine lobe);
+    // uses more photons than a radiance estimate since they are spread over cells
+    GuideHistogram histogram;
+    BuildGuideHistogram(histogram, point, normal, cos_theta, GLOBAL_PMAP,
+      GUIDE_ESTIMATE_SIZE, GLOBAL_ESTIMATE_DIST);
+    RNRgb sample_color;
+    RNScalar weight;
+    for (int i = 0; i < num_samples; i++) {
+      sampled_bounce = SampleGuideHistogram(histogram, GUIDE_COSINE_PROB, weight);
+      ray = R3Ray(point + sampled_bounce * RN_EPSILON, sampled_bounce, TRUE);
+      sample_color = RNblack_rgb;
+      MonteCarlo_IndirectSample(ray, sample_color, total_weight * weight);
+      color_buffer += sample_color * weight;
+      LOCAL_INDIRECT_RAY_COUNT++;
+    }
+  } else {
+    for (int i = 0; i < num_samples; i++) {
+      // Diffuse importance sample
+      sampled_bounce = Diffuse_ImportanceSample(normal, cos_theta);
+      ray = R3Ray(point + sampled_bounce * RN_EPSILON, sampled_bounce, TRUE);
+      MonteCarlo_IndirectSample(ray, color_buffer, total_weight);
+      LOCAL_INDIRECT_RAY_COUNT++;
+    }
   }
   // Normalize average and add contribution
   color += (color_buffer / (RNScalar) num_samples) * total_weight;
@@ -170,15 +238,27 @@ void EstimateGlobalIllumination(R3Point& point, R3Vector& normal, RNRgb& color,
 // Main Raytracing Method
 ////////////////////////////////////////////////////////////////////////
 
+// Share of a ray budget given to a bounce with the given contribution (at
+// least one ray, so no bounce is dropped entirely)
+static int BudgetedSamples(RNScalar budget, RNScalar contribution,
+  RNScalar total_contribution)
+{
+  int num_samples = (int) (budget * contribution / total_contribution + 0.5);
+  return (num_samples < 1) ? 1 : num_samples;
+}
+
 // Sample Ray from eye
 void RayTrace(R3SceneElement* element, R3Point& point, R3Vector& normal,
-  R3Ray& ray, const R3Point& eye, RNRgb& color)
+  R3Ray& ray, const R3Point& eye, RNRgb& color, RNRgb *direct_color,
+  Trace_Part part, RNRgb *specular_color)
 {
   // Get intersection information
   const R3Material *material = (element) ? element->Material() : &R3default_material;
   const R3Brdf *brdf = (material) ? material->Brdf() : &R3default_brdf;
+  const RNRgb color_in = color;
+  const bool direct_part = (part != BOUNCE_PART);
 
-  if (AMBIENT) {
+  if (AMBIENT && direct_part) {
     // Global ambient contribution (ambience from scene)
     color += SCENE_AMBIENT;
   }
@@ -193,33 +273,73 @@ void RayTrace(R3SceneElement* element, R3Point& point, R3Vector& normal,
     // Fresnel Reflection Coefficient for transmission (approximated)
     RNScalar R_coeff = 0;
 
-    if (AMBIENT && brdf->IsAmbient()) {
+    if (AMBIENT && direct_part && brdf->IsAmbient()) {
       // Local ambient contribution (ambience from material)
       color += brdf->Ambient();
     }
-    if (DIRECT_ILLUM && (brdf->IsDiffuse() || brdf->IsSpecular())) {
+    if (DIRECT_ILLUM && direct_part && (brdf->IsDiffuse() || brdf->IsSpecular())) {
       // Compute contribution from direct illumination
       DirectIllumination(point, normal, eye, color, brdf, cos_theta, false);
     }
+    if (direct_color) {
+      *direct_color += color - color_in;
+    }
+    if (part == DIRECT_PART) return;
     if (TRANSMISSIVE_ILLUM && brdf->IsTransparent()) {
       // Compute Reflection Coefficient, carry reflection portion to Specular
       if (SPECULAR_ILLUM && FRESNEL) {
         R_coeff = ComputeReflectionCoeff(cos_theta, brdf->IndexOfRefraction());
       }
-      // Compute contribution from transmission
-      if (R_coeff < 1.0) {
-        TransmissiveIllumination(point, normal, color, brdf, view, cos_theta,
-          1.0 - R_coeff);
+    }
+
+    // Decide which bounces are sampled and how much each contributes
+    RNScalar T_contribution = 0;
+    RNScalar S_contribution = 0;
+    RNScalar I_contribution = 0;
+    if (TRANSMISSIVE_ILLUM && brdf->IsTransparent() && R_coeff < 1.0) {
+      T_contribution = MaxChannelVal((1.0 - R_coeff) * brdf->Transmission());
+    }
+    if (SPECULAR_ILLUM && (brdf->IsSpecular() || R_coeff > 0)) {
+      S_contribution = MaxChannelVal(brdf->Transmission()*R_coeff + brdf->Specular());
+    }
+    if (INDIRECT_ILLUM && (brdf->IsDiffuse())) {
+      I_contribution = MaxChannelVal(brdf->Diffuse());
+    }
+
+    // Split the ray budget of the pixel, shared by its anti-aliasing and depth
+    // of field samples, among bounces by expected contribution (zero lets
+    // each bounce pick its own number of rays)
+    int T_samples = 0;
+    int S_samples = 0;
+    int I_samples = 0;
+    if (RAY_BUDGET > 0) {
+      RNScalar total_contribution = T_contribution + S_contribution + I_contribution;
+      RNScalar budget = RAY_BUDGET / (RNScalar) (PIXEL_SAMPLES * DOF_TEST);
+      if (total_contribution > 0) {
+        T_samples = BudgetedSamples(budget, T_contribution, total_contribution);
+        S_samples = BudgetedSamples(budget, S_contribution, total_contribution);
+        I_samples = BudgetedSamples(budget, I_contribution, total_contribution);
       }
     }
+
+    const RNRgb color_before_specular = color;
+    if (TRANSMISSIVE_ILLUM && brdf->IsTransparent() && R_coeff < 1.0) {
+      // Compute contribution from transmission
+      TransmissiveIllumination(point, normal, color, brdf, view, cos_theta,
+        1.0 - R_coeff, T_samples);
+    }
     if (SPECULAR_ILLUM && (brdf->IsSpecular() || R_coeff > 0)) {
       // Compute contribution from transmission
       SpecularIllumination(point, normal, color, brdf, view, cos_theta,
-        R_coeff);
+        R_coeff, S_samples);
+    }
+    if (specular_color) {
+      *specular_color += color - color_before_specular;
     }
     if (INDIRECT_ILLUM && (brdf->IsDiffuse())) {
       // Compute contribution from indirect illumination
-      IndirectIllumination(point, normal, color, brdf, cos_theta, false);
+      IndirectIllumination(point, normal, color, brdf, cos_theta, false,
+        I_samples);
     }
     if (CAUSTIC_ILLUM && brdf->IsDiffuse()) {
       // Compute contribution from caustic illumination
@@ -229,5 +349,7 @@ void RayTrace(R3SceneElement* element, R3Point& point, R3Vector& normal,
       // Sample the global photon map directly for global illumination estimation
       EstimateGlobalIllumination(point, normal, color, brdf, view, cos_theta);
     }
+  } else if (direct_color) {
+    *direct_color += color - color_in;
   }
 }
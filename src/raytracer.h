@@ -14,17 +14,23 @@
 void DirectIllumination(R3Point& point, R3Vector& normal, const R3Point& eye,
   RNRgb& color, const R3Brdf *brdf, const RNScalar cos_theta, const bool inMonteCarlo);
 
-// Compute transmissive bounce on point
+// Compute transmissive bounce on point (num_samples < 1 scales the number of
+// rays with the contribution of the bounce)
 void TransmissiveIllumination(R3Point& point, R3Vector& normal, RNRgb& color,
-  const R3Brdf *brdf, R3Vector& view, RNScalar cos_theta, RNScalar T_coeff);
+  const R3Brdf *brdf, R3Vector& view, RNScalar cos_theta, RNScalar T_coeff,
+  int num_samples = 0);
 
-// Compute specular bounce on point
+// Compute specular bounce on point (num_samples < 1 scales the number of rays
+// with the contribution of the bounce)
 void SpecularIllumination(R3Point& point, R3Vector& normal, RNRgb& color,
-  const R3Brdf *brdf, R3Vector& view, RNScalar cos_theta, RNScalar R_coeff);
+  const R3Brdf *brdf, R3Vector& view, RNScalar cos_theta, RNScalar R_coeff,
+  int num_samples = 0);
 
-// Compute indirect illumination at point
+// Compute indirect illumination at point (num_samples < 1 scales the number of
+// rays with the contribution of the bounce)
 void IndirectIllumination(R3Point& point, R3Vector& normal, RNRgb& color,
-  const R3Brdf *brdf, const RNScalar cos_theta, const bool inMonteCarlo);
+  const R3Brdf *brdf, const RNScalar cos_theta, const bool inMonteCarlo,
+  int num_samples = 0);
 
 // Compute caustic radiance at point
 void CausticIllumination(R3Point& point, R3Vector& normal, RNRgb& color,
@@ -38,8 +44,15 @@ void EstimateGlobalIllumination(R3Point& point, R3Vector& normal, RNRgb& color,
 // Main Raytracing Method
 ////////////////////////////////////////////////////////////////////////
 
-// Sample Ray from eye
+// Parts of the radiance at the first hit that RayTrace can compute separately
+// (the direct part needs no photon maps; bounces may reach them at any depth)
+enum Trace_Part {ALL_PARTS, DIRECT_PART, BOUNCE_PART};
+
+// Sample Ray from eye (adding the ambient and direct part of color to
+// direct_color and its specular reflection and transmission to
+// specular_color if given), computing only part of the radiance
 void RayTrace(R3SceneElement* element, R3Point& point, R3Vector& normal,
-  R3Ray& ray, const R3Point& eye, RNRgb& color);
+  R3Ray& ray, const R3Point& eye, RNRgb& color, RNRgb *direct_color = NULL,
+  Trace_Part part = ALL_PARTS, RNRgb *specular_color = NULL);
 
 #endif
@@ -6,6 +6,11 @@
 #include "raytracer.h"
 #include "utils/io_utils.h"
 #include "utils/graphics_utils.h"
+#include "utils/denoise_utils.h"
+#include "utils/distribute_utils.h"
+#include "utils/trace_utils.h"
+#include "utils/perf_utils.h"
+#include "utils/memory_utils.h"
 #include "R3Graphics/R3Graphics.h"
 #include <vector>
 #include <iostream>
@@ -31,24 +36,102 @@ __thread unsigned long long int LOCAL_SPECULAR_RAY_COUNT = 0;
 __thread unsigned long long int LOCAL_INDIRECT_RAY_COUNT = 0;
 __thread unsigned long long int LOCAL_CAUSTIC_RAY_COUNT = 0;
 
-// Ray counts (global)
-static atomic_ullong ray_count (0);
-static atomic_ullong shadow_ray_count (0);
-static atomic_ullong monte_ray_count (0);
-static atomic_ullong transmissive_ray_count (0);
-static atomic_ullong specular_ray_count (0);
-static atomic_ullong indirect_ray_count (0);
-static atomic_ullong caustic_ray_count (0);
+// Photon map gathers (thread local, never cleared)
+__thread unsigned long long int LOCAL_GATHER_COUNT = 0;
+
+// Ray counts (global, indexed by Ray_Count_Type)
+static atomic_ullong ray_counts[NUM_RAY_COUNTS];
+
+// Names of the ray counts in traces (indexed by Ray_Count_Type)
+static const char *ray_count_names[NUM_RAY_COUNTS] = {
+  "screen_rays", "shadow_rays", "monte_carlo_rays", "transmissive_samples",
+  "specular_samples", "indirect_samples", "caustic_samples"
+};
+
+// Sample columns in each traced strip of a render
+static const int TRACE_STRIP_WIDTH = 64;
+
+// Per sample buffers of a render, indexed [x][y] at anti-aliased resolution
+// (the first hit buffers are only allocated for denoising or AOV output)
+struct SampleBuffers {
+  vector<vector<RNRgb> > color;      // Radiance
+  vector<vector<RNRgb> > direct;     // Ambient and direct part of radiance
+  vector<vector<RNRgb> > specular;   // Specular reflection and transmission at first hit
+  vector<vector<RNRgb> > albedo;     // Diffuse reflectance at first hit
+  vector<vector<R3Vector> > normal;  // Shading normal at first hit (facing eye)
+  vector<vector<RNScalar> > depth;   // Distance to first hit (0 if none)
+};
 
 ////////////////////////////////////////////////////////////////////////
 // Main Rendering Methods
 ////////////////////////////////////////////////////////////////////////
 
-// Threadable (parallelizable) ray tracing method
-static void Threadable_RayTracer(vector<vector<RNRgb> >& image_buffer, int width,
-  int height, const R3Point& eye, int id)
+// Read the rays traced by the calling thread since its counts were cleared
+static void ReadLocalRayCounts(unsigned long long int counts[NUM_RAY_COUNTS])
 {
+  counts[SCREEN_RAYS] = LOCAL_RAY_COUNT;
+  counts[SHADOW_RAYS] = LOCAL_SHADOW_RAY_COUNT;
+  counts[MONTE_RAYS] = LOCAL_MONTE_RAY_COUNT;
+  counts[TRANSMISSIVE_RAYS] = LOCAL_TRANSMISSIVE_RAY_COUNT;
+  counts[SPECULAR_RAYS] = LOCAL_SPECULAR_RAY_COUNT;
+  counts[INDIRECT_RAYS] = LOCAL_INDIRECT_RAY_COUNT;
+  counts[CAUSTIC_RAYS] = LOCAL_CAUSTIC_RAY_COUNT;
+}
+
+// Add the rays traced between two readings of the counts to args
+static void AddRayCountArgs(TraceArgs& args,
+  const unsigned long long int start[NUM_RAY_COUNTS],
+  const unsigned long long int end[NUM_RAY_COUNTS])
+{
+  for (int i = 0; i < NUM_RAY_COUNTS; i++) {
+    args.push_back(make_pair(string(ray_count_names[i]), (double) (end[i] - start[i])));
+  }
+}
+
+// Record a strip of columns rendered by the calling thread, with its rays
+static void RecordColumnStrip(int x, double start,
+  const unsigned long long int start_counts[NUM_RAY_COUNTS])
+{
+  unsigned long long int counts[NUM_RAY_COUNTS];
+  ReadLocalRayCounts(counts);
+  TraceArgs args;
+  AddRayCountArgs(args, start_counts, counts);
+  char label[64];
+  sprintf(label, "x %d-%d", x, x + TRACE_STRIP_WIDTH - 1);
+  RecordTraceEvent("render strip", "render", start, TraceTime(), args, label);
+}
+
+// Seed for the samples of column x of the region starting at row y (mixes the
+// bits so neighboring columns get unrelated random sequences, and -seed
+// changes all of them)
+static unsigned int RegionColumnSeed(int x, int y)
+{
+  unsigned int h = (unsigned int) x * 0x8DA6B343u ^ (unsigned int) y * 0xD8163841u ^
+    RANDOM_SEED * 0x9E3779B9u;
+  h ^= h >> 16;
+  h *= 0x7FEB352Du;
+  h ^= h >> 15;
+  return h;
+}
+
+// Threadable (parallelizable) ray tracing method, filling buffers with part
+// of the radiance of the samples of the region of the image starting at
+// (x0, y0) (the bounce part is added to the direct part already there).
+// Regions are seeded per column from their position (so they render the same
+// in any process) and do not print progress. With -seed, whole images are
+// seeded the same way
+static void Threadable_RayTracer(SampleBuffers& buffers, int x0, int y0,
+  const R3Point& eye, bool region, Trace_Part part, int id)
+{
+  static const char *perf_names[3] = {"render", "render direct", "render bounces"};
+  PerfScope perf((region) ? "render tiles" : perf_names[part], id);
+  unsigned long long int perf_counts[NUM_RAY_COUNTS];
+  ReadLocalRayCounts(perf_counts);
+  unsigned long long int perf_gathers = LOCAL_GATHER_COUNT;
   RNInitThreadRandomness();
+  const int width = buffers.color.size();
+  const int height = (width > 0) ? buffers.color[0].size() : 0;
+
   // Useful values
   R3SceneNode *node;
   R3SceneElement *element;
@@ -57,10 +140,25 @@ static void Threadable_RayTracer(vector<vector<RNRgb> >& image_buffer, int width
   R3Vector normal;
   RNScalar t;
   RNRgb color;
+  RNRgb direct;
+  RNRgb pixel;
+  vector<vector<RNRgb> >& image_buffer = buffers.color;
+  const bool first_hit_buffers = !buffers.albedo.empty() && part != BOUNCE_PART;
+  const bool specular_buffer = !buffers.specular.empty() && part != DIRECT_PART;
+
+  // The direct part is rendered alongside photon tracing, which prints its
+  // own progress
+  const bool show_progress = (id == 0 && !region && part != DIRECT_PART);
 
   // For progress bar printing
   int last_value = -1;
 
+  // For tracing strips of columns (regions are traced as a whole)
+  const bool trace_strips = Tracing() && !region;
+  int strip = -1;
+  double strip_start = 0;
+  unsigned long long int strip_counts[NUM_RAY_COUNTS];
+
   // World ray precomputation
   R3Camera camera = SCENE->Camera();
   R2Viewport viewport = SCENE->Viewport();
@@ -78,7 +176,7 @@ static void Threadable_RayTracer(vector<vector<RNRgb> >& image_buffer, int width
 
   // Draw intersection point and normal for world rays
   for (int i = 0; i < width; i++) {
-    if (id == 0 && !(i % 2)) {
+    if (show_progress && !(i % 2)) {
       double progress = ((double) bars_completed.load()) / width;
       int next_value = int(progress * 100.0);
       if (next_value != last_value) {
@@ -88,13 +186,21 @@ static void Threadable_RayTracer(vector<vector<RNRgb> >& image_buffer, int width
     }
     // Each thread does 1/THREADS work
     if (i % THREADS != id) continue;
+    if (region || RANDOM_SEED) RNReseedThreadRandomness(RegionColumnSeed(x0 + i, y0));
+    if (trace_strips && i / TRACE_STRIP_WIDTH != strip) {
+      if (strip >= 0) RecordColumnStrip(strip * TRACE_STRIP_WIDTH, strip_start, strip_counts);
+      strip = i / TRACE_STRIP_WIDTH;
+      strip_start = TraceTime();
+      ReadLocalRayCounts(strip_counts);
+    }
     for (int j = 0; j < height; j++) {
-      // Zero out buffer
-      image_buffer[i][j] = RNblack_rgb;
+      // Zero out pixel
+      pixel = RNblack_rgb;
+      int num_hits = 0;
 
       // World ray computation
-      RNScalar dx = (RNScalar) (2 * (i - viewport.XCenter())) / (RNScalar) viewport.Width();
-      RNScalar dy = (RNScalar) (2 * (j - viewport.YCenter())) / (RNScalar) viewport.Height();
+      RNScalar dx = (RNScalar) (2 * (x0 + i - viewport.XCenter())) / (RNScalar) viewport.Width();
+      RNScalar dy = (RNScalar) (2 * (y0 + j - viewport.YCenter())) / (RNScalar) viewport.Height();
       R3Point far_point = far_org + (far_right * dx) + (far_up * dy);
 
       // Depth of field loop
@@ -118,142 +224,505 @@ static void Threadable_RayTracer(vector<vector<RNRgb> >& image_buffer, int width
 
         if (SCENE->Intersects(ray, &node, &element, &shape, &point, &normal, &t)) {
           color = RNblack_rgb;
-          // Call Raytracer on ray
-          RayTrace(element, point, normal, ray, eye, color);
+          RNRgb *specular = (specular_buffer) ? &buffers.specular[i][j] : NULL;
+          if (!first_hit_buffers) {
+            // Call Raytracer on ray
+            RayTrace(element, point, normal, ray, eye, color, NULL, part, specular);
+          } else {
+            // Call Raytracer on ray, keeping the first hit for the denoiser
+            direct = RNblack_rgb;
+            RayTrace(element, point, normal, ray, eye, color, &direct, part, specular);
+            const R3Material *material = (element) ? element->Material() : &R3default_material;
+            const R3Brdf *brdf = (material) ? material->Brdf() : &R3default_brdf;
+            if (brdf) buffers.albedo[i][j] += brdf->Diffuse();
+            buffers.normal[i][j] += (normal.Dot(ray.Vector()) > 0) ? -normal : normal;
+            buffers.depth[i][j] += t;
+            buffers.direct[i][j] += direct;
+            num_hits++;
+          }
 
           // Set pixel color
-          image_buffer[i][j] += color;
+          pixel += color;
 
           // Update ray count
           LOCAL_RAY_COUNT++;
-        } else {
-          image_buffer[i][j] += SCENE->Background();
+        } else if (part != BOUNCE_PART) {
+          pixel += SCENE->Background();
+          if (first_hit_buffers) buffers.direct[i][j] += SCENE->Background();
         }
       }
 
       // Normalize
-      image_buffer[i][j] /= DOF_TEST;
+      pixel /= DOF_TEST;
+      if (part == BOUNCE_PART) image_buffer[i][j] += pixel;
+      else image_buffer[i][j] = pixel;
+      if (specular_buffer) buffers.specular[i][j] /= DOF_TEST;
+      if (first_hit_buffers) {
+        buffers.direct[i][j] /= DOF_TEST;
+        if (num_hits > 0) {
+          buffers.albedo[i][j] /= num_hits;
+          buffers.normal[i][j].Normalize();
+          buffers.depth[i][j] /= num_hits;
+        }
+      }
     }
 
     bars_completed += 1;
   }
-
-  // Update total ray counts (done at once for speed bc atomic operations are slow)
-  ray_count += LOCAL_RAY_COUNT;
-  shadow_ray_count += LOCAL_SHADOW_RAY_COUNT;
-  monte_ray_count += LOCAL_MONTE_RAY_COUNT;
-  transmissive_ray_count += LOCAL_TRANSMISSIVE_RAY_COUNT;
-  specular_ray_count += LOCAL_SPECULAR_RAY_COUNT;
-  indirect_ray_count += LOCAL_INDIRECT_RAY_COUNT;
-  caustic_ray_count += LOCAL_CAUSTIC_RAY_COUNT;
+  if (strip >= 0) RecordColumnStrip(strip * TRACE_STRIP_WIDTH, strip_start, strip_counts);
+
+  // Count the rays and gathers of this pass with its hardware events
+  unsigned long long int counts[NUM_RAY_COUNTS];
+  ReadLocalRayCounts(counts);
+  for (int i = 0; i < NUM_RAY_COUNTS; i++) perf.rays += counts[i] - perf_counts[i];
+  perf.gathers = LOCAL_GATHER_COUNT - perf_gathers;
+
+  // Update total ray counts (done at once for speed bc atomic operations are slow),
+  // then clear the local counts since the main thread renders again for each region
+  ray_counts[SCREEN_RAYS] += LOCAL_RAY_COUNT;
+  ray_counts[SHADOW_RAYS] += LOCAL_SHADOW_RAY_COUNT;
+  ray_counts[MONTE_RAYS] += LOCAL_MONTE_RAY_COUNT;
+  ray_counts[TRANSMISSIVE_RAYS] += LOCAL_TRANSMISSIVE_RAY_COUNT;
+  ray_counts[SPECULAR_RAYS] += LOCAL_SPECULAR_RAY_COUNT;
+  ray_counts[INDIRECT_RAYS] += LOCAL_INDIRECT_RAY_COUNT;
+  ray_counts[CAUSTIC_RAYS] += LOCAL_CAUSTIC_RAY_COUNT;
+  LOCAL_RAY_COUNT = 0;
+  LOCAL_SHADOW_RAY_COUNT = 0;
+  LOCAL_MONTE_RAY_COUNT = 0;
+  LOCAL_TRANSMISSIVE_RAY_COUNT = 0;
+  LOCAL_SPECULAR_RAY_COUNT = 0;
+  LOCAL_INDIRECT_RAY_COUNT = 0;
+  LOCAL_CAUSTIC_RAY_COUNT = 0;
 
   RNClearThreadRandomness();
 }
 
-// Multithreaded function that initializes image raytracing and handles
-// anti aliasing. Returns rendered scene as image.
-R2Image * RenderImage(int aa, int width, int height)
+// Average the (clamped) samples of an anti-aliased buffer into image
+static void DownSample(const vector<vector<RNRgb> >& buffer, R2Image *image, int aa)
 {
-  if (!SCENE) {
-    fprintf(stderr, "Renderer requires a scene\n");
-    return NULL;
+  int width = image->Width();
+  int height = image->Height();
+  int aa_factor = pow(2.0, aa);
+  RNScalar axis_scale = 1.0 / aa_factor;
+  RNScalar box_weight = 1.0 / aa_factor / aa_factor;
+  vector<vector<RNRgb> > down_sample_buffer(width,
+         vector<RNRgb> (height, RNblack_rgb));
+  for (int j = 0; j < height * aa_factor; j++) {
+    for (int i = 0; i < width * aa_factor; i++) {
+      int u = int(i * axis_scale);
+      int v = int(j * axis_scale);
+      RNRgb color = buffer[i][j];
+      ClampColor(color);
+      down_sample_buffer[u][v] += color;
+    }
+  }
+  for (int j = 0; j < height; j++) {
+    for (int i = 0; i < width; i++) {
+      RNRgb color = box_weight*down_sample_buffer[i][j];
+      image->SetPixelRGB(i, j, color);
+    }
   }
+}
 
-  // Start statistics
-  RNTime start_time;
-  start_time.Read();
+// Average the samples of an anti-aliased buffer into pixels, without clamping
+static void BoxFilter(const vector<vector<RNRgb> >& buffer, vector<vector<RNRgb> >& pixels,
+  int width, int height, int aa)
+{
+  int aa_factor = pow(2.0, aa);
+  RNScalar box_weight = 1.0 / aa_factor / aa_factor;
+  pixels.assign(width, vector<RNRgb> (height, RNblack_rgb));
+  for (int i = 0; i < width * aa_factor; i++) {
+    for (int j = 0; j < height * aa_factor; j++) {
+      pixels[i / aa_factor][j / aa_factor] += box_weight * buffer[i][j];
+    }
+  }
+}
 
-  // Allocate image
-  R2Image *image = new R2Image(width, height);
-  if (!image) {
-    fprintf(stderr, "Unable to allocate image\n");
-    return NULL;
+// Bytes of each sample of the buffers of a render (with the first hit buffers
+// if used, and at peak the copies made while finishing the image: the
+// indirect part, the denoiser's flattened buffers and the auxiliary images)
+static unsigned long long int BytesPerSample(bool first_hit_buffers, bool peak)
+{
+  unsigned long long int bytes = sizeof(RNRgb);
+  if (first_hit_buffers) {
+    bytes += 3 * sizeof(RNRgb) + sizeof(R3Vector) + sizeof(RNScalar);
+    if (peak) bytes += 3 * sizeof(RNRgb);
+    if (peak && DENOISE > 0) bytes += 4 * sizeof(RNRgb) + sizeof(R3Vector) + 4 * sizeof(RNScalar);
   }
+  return bytes;
+}
+
+unsigned long long int SampleBufferBytes(int aa, int width, int height, bool first_hit_buffers)
+{
+  int aa_factor = pow(2.0, aa);
+  unsigned long long int num_samples = (unsigned long long int) width*aa_factor * height*aa_factor;
+  return num_samples * BytesPerSample(first_hit_buffers, true);
+}
 
-  // Anti-aliasing
+// Allocate the sample buffers of an anti-aliased render (the first hit
+// buffers only if they will be used), tracking their memory
+static void AllocateSampleBuffers(SampleBuffers& buffers, int aa, int width, int height,
+  bool first_hit_buffers)
+{
   int aa_factor = pow(2.0, aa);
-  RNScalar axis_scale = 1.0 / aa_factor;
-  RNScalar box_weight = 1.0 / aa_factor / aa_factor;
   int scaled_width = width*aa_factor;
   int scaled_height = height*aa_factor;
-
-  if (VERBOSE) {
-    printf("Rendering image ...\n");
+  buffers.color.assign(scaled_width, vector<RNRgb> (scaled_height, RNblack_rgb));
+  if (first_hit_buffers) {
+    buffers.direct.assign(scaled_width, vector<RNRgb> (scaled_height, RNblack_rgb));
+    buffers.specular.assign(scaled_width, vector<RNRgb> (scaled_height, RNblack_rgb));
+    buffers.albedo.assign(scaled_width, vector<RNRgb> (scaled_height, RNblack_rgb));
+    buffers.normal.assign(scaled_width, vector<R3Vector> (scaled_height, R3zero_vector));
+    buffers.depth.assign(scaled_width, vector<RNScalar> (scaled_height, 0));
   }
+  TrackMemory(MEM_IMAGE_BUFFERS, (long long int) scaled_width * scaled_height *
+    BytesPerSample(first_hit_buffers, false));
+}
+
+// Free the sample buffers of a render
+static void FreeSampleBuffers(SampleBuffers& buffers)
+{
+  int scaled_width = buffers.color.size();
+  int scaled_height = (scaled_width > 0) ? buffers.color[0].size() : 0;
+  TrackMemory(MEM_IMAGE_BUFFERS, -(long long int) scaled_width * scaled_height *
+    BytesPerSample(!buffers.direct.empty(), false));
+  buffers = SampleBuffers();
+}
+
+// Render part of the radiance of every sample of buffers on all threads
+static void RenderSamples(SampleBuffers& buffers, Trace_Part part)
+{
+  static const char *pass_names[3] = {"render", "render direct", "render bounces"};
+  TraceScope trace(pass_names[part], "render");
+  bars_completed = 0;
 
   // Split off into child threads
-  vector<vector<RNRgb> > image_buffer(scaled_width,
-         vector<RNRgb> (scaled_height, RNblack_rgb));
   const R3Point& eye = SCENE->Camera().Origin();
   thread *children = new thread[THREADS - 1];
   for (int i = 0; i < THREADS - 1; ++i) {
-    children[i] = thread(Threadable_RayTracer, ref(image_buffer), scaled_width, scaled_height, eye, i+1);
+    children[i] = thread(Threadable_RayTracer, ref(buffers), 0, 0, eye, false, part, i+1);
   }
 
   // Use the main thread as well
-  Threadable_RayTracer(image_buffer, scaled_width, scaled_height, eye, 0);
+  Threadable_RayTracer(buffers, 0, 0, eye, false, part, 0);
 
   // Join children threads
   for (int i = 0; i < THREADS - 1; i++)
     children[i].join();
   delete [] children;
 
-  PrintProgress(1.0, PROGRESS_BAR_WIDTH);
-  cout << endl;
+  if (part != DIRECT_PART) {
+    PrintProgress(1.0, PROGRESS_BAR_WIDTH);
+    cout << endl;
+  }
+}
 
-  // Copy to image
-  vector<vector<RNRgb> > down_sample_buffer(width,
-         vector<RNRgb> (height, RNblack_rgb));
-  for (int j = 0; j < scaled_height; j++) {
-    for (int i = 0; i < scaled_width; i++) {
-      int u = int(i * axis_scale);
-      int v = int(j * axis_scale);
-      RNRgb color = image_buffer[i][j];
-      ClampColor(color);
-      down_sample_buffer[u][v] += color;
-    }
+// Denoise the rendered samples of buffers and filter them into an image (and
+// aovs and radiance if given)
+static R2Image *FinishImage(SampleBuffers& buffers, int aa, int width, int height,
+  RNScalar render_time, RenderAOVs *aovs, vector<vector<RNRgb> > *radiance)
+{
+  // Allocate image
+  R2Image *image = new R2Image(width, height);
+  if (!image) {
+    fprintf(stderr, "Unable to allocate image\n");
+    return NULL;
   }
-  for (int j = 0; j < height; j++) {
-    for (int i = 0; i < width; i++) {
-      RNRgb color = box_weight*down_sample_buffer[i][j];
-      image->SetPixelRGB(i, j, color);
+  vector<vector<RNRgb> >& image_buffer = buffers.color;
+  int scaled_width = image_buffer.size();
+  int scaled_height = (scaled_width > 0) ? image_buffer[0].size() : 0;
+
+  // Split radiance into direct, specular and indirect parts
+  vector<vector<RNRgb> > indirect_buffer;
+  if (!buffers.direct.empty()) {
+    indirect_buffer = image_buffer;
+    for (int i = 0; i < scaled_width; i++) {
+      for (int j = 0; j < scaled_height; j++) {
+        indirect_buffer[i][j] -= buffers.direct[i][j] + buffers.specular[i][j];
+      }
     }
   }
 
-  // Print statistics
-  if (VERBOSE) {
-    unsigned long long int total_ray_count = ray_count.load();
-    printf("Rendered image ...\n");
-    printf("  Time = %.2f seconds\n", start_time.Elapsed());
-    printf("  # Screen Rays = %llu\n", ray_count.load());
-    if (SHADOWS) {
-      printf("  # Shadow Rays = %llu\n", shadow_ray_count.load());
-      total_ray_count += shadow_ray_count.load();
+  // Denoise parts separately (indirect light is filtered without albedo, since
+  // it is mostly diffuse interreflection). The specular part is added back
+  // unfiltered, since the first hit normal and depth of a mirror or glass
+  // surface say nothing about the reflected or refracted scene
+  if (DENOISE > 0) {
+    TraceScope trace("denoise", "render");
+    PerfScope perf("denoise", 0);
+    RNTime denoise_time;
+    denoise_time.Read();
+    DenoiseBuffer(buffers.direct, buffers.albedo, buffers.normal, buffers.depth, false, DENOISE);
+    DenoiseBuffer(indirect_buffer, buffers.albedo, buffers.normal, buffers.depth, true, DENOISE);
+    for (int i = 0; i < scaled_width; i++) {
+      for (int j = 0; j < scaled_height; j++) {
+        image_buffer[i][j] = buffers.direct[i][j] + buffers.specular[i][j] + indirect_buffer[i][j];
+      }
     }
-    if (MONTE_CARLO) {
-      printf("  # Monte Carlo Rays = %llu\n", monte_ray_count.load());
-      total_ray_count += monte_ray_count.load();
+    if (VERBOSE) {
+      printf("Denoised image ...\n");
+      printf("  Time = %.2f seconds\n", denoise_time.Elapsed());
+      printf("  # Iterations = %d\n", DENOISE);
+      fflush(stdout);
     }
-    if (TRANSMISSIVE_ILLUM) {
-      printf("  # Transmissive Samples = %llu\n", transmissive_ray_count.load());
-      total_ray_count += transmissive_ray_count.load();
+  }
+
+  // Copy to image
+  DownSample(image_buffer, image, aa);
+  if (radiance) BoxFilter(image_buffer, *radiance, width, height, aa);
+
+  // Copy auxiliary buffers to images (the indirect image includes the
+  // specular part)
+  if (aovs) {
+    for (int i = 0; i < scaled_width; i++) {
+      for (int j = 0; j < scaled_height; j++) {
+        indirect_buffer[i][j] += buffers.specular[i][j];
+      }
     }
-    if (SPECULAR_ILLUM) {
-      printf("  # Specular Samples = %llu\n", specular_ray_count.load());
-      total_ray_count += specular_ray_count.load();
+    RNScalar max_depth = 0;
+    vector<vector<RNRgb> > normal_buffer(scaled_width, vector<RNRgb> (scaled_height, RNblack_rgb));
+    vector<vector<RNRgb> > depth_buffer(scaled_width, vector<RNRgb> (scaled_height, RNblack_rgb));
+    for (int i = 0; i < scaled_width; i++) {
+      for (int j = 0; j < scaled_height; j++) {
+        max_depth = max(max_depth, buffers.depth[i][j]);
+      }
     }
-    if (INDIRECT_ILLUM) {
-      printf("  # Indirect Samples = %llu\n", indirect_ray_count.load());
-      total_ray_count += indirect_ray_count.load();
+    for (int i = 0; i < scaled_width; i++) {
+      for (int j = 0; j < scaled_height; j++) {
+        const R3Vector& n = buffers.normal[i][j];
+        normal_buffer[i][j] = RNRgb(0.5 + 0.5*n.X(), 0.5 + 0.5*n.Y(), 0.5 + 0.5*n.Z());
+        RNScalar d = (max_depth > 0) ? buffers.depth[i][j] / max_depth : 0;
+        depth_buffer[i][j] = RNRgb(d, d, d);
+      }
     }
-    if (CAUSTIC_ILLUM) {
-      printf("  # Caustic Samples = %llu\n", caustic_ray_count.load());
-      total_ray_count += caustic_ray_count.load();
+    aovs->albedo = new R2Image(width, height);
+    aovs->normal = new R2Image(width, height);
+    aovs->depth = new R2Image(width, height);
+    aovs->direct = new R2Image(width, height);
+    aovs->indirect = new R2Image(width, height);
+    DownSample(buffers.albedo, aovs->albedo, aa);
+    DownSample(normal_buffer, aovs->normal, aa);
+    DownSample(depth_buffer, aovs->depth, aa);
+    DownSample(buffers.direct, aovs->direct, aa);
+    DownSample(indirect_buffer, aovs->indirect, aa);
+  }
+
+  // Print statistics
+  if (VERBOSE) {
+    unsigned long long int counts[NUM_RAY_COUNTS];
+    ReadRayCounts(counts);
+    PrintRenderStatistics(render_time, counts);
+  }
+
+  // Return image
+  return image;
+}
+
+// Multithreaded function that initializes image raytracing and handles
+// anti aliasing. Returns rendered scene as image.
+R2Image * RenderImage(int aa, int width, int height, RenderAOVs *aovs,
+  vector<vector<RNRgb> > *radiance)
+{
+  if (!SCENE) {
+    fprintf(stderr, "Renderer requires a scene\n");
+    return NULL;
+  }
+
+  // Start statistics
+  RNTime start_time;
+  start_time.Read();
+
+  if (VERBOSE) {
+    printf("Rendering image ...\n");
+  }
+
+  // Render samples
+  SampleBuffers buffers;
+  AllocateSampleBuffers(buffers, aa, width, height, DENOISE > 0 || aovs);
+  RenderSamples(buffers, ALL_PARTS);
+
+  // Return image
+  R2Image *image = FinishImage(buffers, aa, width, height, start_time.Elapsed(), aovs, radiance);
+  FreeSampleBuffers(buffers);
+  return image;
+}
+
+// Render the scene while task (e.g. photon tracing) runs on another thread:
+// the ambient and direct part of radiance is rendered alongside task and
+// written to preview_name if given, then the rest is added once task is done
+// (aovs and radiance are filled in as by RenderImage)
+R2Image *RenderPipelinedImage(int aa, int width, int height,
+  const function<void(void)>& task, const char *preview_name, RenderAOVs *aovs,
+  vector<vector<RNRgb> > *radiance)
+{
+  if (!SCENE) {
+    fprintf(stderr, "Renderer requires a scene\n");
+    return NULL;
+  }
+
+  // Start statistics
+  RNTime start_time;
+  start_time.Read();
+
+  // Render direct part while task runs
+  SampleBuffers buffers;
+  AllocateSampleBuffers(buffers, aa, width, height, DENOISE > 0 || aovs);
+  thread task_thread(task);
+  RenderSamples(buffers, DIRECT_PART);
+  RNScalar direct_time = start_time.Elapsed();
+
+  // Write preview
+  if (preview_name) {
+    R2Image preview(width, height);
+    DownSample(buffers.color, &preview, aa);
+    if (!WriteImage(&preview, preview_name)) {
+      fprintf(stderr, "Unable to write preview %s\n", preview_name);
     }
-    printf("Total Rays: %llu\n", total_ray_count);
+  }
+  if (VERBOSE) {
+    printf("Rendered direct light ...\n");
+    printf("  Time = %.2f seconds\n", direct_time);
+    fflush(stdout);
+  }
+
+  // Add the rest once task is done
+  task_thread.join();
+  if (VERBOSE) {
+    printf("Rendering image ...\n");
+    printf("  Waited = %.2f seconds\n", start_time.Elapsed() - direct_time);
     fflush(stdout);
   }
+  RenderSamples(buffers, BOUNCE_PART);
+
+  // Return image
+  R2Image *image = FinishImage(buffers, aa, width, height, start_time.Elapsed(), aovs, radiance);
+  FreeSampleBuffers(buffers);
+  return image;
+}
+
+// Render the scene as the coordinator of a distributed job, assembling the
+// tiles rendered by every process working on the job directory
+R2Image *RenderDistributedImage(int aa, int width, int height,
+  vector<vector<RNRgb> > *radiance)
+{
+  if (!SCENE) {
+    fprintf(stderr, "Renderer requires a scene\n");
+    return NULL;
+  }
+
+  // Start statistics
+  RNTime start_time;
+  start_time.Read();
+
+  // Allocate image
+  R2Image *image = new R2Image(width, height);
+  if (!image) {
+    fprintf(stderr, "Unable to allocate image\n");
+    return NULL;
+  }
+
+  if (VERBOSE) {
+    printf("Rendering image in tiles ...\n");
+  }
+
+  // Render tiles alongside the workers, then gather all of them
+  int aa_factor = pow(2.0, aa);
+  vector<vector<RNRgb> > image_buffer;
+  unsigned long long int counts[NUM_RAY_COUNTS];
+  if (!RenderJobTiles(image_buffer, counts, width*aa_factor, height*aa_factor)) {
+    delete image;
+    return NULL;
+  }
+  RNScalar render_time = start_time.Elapsed();
+
+  // Copy to image
+  DownSample(image_buffer, image, aa);
+  if (radiance) BoxFilter(image_buffer, *radiance, width, height, aa);
+
+  // Print statistics (summed over all tiles)
+  if (VERBOSE) {
+    PrintRenderStatistics(render_time, counts);
+  }
 
   // Return image
   return image;
 }
+
+// Render samples [x0, x1) x [y0, y1) of the anti-aliased image into buffer
+// (indexed [x - x0][y - y0]) on all threads, seeding each column from its
+// position so that a region renders the same in any process
+void RenderRegion(vector<vector<RNRgb> >& buffer, int x0, int y0, int x1, int y1)
+{
+  TraceScope trace("render tile", "render");
+  unsigned long long int start_counts[NUM_RAY_COUNTS];
+  ReadRayCounts(start_counts);
+  // Allocate samples of region
+  SampleBuffers buffers;
+  buffers.color.assign(x1 - x0, vector<RNRgb> (y1 - y0, RNblack_rgb));
+
+  // Split off into child threads
+  const R3Point& eye = SCENE->Camera().Origin();
+  thread *children = new thread[THREADS - 1];
+  for (int i = 0; i < THREADS - 1; ++i) {
+    children[i] = thread(Threadable_RayTracer, ref(buffers), x0, y0, eye, true, ALL_PARTS, i+1);
+  }
+  Threadable_RayTracer(buffers, x0, y0, eye, true, ALL_PARTS, 0);
+  for (int i = 0; i < THREADS - 1; i++)
+    children[i].join();
+  delete [] children;
+
+  buffer.swap(buffers.color);
+
+  // Trace the position and rays of the tile
+  if (Tracing()) {
+    unsigned long long int counts[NUM_RAY_COUNTS];
+    ReadRayCounts(counts);
+    char label[64];
+    sprintf(label, "x %d-%d, y %d-%d", x0, x1 - 1, y0, y1 - 1);
+    trace.label = label;
+    AddRayCountArgs(trace.args, start_counts, counts);
+  }
+}
+
+// Read the number of rays of each type traced by renders so far
+void ReadRayCounts(unsigned long long int counts[NUM_RAY_COUNTS])
+{
+  for (int i = 0; i < NUM_RAY_COUNTS; i++) {
+    counts[i] = ray_counts[i].load();
+  }
+}
+
+// Print the time taken and rays traced by a render
+void PrintRenderStatistics(RNScalar time, const unsigned long long int counts[NUM_RAY_COUNTS])
+{
+  unsigned long long int total_ray_count = counts[SCREEN_RAYS];
+  printf("Rendered image ...\n");
+  printf("  Time = %.2f seconds\n", time);
+  printf("  # Screen Rays = %llu\n", counts[SCREEN_RAYS]);
+  if (SHADOWS) {
+    printf("  # Shadow Rays = %llu\n", counts[SHADOW_RAYS]);
+    total_ray_count += counts[SHADOW_RAYS];
+  }
+  if (MONTE_CARLO) {
+    printf("  # Monte Carlo Rays = %llu\n", counts[MONTE_RAYS]);
+    total_ray_count += counts[MONTE_RAYS];
+  }
+  if (TRANSMISSIVE_ILLUM) {
+    printf("  # Transmissive Samples = %llu\n", counts[TRANSMISSIVE_RAYS]);
+    total_ray_count += counts[TRANSMISSIVE_RAYS];
+  }
+  if (SPECULAR_ILLUM) {
+    printf("  # Specular Samples = %llu\n", counts[SPECULAR_RAYS]);
+    total_ray_count += counts[SPECULAR_RAYS];
+  }
+  if (INDIRECT_ILLUM) {
+    printf("  # Indirect Samples = %llu\n", counts[INDIRECT_RAYS]);
+    total_ray_count += counts[INDIRECT_RAYS];
+  }
+  if (CAUSTIC_ILLUM) {
+    printf("  # Caustic Samples = %llu\n", counts[CAUSTIC_RAYS]);
+    total_ray_count += counts[CAUSTIC_RAYS];
+  }
+  printf("Total Rays: %llu\n", total_ray_count);
+  fflush(stdout);
+}
@@ -6,6 +6,8 @@
 
 #include "R3Graphics/R3Graphics.h"
 #include <mutex>
+#include <vector>
+#include <functional>
 
 using namespace std;
 
@@ -18,6 +20,13 @@ struct Photon {
   R3Point position; // Position
   unsigned char rgbe[4];     // compressed RGB values
   unsigned short direction;  // compressed REFLECTION direction
+  unsigned char bounce;      // bounces before storage (0 if direct, capped at 255)
+};
+
+// Shadow photon data structure (marks whether a light reaches a point)
+struct ShadowPhoton {
+  R3Point position; // Position
+  bool shadow;      // True if occluded from the light, false if directly lit
 };
 
 ////////////////////////////////////////////////////////////////////////
@@ -44,10 +53,20 @@ extern bool SHADOWS;
 extern bool SOFT_SHADOWS;
 extern int LIGHT_TEST;
 extern int SHADOW_TEST;
+extern int LIGHT_TREE_SAMPLES;
+extern bool OCCLUDER_CACHE;
+extern int VISIBILITY_GRID;
+extern bool MIS;
+extern bool SOLID_ANGLE_SAMPLING;
+extern bool CONCENTRIC_DISK_SAMPLING;
 
 extern bool MONTE_CARLO;
 extern int MAX_MONTE_DEPTH;
 extern RNScalar PROB_ABSORB;
+extern bool RUSSIAN_ROULETTE;
+extern int RR_MIN_DEPTH;
+extern int RAY_BUDGET;
+extern int PIXEL_SAMPLES;
 extern bool RECURSIVE_SHADOWS;
 extern bool DISTRIB_TRANSMISSIVE;
 extern int TRANSMISSIVE_TEST;
@@ -59,6 +78,9 @@ extern int DOF_TEST;
 extern RNScalar FOCUS_DEPTH;
 extern RNScalar APERTURE_RADIUS;
 
+extern int DENOISE;
+extern bool WRITE_AOVS;
+
 
 enum Photon_Type {GLOBAL, CAUSTIC};
 enum Filter_Type {DISK, CONE, GAUSS};
@@ -67,8 +89,13 @@ extern int GLOBAL_PHOTON_COUNT;
 extern int CAUSTIC_PHOTON_COUNT;
 extern const int SIZE_LOCAL_PHOTON_STORAGE;
 extern int MAX_PHOTON_DEPTH;
+extern bool QMC_PHOTONS;
+extern int IMPORTON_COUNT;
 
 extern int INDIRECT_TEST;
+extern bool GUIDED_GATHER;
+extern RNScalar GUIDE_COSINE_PROB;
+extern int GUIDE_ESTIMATE_SIZE;
 extern int GLOBAL_ESTIMATE_SIZE;
 extern RNScalar GLOBAL_ESTIMATE_DIST;
 extern Filter_Type GLOBAL_FILTER;
@@ -85,10 +112,29 @@ extern R3Kdtree<Photon *> *CAUSTIC_PMAP;
 extern RNArray <Photon *> GLOBAL_PHOTONS;
 extern RNArray <Photon *> CAUSTIC_PHOTONS;
 
+extern int SHADOW_PHOTON_COUNT;
+extern int SHADOW_ESTIMATE_SIZE;
+extern RNScalar SHADOW_ESTIMATE_DIST;
+extern vector<R3Kdtree<ShadowPhoton *> *> SHADOW_PMAPS;
+extern RNArray <ShadowPhoton *> SHADOW_PHOTONS;
+
 extern RNScalar PHOTON_X_LOOKUP[65536];
 extern RNScalar PHOTON_Y_LOOKUP[65536];
 extern RNScalar PHOTON_Z_LOOKUP[65536];
 
+extern char *JOB_DIR;
+extern int JOB_WORKERS;
+extern bool JOB_WORKER;
+extern char *CAMERA_PATH;
+extern bool PIPELINE;
+extern char *TRACE_FILE;
+extern unsigned int RANDOM_SEED;
+extern bool MICROBENCH;
+extern bool PERF_COUNTERS;
+extern int MEM_BUDGET;
+extern char *SERVER_SOCKET;
+extern int SERVER_CACHE_SIZE;
+
 extern R3Scene* SCENE;
 extern RNScalar SCENE_RADIUS;
 extern RNRgb SCENE_AMBIENT;
@@ -108,11 +154,65 @@ __thread extern unsigned long long int LOCAL_TRANSMISSIVE_RAY_COUNT;
 __thread extern unsigned long long int LOCAL_SPECULAR_RAY_COUNT;
 __thread extern unsigned long long int LOCAL_INDIRECT_RAY_COUNT;
 __thread extern unsigned long long int LOCAL_CAUSTIC_RAY_COUNT;
+__thread extern unsigned long long int LOCAL_GATHER_COUNT;
 
 ////////////////////////////////////////////////////////////////////////
 // Main Rendering Method
 ////////////////////////////////////////////////////////////////////////
 
-R2Image *RenderImage(int aa, int width, int height);
+// Auxiliary images of a render, from the first hit of each pixel
+struct RenderAOVs {
+  R2Image *albedo;   // Diffuse reflectance
+  R2Image *normal;   // Shading normal (mapped from [-1, 1] to [0, 1])
+  R2Image *depth;    // Distance to hit (the farthest hit is white)
+  R2Image *direct;   // Ambient and direct illumination
+  R2Image *indirect; // Everything else (bounces, caustics, photon estimates)
+};
+
+// Render the scene (and fill in aovs if given, which the caller deletes, and
+// radiance if given with the unclamped average of each pixel's samples)
+R2Image *RenderImage(int aa, int width, int height, RenderAOVs *aovs = NULL,
+  vector<vector<RNRgb> > *radiance = NULL);
+
+// Render the scene while task (e.g. photon tracing) runs on another thread:
+// the ambient and direct part of radiance is rendered alongside task and
+// written to preview_name if given, then the rest is added once task is done
+// (aovs and radiance are filled in as by RenderImage)
+R2Image *RenderPipelinedImage(int aa, int width, int height,
+  const function<void(void)>& task, const char *preview_name = NULL,
+  RenderAOVs *aovs = NULL, vector<vector<RNRgb> > *radiance = NULL);
+
+// Render the scene as the coordinator of a distributed job, assembling the
+// tiles rendered by every process working on the job directory (and radiance
+// is filled in as by RenderImage)
+R2Image *RenderDistributedImage(int aa, int width, int height,
+  vector<vector<RNRgb> > *radiance = NULL);
+
+// Bytes of the sample buffers of a render at their peak (with the first hit
+// buffers if used, and the copies made while finishing the image)
+unsigned long long int SampleBufferBytes(int aa, int width, int height, bool first_hit_buffers);
+
+// Render samples [x0, x1) x [y0, y1) of the anti-aliased image into buffer
+// (indexed [x - x0][y - y0]) on all threads, seeding each column from its
+// position so that a region renders the same in any process
+void RenderRegion(vector<vector<RNRgb> >& buffer, int x0, int y0, int x1, int y1);
+
+// Types of rays counted by renders
+enum Ray_Count_Type {
+  SCREEN_RAYS,
+  SHADOW_RAYS,
+  MONTE_RAYS,
+  TRANSMISSIVE_RAYS,
+  SPECULAR_RAYS,
+  INDIRECT_RAYS,
+  CAUSTIC_RAYS,
+  NUM_RAY_COUNTS
+};
+
+// Read the number of rays of each type traced by renders so far
+void ReadRayCounts(unsigned long long int counts[NUM_RAY_COUNTS]);
+
+// Print the time taken and rays traced by a render
+void PrintRenderStatistics(RNScalar time, const unsigned long long int counts[NUM_RAY_COUNTS]);
 
 #endif
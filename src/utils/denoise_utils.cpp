@@ -0,0 +1,275 @@
+////////////////////////////////////////////////////////////////////////
+// Directives
+////////////////////////////////////////////////////////////////////////
+
+#include "denoise_utils.h"
+#include "../render.h"
+#include "../R3Graphics/R3Graphics.h"
+#include <vector>
+#include <thread>
+#include <functional>
+#include <algorithm>
+
+using namespace std;
+
+////////////////////////////////////////////////////////////////////////
+// Denoiser Data
+////////////////////////////////////////////////////////////////////////
+
+// Edge stopping strengths (normal is an exponent on the cosine between normals,
+// depth and luminance are multiples of the expected change, and albedo is a
+// distance in RGB)
+static const RNScalar SIGMA_NORMAL = 128.0;
+static const RNScalar SIGMA_DEPTH = 1.0;
+static const RNScalar SIGMA_LUMINANCE = 4.0;
+static const RNScalar SIGMA_ALBEDO = 0.1;
+
+// Albedo below which radiance is not demodulated
+static const RNScalar MIN_DEMODULATION_ALBEDO = 0.01;
+
+// Weights of the B3 spline kernel, by distance from center (in steps)
+static const RNScalar ATROUS_KERNEL[3] = {3.0 / 8.0, 1.0 / 4.0, 1.0 / 16.0};
+
+// Flattened buffers (pixel x, y at x * height + y) shared by filter passes
+struct DenoiseState {
+  int width, height;
+  vector<RNRgb> albedo;
+  vector<R3Vector> normal;
+  vector<RNScalar> depth;
+  vector<RNScalar> depth_gradient;  // Change in depth per pixel
+  vector<RNRgb> color[2];           // Ping-pong radiance
+  vector<RNScalar> variance[2];     // Ping-pong luminance variance
+};
+
+////////////////////////////////////////////////////////////////////////
+// Edge Stopping
+////////////////////////////////////////////////////////////////////////
+
+// Luminance of a color
+static inline RNScalar Luminance(const RNRgb& color)
+{
+  return 0.2126 * color.R() + 0.7152 * color.G() + 0.0722 * color.B();
+}
+
+// Weight of pixel q in the estimate of pixel p from their first hits (offset
+// is the distance between them in pixels)
+static inline RNScalar GeometryWeight(const DenoiseState& s, int p, int q, RNScalar offset)
+{
+  if (s.depth[q] <= 0) return 0;
+
+  // Normals
+  RNScalar cos_n = s.normal[p].Dot(s.normal[q]);
+  if (cos_n <= 0) return 0;
+  RNScalar w = pow(cos_n, SIGMA_NORMAL);
+
+  // Depth (against the change expected along the surface over the offset)
+  RNScalar expected = SIGMA_DEPTH * s.depth_gradient[p] * offset + 1.0E-3 * s.depth[p];
+  w *= exp(-abs(s.depth[p] - s.depth[q]) / expected);
+
+  // Albedo
+  RNRgb da = s.albedo[p] - s.albedo[q];
+  RNScalar da2 = da.R()*da.R() + da.G()*da.G() + da.B()*da.B();
+  w *= exp(-da2 / (SIGMA_ALBEDO * SIGMA_ALBEDO));
+  return w;
+}
+
+////////////////////////////////////////////////////////////////////////
+// Filter Passes
+////////////////////////////////////////////////////////////////////////
+
+// Estimate the change in depth per pixel as the sum over both axes of the
+// smaller one sided difference, so steps at silhouettes are ignored (every
+// THREADS-th column)
+static void Threadable_EstimateDepthGradient(DenoiseState& s, int src, int step, int id)
+{
+  const int height = s.height;
+  for (int x = id; x < s.width; x += THREADS) {
+    for (int y = 0; y < height; y++) {
+      int p = x * height + y;
+      if (s.depth[p] <= 0) continue;
+
+      RNScalar gradient = 0;
+      for (int axis = 0; axis < 2; axis++) {
+        bool found = false;
+        RNScalar change = 0;
+        for (int d = -1; d <= 1; d += 2) {
+          int qx = (axis == 0) ? x + d : x;
+          int qy = (axis == 1) ? y + d : y;
+          if (qx < 0 || qx >= s.width || qy < 0 || qy >= height) continue;
+          int q = qx * height + qy;
+          if (s.depth[q] <= 0) continue;
+          RNScalar difference = abs(s.depth[q] - s.depth[p]);
+          if (!found || difference < change) change = difference;
+          found = true;
+        }
+        gradient += change;
+      }
+      s.depth_gradient[p] = gradient;
+    }
+  }
+}
+
+// Estimate the luminance variance of each pixel of buffer [src] from its 5x5
+// neighborhood on the same surface (every THREADS-th column)
+static void Threadable_EstimateVariance(DenoiseState& s, int src, int step, int id)
+{
+  const int height = s.height;
+  for (int x = id; x < s.width; x += THREADS) {
+    for (int y = 0; y < height; y++) {
+      int p = x * height + y;
+      if (s.depth[p] <= 0) continue;
+
+      // Weighted first and second moments of luminance
+      RNScalar sum_w = 0, sum_l = 0, sum_l2 = 0;
+      for (int dx = -2; dx <= 2; dx++) {
+        for (int dy = -2; dy <= 2; dy++) {
+          int qx = x + dx;
+          int qy = y + dy;
+          if (qx < 0 || qx >= s.width || qy < 0 || qy >= height) continue;
+          int q = qx * height + qy;
+          RNScalar w = GeometryWeight(s, p, q, sqrt((RNScalar) (dx*dx + dy*dy)));
+          RNScalar l = Luminance(s.color[src][q]);
+          sum_w += w;
+          sum_l += w * l;
+          sum_l2 += w * l * l;
+        }
+      }
+      if (sum_w <= 0) continue;
+      RNScalar mean = sum_l / sum_w;
+      s.variance[src][p] = max(0.0, sum_l2 / sum_w - mean * mean);
+    }
+  }
+}
+
+// One a-trous pass with the given step, reading buffers [src] and writing
+// buffers [1 - src] (every THREADS-th column)
+static void Threadable_AtrousPass(DenoiseState& s, int src, int step, int id)
+{
+  const int height = s.height;
+  const vector<RNRgb>& color_in = s.color[src];
+  const vector<RNScalar>& variance_in = s.variance[src];
+  vector<RNRgb>& color_out = s.color[1 - src];
+  vector<RNScalar>& variance_out = s.variance[1 - src];
+
+  for (int x = id; x < s.width; x += THREADS) {
+    for (int y = 0; y < height; y++) {
+      int p = x * height + y;
+      if (s.depth[p] <= 0) {
+        color_out[p] = color_in[p];
+        variance_out[p] = variance_in[p];
+        continue;
+      }
+
+      // Luminance differences are judged against the noise at p
+      RNScalar l_p = Luminance(color_in[p]);
+      RNScalar sigma_l = SIGMA_LUMINANCE * sqrt(variance_in[p]) + 1.0E-6;
+
+      RNRgb sum_c = RNblack_rgb;
+      RNScalar sum_v = 0;
+      RNScalar sum_w = 0;
+      for (int dx = -2; dx <= 2; dx++) {
+        int qx = x + dx * step;
+        if (qx < 0 || qx >= s.width) continue;
+        for (int dy = -2; dy <= 2; dy++) {
+          int qy = y + dy * step;
+          if (qy < 0 || qy >= height) continue;
+          int q = qx * height + qy;
+
+          RNScalar w = ATROUS_KERNEL[abs(dx)] * ATROUS_KERNEL[abs(dy)];
+          if (q != p) {
+            RNScalar offset = step * sqrt((RNScalar) (dx*dx + dy*dy));
+            w *= GeometryWeight(s, p, q, offset);
+            if (w <= 0) continue;
+            w *= exp(-abs(l_p - Luminance(color_in[q])) / sigma_l);
+          }
+          sum_c += w * color_in[q];
+          sum_v += w * w * variance_in[q];
+          sum_w += w;
+        }
+      }
+      color_out[p] = sum_c / sum_w;
+      variance_out[p] = sum_v / (sum_w * sum_w);
+    }
+  }
+}
+
+////////////////////////////////////////////////////////////////////////
+// Denoising Utils
+////////////////////////////////////////////////////////////////////////
+
+// Filter pass run on every thread
+typedef void (*DenoisePass)(DenoiseState& s, int src, int step, int id);
+
+// Run pass on every thread
+static void RunDenoisePass(DenoisePass pass, DenoiseState& s, int src, int step)
+{
+  thread *children = new thread[THREADS - 1];
+  for (int i = 0; i < THREADS - 1; ++i) {
+    children[i] = thread(pass, ref(s), src, step, i+1);
+  }
+  pass(s, src, step, 0);
+  for (int i = 0; i < THREADS - 1; i++)
+    children[i].join();
+  delete [] children;
+}
+
+// Denoise a buffer of radiance (indexed [x][y]) with an edge-avoiding a-trous
+// wavelet filter (Dammertz et al. 2010) guided by the albedo, normal and depth
+// of the first hit at each pixel (depth 0 marks pixels that hit nothing, which
+// are left alone). Luminance differences are judged against a running estimate
+// of the local noise level as in SVGF (Schied et al. 2017). If demodulate is
+// set, radiance is divided by albedo while filtering so texture is kept
+void DenoiseBuffer(vector<vector<RNRgb> >& color, const vector<vector<RNRgb> >& albedo,
+  const vector<vector<R3Vector> >& normal, const vector<vector<RNScalar> >& depth,
+  bool demodulate, int iterations)
+{
+  if (color.empty() || iterations < 1) return;
+
+  // Flatten buffers, dividing out albedo if requested
+  DenoiseState s;
+  s.width = color.size();
+  s.height = color[0].size();
+  int num_pixels = s.width * s.height;
+  s.albedo.resize(num_pixels);
+  s.normal.resize(num_pixels);
+  s.depth.resize(num_pixels);
+  s.depth_gradient.assign(num_pixels, 0);
+  s.color[0].resize(num_pixels);
+  s.color[1].resize(num_pixels);
+  s.variance[0].assign(num_pixels, 0);
+  s.variance[1].assign(num_pixels, 0);
+  vector<RNRgb> modulation(num_pixels, RNwhite_rgb);
+  for (int x = 0; x < s.width; x++) {
+    for (int y = 0; y < s.height; y++) {
+      int p = x * s.height + y;
+      s.albedo[p] = albedo[x][y];
+      s.normal[p] = normal[x][y];
+      s.depth[p] = depth[x][y];
+      if (demodulate) {
+        for (int c = 0; c < 3; c++) {
+          if (albedo[x][y][c] > MIN_DEMODULATION_ALBEDO) modulation[p][c] = albedo[x][y][c];
+        }
+      }
+      s.color[0][p] = color[x][y];
+      for (int c = 0; c < 3; c++) s.color[0][p][c] /= modulation[p][c];
+    }
+  }
+
+  // Estimate noise, then filter with the kernel spread further apart each pass
+  RunDenoisePass(Threadable_EstimateDepthGradient, s, 0, 1);
+  RunDenoisePass(Threadable_EstimateVariance, s, 0, 1);
+  int src = 0;
+  for (int i = 0; i < iterations; i++) {
+    int step = 1 << i;
+    RunDenoisePass(Threadable_AtrousPass, s, src, step);
+    src = 1 - src;
+  }
+
+  // Copy back, restoring albedo
+  for (int x = 0; x < s.width; x++) {
+    for (int y = 0; y < s.height; y++) {
+      int p = x * s.height + y;
+      color[x][y] = s.color[src][p] * modulation[p];
+    }
+  }
+}
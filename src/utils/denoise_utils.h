@@ -0,0 +1,27 @@
+////////////////////////////////////////////////////////////////////////
+// Directives
+////////////////////////////////////////////////////////////////////////
+
+#ifndef DENOISE_INC
+#define DENOISE_INC
+
+#include "../R3Graphics/R3Graphics.h"
+#include <vector>
+
+using namespace std;
+
+////////////////////////////////////////////////////////////////////////
+// Denoising Utils
+////////////////////////////////////////////////////////////////////////
+
+// Denoise a buffer of radiance (indexed [x][y]) with an edge-avoiding a-trous
+// wavelet filter (Dammertz et al. 2010) guided by the albedo, normal and depth
+// of the first hit at each pixel (depth 0 marks pixels that hit nothing, which
+// are left alone). Luminance differences are judged against a running estimate
+// of the local noise level as in SVGF (Schied et al. 2017). If demodulate is
+// set, radiance is divided by albedo while filtering so texture is kept
+void DenoiseBuffer(vector<vector<RNRgb> >& color, const vector<vector<RNRgb> >& albedo,
+  const vector<vector<R3Vector> >& normal, const vector<vector<RNScalar> >& depth,
+  bool demodulate, int iterations);
+
+#endif
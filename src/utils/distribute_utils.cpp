@@ -0,0 +1,514 @@
+////////////////////////////////////////////////////////////////////////
+// Directives
+////////////////////////////////////////////////////////////////////////
+
+#include "distribute_utils.h"
+#include "io_utils.h"
+#include "../R3Graphics/R3Graphics.h"
+#include "../render.h"
+#include <vector>
+#include <string>
+#include <cstring>
+#include <cerrno>
+#include <csignal>
+#include <cstdlib>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+using namespace std;
+
+////////////////////////////////////////////////////////////////////////
+// Job Layout
+////////////////////////////////////////////////////////////////////////
+
+// A job directory holds the photons published by the coordinator and, for
+// each tile of the anti-aliased image, a claim file (created exclusively by
+// the process that renders the tile) and the rendered samples of the tile.
+// Files are written under a temporary name and renamed into place, so a
+// reader never sees a partial file
+
+// Width and height of a tile (in anti-aliased samples)
+static const int JOB_TILE_SIZE = 64;
+
+// Tag at the start of the photon file
+static const unsigned int JOB_PHOTONS_MAGIC = 0x504A4D50;
+
+// Poll interval while waiting on other processes (in microseconds)
+static const int JOB_POLL_INTERVAL = 100000;
+
+// A tile that has not arrived is rendered again by the coordinator once no
+// tile has arrived for this long (in seconds), or for several times the
+// longest tile the coordinator rendered itself
+static const RNScalar JOB_MIN_STALL_TIME = 30.0;
+static const RNScalar JOB_STALL_FACTOR = 8.0;
+
+// A worker gives up on a job whose photons have not been published after this
+// long (in seconds)
+static const RNScalar JOB_PHOTONS_TIMEOUT = 3600.0;
+
+// Processes spawned by this one
+static vector<pid_t> job_workers;
+
+// Path of a file in the job directory
+static string JobPath(const char *name)
+{
+  return string(JOB_DIR) + "/" + name;
+}
+
+// Path of a file of tile (tx, ty) with the given extension
+static string TilePath(int tx, int ty, const char *extension)
+{
+  char name[64];
+  sprintf(name, "tile_%d_%d.%s", tx, ty, extension);
+  return JobPath(name);
+}
+
+// Path of a temporary file for the samples of tile (tx, ty), unique to this
+// process among those sharing the job directory (possibly from other hosts)
+static string TileTempPath(int tx, int ty)
+{
+  char host[256];
+  if (gethostname(host, sizeof(host)) != 0) strcpy(host, "localhost");
+  host[sizeof(host) - 1] = '\0';
+  return TilePath(tx, ty, "rgb") + "." + host + "." + to_string((int) getpid()) + ".tmp";
+}
+
+// Check whether a file exists
+static bool FileExists(const string& path)
+{
+  return access(path.c_str(), F_OK) == 0;
+}
+
+// Create a directory and its missing parents (as mkdir -p does)
+static int MakeDirectories(const string& path)
+{
+  for (size_t end = path.find('/', 1); ; end = path.find('/', end + 1)) {
+    string parent = path.substr(0, end);
+    if (mkdir(parent.c_str(), 0755) != 0 && errno != EEXIST) return 0;
+    if (end == string::npos) break;
+  }
+
+  // Check that the path is a directory
+  struct stat info;
+  return (stat(path.c_str(), &info) == 0) && S_ISDIR(info.st_mode);
+}
+
+////////////////////////////////////////////////////////////////////////
+// Job Setup
+////////////////////////////////////////////////////////////////////////
+
+// Create the job directory, removing photons and tiles left by an earlier job
+int PrepareJob(void)
+{
+  // Create directory
+  if (!MakeDirectories(JOB_DIR)) {
+    fprintf(stderr, "Unable to create job directory %s: %s\n", JOB_DIR, strerror(errno));
+    return 0;
+  }
+  DIR *dir = opendir(JOB_DIR);
+  if (!dir) {
+    fprintf(stderr, "Unable to open job directory %s\n", JOB_DIR);
+    return 0;
+  }
+
+  // Remove files of earlier jobs
+  struct dirent *entry;
+  while ((entry = readdir(dir))) {
+    if (!strncmp(entry->d_name, "tile_", 5) || !strncmp(entry->d_name, "photons", 7)) {
+      unlink(JobPath(entry->d_name).c_str());
+    }
+  }
+  closedir(dir);
+
+  // Return success
+  return 1;
+}
+
+// Start JOB_WORKERS copies of this program working on the job (with the same
+// arguments, except that -distribute becomes -worker and -v is dropped)
+int SpawnJobWorkers(int argc, char **argv)
+{
+  // Build worker arguments
+  vector<char *> args;
+  char worker_flag[] = "-worker";
+  args.push_back(argv[0]);
+  for (int i = 1; i < argc; i++) {
+    if (!strcmp(argv[i], "-distribute") && i + 2 < argc) {
+      args.push_back(worker_flag);
+      args.push_back(argv[i + 1]);
+      i += 2;
+    } else if (strcmp(argv[i], "-v")) {
+      args.push_back(argv[i]);
+    }
+  }
+  args.push_back(NULL);
+
+  // Stop the workers if this process exits before waiting for them
+  static bool kill_at_exit = false;
+  if (!kill_at_exit) {
+    atexit(KillJobWorkers);
+    kill_at_exit = true;
+  }
+
+  // Spawn workers
+  for (int i = 0; i < JOB_WORKERS; i++) {
+    pid_t pid = fork();
+    if (pid < 0) {
+      fprintf(stderr, "Unable to spawn worker %d\n", i);
+      return 0;
+    } else if (pid == 0) {
+      execv("/proc/self/exe", &args[0]);
+      execvp(argv[0], &args[0]);
+      fprintf(stderr, "Unable to start worker %s\n", argv[0]);
+      _exit(-1);
+    }
+    job_workers.push_back(pid);
+  }
+
+  // Return success
+  return 1;
+}
+
+// Wait for the spawned workers to exit
+void WaitJobWorkers(void)
+{
+  for (unsigned int i = 0; i < job_workers.size(); i++) {
+    int status;
+    waitpid(job_workers[i], &status, 0);
+  }
+  job_workers.clear();
+}
+
+// Stop the spawned workers (waking any that are suspended, so that they
+// receive the signal) and wait for them to exit
+void KillJobWorkers(void)
+{
+  for (unsigned int i = 0; i < job_workers.size(); i++) {
+    kill(job_workers[i], SIGTERM);
+    kill(job_workers[i], SIGCONT);
+  }
+  WaitJobWorkers();
+}
+
+////////////////////////////////////////////////////////////////////////
+// Photon Exchange
+////////////////////////////////////////////////////////////////////////
+
+// Publish the traced photons (global and caustic photons, and the shadow
+// photons of each light) so that workers can build the same photon maps
+int WriteJobPhotons(const vector<vector<ShadowPhoton> >& shadow_photons)
+{
+  string tmpname = JobPath("photons.tmp");
+  FILE *fp = fopen(tmpname.c_str(), "wb");
+  if (!fp) {
+    fprintf(stderr, "Unable to write photons to %s\n", tmpname.c_str());
+    return 0;
+  }
+
+  // Header (with the illumination toggles, which tracing may have turned off)
+  int header[7] = { (int) JOB_PHOTONS_MAGIC, INDIRECT_ILLUM, DIRECT_PHOTON_ILLUM,
+    CAUSTIC_ILLUM, GLOBAL_PHOTONS.NEntries(), CAUSTIC_PHOTONS.NEntries(),
+    (int) shadow_photons.size() };
+  int status = (fwrite(header, sizeof(int), 7, fp) == 7);
+
+  // Photons
+  for (int i = 0; status && i < GLOBAL_PHOTONS.NEntries(); i++) {
+    status = (fwrite(GLOBAL_PHOTONS[i], sizeof(Photon), 1, fp) == 1);
+  }
+  for (int i = 0; status && i < CAUSTIC_PHOTONS.NEntries(); i++) {
+    status = (fwrite(CAUSTIC_PHOTONS[i], sizeof(Photon), 1, fp) == 1);
+  }
+  for (unsigned int i = 0; status && i < shadow_photons.size(); i++) {
+    int count = shadow_photons[i].size();
+    status = (fwrite(&count, sizeof(int), 1, fp) == 1);
+    if (status && count > 0) {
+      status = (fwrite(&shadow_photons[i][0], sizeof(ShadowPhoton), count, fp) == (size_t) count);
+    }
+  }
+
+  // Move into place
+  if (fclose(fp) != 0) status = 0;
+  if (!status || (rename(tmpname.c_str(), JobPath("photons").c_str()) != 0)) {
+    fprintf(stderr, "Unable to write photons to %s\n", tmpname.c_str());
+    unlink(tmpname.c_str());
+    return 0;
+  }
+
+  // Return success
+  return 1;
+}
+
+// Wait for the photons of the job and read them into GLOBAL_PHOTONS,
+// CAUSTIC_PHOTONS and shadow_photons (restoring the illumination toggles
+// of the coordinator)
+int ReadJobPhotons(vector<vector<ShadowPhoton> >& shadow_photons)
+{
+  // Wait for photons (giving up once the process that started this one exits,
+  // e.g. a coordinator that failed before publishing them, or after a timeout)
+  string filename = JobPath("photons");
+  pid_t parent = getppid();
+  RNTime wait_time;
+  wait_time.Read();
+  while (!FileExists(filename)) {
+    if (getppid() != parent) {
+      fprintf(stderr, "Coordinator exited before publishing photons to %s\n", filename.c_str());
+      return 0;
+    }
+    if (wait_time.Elapsed() > JOB_PHOTONS_TIMEOUT) {
+      fprintf(stderr, "Timed out waiting for photons in %s\n", filename.c_str());
+      return 0;
+    }
+    usleep(JOB_POLL_INTERVAL);
+  }
+  FILE *fp = fopen(filename.c_str(), "rb");
+  if (!fp) {
+    fprintf(stderr, "Unable to read photons from %s\n", filename.c_str());
+    return 0;
+  }
+
+  // Header
+  int header[7];
+  if ((fread(header, sizeof(int), 7, fp) != 7) || (header[0] != (int) JOB_PHOTONS_MAGIC) ||
+      ((header[6] != 0) && (header[6] != SCENE_NLIGHTS))) {
+    fprintf(stderr, "Invalid photon file %s\n", filename.c_str());
+    fclose(fp);
+    return 0;
+  }
+  INDIRECT_ILLUM = header[1];
+  DIRECT_PHOTON_ILLUM = header[2];
+  CAUSTIC_ILLUM = header[3];
+
+  // Photons
+  int status = 1;
+  for (int i = 0; status && i < header[4]; i++) {
+    Photon *photon = new Photon();
+    status = (fread(photon, sizeof(Photon), 1, fp) == 1);
+    GLOBAL_PHOTONS.Insert(photon);
+  }
+  for (int i = 0; status && i < header[5]; i++) {
+    Photon *photon = new Photon();
+    status = (fread(photon, sizeof(Photon), 1, fp) == 1);
+    CAUSTIC_PHOTONS.Insert(photon);
+  }
+  shadow_photons.assign(header[6], vector<ShadowPhoton>());
+  for (int i = 0; status && i < header[6]; i++) {
+    int count;
+    status = (fread(&count, sizeof(int), 1, fp) == 1) && (count >= 0);
+    if (status && count > 0) {
+      shadow_photons[i].resize(count);
+      status = (fread(&shadow_photons[i][0], sizeof(ShadowPhoton), count, fp) == (size_t) count);
+    }
+  }
+  fclose(fp);
+
+  if (!status) {
+    fprintf(stderr, "Unable to read photons from %s\n", filename.c_str());
+    return 0;
+  }
+
+  // Return success
+  return 1;
+}
+
+////////////////////////////////////////////////////////////////////////
+// Tile Rendering
+////////////////////////////////////////////////////////////////////////
+
+// Render tile (tx, ty) of the image and write its samples and ray counts
+static int RenderTile(int tx, int ty, int width, int height)
+{
+  int x0 = tx * JOB_TILE_SIZE;
+  int y0 = ty * JOB_TILE_SIZE;
+  int x1 = min(x0 + JOB_TILE_SIZE, width);
+  int y1 = min(y0 + JOB_TILE_SIZE, height);
+
+  // Render (counting the rays of this tile alone)
+  vector<vector<RNRgb> > buffer;
+  unsigned long long int counts_before[NUM_RAY_COUNTS];
+  unsigned long long int counts[NUM_RAY_COUNTS];
+  ReadRayCounts(counts_before);
+  RenderRegion(buffer, x0, y0, x1, y1);
+  ReadRayCounts(counts);
+  for (int i = 0; i < NUM_RAY_COUNTS; i++) {
+    counts[i] -= counts_before[i];
+  }
+
+  // Write tile
+  string tmpname = TileTempPath(tx, ty);
+  FILE *fp = fopen(tmpname.c_str(), "wb");
+  if (!fp) {
+    fprintf(stderr, "Unable to write tile to %s\n", tmpname.c_str());
+    return 0;
+  }
+  int bounds[4] = { x0, y0, x1, y1 };
+  int status = (fwrite(bounds, sizeof(int), 4, fp) == 4);
+  if (status) {
+    status = (fwrite(counts, sizeof(counts[0]), NUM_RAY_COUNTS, fp) == NUM_RAY_COUNTS);
+  }
+  for (int i = 0; status && i < x1 - x0; i++) {
+    status = (fwrite(&buffer[i][0], sizeof(RNRgb), y1 - y0, fp) == (size_t) (y1 - y0));
+  }
+  if (fclose(fp) != 0) status = 0;
+  if (!status) {
+    fprintf(stderr, "Unable to write tile to %s\n", tmpname.c_str());
+    unlink(tmpname.c_str());
+    return 0;
+  }
+
+  // Move tile into place (if another process rendering the same tile got
+  // there first, its samples are the same, so losing the race is fine)
+  string filename = TilePath(tx, ty, "rgb");
+  if (rename(tmpname.c_str(), filename.c_str()) != 0) {
+    unlink(tmpname.c_str());
+    if (!FileExists(filename)) {
+      fprintf(stderr, "Unable to write tile to %s\n", filename.c_str());
+      return 0;
+    }
+  }
+
+  // Return success
+  return 1;
+}
+
+// Read the samples of tile (tx, ty) into buffer, adding its ray counts to counts
+static int ReadTile(int tx, int ty, vector<vector<RNRgb> >& buffer,
+  unsigned long long int counts[NUM_RAY_COUNTS])
+{
+  string filename = TilePath(tx, ty, "rgb");
+  FILE *fp = fopen(filename.c_str(), "rb");
+  if (!fp) return 0;
+
+  // Check bounds
+  int bounds[4];
+  int status = (fread(bounds, sizeof(int), 4, fp) == 4) &&
+    (bounds[0] == tx * JOB_TILE_SIZE) && (bounds[1] == ty * JOB_TILE_SIZE) &&
+    (bounds[2] <= (int) buffer.size()) && (bounds[3] <= (int) buffer[0].size());
+
+  // Read counts and samples
+  unsigned long long int tile_counts[NUM_RAY_COUNTS];
+  if (status) {
+    status = (fread(tile_counts, sizeof(tile_counts[0]), NUM_RAY_COUNTS, fp) == NUM_RAY_COUNTS);
+  }
+  for (int i = bounds[0]; status && i < bounds[2]; i++) {
+    status = (fread(&buffer[i][bounds[1]], sizeof(RNRgb), bounds[3] - bounds[1], fp) ==
+      (size_t) (bounds[3] - bounds[1]));
+  }
+  fclose(fp);
+
+  if (!status) {
+    fprintf(stderr, "Invalid tile %s\n", filename.c_str());
+    return 0;
+  }
+  for (int i = 0; i < NUM_RAY_COUNTS; i++) {
+    counts[i] += tile_counts[i];
+  }
+
+  // Return success
+  return 1;
+}
+
+// Claim and render tiles in order until none are left unclaimed. Claims are
+// files created exclusively, so each tile is claimed by exactly one process.
+// Returns the longest time taken by a tile (or -1 on failure)
+static RNScalar RenderUnclaimedTiles(int width, int height)
+{
+  int ntiles_x = (width + JOB_TILE_SIZE - 1) / JOB_TILE_SIZE;
+  int ntiles_y = (height + JOB_TILE_SIZE - 1) / JOB_TILE_SIZE;
+  RNScalar longest_time = 0;
+  for (int t = 0; t < ntiles_x * ntiles_y; t++) {
+    int tx = t % ntiles_x;
+    int ty = t / ntiles_x;
+    int fd = open(TilePath(tx, ty, "claim").c_str(), O_CREAT | O_EXCL | O_WRONLY, 0644);
+    if (fd < 0) continue;
+    close(fd);
+
+    RNTime tile_time;
+    tile_time.Read();
+    if (!RenderTile(tx, ty, width, height)) return -1;
+    longest_time = max(longest_time, tile_time.Elapsed());
+  }
+  return longest_time;
+}
+
+// Render tiles of the job until none are left unclaimed (as a worker)
+int WorkOnJob(int width, int height)
+{
+  return RenderUnclaimedTiles(width, height) >= 0;
+}
+
+// Render tiles of the job until none are left unclaimed, then wait for the
+// rest and assemble all tiles into buffer, summing their ray counts (as the
+// coordinator). Tiles that never show up are rendered again
+int RenderJobTiles(vector<vector<RNRgb> >& buffer,
+  unsigned long long int counts[NUM_RAY_COUNTS], int width, int height)
+{
+  int ntiles_x = (width + JOB_TILE_SIZE - 1) / JOB_TILE_SIZE;
+  int ntiles_y = (height + JOB_TILE_SIZE - 1) / JOB_TILE_SIZE;
+  int ntiles = ntiles_x * ntiles_y;
+  buffer.assign(width, vector<RNRgb> (height, RNblack_rgb));
+  for (int i = 0; i < NUM_RAY_COUNTS; i++) {
+    counts[i] = 0;
+  }
+
+  // Render alongside the workers
+  RNScalar longest_time = RenderUnclaimedTiles(width, height);
+  if (longest_time < 0) return 0;
+  RNScalar stall_time = max(JOB_MIN_STALL_TIME, JOB_STALL_FACTOR * longest_time);
+
+  // Gather tiles as they arrive
+  vector<bool> gathered(ntiles, false);
+  int ngathered = 0;
+  bool stalled = false;
+  RNTime last_arrival;
+  last_arrival.Read();
+  while (ngathered < ntiles) {
+    int previous_ngathered = ngathered;
+    for (int t = 0; t < ntiles; t++) {
+      if (gathered[t]) continue;
+      int tx = t % ntiles_x;
+      int ty = t / ntiles_x;
+      if (!FileExists(TilePath(tx, ty, "rgb"))) continue;
+      if (!ReadTile(tx, ty, buffer, counts)) return 0;
+      gathered[t] = true;
+      ngathered++;
+    }
+    if (VERBOSE) PrintProgress(((double) ngathered) / ntiles, PROGRESS_BAR_WIDTH);
+    if (ngathered == ntiles) break;
+
+    // Render one tile of a stalled worker again (seeds depend on the tile
+    // alone, so it comes out the same as the lost one would have), then look
+    // for arrivals before the next, since the worker may only be slow
+    if (ngathered > previous_ngathered) {
+      last_arrival.Read();
+    } else if (last_arrival.Elapsed() > stall_time) {
+      int t = 0;
+      while (gathered[t]) t++;
+      int tx = t % ntiles_x;
+      int ty = t / ntiles_x;
+      if (VERBOSE) printf("\nRendering tile %d again\n", t);
+      if (!RenderTile(tx, ty, width, height)) return 0;
+      if (!ReadTile(tx, ty, buffer, counts)) return 0;
+      gathered[t] = true;
+      ngathered++;
+      stalled = true;
+    } else {
+      usleep(JOB_POLL_INTERVAL);
+    }
+  }
+  if (VERBOSE) printf("\n");
+
+  // Stop the workers if any stalled (they would otherwise be waited on)
+  if (stalled) KillJobWorkers();
+
+  // Remove tile samples (claims and photons are kept so that late workers
+  // exit at once instead of rendering again)
+  for (int t = 0; t < ntiles; t++) {
+    unlink(TilePath(t % ntiles_x, t / ntiles_x, "rgb").c_str());
+  }
+
+  // Return success
+  return 1;
+}
@@ -0,0 +1,51 @@
+////////////////////////////////////////////////////////////////////////
+// Directives
+////////////////////////////////////////////////////////////////////////
+
+#ifndef DISTRIBUTE_INC
+#define DISTRIBUTE_INC
+
+#include "../R3Graphics/R3Graphics.h"
+#include "../render.h"
+#include <vector>
+
+using namespace std;
+
+////////////////////////////////////////////////////////////////////////
+// Distributed Rendering Utils
+////////////////////////////////////////////////////////////////////////
+
+// Create the job directory, removing photons and tiles left by an earlier job
+int PrepareJob(void);
+
+// Start JOB_WORKERS copies of this program working on the job (with the same
+// arguments, except that -distribute becomes -worker and -v is dropped).
+// Workers still running when this process exits are killed
+int SpawnJobWorkers(int argc, char **argv);
+
+// Wait for the spawned workers to exit
+void WaitJobWorkers(void);
+
+// Stop the spawned workers and wait for them to exit
+void KillJobWorkers(void);
+
+// Publish the traced photons (global and caustic photons, and the shadow
+// photons of each light) so that workers can build the same photon maps
+int WriteJobPhotons(const vector<vector<ShadowPhoton> >& shadow_photons);
+
+// Wait for the photons of the job and read them into GLOBAL_PHOTONS,
+// CAUSTIC_PHOTONS and shadow_photons (restoring the illumination toggles
+// of the coordinator). Fails if the process that started this one exits, or
+// no photons are published within an hour
+int ReadJobPhotons(vector<vector<ShadowPhoton> >& shadow_photons);
+
+// Render tiles of the job until none are left unclaimed (as a worker)
+int WorkOnJob(int width, int height);
+
+// Render tiles of the job until none are left unclaimed, then wait for the
+// rest and assemble all tiles into buffer, summing their ray counts (as the
+// coordinator). Tiles that never show up are rendered again
+int RenderJobTiles(vector<vector<RNRgb> >& buffer,
+  unsigned long long int counts[NUM_RAY_COUNTS], int width, int height);
+
+#endif
@@ -83,9 +83,10 @@ RNRgb RGBE_to_RNRgb(unsigned char* rgbe_src)
 // Return the length of an intersecting ray
 RNLength IntersectionDist(const R3Ray& ray, const R3Point& origin)
 {
-  R3Point intersection_point;
-  if (SCENE->Intersects(ray, NULL, NULL, NULL, &intersection_point)) {
-    return R3Distance(origin, intersection_point);
+  // Only the ray parameter is needed, so skip computing hit point and normal
+  RNScalar t;
+  if (SCENE->Intersects(ray, NULL, NULL, NULL, NULL, NULL, &t)) {
+    return R3Distance(origin, ray.Point(t));
   }
 
   return RN_INFINITY;
@@ -160,6 +161,16 @@ R3Vector TransmissiveBounce(R3Vector normal, R3Vector& view, RNScalar cos_theta,
 // Use importance sampling to return a vector sampled from a weighted hemisphere
 // around the surface normal (normal is flipped if cos_theta is negative)
 R3Vector Diffuse_ImportanceSample(R3Vector normal, const RNScalar cos_theta)
+{
+  const RNScalar u1 = RNThreadableRandomScalar();
+  const RNScalar u2 = RNThreadableRandomScalar();
+  return Diffuse_ImportanceSample(normal, cos_theta, u1, u2);
+}
+
+// Same as above, but driven by the provided uniform values in [0, 1) (e.g. from
+// a low discrepancy sequence)
+R3Vector Diffuse_ImportanceSample(R3Vector normal, const RNScalar cos_theta,
+  const RNScalar u1, const RNScalar u2)
 {
   // Check normal direction
   if (cos_theta < 0) {
@@ -167,8 +178,8 @@ R3Vector Diffuse_ImportanceSample(R3Vector normal, const RNScalar cos_theta)
   }
 
   // Pick spherical coords
-  const RNAngle theta = acos(sqrt(RNThreadableRandomScalar()));
-  const RNAngle phi = 2*RN_PI*RNThreadableRandomScalar();
+  const RNAngle theta = acos(sqrt(u1));
+  const RNAngle phi = 2*RN_PI*u2;
 
   // Build a vector with angle alpha relative to the normal direction
   R3Vector perpendicular_direction = R3Vector(normal[1], -normal[0], 0);
@@ -188,6 +199,16 @@ R3Vector Diffuse_ImportanceSample(R3Vector normal, const RNScalar cos_theta)
 // a random variable drawn from the brdf
 R3Vector Specular_ImportanceSample(const R3Vector& exact, const RNScalar n,
   const RNScalar cos_theta)
+{
+  const RNScalar u1 = RNThreadableRandomScalar();
+  const RNScalar u2 = RNThreadableRandomScalar();
+  return Specular_ImportanceSample(exact, n, cos_theta, u1, u2);
+}
+
+// Same as above, but driven by the provided uniform values in [0, 1) (e.g. from
+// a low discrepancy sequence)
+R3Vector Specular_ImportanceSample(const R3Vector& exact, const RNScalar n,
+  const RNScalar cos_theta, const RNScalar u1, const RNScalar u2)
 {
   // Get the max value for alpha (becomes increasingly small as cos theta shrinks
   // to prevent the reflection from penetrating the surface; mimics real behavior
@@ -197,9 +218,9 @@ R3Vector Specular_ImportanceSample(const R3Vector& exact, const RNScalar n,
   const RNScalar angle_limit = (1.0 - acos(abs(cos_theta)) * 2.0 / RN_PI);
 
   // Find axis perturbation values from brdf (see Lafortune & Williams, 1994)
-  const RNAngle alpha = acos(pow(RNThreadableRandomScalar(), 1.0 / (n + 1.0))) * angle_limit;
+  const RNAngle alpha = acos(pow(u1, 1.0 / (n + 1.0))) * angle_limit;
 
-  const RNAngle phi = RN_TWO_PI*RNThreadableRandomScalar();
+  const RNAngle phi = RN_TWO_PI*u2;
 
   // Build a vector with angle alpha relative to the exact direction
   R3Vector perpendicular_direction = R3Vector(exact[1], -exact[0], 0);
@@ -215,6 +236,48 @@ R3Vector Specular_ImportanceSample(const R3Vector& exact, const RNScalar n,
   return result;
 }
 
+////////////////////////////////////////////////////////////////////////
+// Sampling Utils
+////////////////////////////////////////////////////////////////////////
+
+// Map uniform values in [0, 1) to a point (x, y) in the unit disk using Shirley
+// and Chiu's concentric mapping (no rejection, so stratification is preserved)
+void ConcentricSampleDisk(RNScalar u1, RNScalar u2, RNScalar& x, RNScalar& y)
+{
+  // Map square to disk by concentric squares
+  const RNScalar a = u1*2.0 - 1.0;
+  const RNScalar b = u2*2.0 - 1.0;
+  if (a == 0 && b == 0) {
+    x = y = 0;
+    return;
+  }
+  RNScalar r, phi;
+  if (abs(a) > abs(b)) {
+    r = a;
+    phi = (RN_PI / 4.0) * (b / a);
+  } else {
+    r = b;
+    phi = (RN_PI / 2.0) - (RN_PI / 4.0) * (a / b);
+  }
+  x = r * cos(phi);
+  y = r * sin(phi);
+}
+
+// Return the radical inverse of index in the given base (the index-th element
+// of a dimension of the Halton sequence)
+RNScalar RadicalInverse(int base, unsigned int index)
+{
+  const RNScalar inv_base = 1.0 / base;
+  RNScalar inv_digit = inv_base;
+  RNScalar result = 0;
+  while (index > 0) {
+    result += (index % base) * inv_digit;
+    index /= base;
+    inv_digit *= inv_base;
+  }
+  return result;
+}
+
 ////////////////////////////////////////////////////////////////////////
 // Light Utils
 ////////////////////////////////////////////////////////////////////////
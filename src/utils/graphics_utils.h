@@ -53,11 +53,33 @@ R3Vector TransmissiveBounce(R3Vector normal, R3Vector& view, RNScalar cos_theta,
 // around the surface normal (normal is flipped if cos_theta is negative)
 R3Vector Diffuse_ImportanceSample(R3Vector normal, const RNScalar cos_theta);
 
+// Same as above, but driven by the provided uniform values in [0, 1) (e.g. from
+// a low discrepancy sequence)
+R3Vector Diffuse_ImportanceSample(R3Vector normal, const RNScalar cos_theta,
+  const RNScalar u1, const RNScalar u2);
+
 // Use importance sampling to return a vector offset from a perfect bounce by
 // a random variable drawn from the brdf
 R3Vector Specular_ImportanceSample(const R3Vector& exact, const RNScalar n,
   const RNScalar cos_theta);
 
+// Same as above, but driven by the provided uniform values in [0, 1) (e.g. from
+// a low discrepancy sequence)
+R3Vector Specular_ImportanceSample(const R3Vector& exact, const RNScalar n,
+  const RNScalar cos_theta, const RNScalar u1, const RNScalar u2);
+
+////////////////////////////////////////////////////////////////////////
+// Sampling Utils
+////////////////////////////////////////////////////////////////////////
+
+// Map uniform values in [0, 1) to a point (x, y) in the unit disk using Shirley
+// and Chiu's concentric mapping (no rejection, so stratification is preserved)
+void ConcentricSampleDisk(RNScalar u1, RNScalar u2, RNScalar& x, RNScalar& y);
+
+// Return the radical inverse of index in the given base (the index-th element
+// of a dimension of the Halton sequence)
+RNScalar RadicalInverse(int base, unsigned int index);
+
 ////////////////////////////////////////////////////////////////////////
 // Light Utils
 ////////////////////////////////////////////////////////////////////////
@@ -4,8 +4,12 @@
 
 #include "illumination_utils.h"
 #include "graphics_utils.h"
+#include "visibility_utils.h"
 #include "../render.h"
 #include "../R3Graphics/R3Graphics.h"
+#include <vector>
+
+using namespace std;
 
 ////////////////////////////////////////////////////////////////////////
 // Occlusion Utils
@@ -83,10 +87,304 @@ int TestLightIntersection(R3Point& point, const R3Point& eye, const R3Light *lig
   return 0;
 }
 
+// Visibility of a light from a point, as classified by its shadow photons
+enum Shadow_Class {LIT, SHADOWED, PENUMBRA};
+
+// Classify a point as fully lit, fully shadowed or in penumbra with respect to
+// light using the shadow photons near the point's tangent plane (penumbra if
+// there is no map or too few photons nearby to tell)
+static Shadow_Class ClassifyShadow(const R3Light& light, const R3Point& point_in_scene,
+  const R3Vector& normal)
+{
+  // Find shadow photon map of light
+  int index = light.SceneIndex();
+  if (index < 0 || index >= (int) SHADOW_PMAPS.size() || !SHADOW_PMAPS[index]) {
+    return PENUMBRA;
+  }
+
+  // Find nearby photons
+  vector<PointAndDistanceSqd<ShadowPhoton*> > nearby_points;
+  SHADOW_PMAPS[index]->FindClosestQuick(point_in_scene, 0, SHADOW_ESTIMATE_DIST,
+    SHADOW_ESTIMATE_SIZE, nearby_points);
+  LOCAL_GATHER_COUNT++;
+
+  // Classify by whether photons on the same surface agree
+  const RNLength max_plane_dist = 0.25 * SHADOW_ESTIMATE_DIST;
+  int num_lit = 0;
+  int num_shadow = 0;
+  for (unsigned int i = 0; i < nearby_points.size(); i++) {
+    const ShadowPhoton *photon = nearby_points[i].point;
+    if (abs(normal.Dot(photon->position - point_in_scene)) > max_plane_dist) continue;
+    if (photon->shadow) num_shadow++;
+    else num_lit++;
+  }
+  if (num_lit + num_shadow < (SHADOW_ESTIMATE_SIZE + 1) / 2) return PENUMBRA;
+  if (num_shadow == 0) return LIT;
+  if (num_lit == 0) return SHADOWED;
+  return PENUMBRA;
+}
+
+// Test for the occlusion of a ray to a light sample, firing a shadow ray only
+// if the point is in penumbra (lit points may still be occluded by their own
+// surface if the sample is behind it)
+static inline bool SampleIlluminationTest(const R3Light& light, const Shadow_Class visibility,
+  const R3Point& point_in_scene, const R3Vector& normal, const R3Point& point_on_light)
+{
+  if (visibility == PENUMBRA) {
+    return LightIlluminationTest(&light, point_in_scene, normal, point_on_light, false);
+  }
+  return (visibility == LIT) && (normal.Dot(point_on_light - point_in_scene) > 0);
+}
+
 ////////////////////////////////////////////////////////////////////////
 // 2D Light Soft Shadow & Reflection Utils
 ////////////////////////////////////////////////////////////////////////
 
+// Sample a point uniformly in the unit disk, either by rejection or (when
+// CONCENTRIC_DISK_SAMPLING is set) by Shirley and Chiu's concentric mapping,
+// which uses exactly two random numbers and preserves stratification
+static void SampleUnitDisk(RNScalar& r1, RNScalar& r2)
+{
+  if (!CONCENTRIC_DISK_SAMPLING) {
+    do {
+      r1 = (RNThreadableRandomScalar()*2.0) - 1.0;
+      r2 = (RNThreadableRandomScalar()*2.0) - 1.0;
+    } while (r1*r1 + r2*r2 > 1.0);
+    return;
+  }
+
+  // Map square to disk by concentric squares
+  const RNScalar u1 = RNThreadableRandomScalar();
+  const RNScalar u2 = RNThreadableRandomScalar();
+  ConcentricSampleDisk(u1, u2, r1, r2);
+}
+
+// Spherical rectangle as seen from a point, for sampling a rect light uniformly
+// by solid angle (Urena, Fajardo and King, 2013)
+struct SphericalRect {
+  bool valid;               // False if the light must be sampled by area instead
+  R3Point o;                // Reference point
+  R3Vector x, y, z;         // Local frame (x, y along rectangle edges)
+  RNScalar x0, y0, z0, x1, y1;
+  RNScalar b0, b1, k, S;    // S is the solid angle subtended
+};
+
+// Set up spherical rectangle for rect light with corner and edge vectors seen
+// from point
+static void InitSphericalRect(SphericalRect& rect, const R3Point& corner,
+  const R3Vector& a1, const R3Vector& a2, const R3Point& point)
+{
+  rect.valid = false;
+
+  // Need an actual rectangle (not a general parallelogram)
+  RNLength l1 = a1.Length();
+  RNLength l2 = a2.Length();
+  if (RNIsZero(l1) || RNIsZero(l2)) return;
+  rect.x = a1 / l1;
+  rect.y = a2 / l2;
+  if (abs(rect.x.Dot(rect.y)) > 1.0E-6) return;
+  rect.z = rect.x % rect.y;
+
+  // Local coordinates of rectangle relative to point
+  rect.o = point;
+  R3Vector d = corner - point;
+  rect.x0 = d.Dot(rect.x);
+  rect.y0 = d.Dot(rect.y);
+  rect.z0 = d.Dot(rect.z);
+  if (rect.z0 > 0) {
+    rect.z0 = -rect.z0;
+    rect.z = -rect.z;
+  }
+  if (RNIsZero(rect.z0)) return;
+  rect.x1 = rect.x0 + l1;
+  rect.y1 = rect.y0 + l2;
+
+  // Normals of the spherical rectangle's edges
+  R3Vector n0(0, rect.z0, -rect.y0);
+  R3Vector n1(-rect.z0, 0, rect.x1);
+  R3Vector n2(0, -rect.z0, rect.y1);
+  R3Vector n3(rect.z0, 0, -rect.x0);
+  n0.Normalize();
+  n1.Normalize();
+  n2.Normalize();
+  n3.Normalize();
+
+  // Internal angles and solid angle
+  RNScalar g0 = acos(max(-1.0, min(1.0, -n0.Dot(n1))));
+  RNScalar g1 = acos(max(-1.0, min(1.0, -n1.Dot(n2))));
+  RNScalar g2 = acos(max(-1.0, min(1.0, -n2.Dot(n3))));
+  RNScalar g3 = acos(max(-1.0, min(1.0, -n3.Dot(n0))));
+  rect.b0 = n0.Z();
+  rect.b1 = n2.Z();
+  rect.k = RN_TWO_PI - g2 - g3;
+  rect.S = g0 + g1 - rect.k;
+  rect.valid = (rect.S > 1.0E-8);
+}
+
+// Sample point on spherical rectangle uniformly by solid angle
+static R3Point SampleSphericalRect(const SphericalRect& rect)
+{
+  // Compute x coordinate from first random number
+  RNScalar au = RNThreadableRandomScalar() * rect.S + rect.k;
+  RNScalar fu = (cos(au) * rect.b0 - rect.b1) / sin(au);
+  RNScalar cu = 1.0 / sqrt(fu*fu + rect.b0*rect.b0) * ((fu > 0) ? 1.0 : -1.0);
+  cu = max(-1.0, min(1.0, cu));
+  RNScalar xu = -(cu * rect.z0) / sqrt(max(1.0E-12, 1.0 - cu*cu));
+  xu = max(rect.x0, min(rect.x1, xu));
+
+  // Compute y coordinate from second random number
+  RNScalar d = sqrt(xu*xu + rect.z0*rect.z0);
+  RNScalar h0 = rect.y0 / sqrt(d*d + rect.y0*rect.y0);
+  RNScalar h1 = rect.y1 / sqrt(d*d + rect.y1*rect.y1);
+  RNScalar hv = h0 + RNThreadableRandomScalar() * (h1 - h0);
+  RNScalar hv2 = hv*hv;
+  RNScalar yv = (hv2 < 1.0 - 1.0E-6) ? (hv * d) / sqrt(1.0 - hv2) : rect.y1;
+
+  // Return point in world coordinates
+  return rect.o + xu*rect.x + yv*rect.y + rect.z0*rect.z;
+}
+
+// Sample point on rect light, by solid angle if possible and by area otherwise;
+// sets inv_pdf to the inverse of the sample's probability density over area
+static R3Point SampleRectLight(const SphericalRect& rect, const R3Point& center,
+  const R3Vector& a1, const R3Vector& a2, const R3Vector& light_norm, const RNArea area,
+  RNScalar& inv_pdf)
+{
+  // Uniform area sampling
+  if (!rect.valid) {
+    RNScalar r1 = RNThreadableRandomScalar() - 0.5;
+    RNScalar r2 = RNThreadableRandomScalar() - 0.5;
+    inv_pdf = area;
+    return r1*a1 + r2*a2 + center;
+  }
+
+  // Uniform solid angle sampling (convert pdf from solid angle to area)
+  R3Point sample_point = SampleSphericalRect(rect);
+  R3Vector L = sample_point - rect.o;
+  RNLength d = L.Length();
+  RNScalar cos_l = (d > 0) ? abs(light_norm.Dot(L)) / d : 0;
+  inv_pdf = (cos_l > RN_EPSILON) ? rect.S * d * d / cos_l : 0;
+  return sample_point;
+}
+
+// Sample a direction from the normalized Phong lobe (n+1)/2pi * cos^n around
+// axis; returns direction and sets pdf (per steradian)
+static R3Vector PhongLobeSample(const R3Vector& axis, const RNScalar n, RNScalar& pdf)
+{
+  // Pick angle from axis and azimuth
+  const RNScalar cos_alpha = pow(RNThreadableRandomScalar(), 1.0 / (n + 1.0));
+  const RNScalar sin_alpha = sqrt(max(0.0, 1.0 - cos_alpha*cos_alpha));
+  const RNAngle phi = RN_TWO_PI*RNThreadableRandomScalar();
+
+  // Build frame around axis
+  R3Vector s = R3Vector(axis[1], -axis[0], 0);
+  if (1.0 - abs(axis[2]) < 0.1) {
+    s = R3Vector(axis[2], 0, -axis[0]);
+  }
+  s.Normalize();
+  R3Vector t = axis % s;
+
+  // Return direction and its pdf
+  pdf = (n + 1.0) / RN_TWO_PI * pow(cos_alpha, n);
+  R3Vector result = s*(sin_alpha*cos(phi)) + t*(sin_alpha*sin(phi)) + axis*cos_alpha;
+  result.Normalize();
+  return result;
+}
+
+// Estimate the specular integral over a 2D light (the disk or parallelogram
+// spanned by u and v around center) by combining uniform samples on the light
+// with samples from the Phong lobe using the power heuristic. Visibility is
+// included in the estimate; uniform samples that reach the light are counted in
+// hits so they can still inform the shadow hit rate
+static RNScalar MIS_SpecularReflection(const R3Light& light, const R3Point& center,
+  const R3Vector& light_norm, const R3Vector& u, const R3Vector& v, const bool disk, const RNArea area,
+  const RNScalar intensity, const RNScalar ca, const RNScalar la, const RNScalar qa,
+  const R3Point& eye, const R3Point& point_in_scene, const R3Vector& normal,
+  const RNScalar n, const int num_samples, const Shadow_Class visibility, int& hits)
+{
+  // Reflected view direction (axis of the Phong lobe)
+  R3Vector V = eye - point_in_scene;
+  V.Normalize();
+  const R3Vector Rv = (2.0 * normal.Dot(V)) * normal - V;
+  const RNScalar lobe_norm = (n + 1.0) / RN_TWO_PI;
+  const RNScalar light_pdf = 1.0 / area;
+
+  // Forward declarations
+  R3Point sample_point;
+  R3Vector L;
+  RNScalar r1, r2, d, denom, cos_l, VR, I, brdf_pdf, mis_weight;
+  RNScalar weight = 0;
+
+  // Samples drawn uniformly on the light
+  for (int i = 0; i < num_samples; i++) {
+    if (disk) {
+      SampleUnitDisk(r1, r2);
+    } else {
+      r1 = RNThreadableRandomScalar() - 0.5;
+      r2 = RNThreadableRandomScalar() - 0.5;
+    }
+    sample_point = r1*u + r2*v + center + light_norm*RN_EPSILON;
+    if (!SampleIlluminationTest(light, visibility, point_in_scene, normal, sample_point)) continue;
+    hits++;
+
+    // Evaluate integrand
+    L = sample_point - point_in_scene;
+    d = L.Length();
+    L /= d;
+    cos_l = light_norm.Dot(-L);
+    VR = Rv.Dot(L);
+    if (RNIsNegativeOrZero(VR) || RNIsNegativeOrZero(cos_l)) continue;
+    denom = ca + d * la + d * d * qa;
+    I = intensity * 2.0 * cos_l;
+    if (RNIsPositive(denom)) I /= denom;
+
+    // Weight by power heuristic against lobe sampling (pdf converted to area)
+    brdf_pdf = lobe_norm * pow(VR, n) * cos_l / (d * d);
+    mis_weight = light_pdf * light_pdf / (light_pdf * light_pdf + brdf_pdf * brdf_pdf);
+    weight += mis_weight * I * pow(VR, n) / light_pdf;
+  }
+
+  // Samples drawn from the Phong lobe
+  for (int i = 0; i < num_samples; i++) {
+    RNScalar solid_angle_pdf;
+    L = PhongLobeSample(Rv, n, solid_angle_pdf);
+
+    // Find where direction meets the plane of the light
+    denom = L.Dot(light_norm);
+    if (RNIsPositiveOrZero(denom)) continue;
+    RNScalar t = (center - point_in_scene).Dot(light_norm) / denom;
+    if (RNIsNegativeOrZero(t)) continue;
+    sample_point = point_in_scene + L * t;
+
+    // Check that the plane point lies on the light
+    R3Vector offset = sample_point - center;
+    if (disk) {
+      if (offset.Length() > u.Length()) continue;
+    } else {
+      if (abs(offset.Dot(u) / u.Dot(u)) > 0.5) continue;
+      if (abs(offset.Dot(v) / v.Dot(v)) > 0.5) continue;
+    }
+    if (!SampleIlluminationTest(light, visibility, point_in_scene, normal, sample_point + light_norm*RN_EPSILON)) continue;
+
+    // Evaluate integrand
+    d = t;
+    cos_l = light_norm.Dot(-L);
+    VR = Rv.Dot(L);
+    if (RNIsNegativeOrZero(VR) || RNIsNegativeOrZero(cos_l)) continue;
+    denom = ca + d * la + d * d * qa;
+    I = intensity * 2.0 * cos_l;
+    if (RNIsPositive(denom)) I /= denom;
+
+    // Weight by power heuristic against light sampling
+    brdf_pdf = solid_angle_pdf * cos_l / (d * d);
+    mis_weight = brdf_pdf * brdf_pdf / (light_pdf * light_pdf + brdf_pdf * brdf_pdf);
+    weight += mis_weight * I * pow(VR, n) / brdf_pdf;
+  }
+
+  // Return estimate of integral over light area
+  return weight / num_samples;
+}
+
 // Add illumination contribution from area light to color
 void ComputeAreaLightReflection(R3AreaLight& area_light, RNRgb& color,
   const R3Brdf& brdf, const R3Point& eye, const R3Point& point_in_scene,
@@ -128,6 +426,9 @@ void ComputeAreaLightReflection(R3AreaLight& area_light, RNRgb& color,
   const RNScalar quadratic_attenuation = area_light.QuadraticAttenuation();
   const RNScalar intensity = area_light.Intensity();
 
+  // Classify point with shadow photons (only penumbra needs shadow rays)
+  const Shadow_Class visibility = ClassifyShadow(area_light, point_in_scene, normal);
+
   // Genereal Forward Declarations
   R3Point sample_point;
   RNScalar r1, r2;
@@ -147,15 +448,12 @@ void ComputeAreaLightReflection(R3AreaLight& area_light, RNRgb& color,
     weight = 0;
     hits = 0;
     for (int i = 0; i < num_light_samples; i++) {
-      do {
-        // Sample point in circle
-        r1 = (RNThreadableRandomScalar()*2.0) - 1.0;
-        r2 = (RNThreadableRandomScalar()*2.0) - 1.0;
-      } while (r1*r1 + r2*r2 > 1.0);
+      // Sample point in circle
+      SampleUnitDisk(r1, r2);
 
       // Use values r1, r2 and vectors u, v to find a random point on light
       sample_point = r1*u + r2*v + center + light_norm*RN_EPSILON;
-      if (RayIlluminationTest(point_in_scene, sample_point)) {
+      if (SampleIlluminationTest(area_light, visibility, point_in_scene, normal, sample_point)) {
         hits++;
         // Compute intensity at point
         I = intensity;
@@ -184,8 +482,18 @@ void ComputeAreaLightReflection(R3AreaLight& area_light, RNRgb& color,
     total_num_samples += num_light_samples;
   }
 
-  // Specular Sampling
-  if (brdf.IsSpecular()) {
+  // Specular Sampling (multiple importance sampled; added after shadow reweighting)
+  RNRgb mis_color = RNblack_rgb;
+  if (brdf.IsSpecular() && MIS) {
+    hits = 0;
+    weight = MIS_SpecularReflection(area_light, center, light_norm, u, v, true, area,
+      intensity, constant_attenuation, linear_attenuation, quadratic_attenuation,
+      eye, point_in_scene, normal, n, num_light_samples, visibility, hits);
+    mis_color = weight * Sc * Ic;
+    total_num_hits += hits;
+    total_num_samples += num_light_samples;
+  }
+  else if (brdf.IsSpecular()) {
     weight = 0;
     hits = 0;
     num_light_samples *= 2;
@@ -195,15 +503,12 @@ void ComputeAreaLightReflection(R3AreaLight& area_light, RNRgb& color,
     RNScalar VR;
     RNScalar NL;
     for (int i = 0; i < num_light_samples; i++) {
-      do {
-        // Sample point in circle
-        r1 = (RNThreadableRandomScalar()*2.0) - 1.0;
-        r2 = (RNThreadableRandomScalar()*2.0) - 1.0;
-      } while (r1*r1 + r2*r2 > 1.0);
+      // Sample point in circle
+      SampleUnitDisk(r1, r2);
 
       // Use values r1, r2 and vectors u, v to find a random point on light
       sample_point = r1*u + r2*v + center + light_norm*RN_EPSILON;
-      if (RayIlluminationTest(point_in_scene, sample_point)) {
+      if (SampleIlluminationTest(area_light, visibility, point_in_scene, normal, sample_point)) {
         hits++;
         // Compute intensity at point
         I = intensity;
@@ -241,16 +546,13 @@ void ComputeAreaLightReflection(R3AreaLight& area_light, RNRgb& color,
 
   // Additional shadow sampling if necessary
   hits = 0;
-  for (int i = 0; i < num_extra_shadow_samples; i++) {
-    do {
-      // Sample point in circle
-      r1 = (RNThreadableRandomScalar()*2.0) - 1.0;
-      r2 = (RNThreadableRandomScalar()*2.0) - 1.0;
-    } while (r1*r1 + r2*r2 > 1.0);
+  for (int i = 0; visibility != SHADOWED && i < num_extra_shadow_samples; i++) {
+    // Sample point in circle
+    SampleUnitDisk(r1, r2);
 
     // Use values r1, r2 and vectors u, v to find a random point on light
     sample_point = r1*u + r2*v + center + light_norm*RN_EPSILON;
-    if (RayIlluminationTest(point_in_scene, sample_point))
+    if (SampleIlluminationTest(area_light, visibility, point_in_scene, normal, sample_point))
       hits++;
   }
   total_num_hits += hits;
@@ -259,6 +561,9 @@ void ComputeAreaLightReflection(R3AreaLight& area_light, RNRgb& color,
   // Reweight according to shadow hit rate
   if (total_num_samples > 0)
     color *= ((double) total_num_hits) / total_num_samples;
+
+  // Multiple importance sampled specular already accounts for visibility
+  color += mis_color;
 }
 
 // Add illumination contribution from rect light to color
@@ -292,9 +597,19 @@ void ComputeRectLightReflection(R3RectLight& rect_light, RNRgb& color,
   const RNScalar quadratic_attenuation = rect_light.QuadraticAttenuation();
   const RNScalar intensity = rect_light.Intensity();
 
+  // Set up solid angle sampling of light if requested
+  SphericalRect rect;
+  rect.valid = false;
+  if (SOLID_ANGLE_SAMPLING) {
+    InitSphericalRect(rect, center - 0.5*a1 - 0.5*a2, a1, a2, point_in_scene);
+  }
+
+  // Classify point with shadow photons (only penumbra needs shadow rays)
+  const Shadow_Class visibility = ClassifyShadow(rect_light, point_in_scene, normal);
+
   // Genereal Forward Declarations
   R3Point sample_point;
-  RNScalar r1, r2;
+  RNScalar inv_pdf;
   RNScalar I;
   RNLength d;
   RNScalar denom;
@@ -312,12 +627,10 @@ void ComputeRectLightReflection(R3RectLight& rect_light, RNRgb& color,
     weight = 0;
     hits = 0;
     for (int i = 0; i < num_light_samples; i++) {
-      r1 = RNThreadableRandomScalar() - 0.5;
-      r2 = RNThreadableRandomScalar() - 0.5;
-
-      // Use values r1, r2 and vectors a1, a2 to find a random point on light
-      sample_point = r1*a1 + r2*a2 + center + light_norm*RN_EPSILON;
-      if (RayIlluminationTest(point_in_scene, sample_point)) {
+      // Find a random point on light (and the inverse of its density)
+      sample_point = SampleRectLight(rect, center, a1, a2, light_norm, area, inv_pdf);
+      sample_point += light_norm*RN_EPSILON;
+      if (SampleIlluminationTest(rect_light, visibility, point_in_scene, normal, sample_point)) {
         hits++;
         // Compute intensity at point
         I = intensity;
@@ -335,19 +648,29 @@ void ComputeRectLightReflection(R3RectLight& rect_light, RNRgb& color,
         I *= light_norm.Dot(-L) * 2.0;
 
         // Compute diffuse reflection from sample point
-        weight += I * abs(normal.Dot(L));
+        weight += I * abs(normal.Dot(L)) * inv_pdf;
       }
     }
     // Add diffuse contribution
     if (hits > 0) {
-      color += weight * Dc * Ic * area / hits;
+      color += weight * Dc * Ic / hits;
     }
     total_num_hits += hits;
     total_num_samples += num_light_samples;
   }
 
-  // Specular Sampling
-  if (brdf.IsSpecular()) {
+  // Specular Sampling (multiple importance sampled; added after shadow reweighting)
+  RNRgb mis_color = RNblack_rgb;
+  if (brdf.IsSpecular() && MIS) {
+    hits = 0;
+    weight = MIS_SpecularReflection(rect_light, center, light_norm, a1, a2, false, area,
+      intensity, constant_attenuation, linear_attenuation, quadratic_attenuation,
+      eye, point_in_scene, normal, n, num_light_samples, visibility, hits);
+    mis_color = weight * Sc * Ic;
+    total_num_hits += hits;
+    total_num_samples += num_light_samples;
+  }
+  else if (brdf.IsSpecular()) {
     weight = 0;
     hits = 0;
     num_light_samples *= 2;
@@ -356,12 +679,10 @@ void ComputeRectLightReflection(R3RectLight& rect_light, RNRgb& color,
     V.Normalize();
     RNScalar VR;
     for (int i = 0; i < num_light_samples; i++) {
-      r1 = RNThreadableRandomScalar() - 0.5;
-      r2 = RNThreadableRandomScalar() - 0.5;
-
-      // Use values r1, r2 and vectors a1, a2 to find a random point on light
-      sample_point = r1*a1 + r2*a2 + center + light_norm*RN_EPSILON;
-      if (RayIlluminationTest(point_in_scene, sample_point)) {
+      // Find a random point on light (and the inverse of its density)
+      sample_point = SampleRectLight(rect, center, a1, a2, light_norm, area, inv_pdf);
+      sample_point += light_norm*RN_EPSILON;
+      if (SampleIlluminationTest(rect_light, visibility, point_in_scene, normal, sample_point)) {
         hits++;
         // Compute intensity at point
         I = intensity;
@@ -385,12 +706,12 @@ void ComputeRectLightReflection(R3RectLight& rect_light, RNRgb& color,
         if (RNIsNegativeOrZero(VR)) continue;
 
         // Add to result
-        weight += (I * pow(VR,n));
+        weight += (I * pow(VR,n)) * inv_pdf;
       }
     }
     // Add specular contribution
     if (hits > 0) {
-      color += weight * Sc * Ic * area / hits;
+      color += weight * Sc * Ic / hits;
     }
     total_num_hits += hits;
     total_num_samples += num_light_samples;
@@ -398,13 +719,11 @@ void ComputeRectLightReflection(R3RectLight& rect_light, RNRgb& color,
 
   // Additional shadow sampling if necessary
   hits = 0;
-  for (int i = 0; i < num_extra_shadow_samples; i++) {
-    r1 = RNThreadableRandomScalar() - 0.5;
-    r2 = RNThreadableRandomScalar() - 0.5;
-
-    // Use values r1, r2 and vectors a1, a2 to find a random point on light
-    sample_point = r1*a1 + r2*a2 + center + light_norm*RN_EPSILON;
-    if (RayIlluminationTest(point_in_scene, sample_point)) {
+  for (int i = 0; visibility != SHADOWED && i < num_extra_shadow_samples; i++) {
+    // Find a random point on light
+    sample_point = SampleRectLight(rect, center, a1, a2, light_norm, area, inv_pdf);
+    sample_point += light_norm*RN_EPSILON;
+    if (SampleIlluminationTest(rect_light, visibility, point_in_scene, normal, sample_point)) {
       hits++;
     }
   }
@@ -414,6 +733,9 @@ void ComputeRectLightReflection(R3RectLight& rect_light, RNRgb& color,
   // Reweight according to shadow hit rate
   if (total_num_samples > 0)
     color *= ((double) total_num_hits) / total_num_samples;
+
+  // Multiple importance sampled specular already accounts for visibility
+  color += mis_color;
 }
 
 ////////////////////////////////////////////////////////////////////////
@@ -489,6 +811,6 @@ void ComputeIllumination(RNRgb& color, R3Light* light, const R3Brdf *brdf,
     return;
   }
 
-  if (RayIlluminationTest(point_in_scene, point_on_light))
+  if (LightIlluminationTest(light, point_in_scene, normal, point_on_light, true))
     color += light->Reflection(*brdf, eye, point_in_scene, normal, num_light_samples);
 }
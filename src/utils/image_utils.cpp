@@ -0,0 +1,348 @@
+////////////////////////////////////////////////////////////////////////
+// Directives
+////////////////////////////////////////////////////////////////////////
+
+#include "image_utils.h"
+#include "../R3Graphics/R3Graphics.h"
+#include "../png/zlib.h"
+#include <vector>
+#include <deque>
+#include <thread>
+#include <string>
+#include <cstring>
+#include <unistd.h>
+
+using namespace std;
+
+// Bytes of filtered rows compressed together on one thread (as in pigz)
+static const int PNG_BAND_SIZE = 131072;
+
+// Bytes at the end of a band that the next band's compressor may refer back
+// to (the deflate window)
+static const int PNG_DICTIONARY_SIZE = 32768;
+
+////////////////////////////////////////////////////////////////////////
+// Streaming PNG Output
+////////////////////////////////////////////////////////////////////////
+
+// A band of filtered rows, compressed on its own thread into raw deflate
+// blocks that end on a byte boundary (so bands can be concatenated)
+struct PNGBand {
+  vector<unsigned char> data;        // Filtered rows (each led by its filter type)
+  vector<unsigned char> dictionary;  // End of the previous band's data
+  vector<unsigned char> compressed;  // Deflate blocks of data
+  uLong adler;                       // Adler-32 of data
+  bool last;                         // Ends the deflate stream
+  bool ok;                           // Compressed successfully
+  thread compressor;
+};
+
+// A PNG file being written row by row
+struct PNGStream {
+  string filename;
+  FILE *fp;
+  int width;
+  int height;
+  int ncomponents;
+  int nthreads;
+  int rows_written;
+  int band_rows;
+  vector<unsigned char> prior;       // Previous row (zeros before the first)
+  vector<unsigned char> candidates;  // Row filtered with each filter type
+  vector<unsigned char> dictionary;  // End of the last band handed out
+  PNGBand *band;                     // Band being filled
+  deque<PNGBand *> pending;          // Bands being compressed, in file order
+  uLong adler;                       // Adler-32 of the bands written
+  bool started;                      // Zlib header written
+  bool ok;
+};
+
+// Write x to fp as 4 big endian bytes
+static void WriteBigEndian(FILE *fp, unsigned int x)
+{
+  unsigned char bytes[4] = { (unsigned char) (x >> 24), (unsigned char) (x >> 16),
+    (unsigned char) (x >> 8), (unsigned char) x };
+  fwrite(bytes, 1, 4, fp);
+}
+
+// Write a chunk of the given type to fp
+static void WritePNGChunk(FILE *fp, const char *type, const unsigned char *data,
+  unsigned int size)
+{
+  uLong crc = crc32(0L, Z_NULL, 0);
+  crc = crc32(crc, (const Bytef *) type, 4);
+  if (size > 0) crc = crc32(crc, data, size);
+  WriteBigEndian(fp, size);
+  fwrite(type, 1, 4, fp);
+  if (size > 0) fwrite(data, 1, size, fp);
+  WriteBigEndian(fp, crc);
+}
+
+// Paeth predictor of a byte from its left, upper and upper left neighbors
+static inline int PaethPredictor(int a, int b, int c)
+{
+  int p = a + b - c;
+  int pa = abs(p - a);
+  int pb = abs(p - b);
+  int pc = abs(p - c);
+  if (pa <= pb && pa <= pc) return a;
+  if (pb <= pc) return b;
+  return c;
+}
+
+// Append row to data, filtered with the PNG filter (none, sub, up, average or
+// paeth) whose output has the smallest sum of absolute values, as libpng does
+static void FilterPNGRow(PNGStream *stream, const unsigned char *row,
+  vector<unsigned char>& data)
+{
+  const int size = stream->width * stream->ncomponents;
+  const int bpp = stream->ncomponents;
+  const unsigned char *prior = stream->prior.data();
+  unsigned char *candidates = stream->candidates.data();
+
+  // Filter with each type
+  for (int k = 0; k < size; k++) {
+    int a = (k >= bpp) ? row[k - bpp] : 0;
+    int b = prior[k];
+    int c = (k >= bpp) ? prior[k - bpp] : 0;
+    candidates[k] = row[k];
+    candidates[size + k] = row[k] - a;
+    candidates[2*size + k] = row[k] - b;
+    candidates[3*size + k] = row[k] - ((a + b) >> 1);
+    candidates[4*size + k] = row[k] - PaethPredictor(a, b, c);
+  }
+
+  // Pick the type with the smallest output (bytes taken as signed)
+  int best_type = 0;
+  long best_sum = -1;
+  for (int type = 0; type < 5; type++) {
+    long sum = 0;
+    for (int k = 0; k < size; k++) {
+      sum += abs((int) (signed char) candidates[type*size + k]);
+    }
+    if (best_sum < 0 || sum < best_sum) {
+      best_sum = sum;
+      best_type = type;
+    }
+  }
+  data.push_back((unsigned char) best_type);
+  data.insert(data.end(), candidates + best_type*size, candidates + (best_type + 1)*size);
+}
+
+// Compress band (run on its own thread)
+static void CompressPNGBand(PNGBand *band)
+{
+  band->ok = false;
+  band->adler = adler32(adler32(0L, Z_NULL, 0), band->data.data(), band->data.size());
+
+  // Start a raw deflate stream primed with the end of the previous band
+  z_stream strm;
+  memset(&strm, 0, sizeof(strm));
+  if (deflateInit2(&strm, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8, Z_FILTERED) != Z_OK) return;
+  if (!band->dictionary.empty() &&
+      deflateSetDictionary(&strm, band->dictionary.data(), band->dictionary.size()) != Z_OK) {
+    deflateEnd(&strm);
+    return;
+  }
+
+  // Compress, ending on a byte boundary unless the band ends the stream
+  band->compressed.resize(deflateBound(&strm, band->data.size()) + 64);
+  strm.next_in = band->data.data();
+  strm.avail_in = band->data.size();
+  int flush = (band->last) ? Z_FINISH : Z_SYNC_FLUSH;
+  while (true) {
+    strm.next_out = band->compressed.data() + strm.total_out;
+    strm.avail_out = band->compressed.size() - strm.total_out;
+    int status = deflate(&strm, flush);
+    if (status == Z_STREAM_ERROR) break;
+    if (band->last && status == Z_STREAM_END) { band->ok = true; break; }
+    if (!band->last && strm.avail_in == 0 && strm.avail_out > 0) { band->ok = true; break; }
+    band->compressed.resize(2 * band->compressed.size());
+  }
+  band->compressed.resize(strm.total_out);
+  deflateEnd(&strm);
+}
+
+// Wait for the oldest band being compressed and write it as an IDAT chunk
+static void FinishPNGBand(PNGStream *stream)
+{
+  PNGBand *band = stream->pending.front();
+  stream->pending.pop_front();
+  band->compressor.join();
+  if (!band->ok) stream->ok = false;
+
+  // Wrap the deflate blocks in the zlib header and checksum
+  vector<unsigned char> chunk;
+  if (!stream->started) {
+    chunk.push_back(0x78);
+    chunk.push_back(0x9C);
+    stream->started = true;
+  }
+  chunk.insert(chunk.end(), band->compressed.begin(), band->compressed.end());
+  stream->adler = adler32_combine(stream->adler, band->adler, band->data.size());
+  if (band->last) {
+    for (int shift = 24; shift >= 0; shift -= 8) {
+      chunk.push_back((unsigned char) (stream->adler >> shift));
+    }
+  }
+  if (stream->ok) WritePNGChunk(stream->fp, "IDAT", chunk.data(), chunk.size());
+  delete band;
+}
+
+// Hand the band being filled to a compressor thread
+static void StartPNGBand(PNGStream *stream)
+{
+  PNGBand *band = stream->band;
+  stream->band = NULL;
+  band->last = (stream->rows_written == stream->height);
+  band->dictionary.swap(stream->dictionary);
+  int keep = min((int) band->data.size(), PNG_DICTIONARY_SIZE);
+  stream->dictionary.assign(band->data.end() - keep, band->data.end());
+
+  // Keep at most nthreads bands in flight
+  while ((int) stream->pending.size() >= stream->nthreads) {
+    FinishPNGBand(stream);
+  }
+  band->compressor = thread(CompressPNGBand, band);
+  stream->pending.push_back(band);
+}
+
+// Start writing a PNG of 8-bit pixels with ncomponents (1 to 4, as in
+// R2Image) to filename. Rows are compressed in bands on up to nthreads
+// threads while later rows are still being written. Returns NULL on failure
+PNGStream *OpenPNGStream(const char *filename, int width, int height, int ncomponents,
+  int nthreads)
+{
+  // Check dimensions
+  static const unsigned char color_types[5] = { 0, 0, 4, 2, 6 };
+  if (width <= 0 || height <= 0 || ncomponents < 1 || ncomponents > 4) {
+    fprintf(stderr, "Invalid dimensions for PNG file %s\n", filename);
+    return NULL;
+  }
+
+  // Open file
+  FILE *fp = fopen(filename, "wb");
+  if (!fp) {
+    fprintf(stderr, "Unable to open PNG file %s\n", filename);
+    return NULL;
+  }
+
+  // Write signature and header
+  static const unsigned char signature[8] = { 137, 'P', 'N', 'G', 13, 10, 26, 10 };
+  fwrite(signature, 1, 8, fp);
+  unsigned char header[13] = {
+    (unsigned char) (width >> 24), (unsigned char) (width >> 16),
+    (unsigned char) (width >> 8), (unsigned char) width,
+    (unsigned char) (height >> 24), (unsigned char) (height >> 16),
+    (unsigned char) (height >> 8), (unsigned char) height,
+    8, color_types[ncomponents], 0, 0, 0 };
+  WritePNGChunk(fp, "IHDR", header, 13);
+
+  // Create stream
+  PNGStream *stream = new PNGStream();
+  stream->filename = filename;
+  stream->fp = fp;
+  stream->width = width;
+  stream->height = height;
+  stream->ncomponents = ncomponents;
+  stream->nthreads = max(1, nthreads);
+  stream->rows_written = 0;
+  stream->band_rows = max(1, PNG_BAND_SIZE / (width * ncomponents + 1));
+  stream->prior.assign(width * ncomponents, 0);
+  stream->candidates.assign(5 * width * ncomponents, 0);
+  stream->band = NULL;
+  stream->adler = adler32(0L, Z_NULL, 0);
+  stream->started = false;
+  stream->ok = true;
+  return stream;
+}
+
+// Write the next row (from the top) of pixels to stream
+int WritePNGRow(PNGStream *stream, const unsigned char *row)
+{
+  if (stream->rows_written >= stream->height) {
+    fprintf(stderr, "Too many rows written to PNG stream\n");
+    stream->ok = false;
+    return 0;
+  }
+
+  // Filter row into the band being filled
+  if (!stream->band) {
+    stream->band = new PNGBand();
+    stream->band->data.reserve(stream->band_rows * (stream->width * stream->ncomponents + 1));
+  }
+  FilterPNGRow(stream, row, stream->band->data);
+  memcpy(stream->prior.data(), row, stream->prior.size());
+  stream->rows_written++;
+
+  // Compress full bands (and the last one)
+  if (stream->rows_written % stream->band_rows == 0 ||
+      stream->rows_written == stream->height) {
+    StartPNGBand(stream);
+  }
+  return stream->ok;
+}
+
+// Finish writing stream once all its rows are written, and delete it (removing
+// the partial file if anything failed)
+int ClosePNGStream(PNGStream *stream)
+{
+  // Write the bands still being compressed
+  while (!stream->pending.empty()) {
+    FinishPNGBand(stream);
+  }
+  if (stream->band) delete stream->band;
+  if (stream->rows_written != stream->height) {
+    fprintf(stderr, "PNG stream closed after %d of %d rows\n", stream->rows_written,
+      stream->height);
+    stream->ok = false;
+  }
+
+  // Write end
+  if (stream->ok) WritePNGChunk(stream->fp, "IEND", NULL, 0);
+  if (ferror(stream->fp)) stream->ok = false;
+  if (fclose(stream->fp) != 0) stream->ok = false;
+  if (!stream->ok) unlink(stream->filename.c_str());
+  int ok = stream->ok;
+  delete stream;
+  return ok;
+}
+
+////////////////////////////////////////////////////////////////////////
+// Float Output
+////////////////////////////////////////////////////////////////////////
+
+// Write radiance (indexed [x][y], the bottom row first) to filename as an
+// uncompressed PFM of 32-bit floats
+int WritePFM(const vector<vector<RNRgb> >& radiance, const char *filename)
+{
+  int width = radiance.size();
+  int height = (width > 0) ? radiance[0].size() : 0;
+
+  // Open file
+  FILE *fp = fopen(filename, "wb");
+  if (!fp) {
+    fprintf(stderr, "Unable to open PFM file %s\n", filename);
+    return 0;
+  }
+
+  // Write header (a negative scale marks little endian floats)
+  fprintf(fp, "PF\n%d %d\n-1.0\n", width, height);
+
+  // Write rows
+  vector<float> row(3 * width);
+  for (int j = 0; j < height; j++) {
+    for (int i = 0; i < width; i++) {
+      row[3*i] = radiance[i][j].R();
+      row[3*i + 1] = radiance[i][j].G();
+      row[3*i + 2] = radiance[i][j].B();
+    }
+    if (fwrite(row.data(), sizeof(float), row.size(), fp) != row.size()) break;
+  }
+
+  // Close file
+  int ok = !ferror(fp);
+  if (fclose(fp) != 0) ok = 0;
+  if (!ok) fprintf(stderr, "Unable to write PFM file %s\n", filename);
+  return ok;
+}
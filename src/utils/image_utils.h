@@ -0,0 +1,41 @@
+////////////////////////////////////////////////////////////////////////
+// Directives
+////////////////////////////////////////////////////////////////////////
+
+#ifndef IMAGE_INC
+#define IMAGE_INC
+
+#include "../R3Graphics/R3Graphics.h"
+#include <vector>
+
+using namespace std;
+
+////////////////////////////////////////////////////////////////////////
+// Streaming PNG Output
+////////////////////////////////////////////////////////////////////////
+
+// A PNG file being written row by row
+struct PNGStream;
+
+// Start writing a PNG of 8-bit pixels with ncomponents (1 to 4, as in
+// R2Image) to filename. Rows are compressed in bands on up to nthreads
+// threads while later rows are still being written. Returns NULL on failure
+PNGStream *OpenPNGStream(const char *filename, int width, int height, int ncomponents,
+  int nthreads);
+
+// Write the next row (from the top) of pixels to stream
+int WritePNGRow(PNGStream *stream, const unsigned char *row);
+
+// Finish writing stream once all its rows are written, and delete it (removing
+// the partial file if anything failed)
+int ClosePNGStream(PNGStream *stream);
+
+////////////////////////////////////////////////////////////////////////
+// Float Output
+////////////////////////////////////////////////////////////////////////
+
+// Write radiance (indexed [x][y], the bottom row first) to filename as an
+// uncompressed PFM of 32-bit floats
+int WritePFM(const vector<vector<RNRgb> >& radiance, const char *filename);
+
+#endif
@@ -0,0 +1,252 @@
+////////////////////////////////////////////////////////////////////////
+// Directives
+////////////////////////////////////////////////////////////////////////
+
+#include "importance_utils.h"
+#include "graphics_utils.h"
+#include "../render.h"
+#include "../R3Graphics/R3Graphics.h"
+#include <vector>
+#include <thread>
+#include <functional>
+
+using namespace std;
+
+////////////////////////////////////////////////////////////////////////
+// Importance Map Data
+////////////////////////////////////////////////////////////////////////
+
+// Number of grid cells along the longest axis of the scene
+static const int IMPORTANCE_GRID_RESOLUTION = 64;
+
+// Store probability of cells no importon reached (kept above zero so photons
+// are still stored, with more power, where importons were too sparse to land)
+static const RNScalar MIN_STORE_PROBABILITY = 0.05;
+
+// Max specular/transmissive bounces followed by an importon
+static const int MAX_IMPORTON_DEPTH = 16;
+
+// Grid of store probabilities over the scene bounds
+static vector<RNScalar> store_probability;
+static R3Box grid_bbox;
+static int grid_resolution[3];
+static RNScalar grid_cell_size;
+
+////////////////////////////////////////////////////////////////////////
+// Importon Tracing
+////////////////////////////////////////////////////////////////////////
+
+// Return index of the grid cell holding point (or -1 if outside the grid)
+static int GridIndex(const R3Point& point)
+{
+  int cell[3];
+  for (int a = 0; a < 3; a++) {
+    cell[a] = (int) ((point[a] - grid_bbox.Min()[a]) / grid_cell_size);
+    if (cell[a] < 0 || cell[a] >= grid_resolution[a]) return -1;
+  }
+  return (cell[2]*grid_resolution[1] + cell[1])*grid_resolution[0] + cell[0];
+}
+
+// Set up a grid over the scene bounds (padded so surfaces on the bounds are
+// inside), returning its number of cells (0 if the scene has no extent)
+static int ImportanceGrid(R3Box& bbox, RNScalar& cell_size, int resolution[3])
+{
+  bbox = SCENE->BBox();
+  cell_size = bbox.LongestAxisLength() / IMPORTANCE_GRID_RESOLUTION;
+  if (cell_size <= 0) return 0;
+  R3Vector padding(cell_size, cell_size, cell_size);
+  bbox = R3Box(bbox.Min() - padding, bbox.Max() + padding);
+  int num_cells = 1;
+  for (int a = 0; a < 3; a++) {
+    resolution[a] = (int) ceil(bbox.AxisLength((RNAxis) a) / cell_size);
+    num_cells *= resolution[a];
+  }
+  return num_cells;
+}
+
+// Count an importon in the cell holding point
+static void DepositImporton(vector<int>& counts, const R3Point& point)
+{
+  int index = GridIndex(point);
+  if (index >= 0) counts[index]++;
+}
+
+// Follow an importon from the camera until it lands on a diffuse surface
+static void TraceImporton(R3Ray ray, vector<int>& counts)
+{
+  R3SceneElement *element;
+  R3Point point;
+  R3Vector normal;
+  R3Point ray_start = ray.Start();
+  for (int iter = 0; iter < MAX_IMPORTON_DEPTH; iter++) {
+    if (!SCENE->Intersects(ray, NULL, &element, NULL, &point, &normal, NULL)) return;
+
+    // Get intersection information
+    const R3Material *material = (element) ? element->Material() : &R3default_material;
+    const R3Brdf *brdf = (material) ? material->Brdf() : &R3default_brdf;
+    if (!brdf) return;
+    R3Vector view = point - ray_start;
+    view.Normalize();
+    RNScalar cos_theta = normal.Dot(-view);
+
+    // Choose bounce by material probabilities (like a Monte Carlo path)
+    RNScalar prob_diffuse = MaxChannelVal(brdf->Diffuse());
+    RNScalar prob_transmission = MaxChannelVal(brdf->Transmission());
+    RNScalar prob_specular = MaxChannelVal(brdf->Specular());
+    RNScalar prob_total = prob_diffuse + prob_transmission + prob_specular;
+    if (prob_total <= 0) return;
+    RNScalar rand = RNThreadableRandomScalar() * prob_total;
+
+    R3Vector bounce;
+    if (rand < prob_diffuse) {
+      // Visible diffuse surface, and the surfaces final gather rays reach
+      DepositImporton(counts, point);
+      if (INDIRECT_ILLUM) {
+        bounce = Diffuse_ImportanceSample(normal, cos_theta);
+        ray = R3Ray(point + bounce * RN_EPSILON, bounce, TRUE);
+        if (SCENE->Intersects(ray, NULL, NULL, NULL, &point, NULL, NULL)) {
+          DepositImporton(counts, point);
+        }
+      }
+      return;
+    } else if (rand < prob_diffuse + prob_transmission) {
+      bounce = TransmissiveBounce(normal, view, cos_theta, brdf->IndexOfRefraction());
+    } else {
+      bounce = ReflectiveBounce(normal, view, cos_theta);
+    }
+
+    // Recur
+    ray_start = point + bounce * RN_EPSILON;
+    ray = R3Ray(ray_start, bounce, TRUE);
+  }
+}
+
+// Threadable (parallelizable) importon tracing method over a square grid of
+// jittered camera samples (rows are seeded by index, so the map is the same for
+// any number of threads)
+static void Threadable_ImportonTracer(vector<int>& counts, int side, int id)
+{
+  // World ray precomputation
+  R3Camera camera = SCENE->Camera();
+  R3Point far_org = camera.Origin() + camera.Towards() * FOCUS_DEPTH;
+  R3Vector far_right = camera.Right() * tan(camera.XFOV()) * FOCUS_DEPTH;
+  R3Vector far_up = camera.Up() * tan(camera.YFOV()) * FOCUS_DEPTH;
+
+  for (int j = 0; j < side; j++) {
+    // Each thread does 1/THREADS work
+    if (j % THREADS != id) continue;
+    RNReseedThreadRandomness(j + 1);
+    for (int i = 0; i < side; i++) {
+      RNScalar dx = 2.0 * (i + RNThreadableRandomScalar()) / side - 1.0;
+      RNScalar dy = 2.0 * (j + RNThreadableRandomScalar()) / side - 1.0;
+      R3Point far_point = far_org + (far_right * dx) + (far_up * dy);
+      TraceImporton(R3Ray(camera.Origin(), far_point), counts);
+    }
+  }
+
+  RNClearThreadRandomness();
+}
+
+////////////////////////////////////////////////////////////////////////
+// Importance Map Utils
+////////////////////////////////////////////////////////////////////////
+
+// Trace importons from the camera (through specular and transmissive bounces
+// to the first diffuse surface, and one diffuse bounce beyond it where final
+// gather rays look up photons) into a coarse grid over the scene, which gives
+// the probability with which a global photon is stored in each cell
+void BuildImportanceMap(void)
+{
+  // Start statistics
+  RNTime start_time;
+  start_time.Read();
+
+  // Set up grid over the scene
+  DeleteImportanceMap();
+  int num_cells = ImportanceGrid(grid_bbox, grid_cell_size, grid_resolution);
+  if (num_cells <= 0) return;
+
+  // Trace importons on all threads into separate counts
+  int side = (int) ceil(sqrt((RNScalar) IMPORTON_COUNT));
+  vector<vector<int> > counts(THREADS, vector<int>(num_cells, 0));
+  thread *children = new thread[THREADS - 1];
+  for (int i = 0; i < THREADS - 1; ++i) {
+    children[i] = thread(Threadable_ImportonTracer, ref(counts[i+1]), side, i+1);
+  }
+  Threadable_ImportonTracer(counts[0], side, 0);
+  for (int i = 0; i < THREADS - 1; i++)
+    children[i].join();
+  delete [] children;
+
+  // Sum counts
+  long long total_count = 0;
+  for (int c = 0; c < num_cells; c++) {
+    for (int i = 1; i < THREADS; i++) {
+      counts[0][c] += counts[i][c];
+    }
+    total_count += counts[0][c];
+  }
+  if (total_count == 0) return;
+
+  // Cells reached by importons (or next to one, since radiance estimates
+  // gather photons from neighboring cells) always store photons
+  store_probability.assign(num_cells, MIN_STORE_PROBABILITY);
+  int cells_reached = 0;
+  for (int z = 0; z < grid_resolution[2]; z++) {
+    for (int y = 0; y < grid_resolution[1]; y++) {
+      for (int x = 0; x < grid_resolution[0]; x++) {
+        int c = (z*grid_resolution[1] + y)*grid_resolution[0] + x;
+        if (counts[0][c] == 0) continue;
+        cells_reached++;
+        for (int dz = max(z - 1, 0); dz <= min(z + 1, grid_resolution[2] - 1); dz++) {
+          for (int dy = max(y - 1, 0); dy <= min(y + 1, grid_resolution[1] - 1); dy++) {
+            for (int dx = max(x - 1, 0); dx <= min(x + 1, grid_resolution[0] - 1); dx++) {
+              store_probability[(dz*grid_resolution[1] + dy)*grid_resolution[0] + dx] = 1.0;
+            }
+          }
+        }
+      }
+    }
+  }
+  RNScalar average_probability = 0;
+  for (int c = 0; c < num_cells; c++) {
+    average_probability += store_probability[c] / num_cells;
+  }
+
+  // Print statistics
+  if (VERBOSE) {
+    printf("Built importance map ...\n");
+    printf("  Time = %.2f seconds\n", start_time.Elapsed());
+    printf("  # Importons = %lld\n", total_count);
+    printf("  # Cells = %d (%d reached)\n", num_cells, cells_reached);
+    printf("  Average Store Probability = %.3f\n", average_probability);
+    fflush(stdout);
+  }
+}
+
+// Bytes of the importance map at its peak (with the importon counts of every
+// thread it is built from)
+unsigned long long int ImportanceMapBytes(void)
+{
+  R3Box bbox;
+  RNScalar cell_size;
+  int resolution[3];
+  unsigned long long int num_cells = ImportanceGrid(bbox, cell_size, resolution);
+  return num_cells * (sizeof(RNScalar) + THREADS * sizeof(int));
+}
+
+// Delete the importance map
+void DeleteImportanceMap(void)
+{
+  store_probability.clear();
+}
+
+// Return the probability with which a global photon landing on point should be
+// stored (1 if there is no importance map)
+RNScalar PhotonStoreProbability(const R3Point& point)
+{
+  if (store_probability.empty()) return 1.0;
+  int index = GridIndex(point);
+  if (index < 0) return MIN_STORE_PROBABILITY;
+  return store_probability[index];
+}
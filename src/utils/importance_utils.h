@@ -0,0 +1,31 @@
+////////////////////////////////////////////////////////////////////////
+// Directives
+////////////////////////////////////////////////////////////////////////
+
+#ifndef IMPORTANCE_INC
+#define IMPORTANCE_INC
+
+#include "../R3Graphics/R3Graphics.h"
+
+////////////////////////////////////////////////////////////////////////
+// Importance Map Utils
+////////////////////////////////////////////////////////////////////////
+
+// Trace importons from the camera (through specular and transmissive bounces
+// to the first diffuse surface, and one diffuse bounce beyond it where final
+// gather rays look up photons) into a coarse grid over the scene, which gives
+// the probability with which a global photon is stored in each cell
+void BuildImportanceMap(void);
+
+// Bytes of the importance map at its peak (with the importon counts of every
+// thread it is built from)
+unsigned long long int ImportanceMapBytes(void);
+
+// Delete the importance map
+void DeleteImportanceMap(void);
+
+// Return the probability with which a global photon landing on point should be
+// stored (1 if there is no importance map)
+RNScalar PhotonStoreProbability(const R3Point& point);
+
+#endif
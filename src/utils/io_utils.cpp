@@ -3,9 +3,12 @@
 ////////////////////////////////////////////////////////////////////////
 
 #include "io_utils.h"
+#include "image_utils.h"
+#include "trace_utils.h"
 #include "../R3Graphics/R3Graphics.h"
 #include "../render.h"
 #include <iostream>
+#include <string>
 
 using namespace std;
 
@@ -14,7 +17,8 @@ using namespace std;
 ////////////////////////////////////////////////////////////////////////
 
 int ParseArgs(int argc, char **argv, char*& input_scene_name,
-  char*& output_image_name, int& width, int& height, int& aa, bool& real_material)
+  char*& output_image_name, int& width, int& height, int& aa, bool& real_material,
+  char*& scene_cache_dir)
 {
   // Parse arguments
   argc--; argv++;
@@ -33,6 +37,8 @@ int ParseArgs(int argc, char **argv, char*& input_scene_name,
           aa *= -1;
       } else if (!strcmp(*argv, "-real")) {
         real_material = true;
+      } else if (!strcmp(*argv, "-scene_cache")) {
+        argc--; argv++; scene_cache_dir = *argv;
       } else if (!strcmp(*argv, "-no_fresnel")) {
         FRESNEL = false;
       } else if (!strcmp(*argv, "-ir")) {
@@ -73,6 +79,15 @@ int ParseArgs(int argc, char **argv, char*& input_scene_name,
         argc--; argv++; PROB_ABSORB = atof(*argv);
         if (PROB_ABSORB < 0)
           PROB_ABSORB = 0;
+      } else if (!strcmp(*argv, "-rr")) {
+        argc--; argv++; RR_MIN_DEPTH = atoi(*argv);
+        RUSSIAN_ROULETTE = true;
+        if (RR_MIN_DEPTH < 0)
+          RR_MIN_DEPTH = 0;
+      } else if (!strcmp(*argv, "-ray_budget")) {
+        argc--; argv++; RAY_BUDGET = atoi(*argv);
+        if (RAY_BUDGET < 0)
+          RAY_BUDGET = 0;
       } else if (!strcmp(*argv, "-no_rs")) {
         RECURSIVE_SHADOWS = false;
       } else if (!strcmp(*argv, "-no_dt")) {
@@ -101,10 +116,23 @@ int ParseArgs(int argc, char **argv, char*& input_scene_name,
         argc--; argv++; MAX_PHOTON_DEPTH = atoi(*argv);
         if (MAX_PHOTON_DEPTH < 1)
           MAX_PHOTON_DEPTH = 1;
+      } else if (!strcmp(*argv, "-qmc_photons")) {
+        QMC_PHOTONS = true;
+      } else if (!strcmp(*argv, "-importons")) {
+        argc--; argv++; IMPORTON_COUNT = atoi(*argv);
+        if (IMPORTON_COUNT < 0)
+          IMPORTON_COUNT = 0;
       } else if (!strcmp(*argv, "-it")) {
         argc--; argv++; INDIRECT_TEST = atoi(*argv);
         if (INDIRECT_TEST < 1)
           INDIRECT_TEST = 1;
+      } else if (!strcmp(*argv, "-guide")) {
+        argc--; argv++; GUIDE_COSINE_PROB = atof(*argv);
+        GUIDED_GATHER = true;
+        if (GUIDE_COSINE_PROB < 0.05)
+          GUIDE_COSINE_PROB = 0.05;
+        if (GUIDE_COSINE_PROB > 1.0)
+          GUIDE_COSINE_PROB = 1.0;
       } else if (!strcmp(*argv, "-gs")) {
         argc--; argv++; GLOBAL_ESTIMATE_SIZE = atoi(*argv);
         if (GLOBAL_ESTIMATE_SIZE < 1)
@@ -155,6 +183,33 @@ int ParseArgs(int argc, char **argv, char*& input_scene_name,
         argc--; argv++; SHADOW_TEST = atoi(*argv);
         if (SHADOW_TEST < 0)
           SHADOW_TEST = 0;
+      } else if (!strcmp(*argv, "-solid_angle")) {
+        SOLID_ANGLE_SAMPLING = true;
+      } else if (!strcmp(*argv, "-concentric_disk")) {
+        CONCENTRIC_DISK_SAMPLING = true;
+      } else if (!strcmp(*argv, "-mis")) {
+        MIS = true;
+      } else if (!strcmp(*argv, "-light_tree")) {
+        argc--; argv++; LIGHT_TREE_SAMPLES = atoi(*argv);
+        if (LIGHT_TREE_SAMPLES < 0)
+          LIGHT_TREE_SAMPLES = 0;
+      } else if (!strcmp(*argv, "-no_occluder_cache")) {
+        OCCLUDER_CACHE = false;
+      } else if (!strcmp(*argv, "-visibility_grid")) {
+        argc--; argv++; VISIBILITY_GRID = atoi(*argv);
+        if (VISIBILITY_GRID < 0)
+          VISIBILITY_GRID = 0;
+        if (VISIBILITY_GRID > 256) // 2 x 256^3 cells (128 MB) per light
+          VISIBILITY_GRID = 256;
+      } else if (!strcmp(*argv, "-shadow_photons")) {
+        argc--; argv++; SHADOW_PHOTON_COUNT = atoi(*argv);
+        if (SHADOW_PHOTON_COUNT < 0)
+          SHADOW_PHOTON_COUNT = 0;
+      } else if (!strcmp(*argv, "-shadow_estimate")) {
+        argc--; argv++; SHADOW_ESTIMATE_SIZE = atoi(*argv);
+        argc--; argv++; SHADOW_ESTIMATE_DIST = atof(*argv);
+        if (SHADOW_ESTIMATE_SIZE < 1)
+          SHADOW_ESTIMATE_SIZE = 1;
       }
       else if (!strcmp(*argv, "-dof")) {
         DEPTH_OF_FIELD = TRUE;
@@ -167,6 +222,59 @@ int ParseArgs(int argc, char **argv, char*& input_scene_name,
           FOCUS_DEPTH = RN_EPSILON;
         if (APERTURE_RADIUS <= 0)
           APERTURE_RADIUS = RN_EPSILON;
+      }
+      // Denoising and auxiliary outputs
+      else if (!strcmp(*argv, "-denoise")) {
+        argc--; argv++; DENOISE = atoi(*argv);
+        if (DENOISE < 0)
+          DENOISE = 0;
+      } else if (!strcmp(*argv, "-aovs")) {
+        WRITE_AOVS = true;
+      }
+      // Distributed rendering
+      else if (!strcmp(*argv, "-distribute")) {
+        argc--; argv++; JOB_DIR = *argv;
+        argc--; argv++; JOB_WORKERS = atoi(*argv);
+        if (JOB_WORKERS < 0)
+          JOB_WORKERS = 0;
+      } else if (!strcmp(*argv, "-worker")) {
+        argc--; argv++; JOB_DIR = *argv;
+        JOB_WORKER = true;
+      }
+      // Camera path
+      else if (!strcmp(*argv, "-camera_path")) {
+        argc--; argv++; CAMERA_PATH = *argv;
+      }
+      // Pipelined rendering
+      else if (!strcmp(*argv, "-pipeline")) {
+        PIPELINE = true;
+      }
+      // Tracing
+      else if (!strcmp(*argv, "-trace")) {
+        argc--; argv++; TRACE_FILE = *argv;
+      }
+      // Fixed seed
+      else if (!strcmp(*argv, "-seed")) {
+        argc--; argv++; RANDOM_SEED = (unsigned int) atoi(*argv);
+      }
+      // Microbenchmarks
+      else if (!strcmp(*argv, "-microbench")) {
+        MICROBENCH = true;
+      }
+      // Hardware counters
+      else if (!strcmp(*argv, "-perf")) {
+        PERF_COUNTERS = true;
+      }
+      // Memory budget
+      else if (!strcmp(*argv, "-mem_budget")) {
+        argc--; argv++; MEM_BUDGET = atoi(*argv);
+      }
+      // Render server
+      else if (!strcmp(*argv, "-serve")) {
+        argc--; argv++; SERVER_SOCKET = *argv;
+        argc--; argv++; SERVER_CACHE_SIZE = atoi(*argv);
+        if (SERVER_CACHE_SIZE < 1)
+          SERVER_CACHE_SIZE = 1;
       } else if (!strcmp(*argv, "-cd")) {
         argc--; argv++; CAUSTIC_ESTIMATE_DIST = atof(*argv);
         if (CAUSTIC_ESTIMATE_DIST < 0.0)
@@ -201,12 +309,31 @@ int ParseArgs(int argc, char **argv, char*& input_scene_name,
     }
   }
 
-  // Check scene filename
-  if (!input_scene_name || !output_image_name) {
+  // Check scene filename (the server reads scenes named by its requests)
+  if (!SERVER_SOCKET && (!input_scene_name || !output_image_name)) {
     fprintf(stderr, "Usage: photonmap inputscenefile outputimagefile [-FLAGS]\n");
     return 0;
   }
 
+  // Frames are rendered by a single process
+  if (CAMERA_PATH && JOB_DIR) {
+    fprintf(stderr, "Camera paths are not supported by distributed renders\n");
+    return 0;
+  }
+
+  // Only single images overlap photon tracing with rendering
+  if (PIPELINE && (CAMERA_PATH || JOB_DIR)) {
+    fprintf(stderr, "Pipelining is not supported by camera paths or distributed renders\n");
+    PIPELINE = false;
+  }
+
+  // Tiles are rendered without first hit buffers
+  if (JOB_DIR && (DENOISE > 0 || WRITE_AOVS)) {
+    fprintf(stderr, "Denoising and AOVs are not supported by distributed renders\n");
+    DENOISE = 0;
+    WRITE_AOVS = false;
+  }
+
   // Return OK status
   return 1;
 }
@@ -216,7 +343,7 @@ int ParseArgs(int argc, char **argv, char*& input_scene_name,
 ////////////////////////////////////////////////////////////////////////
 
 // Read scene from file
-R3Scene * ReadScene(char *filename, bool real_material)
+R3Scene * ReadScene(char *filename, bool real_material, const char *scene_cache_dir)
 {
   // Start statistics
   RNTime start_time;
@@ -230,6 +357,9 @@ R3Scene * ReadScene(char *filename, bool real_material)
     return NULL;
   }
 
+  // Flattened meshes and their hierarchies are cached by content
+  R3SetMeshCacheDirectory(scene_cache_dir);
+
   // Read scene from file
   if (!scene->ReadFile(filename, real_material)) {
     delete scene;
@@ -249,6 +379,85 @@ R3Scene * ReadScene(char *filename, bool real_material)
   return scene;
 }
 
+// Read the frames of a camera path. Each "camera <ex ey ez> <tx ty tz>
+// <ux uy uz> <xfov>" line is a frame, and each "keyframe <int N>" line
+// followed by the same values adds N frames moving evenly from the previous
+// frame to that camera. Near and far distances are taken from camera
+int ReadCameraPath(const char *filename, const R3Camera& camera, vector<R3Camera>& cameras)
+{
+  FILE *fp = fopen(filename, "r");
+  if (!fp) {
+    fprintf(stderr, "Unable to open camera path %s\n", filename);
+    return 0;
+  }
+
+  // Read commands
+  char cmd[128];
+  int command_number = 0;
+  cameras.clear();
+  while (fscanf(fp, "%127s", cmd) == 1) {
+    if (cmd[0] == '#') {
+      // Skip comment
+      int c;
+      while ((c = fgetc(fp)) != EOF && c != '\n');
+      continue;
+    }
+    command_number++;
+
+    // Read frame count and camera
+    int nframes = 1;
+    if (!strcmp(cmd, "keyframe")) {
+      if (fscanf(fp, "%d", &nframes) != 1 || nframes < 1 || cameras.empty()) {
+        fprintf(stderr, "Invalid keyframe at command %d in %s\n", command_number, filename);
+        fclose(fp);
+        return 0;
+      }
+    } else if (strcmp(cmd, "camera")) {
+      fprintf(stderr, "Unrecognized command %s in %s\n", cmd, filename);
+      fclose(fp);
+      return 0;
+    }
+    R3Point e;
+    R3Vector t, u;
+    RNScalar xfov;
+    if (fscanf(fp, "%lf%lf%lf%lf%lf%lf%lf%lf%lf%lf", &e[0], &e[1], &e[2],
+        &t[0], &t[1], &t[2], &u[0], &u[1], &u[2], &xfov) != 10) {
+      fprintf(stderr, "Unable to read camera at command %d in %s\n", command_number, filename);
+      fclose(fp);
+      return 0;
+    }
+    t.Normalize();
+    u.Normalize();
+
+    // Add frames (interpolating from the previous frame for keyframes)
+    if (!strcmp(cmd, "camera")) {
+      cameras.push_back(R3Camera(e, t, u, xfov, xfov, camera.Near(), camera.Far()));
+      continue;
+    }
+    R3Camera start = cameras.back();
+    for (int i = 1; i <= nframes; i++) {
+      RNScalar s = (RNScalar) i / nframes;
+      R3Point frame_e = start.Origin() + s * (e - start.Origin());
+      R3Vector frame_t = (1 - s) * start.Towards() + s * t;
+      R3Vector frame_u = (1 - s) * start.Up() + s * u;
+      frame_t.Normalize();
+      frame_u.Normalize();
+      RNScalar frame_xfov = (1 - s) * start.XFOV() + s * xfov;
+      cameras.push_back(R3Camera(frame_e, frame_t, frame_u, frame_xfov, frame_xfov,
+        camera.Near(), camera.Far()));
+    }
+  }
+  fclose(fp);
+
+  if (cameras.empty()) {
+    fprintf(stderr, "No cameras in camera path %s\n", filename);
+    return 0;
+  }
+
+  // Return success
+  return 1;
+}
+
 ////////////////////////////////////////////////////////////////////////
 // Ouput
 ////////////////////////////////////////////////////////////////////////
@@ -267,15 +476,47 @@ void PrintProgress(const double progress, const int width)
   cout.flush();
 }
 
-// Write image to file
-int WriteImage(R2Image *image, const char *filename)
+// Write image to a PNG, streaming its rows (from the top) to compressors
+static int WriteImagePNG(R2Image *image, const char *filename)
 {
+  PNGStream *stream = OpenPNGStream(filename, image->Width(), image->Height(),
+    image->NComponents(), THREADS);
+  if (!stream) return 0;
+  for (int j = image->Height() - 1; j >= 0; j--) {
+    if (!WritePNGRow(stream, image->Pixels(j))) break;
+  }
+  return ClosePNGStream(stream);
+}
+
+// Write image to file (or radiance, unclamped, if given and filename is a PFM)
+int WriteImage(R2Image *image, const char *filename,
+  const vector<vector<RNRgb> > *radiance)
+{
+  TraceScope trace("write image", "output");
+  trace.label = filename;
+
   // Start statistics
   RNTime start_time;
   start_time.Read();
 
-  // Write image to file
-  if (!image->Write(filename)) return 0;
+  // Write image to file (PNGs are compressed on all threads, and PFMs are
+  // written as floats without compression)
+  const char *extension = strrchr(filename, '.');
+  if (extension && !strcmp(extension, ".png")) {
+    if (!WriteImagePNG(image, filename)) return 0;
+  } else if (extension && !strcmp(extension, ".pfm") && radiance) {
+    if (!WritePFM(*radiance, filename)) return 0;
+  } else if (extension && !strcmp(extension, ".pfm")) {
+    vector<vector<RNRgb> > pixels(image->Width(), vector<RNRgb> (image->Height()));
+    for (int i = 0; i < image->Width(); i++) {
+      for (int j = 0; j < image->Height(); j++) {
+        pixels[i][j] = image->PixelRGB(i, j);
+      }
+    }
+    if (!WritePFM(pixels, filename)) return 0;
+  } else {
+    if (!image->Write(filename)) return 0;
+  }
 
   // Print statistics
   if (VERBOSE) {
@@ -289,3 +530,43 @@ int WriteImage(R2Image *image, const char *filename)
   // Return success
   return 1;
 }
+
+// Name of a file next to filename, with suffix appended to the base name
+// (and the extension replaced by extension, if given)
+string SuffixedName(const char *filename, const string& suffix, const char *extension)
+{
+  // Split filename at extension
+  string path(filename);
+  size_t dot = path.find_last_of('.');
+  size_t slash = path.find_last_of('/');
+  if (dot == string::npos || (slash != string::npos && dot < slash)) dot = path.size();
+
+  return path.substr(0, dot) + suffix + ((extension) ? string(extension) : path.substr(dot));
+}
+
+// Name of the image of a frame, with the frame number appended to the base
+// name (e.g. out_0007.png for frame 7 of out.png)
+string FrameImageName(const char *filename, int frame)
+{
+  char number[32];
+  sprintf(number, "_%04d", frame);
+  return SuffixedName(filename, number);
+}
+
+// Write each auxiliary image next to the output image, with the name of the
+// buffer appended to the base name (e.g. out_albedo.png for out.png)
+int WriteAOVs(const RenderAOVs& aovs, const char *filename)
+{
+  const char *names[5] = {"albedo", "normal", "depth", "direct", "indirect"};
+  R2Image *images[5] = {aovs.albedo, aovs.normal, aovs.depth, aovs.direct, aovs.indirect};
+
+  // Write images
+  for (int i = 0; i < 5; i++) {
+    if (!images[i]) continue;
+    string aov_filename = SuffixedName(filename, string("_") + names[i]);
+    if (!WriteImage(images[i], aov_filename.c_str())) return 0;
+  }
+
+  // Return success
+  return 1;
+}
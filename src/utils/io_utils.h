@@ -6,20 +6,32 @@
 #define IO_INC
 
 #include "../R3Graphics/R3Graphics.h"
+#include "../render.h"
+#include <vector>
+#include <string>
+
+using namespace std;
 
 ////////////////////////////////////////////////////////////////////////
 // Program argument parsing
 ////////////////////////////////////////////////////////////////////////
 
 int ParseArgs(int argc, char **argv, char*& input_scene_name,
-  char*& output_image_name, int& width, int& height, int& aa, bool& real_material);
+  char*& output_image_name, int& width, int& height, int& aa, bool& real_material,
+  char*& scene_cache_dir);
 
 ////////////////////////////////////////////////////////////////////////
 // Input
 ////////////////////////////////////////////////////////////////////////
 
 // Read scene from file
-R3Scene * ReadScene(char *filename, bool real_material);
+R3Scene * ReadScene(char *filename, bool real_material, const char *scene_cache_dir);
+
+// Read the frames of a camera path. Each "camera <ex ey ez> <tx ty tz>
+// <ux uy uz> <xfov>" line is a frame, and each "keyframe <int N>" line
+// followed by the same values adds N frames moving evenly from the previous
+// frame to that camera. Near and far distances are taken from camera
+int ReadCameraPath(const char *filename, const R3Camera& camera, vector<R3Camera>& cameras);
 
 ////////////////////////////////////////////////////////////////////////
 // Ouput
@@ -28,7 +40,22 @@ R3Scene * ReadScene(char *filename, bool real_material);
 // Print progress (out of 1) to stdout
 void PrintProgress(double progress, const int width);
 
-// Write image to file
-int WriteImage(R2Image *image, const char *filename);
+// Write image to file (or radiance, unclamped, if given and filename is a PFM)
+int WriteImage(R2Image *image, const char *filename,
+  const vector<vector<RNRgb> > *radiance = NULL);
+
+// Name of a file next to filename, with suffix appended to the base name
+// (and the extension replaced by extension, if given), e.g. out_albedo.png
+// for out.png and suffix _albedo
+string SuffixedName(const char *filename, const string& suffix,
+  const char *extension = NULL);
+
+// Name of the image of a frame, with the frame number appended to the base
+// name (e.g. out_0007.png for frame 7 of out.png)
+string FrameImageName(const char *filename, int frame);
+
+// Write each auxiliary image next to the output image, with the name of the
+// buffer appended to the base name (e.g. out_albedo.png for out.png)
+int WriteAOVs(const RenderAOVs& aovs, const char *filename);
 
 #endif
@@ -0,0 +1,223 @@
+////////////////////////////////////////////////////////////////////////
+// Directives
+////////////////////////////////////////////////////////////////////////
+
+#include "light_utils.h"
+#include "graphics_utils.h"
+#include "../render.h"
+#include "../R3Graphics/R3Graphics.h"
+#include <vector>
+#include <algorithm>
+
+using namespace std;
+
+////////////////////////////////////////////////////////////////////////
+// Light Tree Data
+////////////////////////////////////////////////////////////////////////
+
+// Node of light tree (nodes are stored depth first, so the left child of an
+// interior node immediately follows it)
+struct LightTreeNode {
+  R3Box bbox;       // Bounds of the lights below node
+  RNScalar power;   // Total power of the lights below node
+  R3Light *light;   // Light (leaves only)
+  int right;        // Index of right child (interior nodes only)
+};
+
+// Light tree, and lights without a position
+static vector<LightTreeNode> light_tree;
+static vector<R3Light *> unbounded_lights;
+
+////////////////////////////////////////////////////////////////////////
+// Light Tree Construction
+////////////////////////////////////////////////////////////////////////
+
+// Light with its bounds and power, used while building the tree
+struct LightTreeEntry {
+  R3Light *light;
+  R3Box bbox;
+  R3Point centroid;
+  RNScalar power;
+};
+
+// Return the bounds of the emitting surface of a positioned light
+static R3Box LightBounds(R3Light *light)
+{
+  R3Box bbox = R3null_box;
+  if (light->ClassID() == R3PointLight::CLASS_ID()) {
+    bbox.Union(((R3PointLight *) light)->Position());
+  } else if (light->ClassID() == R3SpotLight::CLASS_ID()) {
+    bbox.Union(((R3SpotLight *) light)->Position());
+  } else if (light->ClassID() == R3AreaLight::CLASS_ID()) {
+    R3AreaLight *area_light = (R3AreaLight *) light;
+    R3Vector r(area_light->Radius(), area_light->Radius(), area_light->Radius());
+    bbox.Union(area_light->Position() - r);
+    bbox.Union(area_light->Position() + r);
+  } else if (light->ClassID() == R3RectLight::CLASS_ID()) {
+    R3RectLight *rect_light = (R3RectLight *) light;
+    R3Vector a1 = rect_light->PrimaryAxis() * (0.5 * rect_light->PrimaryLength());
+    R3Vector a2 = rect_light->SecondaryAxis() * (0.5 * rect_light->SecondaryLength());
+    const R3Point& c = rect_light->Position();
+    bbox.Union(c + a1 + a2);
+    bbox.Union(c + a1 - a2);
+    bbox.Union(c - a1 + a2);
+    bbox.Union(c - a1 - a2);
+  }
+  return bbox;
+}
+
+// Recursively build subtree over entries [start, end); returns total power
+static RNScalar BuildLightSubtree(vector<LightTreeEntry>& entries, int start, int end)
+{
+  // Create node
+  int index = light_tree.size();
+  light_tree.push_back(LightTreeNode());
+  LightTreeNode node;
+  node.bbox = R3null_box;
+  node.power = 0;
+  node.light = NULL;
+  node.right = -1;
+
+  // Check for leaf
+  if (end - start == 1) {
+    node.bbox = entries[start].bbox;
+    node.power = entries[start].power;
+    node.light = entries[start].light;
+    light_tree[index] = node;
+    return node.power;
+  }
+
+  // Split at median centroid along longest axis of centroid bounds
+  R3Box centroid_bbox = R3null_box;
+  for (int i = start; i < end; i++) {
+    centroid_bbox.Union(entries[i].centroid);
+  }
+  int axis = centroid_bbox.LongestAxis();
+  int mid = (start + end) / 2;
+  nth_element(entries.begin() + start, entries.begin() + mid, entries.begin() + end,
+    [axis](const LightTreeEntry& a, const LightTreeEntry& b) {
+      return a.centroid[axis] < b.centroid[axis];
+    });
+
+  // Build children (left child follows this node)
+  RNScalar left_power = BuildLightSubtree(entries, start, mid);
+  node.right = light_tree.size();
+  RNScalar right_power = BuildLightSubtree(entries, mid, end);
+
+  // Fill in node from children
+  node.bbox.Union(light_tree[index + 1].bbox);
+  node.bbox.Union(light_tree[node.right].bbox);
+  node.power = left_power + right_power;
+  light_tree[index] = node;
+  return node.power;
+}
+
+// Build a bounding volume hierarchy over the positioned lights of the scene,
+// where each node stores the bounds and total power of the lights beneath it
+void BuildLightTree(void)
+{
+  // Start statistics
+  RNTime start_time;
+  start_time.Read();
+
+  // Gather lights
+  DeleteLightTree();
+  vector<LightTreeEntry> entries;
+  for (int i = 0; i < SCENE_NLIGHTS; i++) {
+    R3Light *light = SCENE->Light(i);
+    R3Box bbox = LightBounds(light);
+    if (bbox.IsEmpty()) {
+      // Directional lights have no position
+      unbounded_lights.push_back(light);
+      continue;
+    }
+    LightTreeEntry entry;
+    entry.light = light;
+    entry.bbox = bbox;
+    entry.centroid = bbox.Centroid();
+    entry.power = (light->IsActive()) ? LightPower(light) : 0;
+    entries.push_back(entry);
+  }
+
+  // Build tree
+  if (!entries.empty()) {
+    light_tree.reserve(2 * entries.size());
+    BuildLightSubtree(entries, 0, entries.size());
+  }
+
+  // Print statistics
+  if (VERBOSE) {
+    printf("Built light tree ...\n");
+    printf("  Time = %.2f seconds\n", start_time.Elapsed());
+    printf("  # Lights in Tree = %d\n", (int) entries.size());
+    printf("  # Unbounded Lights = %d\n", (int) unbounded_lights.size());
+    printf("  # Nodes = %d\n", (int) light_tree.size());
+    fflush(stdout);
+  }
+}
+
+// Delete the light tree
+void DeleteLightTree(void)
+{
+  light_tree.clear();
+  unbounded_lights.clear();
+}
+
+////////////////////////////////////////////////////////////////////////
+// Light Tree Sampling
+////////////////////////////////////////////////////////////////////////
+
+// Return the number of lights that have no position (i.e. directional lights),
+// which are not in the tree and must be sampled every time
+int NUnboundedLights(void)
+{
+  return unbounded_lights.size();
+}
+
+// Return the k-th light without a position
+R3Light *UnboundedLight(int k)
+{
+  return unbounded_lights[k];
+}
+
+// Estimate of how much a subtree contributes to point: power over squared
+// distance, where the distance is clamped to the size of the node's bounds
+static RNScalar LightTreeImportance(const LightTreeNode& node, const R3Point& point)
+{
+  RNScalar d2 = R3SquaredDistance(point, node.bbox.Centroid());
+  RNScalar r = node.bbox.DiagonalRadius();
+  if (d2 < r * r) d2 = r * r;
+  if (d2 < RN_EPSILON) d2 = RN_EPSILON;
+  return node.power / d2;
+}
+
+// Stochastically walk the light tree toward lights that are bright and close to
+// point; returns the chosen light (or NULL if the tree is empty) and sets pdf to
+// the probability with which it was chosen
+R3Light *SampleLightTree(const R3Point& point, RNScalar& pdf)
+{
+  pdf = 0;
+  if (light_tree.empty()) return NULL;
+
+  // Descend, choosing each child with probability proportional to importance
+  pdf = 1.0;
+  int index = 0;
+  while (!light_tree[index].light) {
+    int left = index + 1;
+    int right = light_tree[index].right;
+    RNScalar left_importance = LightTreeImportance(light_tree[left], point);
+    RNScalar right_importance = LightTreeImportance(light_tree[right], point);
+    RNScalar total = left_importance + right_importance;
+    RNScalar p_left = (total > 0) ? left_importance / total : 0.5;
+    if (RNThreadableRandomScalar() < p_left) {
+      pdf *= p_left;
+      index = left;
+    } else {
+      pdf *= 1.0 - p_left;
+      index = right;
+    }
+  }
+
+  // Return light at leaf
+  return light_tree[index].light;
+}
@@ -0,0 +1,33 @@
+////////////////////////////////////////////////////////////////////////
+// Directives
+////////////////////////////////////////////////////////////////////////
+
+#ifndef LIGHT_INC
+#define LIGHT_INC
+
+#include "../R3Graphics/R3Graphics.h"
+
+////////////////////////////////////////////////////////////////////////
+// Light Tree Utils
+////////////////////////////////////////////////////////////////////////
+
+// Build a bounding volume hierarchy over the positioned lights of the scene,
+// where each node stores the bounds and total power of the lights beneath it
+void BuildLightTree(void);
+
+// Delete the light tree
+void DeleteLightTree(void);
+
+// Return the number of lights that have no position (i.e. directional lights),
+// which are not in the tree and must be sampled every time
+int NUnboundedLights(void);
+
+// Return the k-th light without a position
+R3Light *UnboundedLight(int k);
+
+// Stochastically walk the light tree toward lights that are bright and close to
+// point; returns the chosen light (or NULL if the tree is empty) and sets pdf to
+// the probability with which it was chosen
+R3Light *SampleLightTree(const R3Point& point, RNScalar& pdf);
+
+#endif
@@ -0,0 +1,277 @@
+////////////////////////////////////////////////////////////////////////
+// Directives
+////////////////////////////////////////////////////////////////////////
+
+#include "memory_utils.h"
+#include "importance_utils.h"
+#include "visibility_utils.h"
+#include "../render.h"
+#include <vector>
+#include <string>
+#include <mutex>
+#include <algorithm>
+#include <cstdio>
+#include <unistd.h>
+#include <sys/resource.h>
+
+using namespace std;
+
+// Names of the subsystems (indexed by Memory_Subsystem)
+static const char *memory_subsystem_names[NUM_MEMORY_SUBSYSTEMS] = {
+  "scene", "global photons", "caustic photons", "shadow photons", "kdtrees",
+  "irradiance cache", "image buffers"
+};
+
+// Fewest photons (as a fraction of those asked for) a budget may cut a map to
+static const RNScalar MIN_BUDGET_PHOTON_FRACTION = 0.1;
+
+// Memory sampled at the end of a phase
+struct MemorySample {
+  string phase;
+  unsigned long long int rss;
+  unsigned long long int peak_rss;
+  unsigned long long int tracked;
+};
+
+// Bytes tracked by subsystem, now and at their peak, and samples of phases
+static mutex memory_lock;
+static unsigned long long int tracked_bytes[NUM_MEMORY_SUBSYSTEMS];
+static unsigned long long int peak_tracked_bytes[NUM_MEMORY_SUBSYSTEMS];
+static unsigned long long int tracked_total;
+static unsigned long long int peak_tracked_total;
+static vector<MemorySample> memory_samples;
+
+////////////////////////////////////////////////////////////////////////
+// Accounting
+////////////////////////////////////////////////////////////////////////
+
+void TrackMemory(int subsystem, long long int bytes)
+{
+  lock_guard<mutex> lk(memory_lock);
+  if (bytes < 0 && (unsigned long long int) -bytes > tracked_bytes[subsystem]) {
+    bytes = -(long long int) tracked_bytes[subsystem];
+  }
+  tracked_bytes[subsystem] += bytes;
+  tracked_total += bytes;
+  if (tracked_bytes[subsystem] > peak_tracked_bytes[subsystem]) {
+    peak_tracked_bytes[subsystem] = tracked_bytes[subsystem];
+  }
+  if (tracked_total > peak_tracked_total) peak_tracked_total = tracked_total;
+}
+
+unsigned long long int TrackedMemory(int subsystem)
+{
+  lock_guard<mutex> lk(memory_lock);
+  return tracked_bytes[subsystem];
+}
+
+unsigned long long int CurrentRSS(void)
+{
+#ifdef __linux__
+  FILE *fp = fopen("/proc/self/statm", "r");
+  if (!fp) return 0;
+  unsigned long long int size, resident;
+  int count = fscanf(fp, "%llu %llu", &size, &resident);
+  fclose(fp);
+  if (count != 2) return 0;
+  return resident * sysconf(_SC_PAGESIZE);
+#else
+  return 0;
+#endif
+}
+
+unsigned long long int PeakRSS(void)
+{
+  struct rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage)) return 0;
+#ifdef __APPLE__
+  return usage.ru_maxrss;
+#else
+  return (unsigned long long int) usage.ru_maxrss * 1024;
+#endif
+}
+
+void SampleMemory(const char *phase)
+{
+  MemorySample sample;
+  sample.phase = phase;
+  sample.rss = CurrentRSS();
+  sample.peak_rss = max(PeakRSS(), sample.rss);
+  lock_guard<mutex> lk(memory_lock);
+  sample.tracked = tracked_total;
+  memory_samples.push_back(sample);
+}
+
+////////////////////////////////////////////////////////////////////////
+// Output
+////////////////////////////////////////////////////////////////////////
+
+// Megabytes of bytes
+static double MB(unsigned long long int bytes)
+{
+  return bytes / (1024.0 * 1024.0);
+}
+
+void PrintMemoryUsage(void)
+{
+  lock_guard<mutex> lk(memory_lock);
+  printf("Memory usage ...\n");
+  printf("  %-18s %12s %12s\n", "Subsystem", "Current MB", "Peak MB");
+  for (int i = 0; i < NUM_MEMORY_SUBSYSTEMS; i++) {
+    printf("  %-18s %12.1f %12.1f\n", memory_subsystem_names[i],
+      MB(tracked_bytes[i]), MB(peak_tracked_bytes[i]));
+  }
+  printf("  %-18s %12.1f %12.1f\n", "tracked total", MB(tracked_total), MB(peak_tracked_total));
+  for (unsigned int i = 0; i < memory_samples.size(); i++) {
+    const MemorySample& sample = memory_samples[i];
+    printf("  After %s: RSS = %.1f MB, Peak RSS = %.1f MB, Tracked = %.1f MB\n",
+      sample.phase.c_str(), MB(sample.rss), MB(sample.peak_rss), MB(sample.tracked));
+  }
+  fflush(stdout);
+}
+
+////////////////////////////////////////////////////////////////////////
+// Memory Budget
+////////////////////////////////////////////////////////////////////////
+
+// Bytes of kdtree nodes per point (leaves are about half full, and there are
+// about as many inner nodes as leaves)
+static double KdtreeBytesPerPoint(void)
+{
+  return 4.0 * sizeof(R3KdtreeNode<Photon *>) / R3kdtree_max_points_per_node;
+}
+
+// Whether any material of SCENE reflects or transmits specularly (without
+// one, no photon is stored in the caustic map)
+static bool SceneHasCaustics(void)
+{
+  for (int i = 0; i < SCENE->NBrdfs(); i++) {
+    R3Brdf *brdf = SCENE->Brdf(i);
+    if (brdf->IsSpecular() || brdf->IsTransparent()) return true;
+  }
+  return false;
+}
+
+// Number of active area and rect lights of SCENE (which get shadow photons)
+static int NumShadowPhotonLights(void)
+{
+  int count = 0;
+  for (int i = 0; i < SCENE_NLIGHTS; i++) {
+    R3Light *light = SCENE->Light(i);
+    if (!(light->IsActive())) continue;
+    if (light->ClassID() == R3AreaLight::CLASS_ID() ||
+        light->ClassID() == R3RectLight::CLASS_ID()) count++;
+  }
+  return count;
+}
+
+// Estimated bytes of the photon maps, with the copies of photons made while
+// building the irradiance cache (batches of traced photons are appended to
+// the maps as they finish, so their copies are few)
+static void EstimatePhotonMapBytes(double& global_bytes, double& caustic_bytes, double& shadow_bytes)
+{
+  global_bytes = caustic_bytes = shadow_bytes = 0;
+  if (SCENE_NLIGHTS <= 0) return;
+  double photon_bytes = HeapObjectBytes(1, sizeof(Photon)) + KdtreeBytesPerPoint();
+  if (INDIRECT_ILLUM || DIRECT_PHOTON_ILLUM) {
+    global_bytes = GLOBAL_PHOTON_COUNT * photon_bytes;
+    if (IRRADIANCE_CACHE) global_bytes += GLOBAL_PHOTON_COUNT * HeapObjectBytes(1, sizeof(Photon));
+  }
+  if (CAUSTIC_ILLUM && SceneHasCaustics()) {
+    caustic_bytes = CAUSTIC_PHOTON_COUNT * photon_bytes;
+  }
+  if (SHADOW_PHOTON_COUNT > 0 && SHADOWS && SOFT_SHADOWS) {
+    double shadow_photon_bytes = HeapObjectBytes(1, sizeof(ShadowPhoton)) +
+      2 * sizeof(ShadowPhoton) + sizeof(ShadowPhoton *) + KdtreeBytesPerPoint();
+    shadow_bytes = (double) SHADOW_PHOTON_COUNT * NumShadowPhotonLights() * shadow_photon_bytes;
+  }
+}
+
+int FitMemoryBudget(int& aa, int width, int height)
+{
+  // Tiles and photons of distributed renders must match in every process
+  if (JOB_DIR) {
+    fprintf(stderr, "Memory budget is not supported with -distribute, ignoring it\n");
+    return 1;
+  }
+
+  // Estimate memory of the render
+  double budget = MEM_BUDGET * 1024.0 * 1024.0;
+  double resident = CurrentRSS();
+  if (resident <= 0) resident = PeakRSS();
+  double global_bytes, caustic_bytes, shadow_bytes;
+  EstimatePhotonMapBytes(global_bytes, caustic_bytes, shadow_bytes);
+  double photon_bytes = global_bytes + caustic_bytes + shadow_bytes;
+  bool first_hit_buffers = DENOISE > 0 || WRITE_AOVS;
+  double buffer_bytes = SampleBufferBytes(aa, width, height, first_hit_buffers);
+  double grid_bytes = LightVisibilityBytes();
+  if (IMPORTON_COUNT > 0 && (INDIRECT_ILLUM || DIRECT_PHOTON_ILLUM)) grid_bytes += ImportanceMapBytes();
+  double available = budget - resident - grid_bytes;
+  if (VERBOSE) {
+    printf("Memory budget ...\n");
+    printf("  Budget = %.1f MB\n", MB(budget));
+    printf("  Resident = %.1f MB\n", MB(resident));
+    printf("  Importance and Visibility Grids = %.1f MB (estimated)\n", MB(grid_bytes));
+    printf("  Photon Maps = %.1f MB (estimated)\n", MB(photon_bytes));
+    printf("  Sample Buffers = %.1f MB (estimated, with denoiser buffers)\n", MB(buffer_bytes));
+    fflush(stdout);
+  }
+  if (resident + grid_bytes + photon_bytes + buffer_bytes <= budget) return 1;
+  if (available <= 0) {
+    fprintf(stderr, "Scene and its grids take %.1f MB, over the memory budget of %d MB\n",
+      MB(resident + grid_bytes), MEM_BUDGET);
+    return 0;
+  }
+
+  // Lower anti-aliasing while the sample buffers take the larger share, or
+  // while the photon maps would otherwise be cut too far
+  int budget_aa = aa;
+  while (budget_aa > 0 && photon_bytes + buffer_bytes > available &&
+         (buffer_bytes >= photon_bytes ||
+          buffer_bytes + MIN_BUDGET_PHOTON_FRACTION * photon_bytes > available)) {
+    budget_aa--;
+    buffer_bytes = SampleBufferBytes(budget_aa, width, height, first_hit_buffers);
+  }
+
+  // Scale photon counts down to fit the rest
+  RNScalar scale = 1.0;
+  if (photon_bytes + buffer_bytes > available) {
+    scale = (available - buffer_bytes) / photon_bytes;
+    if (scale < MIN_BUDGET_PHOTON_FRACTION) {
+      fprintf(stderr, "Render needs %.1f MB, over the memory budget of %d MB "
+        "even with a tenth of the photons (%.1f MB resident, %.1f MB of grids, %.1f MB of photon maps, "
+        "%.1f MB of sample buffers at -aa %d)\n",
+        MB(resident + grid_bytes + MIN_BUDGET_PHOTON_FRACTION * photon_bytes + buffer_bytes), MEM_BUDGET,
+        MB(resident), MB(grid_bytes), MB(MIN_BUDGET_PHOTON_FRACTION * photon_bytes), MB(buffer_bytes),
+        budget_aa);
+      return 0;
+    }
+  }
+
+  // Apply and report downscaling
+  if (budget_aa != aa) {
+    fprintf(stderr, "Memory budget of %d MB lowers -aa from %d to %d\n", MEM_BUDGET, aa, budget_aa);
+    aa = budget_aa;
+  }
+  if (scale < 1.0) {
+    if (global_bytes > 0) {
+      int count = max(1, (int) (scale * GLOBAL_PHOTON_COUNT));
+      fprintf(stderr, "Memory budget of %d MB lowers global photons from %d to %d\n",
+        MEM_BUDGET, GLOBAL_PHOTON_COUNT, count);
+      GLOBAL_PHOTON_COUNT = count;
+    }
+    if (caustic_bytes > 0) {
+      int count = max(1, (int) (scale * CAUSTIC_PHOTON_COUNT));
+      fprintf(stderr, "Memory budget of %d MB lowers caustic photons from %d to %d\n",
+        MEM_BUDGET, CAUSTIC_PHOTON_COUNT, count);
+      CAUSTIC_PHOTON_COUNT = count;
+    }
+    if (shadow_bytes > 0) {
+      int count = max(1, (int) (scale * SHADOW_PHOTON_COUNT));
+      fprintf(stderr, "Memory budget of %d MB lowers shadow photons from %d to %d\n",
+        MEM_BUDGET, SHADOW_PHOTON_COUNT, count);
+      SHADOW_PHOTON_COUNT = count;
+    }
+  }
+  return 1;
+}
@@ -0,0 +1,74 @@
+////////////////////////////////////////////////////////////////////////
+// Directives
+////////////////////////////////////////////////////////////////////////
+
+#ifndef MEMORY_INC
+#define MEMORY_INC
+
+#include "../R3Graphics/R3Graphics.h"
+#include <cstddef>
+
+////////////////////////////////////////////////////////////////////////
+// Memory Accounting
+////////////////////////////////////////////////////////////////////////
+
+// Subsystems whose memory is tracked
+enum Memory_Subsystem {
+  MEM_SCENE,
+  MEM_GLOBAL_PHOTONS,
+  MEM_CAUSTIC_PHOTONS,
+  MEM_SHADOW_PHOTONS,
+  MEM_KDTREES,
+  MEM_IRRADIANCE_CACHE,
+  MEM_IMAGE_BUFFERS,
+  NUM_MEMORY_SUBSYSTEMS
+};
+
+// Add bytes (negative once freed) to the memory tracked for subsystem
+void TrackMemory(int subsystem, long long int bytes);
+
+// Bytes currently tracked for subsystem
+unsigned long long int TrackedMemory(int subsystem);
+
+// Resident set size of the process now, and at its peak so far (0 if the
+// system does not tell)
+unsigned long long int CurrentRSS(void);
+unsigned long long int PeakRSS(void);
+
+// Record the resident set size and the memory tracked at the end of phase
+void SampleMemory(const char *phase);
+
+// Print the memory tracked for each subsystem (now and at its peak) and the
+// samples of each phase
+void PrintMemoryUsage(void);
+
+// Bytes of count objects of size allocated one at a time and held by
+// pointer in an array (with the allocator's bookkeeping of each)
+inline unsigned long long int HeapObjectBytes(int count, size_t size)
+{
+  size_t chunk = (size + sizeof(size_t) + 15) / 16 * 16;
+  return (unsigned long long int) count * (chunk + sizeof(void *));
+}
+
+// Bytes of the nodes of a kdtree
+template <class PtrType>
+unsigned long long int KdtreeBytes(const R3Kdtree<PtrType> *kdtree)
+{
+  if (!kdtree) return 0;
+  return sizeof(*kdtree) + (unsigned long long int) kdtree->NNodes() * sizeof(R3KdtreeNode<PtrType>);
+}
+
+////////////////////////////////////////////////////////////////////////
+// Memory Budget
+////////////////////////////////////////////////////////////////////////
+
+// Fit the render of a width x height image into MEM_BUDGET megabytes (once
+// the scene is read), from the memory already resident and an estimate of
+// the importance and visibility grids (which are not scaled), photon maps
+// and sample buffers (with the denoiser's) to come: aa is lowered while the
+// sample buffers take the larger share, then the photon counts are scaled down.
+// Returns 0 (after printing why) if the render cannot fit without cutting
+// the photon maps below a tenth
+int FitMemoryBudget(int& aa, int width, int height);
+
+#endif
@@ -0,0 +1,413 @@
+////////////////////////////////////////////////////////////////////////
+// Directives
+////////////////////////////////////////////////////////////////////////
+
+#include "microbench_utils.h"
+#include "graphics_utils.h"
+#include "photon_utils.h"
+#include <vector>
+#include <string>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <cstdio>
+#include <cstddef>
+
+using namespace std;
+
+// Seconds each kernel runs for on every thread count
+static const double MICROBENCH_SECONDS = 0.25;
+
+// Inputs generated for each kernel (cycled through, so that generating them
+// is not timed)
+static const int MICROBENCH_INPUTS = 4096;
+
+// A kernel timed by the microbenchmarks: runs ops operations on the calling
+// thread and returns a value depending on their results (so that they are
+// not optimized away)
+typedef function<double(int)> MicrobenchKernel;
+
+// Timing of a kernel on some input data with a number of threads
+struct MicrobenchResult {
+  string kernel;
+  string data;
+  int threads;
+  int ops;            // Operations per thread
+  double seconds;
+};
+
+// Sum of the values returned by kernels
+static volatile double microbench_sink = 0;
+
+////////////////////////////////////////////////////////////////////////
+// Timing
+////////////////////////////////////////////////////////////////////////
+
+// Seconds taken by nthreads threads to each run ops operations of kernel,
+// started together once every thread is seeded (the calling thread only
+// times them, so its random numbers are left alone)
+static double TimeKernel(const MicrobenchKernel& kernel, int ops, int nthreads)
+{
+  atomic_int ready(0);
+  atomic_bool go(false);
+  vector<double> values(nthreads, 0.0);
+  vector<thread> children;
+  for (int i = 0; i < nthreads; i++) {
+    children.push_back(thread([&, i]() {
+      RNReseedThreadRandomness(i + 1);
+      ready++;
+      while (!go) this_thread::yield();
+      values[i] = kernel(ops);
+      RNClearThreadRandomness();
+    }));
+  }
+  while (ready < nthreads) this_thread::yield();
+  chrono::steady_clock::time_point start = chrono::steady_clock::now();
+  go = true;
+  for (unsigned int i = 0; i < children.size(); i++) children[i].join();
+  double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+  for (int i = 0; i < nthreads; i++) microbench_sink += values[i];
+  return seconds;
+}
+
+// Time kernel on 1, 2, 4... up to THREADS threads with as many operations per
+// thread as run for MICROBENCH_SECONDS on one, printing and appending results
+static void MeasureKernel(const char *name, const string& data, const MicrobenchKernel& kernel,
+  vector<MicrobenchResult>& results)
+{
+  // Find operations per thread (the last try also warms caches)
+  int ops = 16;
+  while (true) {
+    double seconds = TimeKernel(kernel, ops, 1);
+    if (seconds >= MICROBENCH_SECONDS || ops >= (1 << 30)) break;
+    double scale = (seconds > 0.01) ? 1.1 * MICROBENCH_SECONDS / seconds : 10.0;
+    ops = (int) min(double(1 << 30), ops * scale + 1);
+  }
+
+  // Time each thread count
+  vector<int> thread_counts;
+  for (int n = 1; n < THREADS; n *= 2) thread_counts.push_back(n);
+  thread_counts.push_back(THREADS);
+  for (unsigned int i = 0; i < thread_counts.size(); i++) {
+    MicrobenchResult result;
+    result.kernel = name;
+    result.data = data;
+    result.threads = thread_counts[i];
+    result.ops = ops;
+    result.seconds = TimeKernel(kernel, ops, result.threads);
+    results.push_back(result);
+    printf("  %-24s %-28s %3d %12.1f %12.3f\n", name, data.c_str(), result.threads,
+      1e9 * result.seconds / ops, result.threads * (double) ops / result.seconds / 1e6);
+    fflush(stdout);
+  }
+}
+
+////////////////////////////////////////////////////////////////////////
+// Kernels
+////////////////////////////////////////////////////////////////////////
+
+// Rays from random points on a sphere of radius 3 towards random points in the
+// cube [-0.5, 0.5]^3 (most hit shapes fitting the cube)
+static vector<R3Ray> ShapeRays(void)
+{
+  vector<R3Ray> rays;
+  for (int i = 0; i < MICROBENCH_INPUTS; i++) {
+    R3Vector direction = Diffuse_ImportanceSample(R3zaxis_vector, 1.0);
+    if (RNThreadableRandomScalar() < 0.5) direction.Flip();
+    R3Point origin = R3zero_point + 3 * direction;
+    R3Point target(RNThreadableRandomScalar() - 0.5, RNThreadableRandomScalar() - 0.5,
+      RNThreadableRandomScalar() - 0.5);
+    rays.push_back(R3Ray(origin, target));
+  }
+  return rays;
+}
+
+// Rays through random points of the scene camera's view
+static vector<R3Ray> CameraRays(void)
+{
+  vector<R3Ray> rays;
+  R3Camera camera = SCENE->Camera();
+  R3Vector right = camera.Right() * tan(camera.XFOV());
+  R3Vector up = camera.Up() * tan(camera.YFOV());
+  for (int i = 0; i < MICROBENCH_INPUTS; i++) {
+    RNScalar dx = 2.0 * RNThreadableRandomScalar() - 1.0;
+    RNScalar dy = 2.0 * RNThreadableRandomScalar() - 1.0;
+    R3Point far_point = camera.Origin() + camera.Towards() + right * dx + up * dy;
+    rays.push_back(R3Ray(camera.Origin(), far_point));
+  }
+  return rays;
+}
+
+// Rays from random points of the scene's bounding box in random directions
+// (like the bounces of a path)
+static vector<R3Ray> SceneRays(void)
+{
+  vector<R3Ray> rays;
+  const R3Box& bbox = SCENE->BBox();
+  for (int i = 0; i < MICROBENCH_INPUTS; i++) {
+    R3Point origin(
+      bbox.XMin() + RNThreadableRandomScalar() * bbox.XLength(),
+      bbox.YMin() + RNThreadableRandomScalar() * bbox.YLength(),
+      bbox.ZMin() + RNThreadableRandomScalar() * bbox.ZLength());
+    R3Vector direction = Diffuse_ImportanceSample(R3zaxis_vector, 1.0);
+    if (RNThreadableRandomScalar() < 0.5) direction.Flip();
+    rays.push_back(R3Ray(origin, direction, TRUE));
+  }
+  return rays;
+}
+
+// Random points in the unit cube (on its z = 0 face if flat)
+static vector<R3Point> RandomPoints(int count, bool flat)
+{
+  vector<R3Point> points(count);
+  for (int i = 0; i < count; i++) {
+    points[i].Reset(RNThreadableRandomScalar(), RNThreadableRandomScalar(),
+      (flat) ? 0.0 : RNThreadableRandomScalar());
+  }
+  return points;
+}
+
+// Photons of unit total power at points, with random directions
+static void MakePhotons(const vector<R3Point>& points, vector<Photon>& photons,
+  RNArray<Photon *>& photon_pointers)
+{
+  photons.resize(points.size());
+  RNRgb power = RNwhite_rgb / (RNScalar) points.size();
+  for (unsigned int i = 0; i < points.size(); i++) {
+    photons[i].position = points[i];
+    RNRgb_to_RGBE(power, photons[i].rgbe);
+    photons[i].direction = (unsigned short) (RNThreadableRandomScalar() * 65535);
+    photons[i].bounce = 1;
+    photon_pointers.Insert(&photons[i]);
+  }
+}
+
+// Intersection of rays with shape
+template <class Shape>
+static MicrobenchKernel IntersectKernel(const vector<R3Ray>& rays, const Shape& shape)
+{
+  return [&rays, &shape](int ops) {
+    double sum = 0;
+    RNScalar t;
+    for (int i = 0; i < ops; i++) {
+      if (R3Intersects(rays[i % MICROBENCH_INPUTS], shape, NULL, NULL, &t)) sum += t;
+    }
+    return sum;
+  };
+}
+
+// Intersection of rays with the scene graph
+static MicrobenchKernel SceneKernel(const vector<R3Ray>& rays)
+{
+  return [&rays](int ops) {
+    double sum = 0;
+    RNScalar t;
+    R3SceneNode *root = SCENE->Root();
+    for (int i = 0; i < ops; i++) {
+      if (root->Intersects(rays[i % MICROBENCH_INPUTS], NULL, NULL, NULL, NULL, NULL, &t)) sum += t;
+    }
+    return sum;
+  };
+}
+
+// Gathers of the k photons of kdtree nearest to queries, within dist
+static MicrobenchKernel GatherKernel(const vector<R3Point>& queries,
+  const R3Kdtree<Photon *>& kdtree, int k, RNScalar dist)
+{
+  return [&queries, &kdtree, k, dist](int ops) {
+    double sum = 0;
+    vector<PointAndDistanceSqd<Photon *> > nearby_points;
+    for (int i = 0; i < ops; i++) {
+      nearby_points.clear();
+      sum += kdtree.FindClosestQuick(queries[i % MICROBENCH_INPUTS], 0, dist, k, nearby_points);
+    }
+    return sum;
+  };
+}
+
+// Radiance estimates at queries on the z = 0 plane from photon_map
+static MicrobenchKernel RadianceKernel(const vector<R3Point>& queries,
+  R3Kdtree<Photon *> *photon_map, const R3Brdf& brdf, int k, RNScalar dist, Filter_Type filter)
+{
+  return [&queries, photon_map, &brdf, k, dist, filter](int ops) {
+    double sum = 0;
+    R3Vector normal = R3zaxis_vector;
+    R3Vector exact_bounce = R3zaxis_vector;
+    for (int i = 0; i < ops; i++) {
+      R3Point point = queries[i % MICROBENCH_INPUTS];
+      RNRgb color = RNblack_rgb;
+      EstimateRadiance(point, normal, color, &brdf, exact_bounce, 1.0, photon_map, k, dist, filter);
+      sum += color.R();
+    }
+    return sum;
+  };
+}
+
+////////////////////////////////////////////////////////////////////////
+// Output
+////////////////////////////////////////////////////////////////////////
+
+// Write results to filename as CSV
+static int WriteMicrobenchResults(const vector<MicrobenchResult>& results, const char *filename)
+{
+  FILE *fp = fopen(filename, "w");
+  if (!fp) {
+    fprintf(stderr, "Unable to open microbenchmark results %s\n", filename);
+    return 0;
+  }
+  fprintf(fp, "kernel,data,threads,ops_per_thread,seconds,ns_per_op,mops_per_second\n");
+  for (unsigned int i = 0; i < results.size(); i++) {
+    const MicrobenchResult& result = results[i];
+    fprintf(fp, "%s,%s,%d,%d,%.6f,%.3f,%.6f\n", result.kernel.c_str(), result.data.c_str(),
+      result.threads, result.ops, result.seconds, 1e9 * result.seconds / result.ops,
+      result.threads * (double) result.ops / result.seconds / 1e6);
+  }
+  int ok = !ferror(fp);
+  if (fclose(fp) != 0) ok = 0;
+  if (!ok) fprintf(stderr, "Unable to write microbenchmark results %s\n", filename);
+  return ok;
+}
+
+////////////////////////////////////////////////////////////////////////
+// Microbenchmarks
+////////////////////////////////////////////////////////////////////////
+
+int RunMicrobenchmarks(const char *filename)
+{
+  vector<MicrobenchResult> results;
+  printf("  %-24s %-28s %3s %12s %12s\n", "Kernel", "Data", "Thr", "ns/op", "Mops/s");
+
+  // Inputs are the same in every run
+  RNReseedThreadRandomness(1);
+  BuildDirectionLookupTable();
+
+  // Ray-primitive intersection
+  {
+    vector<R3Ray> rays = ShapeRays();
+    R3TriangleVertex v0(R3Point(-0.5, -0.5, 0)), v1(R3Point(0.5, -0.5, 0)), v2(R3Point(0, 0.5, 0));
+    R3Triangle triangle(&v0, &v1, &v2);
+    R3Sphere sphere(R3zero_point, 0.5);
+    R3Box box(-0.5, -0.5, -0.5, 0.5, 0.5, 0.5);
+    R3Cylinder cylinder(R3Point(0, -0.5, 0), R3Point(0, 0.5, 0), 0.5);
+    MeasureKernel("intersect triangle", "random rays", IntersectKernel(rays, triangle), results);
+    MeasureKernel("intersect sphere", "random rays", IntersectKernel(rays, sphere), results);
+    MeasureKernel("intersect box", "random rays", IntersectKernel(rays, box), results);
+    MeasureKernel("intersect cylinder", "random rays", IntersectKernel(rays, cylinder), results);
+  }
+
+  // Scene intersection
+  {
+    vector<R3Ray> camera_rays = CameraRays();
+    vector<R3Ray> scene_rays = SceneRays();
+    MeasureKernel("intersect scene", "camera rays", SceneKernel(camera_rays), results);
+    MeasureKernel("intersect scene", "random rays", SceneKernel(scene_rays), results);
+  }
+
+  // Photon gathers by photon count and k (within the distance expected to
+  // hold 2k photons, like a tuned estimate distance)
+  {
+    static const int photon_counts[] = {10000, 100000, 1000000};
+    static const int ks[] = {1, 8, 50, 200};
+    vector<R3Point> queries = RandomPoints(MICROBENCH_INPUTS, false);
+    for (int c = 0; c < 3; c++) {
+      vector<Photon> photons;
+      RNArray<Photon *> photon_pointers;
+      MakePhotons(RandomPoints(photon_counts[c], false), photons, photon_pointers);
+      R3Kdtree<Photon *> kdtree(photon_pointers, (int) offsetof(struct Photon, position));
+      for (int i = 0; i < 4; i++) {
+        string data = "photons=" + to_string(photon_counts[c]) + " k=" + to_string(ks[i]);
+        RNScalar dist = pow(2 * ks[i] / (4.0 / 3.0 * RN_PI * photon_counts[c]), 1.0 / 3.0);
+        MeasureKernel("kdtree gather", data, GatherKernel(queries, kdtree, ks[i], dist), results);
+      }
+    }
+  }
+
+  // Radiance estimates by filter (photons on a plane, as on a floor, gathered
+  // within the distance expected to hold twice the estimate size)
+  {
+    static const char *filter_names[] = {"disk", "cone", "gauss"};
+    static const Filter_Type filters[] = {DISK, CONE, GAUSS};
+    static const int photon_count = 100000;
+    vector<R3Point> queries = RandomPoints(MICROBENCH_INPUTS, true);
+    vector<Photon> photons;
+    RNArray<Photon *> photon_pointers;
+    MakePhotons(RandomPoints(photon_count, true), photons, photon_pointers);
+    R3Kdtree<Photon *> kdtree(photon_pointers, (int) offsetof(struct Photon, position));
+    R3Brdf brdf(RNRgb(0.2, 0.2, 0.2), RNRgb(0.5, 0.5, 0.5), RNRgb(0.3, 0.3, 0.3),
+      RNblack_rgb, 10.0);
+    RNScalar dist = sqrt(2 * GLOBAL_ESTIMATE_SIZE / (RN_PI * photon_count));
+    for (int f = 0; f < 3; f++) {
+      string data = "photons=" + to_string(photon_count) + " k=" +
+        to_string(GLOBAL_ESTIMATE_SIZE) + " " + filter_names[f];
+      MeasureKernel("estimate radiance", data, RadianceKernel(queries, &kdtree, brdf,
+        GLOBAL_ESTIMATE_SIZE, dist, filters[f]), results);
+    }
+  }
+
+  // BRDF sampling
+  {
+    vector<R3Vector> normals;
+    for (int i = 0; i < MICROBENCH_INPUTS; i++) {
+      normals.push_back(Diffuse_ImportanceSample(R3zaxis_vector, 1.0));
+    }
+    MeasureKernel("diffuse sample", "cos_theta=1", [&normals](int ops) {
+      double sum = 0;
+      for (int i = 0; i < ops; i++) {
+        sum += Diffuse_ImportanceSample(normals[i % MICROBENCH_INPUTS], 1.0).Z();
+      }
+      return sum;
+    }, results);
+    MeasureKernel("specular sample", "n=100", [&normals](int ops) {
+      double sum = 0;
+      for (int i = 0; i < ops; i++) {
+        sum += Specular_ImportanceSample(normals[i % MICROBENCH_INPUTS], 100.0, 1.0).Z();
+      }
+      return sum;
+    }, results);
+  }
+
+  // Random numbers
+  MeasureKernel("random scalar", "mt19937", [](int ops) {
+    double sum = 0;
+    for (int i = 0; i < ops; i++) sum += RNThreadableRandomScalar();
+    return sum;
+  }, results);
+
+  // RGBE conversion
+  {
+    vector<RNRgb> colors;
+    vector<unsigned char> rgbes(4 * MICROBENCH_INPUTS);
+    for (int i = 0; i < MICROBENCH_INPUTS; i++) {
+      RNRgb color(RNThreadableRandomScalar(), RNThreadableRandomScalar(), RNThreadableRandomScalar());
+      color *= 10 * RNThreadableRandomScalar();
+      colors.push_back(color);
+      RNRgb_to_RGBE(color, &rgbes[4 * i]);
+    }
+    MeasureKernel("rgbe encode", "random colors", [&colors](int ops) {
+      double sum = 0;
+      unsigned char rgbe[4];
+      for (int i = 0; i < ops; i++) {
+        RNRgb color = colors[i % MICROBENCH_INPUTS];
+        RNRgb_to_RGBE(color, rgbe);
+        sum += rgbe[3];
+      }
+      return sum;
+    }, results);
+    MeasureKernel("rgbe decode", "random colors", [&rgbes](int ops) {
+      double sum = 0;
+      unsigned char rgbe[4];
+      for (int i = 0; i < ops; i++) {
+        const unsigned char *src = &rgbes[4 * (i % MICROBENCH_INPUTS)];
+        rgbe[0] = src[0]; rgbe[1] = src[1]; rgbe[2] = src[2]; rgbe[3] = src[3];
+        sum += RGBE_to_RNRgb(rgbe).R();
+      }
+      return sum;
+    }, results);
+  }
+
+  RNClearThreadRandomness();
+
+  // Write results
+  return WriteMicrobenchResults(results, filename);
+}
@@ -0,0 +1,22 @@
+////////////////////////////////////////////////////////////////////////
+// Directives
+////////////////////////////////////////////////////////////////////////
+
+#ifndef MICROBENCH_INC
+#define MICROBENCH_INC
+
+#include "../R3Graphics/R3Graphics.h"
+#include "../render.h"
+
+////////////////////////////////////////////////////////////////////////
+// Microbenchmarks
+////////////////////////////////////////////////////////////////////////
+
+// Time the hot kernels of the renderer in isolation (ray-primitive and scene
+// intersection with SCENE, photon kdtree gathers and radiance estimates on
+// synthetic photons, BRDF sampling, random numbers and RGBE conversion) on 1,
+// 2, 4... up to THREADS threads. Prints nanoseconds per operation and total
+// throughput, and writes them to filename as CSV. Returns 0 on failure
+int RunMicrobenchmarks(const char *filename);
+
+#endif
@@ -0,0 +1,278 @@
+////////////////////////////////////////////////////////////////////////
+// Directives
+////////////////////////////////////////////////////////////////////////
+
+#include "perf_utils.h"
+#include <vector>
+#include <string>
+#include <map>
+#include <mutex>
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#ifdef __linux__
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+
+using namespace std;
+
+// Names of the events (indexed by Perf_Counter_Type)
+static const char *perf_counter_names[NUM_PERF_COUNTERS] = {
+  "cycles", "instructions", "LLC misses", "branch misses", "dTLB misses"
+};
+
+// Whether each event can be counted (found by StartPerfCounters)
+static atomic_bool counting (false);
+static bool counter_available[NUM_PERF_COUNTERS];
+
+// Events counted in a phase by a worker
+struct PerfTotals {
+  double counts[NUM_PERF_COUNTERS];
+  unsigned long long int rays;
+  unsigned long long int gathers;
+};
+
+// Totals by phase (in the order phases first ended) and worker
+static mutex perf_lock;
+static vector<string> perf_phases;
+static map<string, map<int, PerfTotals> > perf_totals;
+
+////////////////////////////////////////////////////////////////////////
+// Counter Groups
+////////////////////////////////////////////////////////////////////////
+
+#ifdef __linux__
+
+// Type and config of each event (indexed by Perf_Counter_Type)
+static void PerfEventConfig(int counter, unsigned int& type, unsigned long long int& config)
+{
+  static const unsigned long long int cache_miss =
+    PERF_COUNT_HW_CACHE_OP_READ << 8 | PERF_COUNT_HW_CACHE_RESULT_MISS << 16;
+  switch (counter) {
+  case PERF_CYCLES: type = PERF_TYPE_HARDWARE; config = PERF_COUNT_HW_CPU_CYCLES; break;
+  case PERF_INSTRUCTIONS: type = PERF_TYPE_HARDWARE; config = PERF_COUNT_HW_INSTRUCTIONS; break;
+  case PERF_LLC_MISSES: type = PERF_TYPE_HW_CACHE; config = PERF_COUNT_HW_CACHE_LL | cache_miss; break;
+  case PERF_BRANCH_MISSES: type = PERF_TYPE_HARDWARE; config = PERF_COUNT_HW_BRANCH_MISSES; break;
+  default: type = PERF_TYPE_HW_CACHE; config = PERF_COUNT_HW_CACHE_DTLB | cache_miss; break;
+  }
+}
+
+// Open a counter of event for the calling thread (in the group of leader if
+// not -1, started with it). Returns the descriptor, or -1
+static int OpenPerfEvent(int counter, int leader)
+{
+  struct perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  PerfEventConfig(counter, attr.type, attr.config);
+  attr.disabled = (leader < 0);
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED |
+    PERF_FORMAT_TOTAL_TIME_RUNNING;
+  return syscall(__NR_perf_event_open, &attr, 0, -1, leader, 0);
+}
+
+// Counters of a thread, opened as one group when the thread first enters a
+// scope and closed when it exits
+struct PerfGroup {
+  int fds[NUM_PERF_COUNTERS];       // Descriptor of each event (-1 if not counted)
+  int leader;                       // First descriptor opened
+  int order[NUM_PERF_COUNTERS];     // Events in the order read from the group
+  int size;
+  PerfGroup(void) : leader(-1), size(0) {
+    for (int i = 0; i < NUM_PERF_COUNTERS; i++) {
+      fds[i] = -1;
+      if (!counter_available[i]) continue;
+      fds[i] = OpenPerfEvent(i, leader);
+      if (fds[i] < 0) continue;
+      if (leader < 0) leader = fds[i];
+      order[size++] = i;
+    }
+    if (leader >= 0) {
+      ioctl(leader, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+      ioctl(leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    }
+  }
+  ~PerfGroup(void) {
+    for (int i = 0; i < NUM_PERF_COUNTERS; i++) {
+      if (fds[i] >= 0) close(fds[i]);
+    }
+  }
+};
+
+// Read the events counted on the calling thread so far (scaled up if the
+// counters were shared with other groups for part of the time). Returns 0 if
+// none are counted
+static int ReadPerfGroup(double counts[NUM_PERF_COUNTERS])
+{
+  static thread_local PerfGroup group;
+  for (int i = 0; i < NUM_PERF_COUNTERS; i++) counts[i] = 0;
+  if (group.leader < 0) return 0;
+  unsigned long long int values[3 + NUM_PERF_COUNTERS];
+  ssize_t size = read(group.leader, values, sizeof(values));
+  if (size < (ssize_t) (3 * sizeof(values[0])) || values[0] != (unsigned int) group.size) return 0;
+  double scale = (values[2] > 0 && values[2] < values[1]) ? (double) values[1] / values[2] : 1.0;
+  for (int i = 0; i < group.size; i++) {
+    counts[group.order[i]] = scale * values[3 + i];
+  }
+  return 1;
+}
+
+#endif
+
+////////////////////////////////////////////////////////////////////////
+// Counting
+////////////////////////////////////////////////////////////////////////
+
+int StartPerfCounters(void)
+{
+#ifdef __linux__
+  // Find the events that can be counted
+  int error = 0;
+  int num_available = 0;
+  for (int i = 0; i < NUM_PERF_COUNTERS; i++) {
+    int fd = OpenPerfEvent(i, -1);
+    counter_available[i] = (fd >= 0);
+    if (fd >= 0) {
+      close(fd);
+      num_available++;
+    } else if (!error) {
+      error = errno;
+    }
+  }
+  if (num_available == 0) {
+    fprintf(stderr, "Hardware performance counters are unavailable (%s%s)\n", strerror(error),
+      (error == EACCES || error == EPERM) ? ", see /proc/sys/kernel/perf_event_paranoid" : "");
+    return 0;
+  }
+  for (int i = 0; i < NUM_PERF_COUNTERS; i++) {
+    if (!counter_available[i]) {
+      fprintf(stderr, "Hardware performance counter for %s is unavailable\n", perf_counter_names[i]);
+    }
+  }
+  counting = true;
+  return 1;
+#else
+  fprintf(stderr, "Hardware performance counters are only supported on Linux\n");
+  return 0;
+#endif
+}
+
+bool PerfCounting(void)
+{
+  return counting;
+}
+
+PerfScope::
+PerfScope(const char *phase, int worker)
+  : rays(0),
+    gathers(0),
+    phase(phase),
+    worker(worker),
+    active(false)
+{
+#ifdef __linux__
+  if (counting) active = ReadPerfGroup(start);
+#endif
+}
+
+PerfScope::
+~PerfScope(void)
+{
+#ifdef __linux__
+  if (!active) return;
+  double end[NUM_PERF_COUNTERS];
+  if (!ReadPerfGroup(end)) return;
+
+  // Add to totals of phase and worker
+  lock_guard<mutex> lk(perf_lock);
+  map<string, map<int, PerfTotals> >::iterator it = perf_totals.find(phase);
+  if (it == perf_totals.end()) {
+    perf_phases.push_back(phase);
+    it = perf_totals.insert(make_pair(string(phase), map<int, PerfTotals>())).first;
+  }
+  map<int, PerfTotals>::iterator totals = it->second.find(worker);
+  if (totals == it->second.end()) {
+    PerfTotals zero;
+    memset(&zero, 0, sizeof(zero));
+    totals = it->second.insert(make_pair(worker, zero)).first;
+  }
+  for (int i = 0; i < NUM_PERF_COUNTERS; i++) {
+    totals->second.counts[i] += end[i] - start[i];
+  }
+  totals->second.rays += rays;
+  totals->second.gathers += gathers;
+#endif
+}
+
+////////////////////////////////////////////////////////////////////////
+// Output
+////////////////////////////////////////////////////////////////////////
+
+// Print a row of totals (events that are not counted are shown as -)
+static void PrintPerfRow(const char *name, const PerfTotals& totals)
+{
+  printf("  %-24s", name);
+  for (int i = 0; i < NUM_PERF_COUNTERS; i++) {
+    if (counter_available[i]) printf(" %13.4g", totals.counts[i]);
+    else printf(" %13s", "-");
+  }
+  if (counter_available[PERF_CYCLES] && counter_available[PERF_INSTRUCTIONS] &&
+      totals.counts[PERF_CYCLES] > 0) {
+    printf(" %6.2f", totals.counts[PERF_INSTRUCTIONS] / totals.counts[PERF_CYCLES]);
+  } else {
+    printf(" %6s", "-");
+  }
+  printf("\n");
+}
+
+// Print the misses per unit of work (e.g. per ray)
+static void PrintPerfRates(const char *unit, unsigned long long int units, const PerfTotals& totals)
+{
+  if (units == 0) return;
+  printf("    per %-6s (%llu):", unit, units);
+  for (int i = PERF_INSTRUCTIONS; i < NUM_PERF_COUNTERS; i++) {
+    if (counter_available[i]) printf(" %.4g %s", totals.counts[i] / units, perf_counter_names[i]);
+  }
+  printf("\n");
+}
+
+void PrintPerfCounters(void)
+{
+  lock_guard<mutex> lk(perf_lock);
+  if (perf_phases.empty()) return;
+  printf("Hardware performance counters ...\n");
+  printf("  %-24s", "Phase / worker");
+  for (int i = 0; i < NUM_PERF_COUNTERS; i++) printf(" %13s", perf_counter_names[i]);
+  printf(" %6s\n", "IPC");
+  for (unsigned int p = 0; p < perf_phases.size(); p++) {
+    const map<int, PerfTotals>& workers = perf_totals[perf_phases[p]];
+
+    // Sum workers
+    PerfTotals sum;
+    memset(&sum, 0, sizeof(sum));
+    for (map<int, PerfTotals>::const_iterator it = workers.begin(); it != workers.end(); ++it) {
+      for (int i = 0; i < NUM_PERF_COUNTERS; i++) sum.counts[i] += it->second.counts[i];
+      sum.rays += it->second.rays;
+      sum.gathers += it->second.gathers;
+    }
+
+    // Print phase, its workers, and its misses per ray and per gather
+    PrintPerfRow(perf_phases[p].c_str(), sum);
+    if (workers.size() > 1) {
+      for (map<int, PerfTotals>::const_iterator it = workers.begin(); it != workers.end(); ++it) {
+        char name[32];
+        sprintf(name, "  worker %d", it->first);
+        PrintPerfRow(name, it->second);
+      }
+    }
+    PrintPerfRates("ray", sum.rays, sum);
+    PrintPerfRates("gather", sum.gathers, sum);
+  }
+  fflush(stdout);
+}
@@ -0,0 +1,50 @@
+////////////////////////////////////////////////////////////////////////
+// Directives
+////////////////////////////////////////////////////////////////////////
+
+#ifndef PERF_INC
+#define PERF_INC
+
+////////////////////////////////////////////////////////////////////////
+// Hardware Performance Counters
+////////////////////////////////////////////////////////////////////////
+
+// Hardware events counted
+enum Perf_Counter_Type {
+  PERF_CYCLES,
+  PERF_INSTRUCTIONS,
+  PERF_LLC_MISSES,
+  PERF_BRANCH_MISSES,
+  PERF_DTLB_MISSES,
+  NUM_PERF_COUNTERS
+};
+
+// Start counting hardware events in the scopes of threads (Linux only).
+// Events the machine cannot count are skipped; returns 0 (after printing
+// why) if none can be counted, in which case scopes count nothing
+int StartPerfCounters(void);
+
+// Whether hardware events are being counted
+bool PerfCounting(void);
+
+// Counts the hardware events of the calling thread in the scope it is
+// declared in, adding them to the totals of its phase and worker along with
+// the rays traced and photon gathers made (set before it ends)
+class PerfScope {
+public:
+  PerfScope(const char *phase, int worker);
+  ~PerfScope(void);
+  unsigned long long int rays;
+  unsigned long long int gathers;
+private:
+  const char *phase;
+  int worker;
+  bool active;
+  double start[NUM_PERF_COUNTERS];
+};
+
+// Print the events counted in each phase, in total and per worker, with the
+// instructions per cycle and the misses per ray and per gather
+void PrintPerfCounters(void);
+
+#endif
@@ -4,6 +4,7 @@
 
 #include "photon_utils.h"
 #include "graphics_utils.h"
+#include "importance_utils.h"
 #include "../render.h"
 #include "../R3Graphics/R3Graphics.h"
 #include <vector>
@@ -38,8 +39,18 @@ int FlushPhotonStorage(vector<Photon>& local_photon_storage, Photon_Type map_typ
 // Store Photons locally in vector; if vector is full, safely copy to
 // global memory using sychronization (thread safe); uses dynamic memory
 void StorePhoton(RNRgb& photon, vector<Photon>& local_photon_storage,
-  R3Vector& incident_vector, R3Point& point, Photon_Type map_type)
+  R3Vector& incident_vector, R3Point& point, int bounce, Photon_Type map_type)
 {
+  // Store global photons by visual importance (raising the power of those kept)
+  RNRgb power = photon;
+  if (map_type == GLOBAL && IMPORTON_COUNT > 0) {
+    RNScalar store_probability = PhotonStoreProbability(point);
+    if (store_probability < 1.0) {
+      if (RNThreadableRandomScalar() >= store_probability) return;
+      power /= store_probability;
+    }
+  }
+
   // Flush buffer if necessary
   if (TEMPORARY_STORAGE_COUNT >= SIZE_LOCAL_PHOTON_STORAGE) {
     int success = FlushPhotonStorage(local_photon_storage, map_type);
@@ -52,12 +63,13 @@ void StorePhoton(RNRgb& photon, vector<Photon>& local_photon_storage,
   // Copy photon
   Photon& photon_target = local_photon_storage[TEMPORARY_STORAGE_COUNT];
   photon_target.position = point;
-  RNRgb_to_RGBE(photon, photon_target.rgbe);
+  RNRgb_to_RGBE(power, photon_target.rgbe);
   int phi = (unsigned char) (255.0
                       * (atan2(incident_vector[1], incident_vector[0]) + RN_PI)
                       / (RN_TWO_PI));
   int theta = (unsigned char) (255.0 * acos(incident_vector[2]) / RN_PI);
   photon_target.direction = phi*256 + theta;
+  photon_target.bounce = (unsigned char) min(bounce, 255);
 
   TEMPORARY_STORAGE_COUNT++;
   PHOTONS_STORED_COUNT++;
@@ -77,6 +89,7 @@ void EstimateRadiance(R3Point& point, R3Vector& normal, RNRgb& color,
   // Find nearby points
   vector<PointAndDistanceSqd<Photon*> > nearby_points;
   photon_map->FindClosestQuick(point, 0, estimate_dist, estimate_size, nearby_points);
+  LOCAL_GATHER_COUNT++;
   // Compute actual radius of estimate
   int num_nearby = nearby_points.size();
   if (num_nearby == 0) {
@@ -176,6 +189,7 @@ void EstimateCachedRadiance(R3Point& point, R3Vector& normal, RNRgb& color,
   R3Vector incident_vector;
   RNScalar perp_component;
 
+  LOCAL_GATHER_COUNT++;
   do {
     closest_photon = photon_map->FindClosest(point, closest_dist + RN_EPSILON, estimate_dist, &closest_dist);
     direction = closest_photon->direction;
@@ -212,6 +226,7 @@ void EstimateIrradiance(R3Point& point, RNRgb& color, R3Kdtree<Photon*>* photon_
   // Find nearby points
   vector<PointAndDistanceSqd<Photon*> > nearby_points;
   photon_map->FindClosestQuick(point, 0, estimate_dist, estimate_size, nearby_points);
+  LOCAL_GATHER_COUNT++;
   // Compute actual radius of estimate
   int num_nearby = nearby_points.size();
   if (num_nearby == 0) {
@@ -245,6 +260,118 @@ void EstimateIrradiance(R3Point& point, RNRgb& color, R3Kdtree<Photon*>* photon_
   color += estimate;
 }
 
+////////////////////////////////////////////////////////////////////////
+// Guiding Utils
+////////////////////////////////////////////////////////////////////////
+
+// Build a guiding histogram at point from the incident directions and powers of
+// the nearest indirect photons in the provided photon map (direct photons point
+// at lights, which final gather rays do not collect)
+void BuildGuideHistogram(GuideHistogram& histogram, const R3Point& point,
+  R3Vector normal, RNScalar cos_theta, R3Kdtree<Photon*>* photon_map,
+  int estimate_size, RNScalar estimate_dist)
+{
+  const int num_bins = GUIDE_THETA_BINS * GUIDE_PHI_BINS;
+  histogram.valid = false;
+
+  // Build local frame around the normal on the viewed side
+  if (cos_theta < 0) {
+    normal.Flip();
+  }
+  R3Vector tangent = R3Vector(normal[1], -normal[0], 0);
+  if (1.0 - abs(normal[2]) < 0.1) {
+    tangent = R3Vector(normal[2], 0, -normal[0]);
+  }
+  tangent.Normalize();
+  histogram.normal = normal;
+  histogram.tangent = tangent;
+  histogram.bitangent = normal % tangent;
+
+  // Find nearby photons
+  vector<PointAndDistanceSqd<Photon*> > nearby_points;
+  photon_map->FindClosestQuick(point, 0, estimate_dist, estimate_size, nearby_points);
+  LOCAL_GATHER_COUNT++;
+
+  // Accumulate photon power by direction of arrival
+  RNScalar flux[num_bins];
+  for (int i = 0; i < num_bins; i++) flux[i] = 0;
+  RNScalar total_flux = 0;
+  for (unsigned int i = 0; i < nearby_points.size(); i++) {
+    // Get direction toward where the photon came from
+    Photon* photon = nearby_points[i].point;
+    if (photon->bounce == 0) continue;
+    int direction = photon->direction;
+    R3Vector L = -R3Vector(PHOTON_X_LOOKUP[direction], PHOTON_Y_LOOKUP[direction],
+      PHOTON_Z_LOOKUP[direction]);
+    RNScalar z = L.Dot(histogram.normal);
+    if (z <= 0) continue;
+
+    // Map to cosine-warped square (u1 = cos^2 theta, u2 = phi / 2pi)
+    RNScalar u1 = z * z;
+    RNScalar u2 = atan2(L.Dot(histogram.bitangent), L.Dot(histogram.tangent)) / RN_TWO_PI;
+    if (u2 < 0) u2 += 1.0;
+    int ti = min((int) (u1 * GUIDE_THETA_BINS), GUIDE_THETA_BINS - 1);
+    int pi = min((int) (u2 * GUIDE_PHI_BINS), GUIDE_PHI_BINS - 1);
+
+    // Add power
+    RNScalar power = MaxChannelVal(RGBE_to_RNRgb(photon->rgbe));
+    flux[ti * GUIDE_PHI_BINS + pi] += power;
+    total_flux += power;
+  }
+  if (total_flux <= 0) return;
+
+  // Build distribution
+  RNScalar sum = 0;
+  for (int i = 0; i < num_bins; i++) {
+    sum += flux[i];
+    histogram.cdf[i] = sum / total_flux;
+    histogram.density[i] = num_bins * flux[i] / total_flux;
+  }
+  histogram.cdf[num_bins - 1] = 1.0;
+  histogram.valid = true;
+}
+
+// Sample a direction from a mixture of the cosine lobe (with probability
+// cosine_prob) and the guiding histogram; sets weight to the ratio of the
+// cosine-weighted pdf to the mixture pdf of the direction
+R3Vector SampleGuideHistogram(const GuideHistogram& histogram, RNScalar cosine_prob,
+  RNScalar& weight)
+{
+  const int num_bins = GUIDE_THETA_BINS * GUIDE_PHI_BINS;
+  if (!histogram.valid) cosine_prob = 1.0;
+
+  // Pick point in cosine-warped square
+  RNScalar u1 = RNThreadableRandomScalar();
+  RNScalar u2 = RNThreadableRandomScalar();
+  int bin;
+  if (RNThreadableRandomScalar() < cosine_prob) {
+    // Cosine lobe (uniform over square)
+    int ti = min((int) (u1 * GUIDE_THETA_BINS), GUIDE_THETA_BINS - 1);
+    int pi = min((int) (u2 * GUIDE_PHI_BINS), GUIDE_PHI_BINS - 1);
+    bin = ti * GUIDE_PHI_BINS + pi;
+  } else {
+    // Histogram (pick cell by flux, then uniformly within cell)
+    RNScalar r = RNThreadableRandomScalar();
+    bin = 0;
+    while (bin < num_bins - 1 && histogram.cdf[bin] <= r) bin++;
+    u1 = (bin / GUIDE_PHI_BINS + u1) / GUIDE_THETA_BINS;
+    u2 = (bin % GUIDE_PHI_BINS + u2) / GUIDE_PHI_BINS;
+  }
+
+  // Weight by one-sample mixture pdf (relative to cosine pdf)
+  RNScalar density = (histogram.valid) ? histogram.density[bin] : 1.0;
+  weight = 1.0 / (cosine_prob + (1.0 - cosine_prob) * density);
+
+  // Map square to hemisphere
+  RNScalar cos_t = sqrt(u1);
+  RNScalar sin_t = sqrt(max(0.0, 1.0 - u1));
+  RNAngle phi = RN_TWO_PI * u2;
+  R3Vector result = histogram.tangent * (sin_t * cos(phi))
+    + histogram.bitangent * (sin_t * sin(phi)) + histogram.normal * cos_t;
+  result.Normalize();
+  return result;
+}
+
 ////////////////////////////////////////////////////////////////////////
 // Efficiency Utils
 ////////////////////////////////////////////////////////////////////////
@@ -22,7 +22,7 @@ int FlushPhotonStorage(vector<Photon>& local_photon_storage, Photon_Type map_typ
 // Store Photons locally in vector; if vector is full, safely copy to
 // global memory using sychronization (thread safe); uses dynamic memory
 void StorePhoton(RNRgb& photon, vector<Photon>& local_photon_storage,
-  R3Vector& incident_vector, R3Point& point, Photon_Type map_type);
+  R3Vector& incident_vector, R3Point& point, int bounce, Photon_Type map_type);
 
 ////////////////////////////////////////////////////////////////////////
 // Radiance Utils
@@ -43,6 +43,36 @@ void EstimateCachedRadiance(R3Point& point, R3Vector& normal, RNRgb& color,
 void EstimateIrradiance(R3Point& point, RNRgb& color, R3Kdtree<Photon*>* photon_map,
     int estimate_size, RNScalar estimate_dist);
 
+////////////////////////////////////////////////////////////////////////
+// Guiding Utils
+////////////////////////////////////////////////////////////////////////
+
+// Resolution of guiding histograms (cells are equally likely under
+// cosine-weighted sampling, GUIDE_THETA_BINS by GUIDE_PHI_BINS)
+const int GUIDE_THETA_BINS = 4;
+const int GUIDE_PHI_BINS = 8;
+
+// Histogram of the flux arriving at a point over the hemisphere around normal
+struct GuideHistogram {
+  R3Vector normal, tangent, bitangent;              // Local frame
+  RNScalar cdf[GUIDE_THETA_BINS * GUIDE_PHI_BINS];   // Cumulative flux per cell
+  RNScalar density[GUIDE_THETA_BINS * GUIDE_PHI_BINS]; // Cell pdf relative to cosine pdf
+  bool valid;                                       // False if no photons arrive
+};
+
+// Build a guiding histogram at point from the incident directions and powers of
+// the nearest indirect photons in the provided photon map (direct photons point
+// at lights, which final gather rays do not collect)
+void BuildGuideHistogram(GuideHistogram& histogram, const R3Point& point,
+  R3Vector normal, RNScalar cos_theta, R3Kdtree<Photon*>* photon_map,
+  int estimate_size, RNScalar estimate_dist);
+
+// Sample a direction from a mixture of the cosine lobe (with probability
+// cosine_prob) and the guiding histogram; sets weight to the ratio of the
+// cosine-weighted pdf to the mixture pdf of the direction
+R3Vector SampleGuideHistogram(const GuideHistogram& histogram, RNScalar cosine_prob,
+  RNScalar& weight);
+
 ////////////////////////////////////////////////////////////////////////
 // Efficiency Utils
 ////////////////////////////////////////////////////////////////////////
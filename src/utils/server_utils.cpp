@@ -0,0 +1,272 @@
+////////////////////////////////////////////////////////////////////////
+// Directives
+////////////////////////////////////////////////////////////////////////
+
+#include "server_utils.h"
+#include "io_utils.h"
+#include "../R3Graphics/R3Graphics.h"
+#include "../render.h"
+#include <vector>
+#include <string>
+#include <sstream>
+#include <cstring>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/time.h>
+
+using namespace std;
+
+// Longest request accepted (in bytes)
+static const int MAX_REQUEST_LENGTH = 65536;
+
+// Longest wait for the next byte of a request (in seconds)
+static const int REQUEST_TIMEOUT = 10;
+
+////////////////////////////////////////////////////////////////////////
+// Resident Scenes
+////////////////////////////////////////////////////////////////////////
+
+// Move the current scene and photon maps into resident (clearing them)
+void StoreResidentScene(ResidentScene& resident)
+{
+  resident.scene = SCENE;
+  resident.global_pmap = GLOBAL_PMAP;
+  resident.caustic_pmap = CAUSTIC_PMAP;
+  resident.global_photons = GLOBAL_PHOTONS;
+  resident.caustic_photons = CAUSTIC_PHOTONS;
+  resident.shadow_pmaps = SHADOW_PMAPS;
+  resident.shadow_photons = SHADOW_PHOTONS;
+  resident.indirect_illum = INDIRECT_ILLUM;
+  resident.direct_photon_illum = DIRECT_PHOTON_ILLUM;
+  resident.caustic_illum = CAUSTIC_ILLUM;
+  resident.global_photon_count = GLOBAL_PHOTON_COUNT;
+  resident.caustic_photon_count = CAUSTIC_PHOTON_COUNT;
+
+  SCENE = NULL;
+  GLOBAL_PMAP = NULL;
+  CAUSTIC_PMAP = NULL;
+  GLOBAL_PHOTONS.Empty();
+  CAUSTIC_PHOTONS.Empty();
+  SHADOW_PMAPS.clear();
+  SHADOW_PHOTONS.Empty();
+}
+
+// Delete resident with its scene and photon maps
+void DeleteResidentScene(ResidentScene *resident)
+{
+  for (int i = 0; i < resident->global_photons.NEntries(); i++) {
+    delete resident->global_photons[i];
+  }
+  for (int i = 0; i < resident->caustic_photons.NEntries(); i++) {
+    delete resident->caustic_photons[i];
+  }
+  if (resident->global_pmap) delete resident->global_pmap;
+  if (resident->caustic_pmap) delete resident->caustic_pmap;
+  for (unsigned int i = 0; i < resident->shadow_pmaps.size(); i++) {
+    if (resident->shadow_pmaps[i]) delete resident->shadow_pmaps[i];
+  }
+  for (int i = 0; i < resident->shadow_photons.NEntries(); i++) {
+    delete resident->shadow_photons[i];
+  }
+  delete resident->scene;
+  delete resident;
+}
+
+// Make resident the current scene (its photon maps stay owned by resident)
+void ActivateResidentScene(const ResidentScene& resident)
+{
+  SCENE = resident.scene;
+  SCENE_RADIUS = SCENE->BBox().DiagonalRadius();
+  SCENE_AMBIENT = SCENE->Ambient();
+  SCENE_NLIGHTS = SCENE->NLights();
+  GLOBAL_PMAP = resident.global_pmap;
+  CAUSTIC_PMAP = resident.caustic_pmap;
+  GLOBAL_PHOTONS = resident.global_photons;
+  CAUSTIC_PHOTONS = resident.caustic_photons;
+  SHADOW_PMAPS = resident.shadow_pmaps;
+  SHADOW_PHOTONS = resident.shadow_photons;
+  INDIRECT_ILLUM = resident.indirect_illum;
+  DIRECT_PHOTON_ILLUM = resident.direct_photon_illum;
+  CAUSTIC_ILLUM = resident.caustic_illum;
+  GLOBAL_PHOTON_COUNT = resident.global_photon_count;
+  CAUSTIC_PHOTON_COUNT = resident.caustic_photon_count;
+}
+
+////////////////////////////////////////////////////////////////////////
+// Socket I/O
+////////////////////////////////////////////////////////////////////////
+
+// Write all of buffer to fd
+static int WriteAll(int fd, const void *buffer, size_t size)
+{
+  const char *data = (const char *) buffer;
+  while (size > 0) {
+    ssize_t count = write(fd, data, size);
+    if (count <= 0) return 0;
+    data += count;
+    size -= count;
+  }
+  return 1;
+}
+
+// Send the response header ("OK <format> <width> <height> <bytes>") then data
+static int SendResponse(int client, const char *format, int width, int height,
+  const string& data)
+{
+  char header[256];
+  sprintf(header, "OK %s %d %d %lu\n", format, width, height, (unsigned long) data.size());
+  return WriteAll(client, header, strlen(header)) &&
+    WriteAll(client, data.data(), data.size());
+}
+
+// Listen on a Unix socket at path (replacing a stale socket file). Returns
+// the socket, or -1 on failure
+int OpenServerSocket(const char *path)
+{
+  struct sockaddr_un address;
+  if (strlen(path) >= sizeof(address.sun_path)) {
+    fprintf(stderr, "Socket path is too long: %s\n", path);
+    return -1;
+  }
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  strcpy(address.sun_path, path);
+
+  int server = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (server < 0) {
+    fprintf(stderr, "Unable to create socket\n");
+    return -1;
+  }
+  unlink(path);
+  if (bind(server, (struct sockaddr *) &address, sizeof(address)) != 0 ||
+      listen(server, 16) != 0) {
+    fprintf(stderr, "Unable to listen on %s\n", path);
+    close(server);
+    return -1;
+  }
+  return server;
+}
+
+// Read a request (one line of arguments separated by whitespace) from client.
+// Returns 0 if the request is empty, too long, or client stalls for longer
+// than REQUEST_TIMEOUT, so that one client cannot block the server
+int ReadServerRequest(int client, vector<string>& args)
+{
+  // Bound the wait for each read
+  struct timeval timeout;
+  timeout.tv_sec = REQUEST_TIMEOUT;
+  timeout.tv_usec = 0;
+  if (setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) != 0) return 0;
+
+  // Read line
+  string line;
+  char c;
+  while (true) {
+    ssize_t count = read(client, &c, 1);
+    if (count < 0) return 0;
+    if (count == 0) break;
+    if (c == '\n') break;
+    line += c;
+    if ((int) line.size() > MAX_REQUEST_LENGTH) return 0;
+  }
+
+  // Split arguments
+  args.clear();
+  istringstream stream(line);
+  string arg;
+  while (stream >> arg) {
+    args.push_back(arg);
+  }
+  return !args.empty();
+}
+
+// Remove "-camera ex ey ez tx ty tz ux uy uz xfov" from args, setting camera
+// to it (keeping the near and far distances of camera). Returns 0 if the
+// flag is malformed
+int ExtractCameraArgs(vector<string>& args, R3Camera& camera)
+{
+  for (unsigned int i = 0; i < args.size(); i++) {
+    if (args[i] != "-camera") continue;
+    if (i + 10 >= args.size()) return 0;
+
+    // Read values
+    RNScalar values[10];
+    for (int k = 0; k < 10; k++) {
+      char *end;
+      values[k] = strtod(args[i + 1 + k].c_str(), &end);
+      if (*end) return 0;
+    }
+    R3Point e(values[0], values[1], values[2]);
+    R3Vector t(values[3], values[4], values[5]);
+    R3Vector u(values[6], values[7], values[8]);
+    camera = R3Camera(e, t, u, values[9], values[9], camera.Near(), camera.Far());
+
+    // Remove flag
+    args.erase(args.begin() + i, args.begin() + i + 11);
+    i--;
+  }
+  return 1;
+}
+
+// Send a rendered image to client, as a PFM of radiance if filename ends in
+// .pfm and otherwise encoded in the format given by the extension
+int SendServerImage(int client, R2Image *image, const vector<vector<RNRgb> >& radiance,
+  const char *filename)
+{
+  const char *extension = strrchr(filename, '.');
+  if (!extension || strlen(extension) > 16) {
+    SendServerError(client, "Output name has no extension");
+    return 0;
+  }
+  int width = image->Width();
+  int height = image->Height();
+
+  // Floats, bottom row first as in the image
+  if (!strcmp(extension, ".pfm")) {
+    char header[64];
+    sprintf(header, "PF\n%d %d\n-1.0\n", width, height);
+    string data = header;
+    for (int j = 0; j < height; j++) {
+      for (int i = 0; i < width; i++) {
+        float rgb[3] = { (float) radiance[i][j].R(), (float) radiance[i][j].G(),
+          (float) radiance[i][j].B() };
+        data.append((const char *) rgb, sizeof(rgb));
+      }
+    }
+    return SendResponse(client, "pfm", width, height, data);
+  }
+
+  // Encode through a temporary file with the same extension
+  char tmpname[64];
+  sprintf(tmpname, "/tmp/photonmapXXXXXX%s", extension);
+  int fd = mkstemps(tmpname, strlen(extension));
+  if (fd < 0) {
+    SendServerError(client, "Unable to create temporary image");
+    return 0;
+  }
+  close(fd);
+  string data;
+  if (image->Write(tmpname)) {
+    FILE *fp = fopen(tmpname, "rb");
+    char buffer[65536];
+    size_t count;
+    while (fp && (count = fread(buffer, 1, sizeof(buffer), fp)) > 0) {
+      data.append(buffer, count);
+    }
+    if (fp) fclose(fp);
+  }
+  unlink(tmpname);
+  if (data.empty()) {
+    SendServerError(client, "Unable to encode image");
+    return 0;
+  }
+  return SendResponse(client, extension + 1, width, height, data);
+}
+
+// Send an error message to client
+void SendServerError(int client, const char *message)
+{
+  string line = string("ERROR ") + message + "\n";
+  WriteAll(client, line.data(), line.size());
+}
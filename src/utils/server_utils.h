@@ -0,0 +1,71 @@
+////////////////////////////////////////////////////////////////////////
+// Directives
+////////////////////////////////////////////////////////////////////////
+
+#ifndef SERVER_INC
+#define SERVER_INC
+
+#include "../R3Graphics/R3Graphics.h"
+#include "../render.h"
+#include <vector>
+#include <string>
+
+using namespace std;
+
+////////////////////////////////////////////////////////////////////////
+// Resident Scenes
+////////////////////////////////////////////////////////////////////////
+
+// A scene kept in memory by the render server, with its photon maps and the
+// illumination toggles that photon tracing left on
+struct ResidentScene {
+  string filename;
+  R3Scene *scene;
+  R3Kdtree<Photon *> *global_pmap;
+  R3Kdtree<Photon *> *caustic_pmap;
+  RNArray <Photon *> global_photons;
+  RNArray <Photon *> caustic_photons;
+  vector<R3Kdtree<ShadowPhoton *> *> shadow_pmaps;
+  RNArray <ShadowPhoton *> shadow_photons;
+  bool indirect_illum;
+  bool direct_photon_illum;
+  bool caustic_illum;
+  int global_photon_count;
+  int caustic_photon_count;
+};
+
+// Move the current scene and photon maps into resident (clearing them)
+void StoreResidentScene(ResidentScene& resident);
+
+// Delete resident with its scene and photon maps
+void DeleteResidentScene(ResidentScene *resident);
+
+// Make resident the current scene (its photon maps stay owned by resident)
+void ActivateResidentScene(const ResidentScene& resident);
+
+////////////////////////////////////////////////////////////////////////
+// Render Server Protocol
+////////////////////////////////////////////////////////////////////////
+
+// Listen on a Unix socket at path (replacing a stale socket file). Returns
+// the socket, or -1 on failure
+int OpenServerSocket(const char *path);
+
+// Read a request (one line of arguments separated by whitespace) from client,
+// giving up if client stalls
+int ReadServerRequest(int client, vector<string>& args);
+
+// Remove "-camera ex ey ez tx ty tz ux uy uz xfov" from args, setting camera
+// to it (keeping the near and far distances of camera). Returns 0 if the
+// flag is malformed
+int ExtractCameraArgs(vector<string>& args, R3Camera& camera);
+
+// Send a rendered image to client, as a PFM of radiance if filename ends in
+// .pfm and otherwise encoded in the format given by the extension
+int SendServerImage(int client, R2Image *image, const vector<vector<RNRgb> >& radiance,
+  const char *filename);
+
+// Send an error message to client
+void SendServerError(int client, const char *message);
+
+#endif
@@ -0,0 +1,230 @@
+////////////////////////////////////////////////////////////////////////
+// Directives
+////////////////////////////////////////////////////////////////////////
+
+#include "trace_utils.h"
+#include "io_utils.h"
+#include <vector>
+#include <string>
+#include <map>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <unistd.h>
+
+using namespace std;
+
+// An event recorded by a thread
+struct TraceEvent {
+  string name;
+  string category;
+  double start;
+  double end;
+  int thread;
+  TraceArgs args;
+  string label;
+};
+
+// Events recorded so far
+static atomic_bool tracing (false);
+static mutex trace_lock;
+static vector<TraceEvent> trace_events;
+
+// Trace ids of threads (assigned in the order threads first record an event)
+static atomic_int next_trace_thread (0);
+static __thread int trace_thread = -1;
+
+////////////////////////////////////////////////////////////////////////
+// Recording
+////////////////////////////////////////////////////////////////////////
+
+// Start recording events (nothing is recorded before)
+void StartTracing(void)
+{
+  tracing = true;
+}
+
+// Whether events are being recorded
+bool Tracing(void)
+{
+  return tracing;
+}
+
+// Seconds on the trace clock (shared by the processes of a machine)
+double TraceTime(void)
+{
+  return chrono::duration<double>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Record an event of the calling thread that ran from start to end (on the
+// trace clock), with args (summed over events of the same name in the
+// summary) and a label telling the event apart (e.g. the tile rendered)
+void RecordTraceEvent(const char *name, const char *category, double start, double end,
+  const TraceArgs& args, const string& label)
+{
+  if (!tracing) return;
+  if (trace_thread < 0) trace_thread = next_trace_thread++;
+  TraceEvent event = { name, category, start, end, trace_thread, args, label };
+  lock_guard<mutex> lk(trace_lock);
+  trace_events.push_back(event);
+}
+
+TraceScope::
+TraceScope(const char *name, const char *category)
+  : name(name),
+    category(category),
+    start((tracing) ? TraceTime() : 0)
+{
+}
+
+TraceScope::
+~TraceScope(void)
+{
+  if (tracing) RecordTraceEvent(name, category, start, TraceTime(), args, label);
+}
+
+////////////////////////////////////////////////////////////////////////
+// Output
+////////////////////////////////////////////////////////////////////////
+
+// Write s to fp as a JSON string
+static void WriteJSONString(FILE *fp, const string& s)
+{
+  fputc('"', fp);
+  for (unsigned int i = 0; i < s.size(); i++) {
+    unsigned char c = s[i];
+    if (c == '"' || c == '\\') fprintf(fp, "\\%c", c);
+    else if (c < 0x20) fprintf(fp, "\\u%04x", c);
+    else fputc(c, fp);
+  }
+  fputc('"', fp);
+}
+
+// Write args (and label if given) to fp as a JSON object
+static void WriteJSONArgs(FILE *fp, const TraceArgs& args, const string& label = string())
+{
+  fprintf(fp, "{");
+  if (!label.empty()) {
+    fprintf(fp, "\"label\": ");
+    WriteJSONString(fp, label);
+  }
+  for (unsigned int i = 0; i < args.size(); i++) {
+    if (i > 0 || !label.empty()) fprintf(fp, ", ");
+    WriteJSONString(fp, args[i].first);
+    if (isfinite(args[i].second)) fprintf(fp, ": %.15g", args[i].second);
+    else fprintf(fp, ": null");
+  }
+  fprintf(fp, "}");
+}
+
+// Close fp, reporting whether everything was written
+static int CloseTraceFile(FILE *fp, const char *filename)
+{
+  int ok = !ferror(fp);
+  if (fclose(fp) != 0) ok = 0;
+  if (!ok) fprintf(stderr, "Unable to write trace file %s\n", filename);
+  return ok;
+}
+
+// Write the events in Chrome trace format (complete events in microseconds)
+static int WriteChromeTrace(const vector<TraceEvent>& events, const char *filename)
+{
+  FILE *fp = fopen(filename, "w");
+  if (!fp) {
+    fprintf(stderr, "Unable to open trace file %s\n", filename);
+    return 0;
+  }
+  int pid = getpid();
+  fprintf(fp, "{\"traceEvents\": [\n");
+  for (unsigned int i = 0; i < events.size(); i++) {
+    const TraceEvent& event = events[i];
+    fprintf(fp, "  {\"name\": ");
+    WriteJSONString(fp, event.name);
+    fprintf(fp, ", \"cat\": ");
+    WriteJSONString(fp, event.category);
+    fprintf(fp, ", \"ph\": \"X\", \"pid\": %d, \"tid\": %d, \"ts\": %.3f, \"dur\": %.3f, \"args\": ",
+      pid, event.thread, 1e6 * event.start, 1e6 * (event.end - event.start));
+    WriteJSONArgs(fp, event.args, event.label);
+    fprintf(fp, "}%s\n", (i + 1 < events.size()) ? "," : "");
+  }
+  fprintf(fp, "], \"displayTimeUnit\": \"ms\"}\n");
+  return CloseTraceFile(fp, filename);
+}
+
+// Write the count, total and longest time of each event name, with their
+// args summed, in the order the names first ended
+static int WriteTraceSummary(const vector<TraceEvent>& events, const char *filename)
+{
+  // Gather events by name
+  vector<string> names;
+  map<string, vector<const TraceEvent *> > events_by_name;
+  double first_start = 0;
+  double last_end = 0;
+  for (unsigned int i = 0; i < events.size(); i++) {
+    const TraceEvent& event = events[i];
+    vector<const TraceEvent *>& named = events_by_name[event.name];
+    if (named.empty()) names.push_back(event.name);
+    named.push_back(&event);
+    if (i == 0 || event.start < first_start) first_start = event.start;
+    if (i == 0 || event.end > last_end) last_end = event.end;
+  }
+
+  // Write summary
+  FILE *fp = fopen(filename, "w");
+  if (!fp) {
+    fprintf(stderr, "Unable to open trace summary %s\n", filename);
+    return 0;
+  }
+  fprintf(fp, "{\n  \"pid\": %d,\n  \"wall_seconds\": %.6f,\n  \"events\": {", getpid(),
+    last_end - first_start);
+  for (unsigned int n = 0; n < names.size(); n++) {
+    const vector<const TraceEvent *>& named = events_by_name[names[n]];
+    double total = 0;
+    const TraceEvent *longest = named[0];
+    TraceArgs sums;
+    for (unsigned int i = 0; i < named.size(); i++) {
+      const TraceEvent *event = named[i];
+      total += event->end - event->start;
+      if (event->end - event->start > longest->end - longest->start) longest = event;
+      for (unsigned int a = 0; a < event->args.size(); a++) {
+        unsigned int s = 0;
+        while (s < sums.size() && sums[s].first != event->args[a].first) s++;
+        if (s == sums.size()) sums.push_back(make_pair(event->args[a].first, 0.0));
+        sums[s].second += event->args[a].second;
+      }
+    }
+    fprintf(fp, "%s\n    ", (n > 0) ? "," : "");
+    WriteJSONString(fp, names[n]);
+    fprintf(fp, ": {\"category\": ");
+    WriteJSONString(fp, longest->category);
+    fprintf(fp, ", \"count\": %u, \"total_seconds\": %.6f, \"max_seconds\": %.6f, "
+      "\"max_thread\": %d, \"max_label\": ", (unsigned int) named.size(), total,
+      longest->end - longest->start, longest->thread);
+    WriteJSONString(fp, longest->label);
+    fprintf(fp, ", \"args\": ");
+    WriteJSONArgs(fp, sums);
+    fprintf(fp, "}");
+  }
+  fprintf(fp, "\n  }\n}\n");
+  return CloseTraceFile(fp, filename);
+}
+
+// Write the events recorded in Chrome trace format (for chrome://tracing or
+// Perfetto) to filename, and the count, total and longest time of each event
+// name, with their args summed, to <name>_summary.json next to it
+int WriteTrace(const char *filename)
+{
+  vector<TraceEvent> events;
+  {
+    lock_guard<mutex> lk(trace_lock);
+    events = trace_events;
+  }
+
+  // Write files
+  string summary_filename = SuffixedName(filename, "_summary", ".json");
+  if (!WriteChromeTrace(events, filename)) return 0;
+  if (!WriteTraceSummary(events, summary_filename.c_str())) return 0;
+  return 1;
+}
@@ -0,0 +1,55 @@
+////////////////////////////////////////////////////////////////////////
+// Directives
+////////////////////////////////////////////////////////////////////////
+
+#ifndef TRACE_INC
+#define TRACE_INC
+
+#include <vector>
+#include <string>
+#include <utility>
+
+using namespace std;
+
+////////////////////////////////////////////////////////////////////////
+// Tracing Utils
+////////////////////////////////////////////////////////////////////////
+
+// Named values attached to an event (e.g. rays traced by type)
+typedef vector<pair<string, double> > TraceArgs;
+
+// Start recording events (nothing is recorded before)
+void StartTracing(void);
+
+// Whether events are being recorded
+bool Tracing(void);
+
+// Seconds on the trace clock (shared by the processes of a machine)
+double TraceTime(void);
+
+// Record an event of the calling thread that ran from start to end (on the
+// trace clock), with args (summed over events of the same name in the
+// summary) and a label telling the event apart (e.g. the tile rendered)
+void RecordTraceEvent(const char *name, const char *category, double start, double end,
+  const TraceArgs& args = TraceArgs(), const string& label = string());
+
+// Records the scope it is declared in as an event of the calling thread, with
+// the args and label set before it ends
+class TraceScope {
+public:
+  TraceScope(const char *name, const char *category);
+  ~TraceScope(void);
+  TraceArgs args;
+  string label;
+private:
+  const char *name;
+  const char *category;
+  double start;
+};
+
+// Write the events recorded in Chrome trace format (for chrome://tracing or
+// Perfetto) to filename, and the count, total and longest time of each event
+// name, with their args summed, to <name>_summary.json next to it
+int WriteTrace(const char *filename);
+
+#endif
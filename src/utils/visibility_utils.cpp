@@ -0,0 +1,325 @@
+////////////////////////////////////////////////////////////////////////
+// Directives
+////////////////////////////////////////////////////////////////////////
+
+#include "visibility_utils.h"
+#include "illumination_utils.h"
+#include "../render.h"
+#include "../R3Graphics/R3Graphics.h"
+#include <atomic>
+#include <algorithm>
+
+using namespace std;
+
+////////////////////////////////////////////////////////////////////////
+// Light Visibility Data
+////////////////////////////////////////////////////////////////////////
+
+// Primitive that blocked the last shadow ray sent to a light
+struct OccluderCacheEntry {
+  const R3Light *light;  // Light the entry belongs to
+  unsigned int epoch;    // Render the entry was made in
+  R3SceneNode *node;     // Node holding the occluder
+  R3Shape *shape;        // Occluder (in the coordinates of node)
+};
+
+// Number of occluder cache entries per thread (lights share entries modulo this)
+static const int OCCLUDER_CACHE_SIZE = 64;
+
+// Number of agreeing shadow rays before a visibility grid cell is trusted
+static const unsigned int VISIBILITY_GRID_SAMPLES = 16;
+
+// Max depth of the scene graph walked to reach a cached occluder
+static const int MAX_OCCLUDER_DEPTH = 64;
+
+// Per thread occluder caches, invalidated by bumping the epoch
+static __thread OccluderCacheEntry occluder_cache[OCCLUDER_CACHE_SIZE];
+static unsigned int visibility_epoch = 0;
+
+// Coarse grid over the scene bounds; each cell holds, for the sides of surfaces
+// facing toward and away from the light, the number of shadow rays found
+// unoccluded (low 16 bits) and occluded (high 16 bits)
+struct VisibilityGrid {
+  R3Box bbox;
+  int resolution[3];
+  RNScalar cell_size[3];
+  atomic<unsigned int> *cells;
+};
+
+// Visibility grid of each light (allocated on the first query for the light)
+static atomic<VisibilityGrid *> *visibility_grids = NULL;
+static int num_visibility_grids = 0;
+
+////////////////////////////////////////////////////////////////////////
+// Occluder Cache
+////////////////////////////////////////////////////////////////////////
+
+// Return true if the cached occluder lies on ray before unoccluded_len
+static bool CachedOccluderBlocks(const OccluderCacheEntry& entry, const R3Ray& ray,
+  RNLength unoccluded_len)
+{
+  // Gather path from occluder's node up to the root
+  const R3SceneNode *path[MAX_OCCLUDER_DEPTH];
+  int depth = 0;
+  for (const R3SceneNode *node = entry.node; node && (depth < MAX_OCCLUDER_DEPTH); node = node->Parent()) {
+    path[depth++] = node;
+  }
+
+  // Transform ray into the node's coordinate system
+  R3Ray node_ray = ray;
+  for (int i = depth - 1; i >= 0; i--) {
+    node_ray.InverseTransform(path[i]->Transformation());
+  }
+
+  // Intersect occluder, and bring hit point back to world coordinates
+  R3Point hit_point;
+  if (!entry.shape->Intersects(node_ray, &hit_point, NULL, NULL)) return false;
+  for (int i = 0; i < depth; i++) {
+    hit_point.Transform(path[i]->Transformation());
+  }
+  return R3Distance(ray.Start(), hit_point) < unoccluded_len - RN_EPSILON;
+}
+
+// Test for the occlusion of a ray from point_on_light to point_in_scene, trying
+// the cached occluder before the whole scene and caching any new occluder
+static bool CachedIlluminationTest(const R3Light *light, const R3Point& point_in_scene,
+  const R3Point& point_on_light)
+{
+  if (!OCCLUDER_CACHE) return RayIlluminationTest(point_in_scene, point_on_light);
+
+  // Determine distance between point and light
+  RNLength unoccluded_len = R3Distance(point_on_light, point_in_scene);
+  R3Ray ray = R3Ray(point_on_light, point_in_scene);
+
+  // Try last occluder of light
+  OccluderCacheEntry& entry = occluder_cache[light->SceneIndex() % OCCLUDER_CACHE_SIZE];
+  bool valid = (entry.light == light) && (entry.epoch == visibility_epoch) && entry.shape;
+  if (valid && CachedOccluderBlocks(entry, ray, unoccluded_len)) {
+    return false;
+  }
+
+  // Test if there is an intersecting ray that spans this distance
+  R3SceneNode *node;
+  R3Shape *shape;
+  RNScalar t;
+  RNLength intersection_len = RN_INFINITY;
+  if (SCENE->Intersects(ray, &node, NULL, &shape, NULL, NULL, &t)) {
+    intersection_len = R3Distance(point_on_light, ray.Point(t));
+  }
+  LOCAL_SHADOW_RAY_COUNT++;
+
+  if (abs(intersection_len - unoccluded_len) < RN_EPSILON)
+    return true;
+
+  // Remember occluder (a hit beyond the point does not block anything)
+  if (intersection_len < unoccluded_len) {
+    entry.light = light;
+    entry.epoch = visibility_epoch;
+    entry.node = node;
+    entry.shape = shape;
+  }
+  return false;
+}
+
+////////////////////////////////////////////////////////////////////////
+// Visibility Grid
+////////////////////////////////////////////////////////////////////////
+
+// Allocate an empty grid over the scene bounds
+static VisibilityGrid *NewVisibilityGrid(void)
+{
+  VisibilityGrid *grid = new VisibilityGrid();
+  grid->bbox = SCENE->BBox();
+  size_t num_cells = 1;
+  for (int a = 0; a < 3; a++) {
+    RNLength length = grid->bbox.AxisLength((RNAxis) a);
+    grid->resolution[a] = (length > RN_EPSILON) ? VISIBILITY_GRID : 1;
+    grid->cell_size[a] = (length > RN_EPSILON) ? length / VISIBILITY_GRID : 1.0;
+    num_cells *= grid->resolution[a];
+  }
+  grid->cells = new atomic<unsigned int>[2 * num_cells]();
+  return grid;
+}
+
+// Delete a grid
+static void DeleteVisibilityGrid(VisibilityGrid *grid)
+{
+  delete [] grid->cells;
+  delete grid;
+}
+
+// Return the visibility grid of light, allocating it if this is the first query
+static VisibilityGrid *LightVisibilityGrid(const R3Light *light)
+{
+  int index = light->SceneIndex();
+  if (index < 0 || index >= num_visibility_grids) return NULL;
+
+  VisibilityGrid *grid = visibility_grids[index].load(memory_order_acquire);
+  if (!grid) {
+    // Another thread may allocate it at the same time; keep whichever lands first
+    VisibilityGrid *new_grid = NewVisibilityGrid();
+    if (visibility_grids[index].compare_exchange_strong(grid, new_grid)) {
+      grid = new_grid;
+    } else {
+      DeleteVisibilityGrid(new_grid);
+    }
+  }
+  return grid;
+}
+
+// Find the cell holding point (returning false if it is outside the grid), and
+// which side of the surface, toward or away from the light, the point is on
+static bool VisibilityCell(VisibilityGrid *grid, const R3Point& point, const R3Vector& normal,
+  const R3Point& point_on_light, int cell[3], int& side)
+{
+  for (int a = 0; a < 3; a++) {
+    cell[a] = (int) ((point[a] - grid->bbox.Min()[a]) / grid->cell_size[a]);
+    if (cell[a] == grid->resolution[a]) cell[a]--;
+    if (cell[a] < 0 || cell[a] >= grid->resolution[a]) return false;
+  }
+  side = (normal.Dot(point_on_light - point) > 0) ? 0 : 1;
+  return true;
+}
+
+// Return the counters of a cell for one side of its surfaces
+static atomic<unsigned int>& VisibilityCounters(VisibilityGrid *grid, int x, int y, int z, int side)
+{
+  size_t index = ((size_t) z*grid->resolution[1] + y)*grid->resolution[0] + x;
+  return grid->cells[2*index + side];
+}
+
+// Return true if no shadow ray from the cell or its neighbours (on the same
+// side of their surfaces) disagreed with lit, so a shadow edge that passes
+// between cells keeps both of them tracing
+static bool VisibilityAgrees(VisibilityGrid *grid, const int cell[3], int side, bool lit)
+{
+  for (int z = max(cell[2] - 1, 0); z <= min(cell[2] + 1, grid->resolution[2] - 1); z++) {
+    for (int y = max(cell[1] - 1, 0); y <= min(cell[1] + 1, grid->resolution[1] - 1); y++) {
+      for (int x = max(cell[0] - 1, 0); x <= min(cell[0] + 1, grid->resolution[0] - 1); x++) {
+        unsigned int state = VisibilityCounters(grid, x, y, z, side).load(memory_order_relaxed);
+        if (lit && (state >> 16)) return false;
+        if (!lit && (state & 0xFFFF)) return false;
+      }
+    }
+  }
+  return true;
+}
+
+////////////////////////////////////////////////////////////////////////
+// Light Visibility Utils
+////////////////////////////////////////////////////////////////////////
+
+// Invalidate the occluder caches of all threads and allocate (empty) visibility
+// grids for the lights of the scene; call before rendering
+void InitializeLightVisibility(void)
+{
+  DeleteLightVisibility();
+  visibility_epoch++;
+  if (VISIBILITY_GRID > 0 && SCENE_NLIGHTS > 0) {
+    num_visibility_grids = SCENE_NLIGHTS;
+    visibility_grids = new atomic<VisibilityGrid *>[num_visibility_grids]();
+  }
+}
+
+// Bytes of the occluder caches of all threads, and of the visibility grids of
+// the lights that may query one (point, spot and directional lights, and area
+// and rect lights without soft shadows) once allocated
+unsigned long long int LightVisibilityBytes(void)
+{
+  unsigned long long int bytes = (unsigned long long int) THREADS * OCCLUDER_CACHE_SIZE *
+    sizeof(OccluderCacheEntry);
+  if (VISIBILITY_GRID <= 0) return bytes;
+
+  // Count cells of a grid
+  R3Box bbox = SCENE->BBox();
+  unsigned long long int num_cells = 1;
+  for (int a = 0; a < 3; a++) {
+    if (bbox.AxisLength((RNAxis) a) > RN_EPSILON) num_cells *= VISIBILITY_GRID;
+  }
+
+  // Add grids of lights
+  for (int i = 0; i < SCENE_NLIGHTS; i++) {
+    R3Light *light = SCENE->Light(i);
+    if (!(light->IsActive())) continue;
+    if (SOFT_SHADOWS && (light->ClassID() == R3AreaLight::CLASS_ID() ||
+        light->ClassID() == R3RectLight::CLASS_ID())) continue;
+    bytes += sizeof(VisibilityGrid) + 2 * num_cells * sizeof(atomic<unsigned int>);
+  }
+  return bytes;
+}
+
+// Delete the visibility grids
+void DeleteLightVisibility(void)
+{
+  if (!visibility_grids) return;
+
+  // Count cells that were queried, and those whose shadow rays all agreed
+  unsigned long long int num_cells = 0;
+  unsigned long long int num_decided = 0;
+  for (int i = 0; i < num_visibility_grids; i++) {
+    VisibilityGrid *grid = visibility_grids[i].load();
+    if (!grid) continue;
+    size_t n = 2 * (size_t) grid->resolution[0] * grid->resolution[1] * grid->resolution[2];
+    for (size_t j = 0; j < n; j++) {
+      unsigned int state = grid->cells[j].load();
+      unsigned int lit = state & 0xFFFF;
+      unsigned int blocked = state >> 16;
+      if (lit + blocked > 0) num_cells++;
+      if ((lit >= VISIBILITY_GRID_SAMPLES && !blocked)
+        || (blocked >= VISIBILITY_GRID_SAMPLES && !lit)) num_decided++;
+    }
+    DeleteVisibilityGrid(grid);
+  }
+  delete [] visibility_grids;
+  visibility_grids = NULL;
+  num_visibility_grids = 0;
+
+  // Print statistics
+  if (VERBOSE) {
+    printf("Deleted visibility grids ...\n");
+    printf("  # Cells Queried = %llu\n", num_cells);
+    printf("  # Unanimous Cells = %llu\n", num_decided);
+    fflush(stdout);
+  }
+}
+
+// Test for the occlusion of a ray from point to a sample on light, as
+// RayIlluminationTest does, but first try the primitive that blocked this
+// thread's previous shadow ray to the light. If the sample depends only on
+// point (e.g. point and spot lights), the light's visibility grid may answer
+// without tracing a ray at all
+bool LightIlluminationTest(const R3Light *light, const R3Point& point_in_scene,
+  const R3Vector& normal, const R3Point& point_on_light, bool fixed_sample)
+{
+  // Find grid cell of point
+  VisibilityGrid *grid = NULL;
+  int cell[3];
+  int side;
+  if (fixed_sample && visibility_grids) {
+    grid = LightVisibilityGrid(light);
+    if (grid && !VisibilityCell(grid, point_in_scene, normal, point_on_light, cell, side)) {
+      grid = NULL;
+    }
+  }
+  if (!grid) return CachedIlluminationTest(light, point_in_scene, point_on_light);
+
+  // Answer from the cell if every shadow ray sent from it and its neighbours
+  // so far agreed
+  atomic<unsigned int>& counters = VisibilityCounters(grid, cell[0], cell[1], cell[2], side);
+  unsigned int state = counters.load(memory_order_relaxed);
+  unsigned int lit = state & 0xFFFF;
+  unsigned int blocked = state >> 16;
+  if (lit >= VISIBILITY_GRID_SAMPLES && !blocked && VisibilityAgrees(grid, cell, side, true)) {
+    return true;
+  }
+  if (blocked >= VISIBILITY_GRID_SAMPLES && !lit && VisibilityAgrees(grid, cell, side, false)) {
+    return false;
+  }
+
+  // Otherwise trace, and record the result until the cell is known to disagree
+  bool result = CachedIlluminationTest(light, point_in_scene, point_on_light);
+  if ((!lit || !blocked) && lit + blocked < 0xFFFF) {
+    counters.fetch_add(result ? 1 : (1 << 16), memory_order_relaxed);
+  }
+  return result;
+}
@@ -0,0 +1,33 @@
+////////////////////////////////////////////////////////////////////////
+// Directives
+////////////////////////////////////////////////////////////////////////
+
+#ifndef VISIBILITY_INC
+#define VISIBILITY_INC
+
+#include "../R3Graphics/R3Graphics.h"
+
+////////////////////////////////////////////////////////////////////////
+// Light Visibility Utils
+////////////////////////////////////////////////////////////////////////
+
+// Invalidate the occluder caches of all threads and allocate (empty) visibility
+// grids for the lights of the scene; call before rendering
+void InitializeLightVisibility(void);
+
+// Delete the visibility grids
+void DeleteLightVisibility(void);
+
+// Bytes of the occluder caches of all threads and of the visibility grids the
+// lights of the scene may allocate
+unsigned long long int LightVisibilityBytes(void);
+
+// Test for the occlusion of a ray from point to a sample on light, as
+// RayIlluminationTest does, but first try the primitive that blocked this
+// thread's previous shadow ray to the light. If the sample depends only on
+// point (e.g. point and spot lights), the light's visibility grid may answer
+// without tracing a ray at all
+bool LightIlluminationTest(const R3Light *light, const R3Point& point_in_scene,
+  const R3Vector& normal, const R3Point& point_on_light, bool fixed_sample);
+
+#endif